@@ -0,0 +1,192 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _SRC_ALLOC_H_
+#define _SRC_ALLOC_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Internal allocator configuration. All memory blocks handed out by
+// the CoTaskMem allocators must remain compatible with free(), since
+// .NET's Marshal.FreeCoTaskMem calls free() directly on non-Windows.
+//
+// The configuration is read once from the environment on first use:
+//
+//  DNCP_COTASKMEM_CACHE=1  Enable the per-thread size-class cache.
+//  DNCP_COTASKMEM_LARGE_THRESHOLD=<bytes>
+//                          Map blocks of at least this size directly
+//                          from the OS. Zero, the default, disables it.
+//  DNCP_ALLOC_STATS=1      Collect allocation statistics.
+//  DNCP_ALLOC_STATS_DUMP=1 Collect allocation statistics and write them
+//                          to stderr on exit.
+//  DNCP_BSTR_CACHE=0       Disable the per-thread cache of freed BSTRs.
+//                          OANOCACHE=1 also disables it, as on Windows.
+//  DNCP_ALLOC_PROFILE_INTERVAL=<bytes>
+//                          Sample the call stack of about one allocation
+//                          per this many bytes. Zero, the default, disables it.
+//
+// A backend installed by PAL_SetAllocator() replaces the system allocator
+// and disables the cache and the large block tier.
+//
+struct alloc_backend
+{
+    void* (*alloc)(size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+    size_t (*usable_size)(void*);
+};
+
+struct alloc_config
+{
+    bool backend_enabled;
+    struct alloc_backend backend;
+    bool cache_enabled;
+    size_t large_threshold;
+    bool stats_enabled;
+    size_t sample_interval;
+    bool bstr_cache_enabled;
+};
+
+struct alloc_config const* alloc_get_config(void);
+
+// Read configuration values from the environment.
+bool alloc_read_env_bool(char const* name, bool default_value);
+size_t alloc_read_env_size(char const* name, size_t default_value);
+
+// Returns the usable size of a block returned by malloc() and friends.
+size_t alloc_usable_size(void* block);
+
+// Returns the usable size of a block returned by PAL_CoTaskMemAlloc().
+size_t alloc_block_size(void* block);
+
+// PAL_CoTaskMemAlloc() for an allocation the profiler has chosen to sample.
+void* alloc_sampled_block(size_t size);
+
+//
+// Per-thread size-class cache - see tcache.c.
+//
+
+// Initialize the cache. Returns false if the platform can't support it.
+bool tcache_init(void);
+
+// Allocate a block of at least the requested size. Returns NULL if
+// the size isn't served by the cache.
+void* tcache_alloc(size_t size);
+
+// Return a block to the cache. Returns false if the block wasn't accepted
+// and should be released by the caller.
+bool tcache_free(void* block);
+
+//
+// Large blocks mapped directly from the OS - see large.c.
+//
+
+// Initialize the large block tier. Returns false if the platform can't support it.
+bool large_init(void);
+
+void* large_alloc(size_t size);
+
+// Returns true if the block was allocated by large_alloc().
+bool large_is_block(void* block);
+
+// Resize the block, which must satisfy large_is_block(). Returns NULL
+// on failure, in which case the block is left untouched.
+void* large_realloc(void* block, size_t size);
+
+void large_free(void* block);
+
+//
+// Allocation statistics - see stats.c.
+//
+
+enum alloc_kind
+{
+    ALLOC_KIND_COTASKMEM,
+    ALLOC_KIND_BSTR,
+    ALLOC_KIND_COUNT
+};
+
+bool stats_init(bool dump_on_exit);
+
+// Record an allocation of the requested size that resulted in a block
+// with the given usable size.
+void stats_record_alloc(enum alloc_kind kind, size_t requested, size_t usable);
+
+// Record the release of a block with the given usable size.
+void stats_record_free(enum alloc_kind kind, size_t usable);
+
+//
+// Per-thread cache of freed BSTRs - see bstr.c.
+//
+
+bool bstr_cache_init(void);
+
+//
+// Sampling heap profiler - see profile.c.
+//
+
+bool profile_init(size_t interval);
+
+// Sampled blocks are allocated with at least this many bytes, more than
+// the thread cache or the BSTR cache will hold. Since a sampled block is
+// never cached, a block released into a cache needs no check for samples.
+#define PROFILE_SAMPLED_MIN_SIZE (2048 + 8)
+
+// Samples are kept in a table of buckets hashed by address. The number
+// of samples in each bucket lets a release skip the table for the vast
+// majority of blocks, which were never sampled.
+#define PROFILE_BUCKET_COUNT 4096
+
+extern _Atomic(uint8_t) profile_bucket_samples[PROFILE_BUCKET_COUNT];
+
+// Bytes the thread can allocate before its next sample.
+extern _Thread_local int64_t profile_bytes_until_sample;
+
+static inline size_t profile_bucket_index(void* block)
+{
+    uint64_t hash = (uint64_t)((uintptr_t)block >> 4) * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(hash >> 32) % PROFILE_BUCKET_COUNT;
+}
+
+// Slow paths of the functions below.
+bool profile_next_sample(void);
+void profile_forget_sample(void* block);
+
+// Called before every allocation. Returns true if the allocation is to
+// be sampled, in which case the block must be allocated with at least
+// PROFILE_SAMPLED_MIN_SIZE bytes and passed to profile_record_sample().
+static inline bool profile_sample_due(size_t size)
+{
+    profile_bytes_until_sample -= (int64_t)size;
+    return profile_bytes_until_sample < 0 && profile_next_sample();
+}
+
+void profile_record_sample(void* block, size_t size);
+
+// Called for every block released other than into a cache.
+static inline void profile_record_free(void* block)
+{
+    if (atomic_load_explicit(&profile_bucket_samples[profile_bucket_index(block)], memory_order_relaxed) != 0)
+        profile_forget_sample(block);
+}
+
+#endif // _SRC_ALLOC_H_
@@ -23,7 +23,11 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <dncp.h>
+#include "alloc.h"
+#include "bstr.h"
+#include "utf.h"
 
 //
 // The BSTR is an allocation that is at least 6-bytes in size.
@@ -60,12 +64,145 @@ static bool ComputeAllocSize(SIZE_T elemCount, SIZE_T elemSize, SIZE_T* bytesToA
     return true;
 }
 
+//
+// Per-thread cache of freed BSTR blocks, as kept by OLEAUT32.
+//
+// Freed blocks are binned by size class into a few small buckets owned
+// by the freeing thread, so a BSTR released on a thread other than the
+// one that allocated it is simply reused by the releasing thread. Blocks
+// that don't fit are released, which bounds the cache to a few KB per
+// thread. The cache is released when the thread exits. Blocks are only
+// ever allocated with PAL_CoTaskMemAlloc, so they can still be released
+// with free().
+//
+// Blocks are allocated with the full size of their class so they can
+// serve any request of that class once cached.
+//
+
+#define BSTR_CACHE_MIN_CLASS 32
+#define BSTR_CACHE_BUCKETS 6
+#define BSTR_CACHE_MAX_CLASS (BSTR_CACHE_MIN_CLASS << (BSTR_CACHE_BUCKETS - 1))
+#define BSTR_CACHE_ENTRIES 6
+
+_Static_assert(2 * BSTR_CACHE_MAX_CLASS <= PROFILE_SAMPLED_MIN_SIZE, "Sampled blocks must not fit in the cache");
+
+enum bstr_cache_state
+{
+    BSTR_CACHE_UNINITIALIZED = 0,
+    BSTR_CACHE_ACTIVE,
+    BSTR_CACHE_DEAD,
+};
+
+struct bstr_cache
+{
+    enum bstr_cache_state state;
+    uint32_t count[BSTR_CACHE_BUCKETS];
+    void* blocks[BSTR_CACHE_BUCKETS][BSTR_CACHE_ENTRIES];
+};
+
+static pthread_key_t bstr_cache_key;
+static _Thread_local struct bstr_cache t_bstr_cache;
+
+static void bstr_cache_thread_exit(void* data)
+{
+    struct bstr_cache* cache = (struct bstr_cache*)data;
+    for (size_t i = 0; i < BSTR_CACHE_BUCKETS; ++i)
+    {
+        for (size_t j = 0; j < cache->count[i]; ++j)
+            PAL_CoTaskMemFree(cache->blocks[i][j]);
+        cache->count[i] = 0;
+    }
+
+    // BSTRs freed by later thread-exit callbacks bypass the cache.
+    cache->state = BSTR_CACHE_DEAD;
+}
+
+bool bstr_cache_init(void)
+{
+    return 0 == pthread_key_create(&bstr_cache_key, bstr_cache_thread_exit);
+}
+
+static struct bstr_cache* GetBstrCache(void)
+{
+    struct bstr_cache* cache = &t_bstr_cache;
+    if (cache->state == BSTR_CACHE_ACTIVE)
+        return cache;
+
+    if (cache->state == BSTR_CACHE_DEAD)
+        return NULL;
+
+    // Register the thread so the cache is released on thread exit.
+    if (0 != pthread_setspecific(bstr_cache_key, cache))
+        return NULL;
+
+    cache->state = BSTR_CACHE_ACTIVE;
+    return cache;
+}
+
+static size_t Log2Floor(SIZE_T value)
+{
+    return sizeof(unsigned long long) * 8 - 1 - (size_t)__builtin_clzll((unsigned long long)value);
+}
+
+static void* BstrCacheAlloc(struct alloc_config const* cfg, SIZE_T byteAlloc)
+{
+    if (byteAlloc > BSTR_CACHE_MAX_CLASS)
+        return PAL_CoTaskMemAlloc(byteAlloc);
+
+    // Smallest class that can hold the request.
+    size_t bucket = byteAlloc <= BSTR_CACHE_MIN_CLASS
+        ? 0
+        : Log2Floor((byteAlloc - 1) / BSTR_CACHE_MIN_CLASS) + 1;
+
+    struct bstr_cache* cache = GetBstrCache();
+    if (cache == NULL)
+        return PAL_CoTaskMemAlloc(byteAlloc);
+
+    if (cache->count[bucket] == 0)
+        return PAL_CoTaskMemAlloc((SIZE_T)BSTR_CACHE_MIN_CLASS << bucket);
+
+    // A sampled block must not come from the cache, see alloc.h.
+    if (cfg->sample_interval != 0 && profile_sample_due(byteAlloc))
+        return alloc_sampled_block(byteAlloc);
+
+    return cache->blocks[bucket][--cache->count[bucket]];
+}
+
+static void BstrCacheFree(void* block)
+{
+    struct bstr_cache* cache;
+    SIZE_T usable = alloc_block_size(block);
+    if (usable < BSTR_CACHE_MIN_CLASS
+        || usable >= 2 * BSTR_CACHE_MAX_CLASS
+        || (cache = GetBstrCache()) == NULL)
+    {
+        PAL_CoTaskMemFree(block);
+        return;
+    }
+
+    // Largest class the block can serve.
+    size_t bucket = Log2Floor(usable / BSTR_CACHE_MIN_CLASS);
+    if (cache->count[bucket] == BSTR_CACHE_ENTRIES)
+    {
+        PAL_CoTaskMemFree(block);
+        return;
+    }
+
+    cache->blocks[bucket][cache->count[bucket]++] = block;
+}
+
 static void* AllocAlignedBstr(SIZE_T byteAlloc)
 {
-    char* alloc = (char*)PAL_CoTaskMemAlloc(byteAlloc);
+    struct alloc_config const* cfg = alloc_get_config();
+    char* alloc = cfg->bstr_cache_enabled
+        ? (char*)BstrCacheAlloc(cfg, byteAlloc)
+        : (char*)PAL_CoTaskMemAlloc(byteAlloc);
     if (alloc == NULL)
         return NULL;
 
+    if (cfg->stats_enabled)
+        stats_record_alloc(ALLOC_KIND_BSTR, byteAlloc, alloc_block_size(alloc));
+
     if (sizeof(SIZE_T) == 8)
     {
         *(UINT*)alloc = 0;
@@ -81,7 +218,54 @@ static void FreeAlignedBstr(void* alloc)
     if (sizeof(SIZE_T) == 8)
         alloc = (char*)alloc - 4;
 
-    PAL_CoTaskMemFree(alloc);
+    struct alloc_config const* cfg = alloc_get_config();
+    if (cfg->stats_enabled)
+        stats_record_free(ALLOC_KIND_BSTR, alloc_block_size(alloc));
+
+    if (cfg->bstr_cache_enabled)
+        BstrCacheFree(alloc);
+    else
+        PAL_CoTaskMemFree(alloc);
+}
+
+// Resize the block of a BSTR. The argument and result point at the
+// length prefix, as returned by AllocAlignedBstr().
+static void* ReallocAlignedBstr(void* alloc, SIZE_T byteAlloc)
+{
+    assert(alloc != NULL);
+    if (sizeof(SIZE_T) == 8)
+        alloc = (char*)alloc - 4;
+
+    struct alloc_config const* cfg = alloc_get_config();
+    SIZE_T usable = alloc_block_size(alloc);
+
+    // Strings are commonly built by appending in a loop. Leave room to
+    // grow when the block has to be extended so the next append can be
+    // done in place.
+    SIZE_T request = byteAlloc;
+    if (byteAlloc > usable)
+    {
+        SIZE_T grown = usable + usable / 2;
+        if (grown > request)
+            request = grown;
+    }
+
+    char* realloced = (char*)PAL_CoTaskMemRealloc(alloc, request);
+    if (realloced == NULL && request != byteAlloc)
+        realloced = (char*)PAL_CoTaskMemRealloc(alloc, byteAlloc);
+    if (realloced == NULL)
+        return NULL;
+
+    if (cfg->stats_enabled)
+    {
+        stats_record_free(ALLOC_KIND_BSTR, usable);
+        stats_record_alloc(ALLOC_KIND_BSTR, byteAlloc, alloc_block_size(realloced));
+    }
+
+    if (sizeof(SIZE_T) == 8)
+        realloced = realloced + 4;
+
+    return realloced;
 }
 
 static UINT OLEStrLen(LPCOLESTR str)
@@ -155,9 +339,119 @@ void PAL_SysFreeString(BSTR str)
     if (str == NULL)
       return;
 
+    // Interned strings are only freed with their last reference.
+    if (bstr_is_kind(str, BSTR_KIND_INTERNED) && intern_release(str))
+        return;
+
+    // A slab is freed with its last member.
+    if (bstr_is_kind(str, BSTR_KIND_SLAB) && slab_release(str))
+        return;
+
+    // Literals are never freed. Freeing one is a caller error, but it
+    // is cheaper to ignore than to crash in the allocator.
+    if (bstr_is_static(str))
+        return;
+
     FreeAlignedBstr((char*)str - sizeof(UINT));
 }
 
+INT PAL_SysReAllocString(BSTR* pbstr, LPCOLESTR psz)
+{
+    if (pbstr == NULL)
+        return FALSE;
+
+    if (psz == NULL)
+    {
+        PAL_SysFreeString(*pbstr);
+        *pbstr = NULL;
+        return TRUE;
+    }
+
+    return PAL_SysReAllocStringLen(pbstr, psz, OLEStrLen(psz));
+}
+
+INT PAL_SysReAllocStringLen(BSTR* pbstr, LPCOLESTR psz, UINT len)
+{
+    if (pbstr == NULL)
+        return FALSE;
+
+    BSTR bstr = *pbstr;
+    if (bstr == NULL)
+    {
+        *pbstr = PAL_SysAllocStringLen(psz, len);
+        return *pbstr != NULL ? TRUE : FALSE;
+    }
+
+    // An interned string is shared, a literal is read-only and a slab
+    // member can't grow in place, so the result is a new string.
+    if (bstr_is_kind(bstr, BSTR_KIND_INTERNED)
+        || bstr_is_kind(bstr, BSTR_KIND_SLAB)
+        || bstr_is_static(bstr))
+    {
+        UINT existing = PAL_SysStringLen(bstr);
+        BSTR copy = PAL_SysAllocStringLen(NULL, len);
+        if (copy == NULL)
+            return FALSE;
+
+        if (psz != NULL)
+            memcpy(copy, psz, len * sizeof(psz[0]));
+        else
+            memcpy(copy, bstr, (len < existing ? len : existing) * sizeof(bstr[0]));
+
+        PAL_SysFreeString(bstr);
+        *pbstr = copy;
+        return TRUE;
+    }
+
+    SIZE_T byteAlloc = 0;
+    if (!ComputeAllocSize(len, sizeof(psz[0]), &byteAlloc))
+        return FALSE;
+
+    // The source may be part of the string being reallocated.
+    UINT byteLen = PAL_SysStringByteLen(bstr);
+    uintptr_t start = (uintptr_t)bstr;
+    uintptr_t end = start + byteLen + sizeof(OLECHAR);
+    bool aliased = (uintptr_t)psz >= start && (uintptr_t)psz < end;
+    SIZE_T offset = 0;
+    SIZE_T toMove = 0;
+    if (aliased)
+    {
+        offset = ((uintptr_t)psz - start) / sizeof(OLECHAR);
+        SIZE_T available = (end - (uintptr_t)psz) / sizeof(OLECHAR);
+        toMove = len < available ? len : available;
+
+        // A shrinking block may lose the source, so it is moved first.
+        if (len * sizeof(psz[0]) <= byteLen)
+        {
+            memmove(bstr, psz, toMove * sizeof(psz[0]));
+            aliased = false;
+            psz = NULL;
+        }
+    }
+
+    // On failure the original string is left untouched, unless the
+    // source was already moved.
+    void* alloc = ReallocAlignedBstr((char*)bstr - sizeof(UINT), byteAlloc);
+    if (alloc == NULL)
+        return FALSE;
+
+    // Set the content length.
+    *(UINT*)alloc = len * sizeof(psz[0]);
+
+    // Increment past content length.
+    bstr = (BSTR)((char*)alloc + sizeof(UINT));
+
+    // Without a source the existing content is kept.
+    if (aliased)
+        memmove(bstr, bstr + offset, toMove * sizeof(bstr[0]));
+    else if (psz != NULL)
+        memcpy(bstr, psz, len * sizeof(psz[0]));
+
+    bstr[len] = W('\0'); //Ensure null termination
+    *pbstr = bstr;
+    return TRUE;
+}
+
 UINT PAL_SysStringLen(BSTR str)
 {
     if(str == NULL)
@@ -172,4 +466,164 @@ UINT PAL_SysStringByteLen(BSTR str)
       return 0;
 
     return (UINT)(((UINT*)str)[-1]);
-}
\ No newline at end of file
+}
+
+//
+// UTF-8 conversion.
+//
+// The output is measured first so it can be transcoded straight into
+// its final storage with a single allocation.
+//
+
+BSTR PAL_SysAllocStringFromUTF8(char const* str, UINT len)
+{
+    if (str == NULL)
+        return NULL;
+
+    // There are never more UTF-16 units than UTF-8 bytes.
+    UINT units = (UINT)utf8_to_utf16_length(str, len, NULL);
+    BSTR bstr = PAL_SysAllocStringLen(NULL, units);
+    if (bstr == NULL)
+        return NULL;
+
+    (void)utf8_to_utf16(str, len, bstr, NULL);
+    return bstr;
+}
+
+HRESULT PAL_SysStringToUTF8(BSTR str, char** result, UINT* len)
+{
+    if (result == NULL)
+        return E_POINTER;
+
+    *result = NULL;
+    UINT units = PAL_SysStringLen(str);
+    size_t bytes = utf16_to_utf8_length(str, units, NULL);
+    if (bytes >= UINT_MAX)
+        return E_OUTOFMEMORY;
+
+    char* utf8 = (char*)PAL_CoTaskMemAlloc(bytes + 1);
+    if (utf8 == NULL)
+        return E_OUTOFMEMORY;
+
+    (void)utf16_to_utf8(str, units, utf8, NULL);
+    utf8[bytes] = '\0';
+
+    *result = utf8;
+    if (len != NULL)
+        *len = (UINT)bytes;
+    return S_OK;
+}
+
+//
+// BSTR builder.
+//
+// The buffer is a BSTR block whose length prefix is only written once
+// the builder is detached. Growth doubles the capacity and resizes the
+// block through PAL_CoTaskMemRealloc, which extends it in place when
+// the allocator has room.
+//
+
+#define BSTR_BUILDER_MIN_CAPACITY 16
+
+// Longest string whose byte length, and allocation size, fit in a UINT.
+#define BSTR_MAX_LEN ((UINT)((UINT_MAX - BSTR_MIN_ALLOC) / sizeof(OLECHAR)))
+
+HRESULT PAL_BstrBuilderReserve(DNCP_BSTR_BUILDER* builder, UINT additional)
+{
+    if (builder == NULL)
+        return E_POINTER;
+
+    if (additional > BSTR_MAX_LEN - builder->Length)
+        return E_OUTOFMEMORY;
+
+    UINT needed = builder->Length + additional;
+    if (needed <= builder->Capacity)
+        return S_OK;
+
+    UINT capacity = builder->Capacity < BSTR_MAX_LEN / 2
+        ? builder->Capacity * 2
+        : BSTR_MAX_LEN;
+    if (capacity < needed)
+        capacity = needed;
+    if (capacity < BSTR_BUILDER_MIN_CAPACITY)
+        capacity = BSTR_BUILDER_MIN_CAPACITY;
+
+    SIZE_T byteAlloc = 0;
+    if (!ComputeAllocSize(capacity, sizeof(OLECHAR), &byteAlloc))
+        return E_OUTOFMEMORY;
+
+    void* alloc = builder->Buffer == NULL
+        ? AllocAlignedBstr(byteAlloc)
+        : ReallocAlignedBstr((char*)builder->Buffer - sizeof(UINT), byteAlloc);
+    if (alloc == NULL)
+        return E_OUTOFMEMORY;
+
+    builder->Buffer = (BSTR)((char*)alloc + sizeof(UINT));
+    builder->Capacity = capacity;
+    return S_OK;
+}
+
+HRESULT PAL_BstrBuilderAppend(DNCP_BSTR_BUILDER* builder, LPCOLESTR str, UINT len)
+{
+    if (str == NULL && len != 0)
+        return E_POINTER;
+
+    LPOLESTR dest = PAL_BstrBuilderAppendBuffer(builder, len);
+    if (dest == NULL)
+        return builder == NULL ? E_POINTER : E_OUTOFMEMORY;
+
+    memcpy(dest, str, len * sizeof(str[0]));
+    return S_OK;
+}
+
+LPOLESTR PAL_BstrBuilderAppendBuffer(DNCP_BSTR_BUILDER* builder, UINT len)
+{
+    if (FAILED(PAL_BstrBuilderReserve(builder, len)))
+        return NULL;
+
+    LPOLESTR dest = builder->Buffer + builder->Length;
+    builder->Length += len;
+    return dest;
+}
+
+BSTR PAL_BstrBuilderDetach(DNCP_BSTR_BUILDER* builder)
+{
+    if (builder == NULL)
+        return NULL;
+
+    if (builder->Buffer == NULL)
+        return PAL_SysAllocStringLen(NULL, 0);
+
+    // Give back unused capacity. The allocator trims the block in place,
+    // and the buffer is kept as is if it can't.
+    void* alloc = (char*)builder->Buffer - sizeof(UINT);
+    SIZE_T byteAlloc = 0;
+    if (builder->Length < builder->Capacity
+        && ComputeAllocSize(builder->Length, sizeof(OLECHAR), &byteAlloc))
+    {
+        void* trimmed = ReallocAlignedBstr(alloc, byteAlloc);
+        if (trimmed != NULL)
+            alloc = trimmed;
+    }
+
+    // Set the content length.
+    *(UINT*)alloc = builder->Length * sizeof(OLECHAR);
+
+    // Increment past content length.
+    BSTR bstr = (BSTR)((char*)alloc + sizeof(UINT));
+    bstr[builder->Length] = W('\0'); //Ensure null termination
+
+    memset(builder, 0, sizeof(*builder));
+    return bstr;
+}
+
+void PAL_BstrBuilderFree(DNCP_BSTR_BUILDER* builder)
+{
+    if (builder == NULL)
+        return;
+
+    if (builder->Buffer != NULL)
+        FreeAlignedBstr((char*)builder->Buffer - sizeof(UINT));
+
+    memset(builder, 0, sizeof(*builder));
+}
@@ -0,0 +1,120 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _SRC_BSTR_H_
+#define _SRC_BSTR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <dncp.h>
+
+//
+// BSTR tags.
+//
+// On 64-bit platforms a BSTR block starts with 4 spare bytes, in front
+// of the length prefix, to keep the string 8-byte aligned. They are zero
+// for ordinary BSTRs. Otherwise they hold a tag describing the string:
+//
+//  | magic (12 bits) | kind (4 bits) | payload (16 bits) |
+//
+// A tag is only a hint. BSTRs allocated elsewhere, for example by another
+// runtime, have arbitrary bytes in this position, so every kind must
+// confirm the string is one of its own before acting on it.
+//
+// An interned string's tag holds its reference count, which is updated
+// while other threads may be reading the tag of the same string, so tags
+// of live strings are only accessed atomically.
+//
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+    #define BSTR_TAGS_SUPPORTED
+#endif
+
+#define BSTR_TAG_MAGIC 0xB57u
+
+enum bstr_kind
+{
+    BSTR_KIND_INTERNED = 1,
+
+    // Static images created by DNCP_BSTR_LITERAL, whose payload is
+    // derived from the length. Keep in sync with dncp.h.
+    BSTR_KIND_STATIC = 2,
+
+    // Members of a slab, whose payload locates the slab header.
+    BSTR_KIND_SLAB = 3,
+};
+
+#define BSTR_TAG(kind, payload) ((BSTR_TAG_MAGIC << 20) | ((UINT)(kind) << 16) | (UINT)(payload))
+#define BSTR_TAG_PAYLOAD(tag) ((tag) & 0xffffu)
+
+static inline _Atomic(UINT)* bstr_tag(BSTR bstr)
+{
+    return (_Atomic(UINT)*)((char*)bstr - sizeof(UINT) - 4);
+}
+
+// Ordering comes from the locks of the owners, so relaxed access suffices.
+static inline UINT bstr_tag_load(BSTR bstr)
+{
+    return atomic_load_explicit(bstr_tag(bstr), memory_order_relaxed);
+}
+
+static inline void bstr_tag_store(BSTR bstr, UINT tag)
+{
+    atomic_store_explicit(bstr_tag(bstr), tag, memory_order_relaxed);
+}
+
+static inline bool bstr_is_kind(BSTR bstr, enum bstr_kind kind)
+{
+#ifdef BSTR_TAGS_SUPPORTED
+    return (bstr_tag_load(bstr) >> 16) == ((BSTR_TAG_MAGIC << 4) | (UINT)kind);
+#else
+    (void)bstr;
+    (void)kind;
+    return false;
+#endif
+}
+
+static inline bool bstr_is_static(BSTR bstr)
+{
+#ifdef BSTR_TAGS_SUPPORTED
+    return bstr_tag_load(bstr) == BSTR_TAG(BSTR_KIND_STATIC, ~PAL_SysStringLen(bstr) & 0xffffu);
+#else
+    (void)bstr;
+    return false;
+#endif
+}
+
+//
+// Interned strings - see intern.c.
+//
+
+// Releases a reference on an interned string. Returns false if the
+// string isn't interned, in which case the caller frees it.
+bool intern_release(BSTR bstr);
+
+//
+// BSTR slabs - see slab.c.
+//
+
+// Releases a member of a slab. Returns false if the string isn't in
+// a slab, in which case the caller frees it.
+bool slab_release(BSTR bstr);
+
+#endif // _SRC_BSTR_H_
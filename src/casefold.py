@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+# Copyright 2022 Aaron R Robinson
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is furnished
+# to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+# INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+# PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+# HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#
+# Generates casefold.h, the table used by the case-insensitive ordinal
+# comparisons in strings.c, from the Unicode data in Python's unicodedata.
+#
+#   python3 casefold.py > casefold.h
+#
+# Each UTF-16 unit maps to its simple uppercase form. As on Windows, units
+# outside ASCII never map into ASCII (e.g., U+0131 and U+017F map to
+# themselves), and surrogates and supplementary characters aren't folded.
+#
+
+import sys
+import unicodedata
+
+LICENSE = '''\
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+'''
+
+BLOCK_BITS = 6
+BLOCK_SIZE = 1 << BLOCK_BITS
+
+
+def simple_upper(c):
+    ch = chr(c)
+    for mapped in (ch.upper(), ch.title()):
+        if len(mapped) == 1 and ord(mapped) <= 0xFFFF:
+            return ord(mapped)
+    return c
+
+
+def upper(c):
+    if 0xD800 <= c <= 0xDFFF:
+        return c
+    u = simple_upper(c)
+    if c >= 0x80 and u < 0x80:
+        return c
+    return u
+
+
+def main():
+    deltas = [(upper(c) - c) & 0xFFFF for c in range(0x10000)]
+
+    blocks = []
+    index = []
+    for start in range(0, 0x10000, BLOCK_SIZE):
+        block = tuple(deltas[start:start + BLOCK_SIZE])
+        if block not in blocks:
+            blocks.append(block)
+        index.append(blocks.index(block))
+
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write(LICENSE)
+    out.write('\n// Generated by casefold.py from Unicode %s. Do not edit.\n\n' % unicodedata.unidata_version)
+    out.write('#ifndef _SRC_CASEFOLD_H_\n#define _SRC_CASEFOLD_H_\n\n')
+    out.write('#include <stdint.h>\n\n')
+    out.write('#define CASEFOLD_BLOCK_BITS %d\n' % BLOCK_BITS)
+    out.write('#define CASEFOLD_BLOCK_SIZE %d\n\n' % BLOCK_SIZE)
+    out.write('// Block of the deltas for each run of CASEFOLD_BLOCK_SIZE units.\n')
+    out.write('static uint8_t const casefold_index[%d] =\n{\n' % len(index))
+    for i in range(0, len(index), 16):
+        out.write('    ' + ', '.join('%d' % b for b in index[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+    out.write('// Value to add, modulo 2^16, to a unit to get its uppercase form.\n')
+    out.write('static uint16_t const casefold_deltas[%d][CASEFOLD_BLOCK_SIZE] =\n{\n' % len(blocks))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, BLOCK_SIZE, 8):
+            out.write('        ' + ', '.join('0x%04x' % d for d in block[i:i + 8]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n\n#endif // _SRC_CASEFOLD_H_\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,159 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <dncp.h>
+#include "utf.h"
+
+//
+// Code page conversion, with the argument checks and results of Win32.
+//
+// Every UTF-8 byte decodes to at most one UTF-16 unit, and every UTF-16
+// unit encodes to at most three UTF-8 bytes. When the destination is
+// known to be large enough, the text is converted in a single pass.
+// Otherwise its length is measured first, and the conversion only runs
+// if it fits.
+//
+
+static _Thread_local DWORD t_last_error;
+
+DWORD PAL_GetLastError(void)
+{
+    return t_last_error;
+}
+
+void PAL_SetLastError(DWORD error)
+{
+    t_last_error = error;
+}
+
+static int Fail(DWORD error)
+{
+    t_last_error = error;
+    return 0;
+}
+
+int PAL_MultiByteToWideChar(UINT code_page, DWORD flags, char const* src, int src_len, WCHAR* dst, int dst_len)
+{
+    if (code_page != CP_UTF8 && code_page != CP_ACP)
+        return Fail(ERROR_INVALID_PARAMETER);
+
+    if ((flags & ~(DWORD)MB_ERR_INVALID_CHARS) != 0)
+        return Fail(ERROR_INVALID_FLAGS);
+
+    if (src == NULL || src_len == 0 || src_len < -1 || dst_len < 0
+        || (dst == NULL && dst_len != 0)
+        || (void const*)src == (void const*)dst)
+    {
+        return Fail(ERROR_INVALID_PARAMETER);
+    }
+
+    // A length of -1 includes the terminator.
+    size_t len = src_len == -1 ? strlen(src) + 1 : (size_t)src_len;
+    bool strict = (flags & MB_ERR_INVALID_CHARS) != 0;
+    bool invalid;
+
+    size_t units;
+    if (dst_len != 0 && (size_t)dst_len >= len)
+    {
+        units = utf8_to_utf16(src, len, dst, &invalid);
+        if (invalid && strict)
+            return Fail(ERROR_NO_UNICODE_TRANSLATION);
+        return (int)units;
+    }
+
+    units = utf8_to_utf16_length(src, len, &invalid);
+    if (invalid && strict)
+        return Fail(ERROR_NO_UNICODE_TRANSLATION);
+
+    if (units > INT_MAX)
+        return Fail(ERROR_INVALID_PARAMETER);
+
+    if (dst_len == 0)
+        return (int)units;
+
+    if (units > (size_t)dst_len)
+        return Fail(ERROR_INSUFFICIENT_BUFFER);
+
+    (void)utf8_to_utf16(src, len, dst, NULL);
+    return (int)units;
+}
+
+int PAL_WideCharToMultiByte(UINT code_page, DWORD flags, WCHAR const* src, int src_len, char* dst, int dst_len, char const* default_char, BOOL* used_default_char)
+{
+    if (code_page != CP_UTF8 && code_page != CP_ACP)
+        return Fail(ERROR_INVALID_PARAMETER);
+
+    if ((flags & ~(DWORD)WC_ERR_INVALID_CHARS) != 0)
+        return Fail(ERROR_INVALID_FLAGS);
+
+    // UTF-8 can encode every character, so there is no default character.
+    if (default_char != NULL || used_default_char != NULL)
+        return Fail(ERROR_INVALID_PARAMETER);
+
+    if (src == NULL || src_len == 0 || src_len < -1 || dst_len < 0
+        || (dst == NULL && dst_len != 0)
+        || (void const*)src == (void const*)dst)
+    {
+        return Fail(ERROR_INVALID_PARAMETER);
+    }
+
+    size_t len = src_len == -1 ? PAL_wcslen(src) + 1 : (size_t)src_len;
+    bool strict = (flags & WC_ERR_INVALID_CHARS) != 0;
+    bool invalid;
+
+    size_t bytes;
+    if (dst_len != 0 && (size_t)dst_len / 3 >= len)
+    {
+        bytes = utf16_to_utf8(src, len, dst, &invalid);
+        if (invalid && strict)
+            return Fail(ERROR_NO_UNICODE_TRANSLATION);
+        return (int)bytes;
+    }
+
+    bytes = utf16_to_utf8_length(src, len, &invalid);
+    if (invalid && strict)
+        return Fail(ERROR_NO_UNICODE_TRANSLATION);
+
+    if (bytes > INT_MAX)
+        return Fail(ERROR_INVALID_PARAMETER);
+
+    if (dst_len == 0)
+        return (int)bytes;
+
+    if (bytes > (size_t)dst_len)
+        return Fail(ERROR_INSUFFICIENT_BUFFER);
+
+    (void)utf16_to_utf8(src, len, dst, NULL);
+    return (int)bytes;
+}
+
+size_t PAL_Utf16ToUtf32(WCHAR const* src, size_t len, UINT32* dst)
+{
+    return utf16_to_utf32(src, len, dst);
+}
+
+size_t PAL_Utf32ToUtf16(UINT32 const* src, size_t len, WCHAR* dst)
+{
+    return utf32_to_utf16(src, len, dst);
+}
@@ -0,0 +1,220 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <dncp.h>
+
+//
+// Private heaps are arenas. Memory is carved out of large chunks by
+// bumping a cursor, so an allocation is a handful of instructions and
+// there is no per-block bookkeeping. HeapFree() only reclaims memory
+// when the block is the most recent allocation. All memory is returned
+// at once by HeapDestroy(), at a cost proportional to the number of
+// chunks rather than the number of blocks.
+//
+
+// Heap blocks have the same alignment as on Windows.
+#define HEAP_ALIGN (2 * sizeof(void*))
+
+#define HEAP_DEFAULT_CHUNK_SIZE ((SIZE_T)64 * 1024)
+#define HEAP_MAX_CHUNK_SIZE ((SIZE_T)64 * 1024 * 1024)
+
+struct heap_chunk
+{
+    struct heap_chunk* next;
+    SIZE_T size;
+};
+
+// Round the chunk header so chunk memory starts aligned.
+#define HEAP_CHUNK_HEADER ((sizeof(struct heap_chunk) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+
+struct heap
+{
+    DWORD options;
+    pthread_mutex_t lock;
+
+    // Bump allocation state for the current chunk.
+    char* cursor;
+    char* limit;
+    char* last;
+
+    struct heap_chunk* chunks;
+    SIZE_T next_chunk_size;
+    bool growable;
+};
+
+static bool AlignHeapSize(SIZE_T size, SIZE_T* aligned)
+{
+    SIZE_T tmp = (size + (HEAP_ALIGN - 1)) & ~(HEAP_ALIGN - 1);
+    if (tmp < size)
+        return false;
+
+    *aligned = tmp;
+    return true;
+}
+
+static bool AddChunk(struct heap* heap, SIZE_T min_size)
+{
+    SIZE_T size = heap->next_chunk_size;
+    if (size < min_size)
+        size = min_size;
+
+    SIZE_T total = size + HEAP_CHUNK_HEADER;
+    if (total < size)
+        return false;
+
+    struct heap_chunk* chunk = (struct heap_chunk*)malloc(total);
+    if (chunk == NULL)
+        return false;
+
+    chunk->next = heap->chunks;
+    chunk->size = size;
+    heap->chunks = chunk;
+
+    heap->cursor = (char*)chunk + HEAP_CHUNK_HEADER;
+    heap->limit = heap->cursor + size;
+    heap->last = NULL;
+
+    // Grow geometrically so the number of chunks stays small.
+    if (heap->next_chunk_size < HEAP_MAX_CHUNK_SIZE)
+        heap->next_chunk_size *= 2;
+
+    return true;
+}
+
+HANDLE PAL_HeapCreate(DWORD flOptions, SIZE_T dwInitialSize, SIZE_T dwMaximumSize)
+{
+    // There are no structured exceptions to raise, so a caller relying on
+    // HEAP_GENERATE_EXCEPTIONS instead of checking for NULL is refused.
+    if ((flOptions & HEAP_GENERATE_EXCEPTIONS) != 0)
+        return NULL;
+
+    if (dwMaximumSize != 0 && dwInitialSize > dwMaximumSize)
+        return NULL;
+
+    struct heap* heap = (struct heap*)calloc(1, sizeof(*heap));
+    if (heap == NULL)
+        return NULL;
+
+    heap->options = flOptions;
+    heap->growable = dwMaximumSize == 0;
+
+    if ((flOptions & HEAP_NO_SERIALIZE) == 0
+        && 0 != pthread_mutex_init(&heap->lock, NULL))
+    {
+        free(heap);
+        return NULL;
+    }
+
+    // A heap with a maximum size is a single chunk of that size.
+    SIZE_T size = heap->growable ? dwInitialSize : dwMaximumSize;
+    if (size < HEAP_DEFAULT_CHUNK_SIZE && heap->growable)
+        size = HEAP_DEFAULT_CHUNK_SIZE;
+
+    if (!AlignHeapSize(size, &heap->next_chunk_size)
+        || !AddChunk(heap, 0))
+    {
+        (void)PAL_HeapDestroy((HANDLE)heap);
+        return NULL;
+    }
+
+    return (HANDLE)heap;
+}
+
+LPVOID PAL_HeapAlloc(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
+{
+    struct heap* heap = (struct heap*)hHeap;
+
+    if ((dwFlags & HEAP_GENERATE_EXCEPTIONS) != 0)
+        return NULL;
+
+    // Zero sized requests still return a unique block.
+    SIZE_T size;
+    if (!AlignHeapSize(dwBytes == 0 ? 1 : dwBytes, &size))
+        return NULL;
+
+    bool serialize = ((heap->options | dwFlags) & HEAP_NO_SERIALIZE) == 0;
+    if (serialize)
+        (void)pthread_mutex_lock(&heap->lock);
+
+    char* block = NULL;
+    if ((SIZE_T)(heap->limit - heap->cursor) >= size
+        || (heap->growable && AddChunk(heap, size)))
+    {
+        block = heap->cursor;
+        heap->cursor += size;
+        heap->last = block;
+    }
+
+    if (serialize)
+        (void)pthread_mutex_unlock(&heap->lock);
+
+    if (block != NULL && (dwFlags & HEAP_ZERO_MEMORY) != 0)
+        memset(block, 0, dwBytes);
+
+    return block;
+}
+
+BOOL PAL_HeapFree(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem)
+{
+    struct heap* heap = (struct heap*)hHeap;
+    if (lpMem == NULL)
+        return TRUE;
+
+    bool serialize = ((heap->options | dwFlags) & HEAP_NO_SERIALIZE) == 0;
+    if (serialize)
+        (void)pthread_mutex_lock(&heap->lock);
+
+    // Only the most recent allocation can be given back.
+    if ((char*)lpMem == heap->last)
+    {
+        heap->cursor = heap->last;
+        heap->last = NULL;
+    }
+
+    if (serialize)
+        (void)pthread_mutex_unlock(&heap->lock);
+
+    return TRUE;
+}
+
+BOOL PAL_HeapDestroy(HANDLE hHeap)
+{
+    struct heap* heap = (struct heap*)hHeap;
+    if (heap == NULL)
+        return FALSE;
+
+    struct heap_chunk* chunk = heap->chunks;
+    while (chunk != NULL)
+    {
+        struct heap_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    if ((heap->options & HEAP_NO_SERIALIZE) == 0)
+        (void)pthread_mutex_destroy(&heap->lock);
+
+    free(heap);
+    return TRUE;
+}
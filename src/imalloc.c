@@ -0,0 +1,167 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#if defined(__GLIBC__)
+    #include <malloc.h>
+#endif
+#include <dncp.h>
+#include "alloc.h"
+
+//
+// The IMalloc for the CoTaskMem allocators.
+//
+// The object is written in C, so the interface is laid out by hand
+// the way a C++ compiler lays out a class with only virtual functions:
+// a pointer to a table of functions taking the object as their first
+// argument, in the order the methods are declared.
+//
+
+extern IID const IID_IUnknown;
+extern IID const IID_IMalloc;
+
+struct task_malloc;
+
+struct task_malloc_vtbl
+{
+    // IUnknown
+    HRESULT (*QueryInterface)(struct task_malloc*, IID const*, void**);
+    ULONG (*AddRef)(struct task_malloc*);
+    ULONG (*Release)(struct task_malloc*);
+
+    // IMalloc
+    void* (*Alloc)(struct task_malloc*, SIZE_T);
+    void* (*Realloc)(struct task_malloc*, void*, SIZE_T);
+    void (*Free)(struct task_malloc*, void*);
+    SIZE_T (*GetSize)(struct task_malloc*, void*);
+    int (*DidAlloc)(struct task_malloc*, void*);
+    void (*HeapMinimize)(struct task_malloc*);
+};
+
+struct task_malloc
+{
+    struct task_malloc_vtbl const* vtbl;
+};
+
+static HRESULT TaskMalloc_QueryInterface(struct task_malloc* This, IID const* riid, void** ppvObject)
+{
+    if (ppvObject == NULL)
+        return E_POINTER;
+
+    if (PAL_IsEqualGUID(riid, &IID_IUnknown)
+        || PAL_IsEqualGUID(riid, &IID_IMalloc))
+    {
+        *ppvObject = This;
+        return S_OK;
+    }
+
+    *ppvObject = NULL;
+    return E_NOINTERFACE;
+}
+
+// The object is a process wide singleton, so it isn't reference counted.
+static ULONG TaskMalloc_AddRef(struct task_malloc* This)
+{
+    (void)This;
+    return 1;
+}
+
+static ULONG TaskMalloc_Release(struct task_malloc* This)
+{
+    (void)This;
+    return 1;
+}
+
+static void* TaskMalloc_Alloc(struct task_malloc* This, SIZE_T cb)
+{
+    (void)This;
+    return PAL_CoTaskMemAlloc(cb);
+}
+
+static void* TaskMalloc_Realloc(struct task_malloc* This, void* pv, SIZE_T cb)
+{
+    (void)This;
+    return PAL_CoTaskMemRealloc(pv, cb);
+}
+
+static void TaskMalloc_Free(struct task_malloc* This, void* pv)
+{
+    (void)This;
+    PAL_CoTaskMemFree(pv);
+}
+
+static SIZE_T TaskMalloc_GetSize(struct task_malloc* This, void* pv)
+{
+    (void)This;
+    if (pv == NULL)
+        return (SIZE_T)-1;
+
+    // The allocator keeps the size next to the block, so no lookup is needed.
+    return alloc_block_size(pv);
+}
+
+static int TaskMalloc_DidAlloc(struct task_malloc* This, void* pv)
+{
+    (void)This;
+    (void)pv;
+
+    // Blocks aren't tracked, so ownership can't be determined.
+    return -1;
+}
+
+static void TaskMalloc_HeapMinimize(struct task_malloc* This)
+{
+    (void)This;
+#if defined(__GLIBC__)
+    if (!alloc_get_config()->backend_enabled)
+        (void)malloc_trim(0);
+#endif
+}
+
+static struct task_malloc_vtbl const task_malloc_vtbl =
+{
+    TaskMalloc_QueryInterface,
+    TaskMalloc_AddRef,
+    TaskMalloc_Release,
+    TaskMalloc_Alloc,
+    TaskMalloc_Realloc,
+    TaskMalloc_Free,
+    TaskMalloc_GetSize,
+    TaskMalloc_DidAlloc,
+    TaskMalloc_HeapMinimize,
+};
+
+static struct task_malloc task_malloc = { &task_malloc_vtbl };
+
+HRESULT PAL_CoGetMalloc(DWORD dwMemContext, struct IMalloc** ppMalloc)
+{
+    if (ppMalloc == NULL)
+        return E_POINTER;
+
+    if (dwMemContext != MEMCTX_TASK)
+    {
+        *ppMalloc = NULL;
+        return E_INVALIDARG;
+    }
+
+    *ppMalloc = (struct IMalloc*)&task_malloc;
+    return S_OK;
+}
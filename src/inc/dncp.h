@@ -39,6 +39,7 @@
     typedef uint16_t USHORT;
     typedef int32_t INT;
     typedef int32_t INT32;
+    typedef uint32_t UINT32;
     typedef uint32_t UINT;
     typedef int32_t LONG;
     typedef uint32_t ULONG;
@@ -82,6 +83,24 @@
     typedef int32_t HRESULT;
     typedef void* HANDLE;
 
+    // Code pages
+    #define CP_ACP                      0
+    #define CP_UTF8                     65001
+
+    // Code page conversion flags
+    #define MB_ERR_INVALID_CHARS        0x00000008
+    #define WC_ERR_INVALID_CHARS        0x00000080
+
+    // Results of CompareStringOrdinal
+    #define CSTR_LESS_THAN              1
+    #define CSTR_EQUAL                  2
+    #define CSTR_GREATER_THAN           3
+
+    // Heap flags
+    #define HEAP_NO_SERIALIZE           0x00000001
+    #define HEAP_GENERATE_EXCEPTIONS    0x00000004
+    #define HEAP_ZERO_MEMORY            0x00000008
+
     typedef struct
     {
         uint32_t  Data1;
@@ -131,8 +150,74 @@
 // Memory allocators
 //
 LPVOID PAL_CoTaskMemAlloc(SIZE_T);
+LPVOID PAL_CoTaskMemRealloc(LPVOID, SIZE_T);
 void PAL_CoTaskMemFree(LPVOID);
 
+// Returns the IMalloc for the CoTaskMem allocator. Only MEMCTX_TASK
+// is supported. IMalloc::GetSize returns the usable size of the block,
+// which may be larger than the requested size, and IMalloc::DidAlloc
+// always returns -1.
+struct IMalloc;
+HRESULT PAL_CoGetMalloc(DWORD, struct IMalloc**);
+
+// Backend for the CoTaskMem allocators, and so for BSTR storage. Blocks
+// must be aligned on at least 8 bytes and GetSize must return the usable
+// size of a block in constant time (e.g., malloc_usable_size).
+typedef struct
+{
+    LPVOID (*Alloc)(SIZE_T);
+    LPVOID (*Realloc)(LPVOID, SIZE_T);
+    void (*Free)(LPVOID);
+    SIZE_T (*GetSize)(LPVOID);
+} DNCP_ALLOCATOR;
+
+// Installs the backend. It must be called before anything is allocated,
+// otherwise E_NOT_VALID_STATE is returned. .NET's Marshal.FreeCoTaskMem
+// releases memory with free(), so memory given to managed code requires a
+// backend that also replaces malloc() and free() for the process.
+HRESULT PAL_SetAllocator(DNCP_ALLOCATOR const*);
+
+// Private heaps. Memory is bump allocated and only released as a whole
+// by PAL_HeapDestroy - PAL_HeapFree only reclaims the latest allocation.
+// HEAP_GENERATE_EXCEPTIONS is not supported outside Windows; passing it to
+// PAL_HeapCreate or PAL_HeapAlloc fails the call.
+HANDLE PAL_HeapCreate(DWORD, SIZE_T, SIZE_T);
+LPVOID PAL_HeapAlloc(HANDLE, DWORD, SIZE_T);
+BOOL PAL_HeapFree(HANDLE, DWORD, LPVOID);
+BOOL PAL_HeapDestroy(HANDLE);
+
+// Allocation statistics, collected when the DNCP_ALLOC_STATS environment
+// variable is set. BSTR storage is also counted as CoTaskMem.
+#define DNCP_ALLOC_HISTOGRAM_BUCKETS 24
+
+typedef struct
+{
+    ULONGLONG AllocCount;
+    ULONGLONG FreeCount;
+    ULONGLONG BytesAllocated;
+    ULONGLONG BytesFreed;
+    LONGLONG LiveBytes;
+
+    // Requested sizes. Bucket 0 counts sizes up to 16 bytes and bucket N
+    // sizes up to (16 << N) bytes. The last bucket counts all larger sizes.
+    ULONGLONG SizeHistogram[DNCP_ALLOC_HISTOGRAM_BUCKETS];
+} DNCP_ALLOC_COUNTERS;
+
+typedef struct
+{
+    DNCP_ALLOC_COUNTERS CoTaskMem;
+    DNCP_ALLOC_COUNTERS Bstr;
+} DNCP_ALLOC_STATS;
+
+// Returns S_FALSE, and zeroed statistics, if statistics aren't being collected.
+HRESULT PAL_GetAllocationStats(DNCP_ALLOC_STATS*);
+
+// Heap profile, collected when the DNCP_ALLOC_PROFILE_INTERVAL environment
+// variable is set. Writes the call stacks of the sampled blocks that are
+// still live to the named file, or stderr when NULL, in the heap profile
+// format read by pprof. Returns S_FALSE if the heap isn't being profiled.
+HRESULT PAL_WriteAllocationProfile(char const*);
+
 //
 // Strings
 //
@@ -146,16 +231,162 @@ void PAL_CoTaskMemFree(LPVOID);
 
 size_t PAL_wcslen(WCHAR const*);
 int PAL_wcscmp(WCHAR const*, WCHAR const*);
+int PAL_wcsncmp(WCHAR const*, WCHAR const*, size_t);
 WCHAR* PAL_wcsstr(WCHAR const*, WCHAR const*);
+WCHAR* PAL_wcschr(WCHAR const*, WCHAR);
+WCHAR* PAL_wcsrchr(WCHAR const*, WCHAR);
+size_t PAL_wcsspn(WCHAR const*, WCHAR const*);
+
+// Case-insensitive ordinal comparisons. Units are compared by their simple
+// uppercase forms, as by CompareStringOrdinal() on Windows. _wcsicmp() and
+// _wcsnicmp() then lower ASCII letters, which orders ASCII strings as the
+// CRT's C locale does. On Windows, those two use the CRT's current locale.
+int PAL__wcsicmp(WCHAR const*, WCHAR const*);
+int PAL__wcsnicmp(WCHAR const*, WCHAR const*, size_t);
+int PAL_CompareStringOrdinal(WCHAR const*, int, WCHAR const*, int, BOOL);
+
+#ifndef _TRUNCATE
+    #define _TRUNCATE ((size_t)-1)
+#endif
+#ifndef STRUNCATE
+    #define STRUNCATE 80
+#endif
+
+// Secure copies with the semantics of the Windows CRT. They return 0,
+// EINVAL or ERANGE, or STRUNCATE when a copy of _TRUNCATE units was cut
+// short, and set the destination to an empty string on failure. On Windows,
+// the CRT's invalid parameter handler is also called on failure.
+int PAL_wcscpy_s(WCHAR*, size_t, WCHAR const*);
+int PAL_wcscat_s(WCHAR*, size_t, WCHAR const*);
+int PAL_wcsncpy_s(WCHAR*, size_t, WCHAR const*, size_t);
+
+// Compiled set of patterns, found together in a single pass over a text.
+// A matcher is immutable once created, so any number of threads may search
+// with it at once.
+typedef struct DNCP_MATCHER DNCP_MATCHER;
+
+// Match units by their simple uppercase forms, as CompareStringOrdinal()
+// does when ignoring case.
+#define DNCP_MATCHER_IGNORE_CASE    0x00000001
+
+typedef struct
+{
+    UINT Pattern; // Index of the pattern that matched.
+    UINT Length; // Length of the pattern, in characters.
+    SIZE_T Offset; // Start of the match in the text, in characters.
+} DNCP_MATCH;
+
+// Called for each match. Returning FALSE ends the search.
+typedef BOOL (*DNCP_MATCH_CALLBACK)(void*, DNCP_MATCH const*);
+
+// The lengths may be null, in which case the patterns are null terminated.
+// Patterns can't be empty.
+HRESULT PAL_MatcherCreate(LPCOLESTR const*, UINT const*, UINT, DWORD, DNCP_MATCHER**);
+
+// Reports every match in the text, including overlapping ones, ordered by
+// where they end and, among those that end together, from the longest to
+// the shortest. Patterns that are equal are reported in index order.
+// Returns S_FALSE if nothing matched.
+HRESULT PAL_MatcherSearch(DNCP_MATCHER const*, WCHAR const*, SIZE_T, DNCP_MATCH_CALLBACK, void*);
+void PAL_MatcherFree(DNCP_MATCHER*);
+
+//
+// Numbers
+//
+
+// Conversions with the semantics of the Windows CRT in the C locale. Leading
+// white space is the ASCII white space characters. Parsing sets errno to
+// ERANGE when the value is out of range, and to EINVAL when an argument is
+// invalid. On Windows, these use the CRT's current locale.
+int PAL__wtoi(WCHAR const*);
+LONG PAL_wcstol(WCHAR const*, WCHAR**, int);
+ULONG PAL_wcstoul(WCHAR const*, WCHAR**, int);
+double PAL_wcstod(WCHAR const*, WCHAR**);
+
+// Formatting returns 0, EINVAL or ERANGE, and sets the buffer to an empty
+// string on failure. Digits above 9 are lowercase letters.
+int PAL__itow_s(int, WCHAR*, size_t, int);
+int PAL__ui64tow_s(UINT64, WCHAR*, size_t, int);
+
+//
+// Code pages
+//
+
+// The last error of the calling thread, set by the functions below that
+// follow Win32 conventions.
+DWORD PAL_GetLastError(void);
+void PAL_SetLastError(DWORD);
+
+// Outside Windows, only UTF-8 is supported and CP_ACP is treated as UTF-8.
+// Ill-formed input is replaced with U+FFFD, unless MB_ERR_INVALID_CHARS or
+// WC_ERR_INVALID_CHARS is passed, in which case the conversion fails with
+// ERROR_NO_UNICODE_TRANSLATION.
+int PAL_MultiByteToWideChar(UINT, DWORD, char const*, int, WCHAR*, int);
+int PAL_WideCharToMultiByte(UINT, DWORD, WCHAR const*, int, char*, int, char const*, BOOL*);
+
+// Converts between UTF-16 and UTF-32, the encoding of wchar_t outside
+// Windows. Unpaired surrogates, and UTF-32 values that aren't Unicode
+// scalar values, are replaced with U+FFFD. Both return the number of units
+// written or, if the destination is null, the number that would be. The
+// UTF-32 form never has more units than the UTF-16 form, which never has
+// more than twice as many as the UTF-32 form.
+size_t PAL_Utf16ToUtf32(WCHAR const*, size_t, UINT32*);
+size_t PAL_Utf32ToUtf16(UINT32 const*, size_t, WCHAR*);
 
 // BSTR
 BSTR PAL_SysAllocString(LPCOLESTR);
 BSTR PAL_SysAllocStringLen(LPCOLESTR, UINT);
 BSTR PAL_SysAllocStringByteLen(char const*, UINT);
 void PAL_SysFreeString(BSTR);
+// Returns a shared BSTR equal to the string. Equal strings share the
+// same BSTR, which is reference counted and released by PAL_SysFreeString.
+// Interned BSTRs must not be modified, and can't be released by another
+// runtime's SysFreeString. On 32-bit platforms, and on Windows, every call
+// returns a new BSTR.
+BSTR PAL_SysAllocStringInterned(LPCOLESTR);
+// Allocates a BSTR for each string in a single block. The lengths may
+// be null, in which case the strings are null terminated. Each BSTR can
+// be freed with PAL_SysFreeString, or all at once with
+// PAL_SysFreeStringArray, which is cheaper. The BSTRs must never be
+// released by another runtime, such as with Marshal.FreeBSTR or another
+// library's SysFreeString, since they are not allocations of their own.
+HRESULT PAL_SysAllocStringArray(LPCOLESTR const*, UINT const*, UINT, BSTR*);
+void PAL_SysFreeStringArray(BSTR*, UINT);
+INT PAL_SysReAllocString(BSTR*, LPCOLESTR);
+INT PAL_SysReAllocStringLen(BSTR*, LPCOLESTR, UINT);
+// Converts between UTF-8 and BSTRs. Ill-formed input is replaced with
+// U+FFFD. The UTF-8 string is allocated with PAL_CoTaskMemAlloc, is null
+// terminated and its length, in bytes, is optionally returned.
+BSTR PAL_SysAllocStringFromUTF8(char const*, UINT);
+HRESULT PAL_SysStringToUTF8(BSTR, char**, UINT*);
 UINT PAL_SysStringLen(BSTR);
 UINT PAL_SysStringByteLen(BSTR);
 
+// Builds a BSTR by appending to a buffer that is already laid out as a
+// BSTR, so the result is handed over without a copy. The buffer grows
+// geometrically. Zero initialize the builder before use.
+typedef struct
+{
+    BSTR Buffer;
+    UINT Length; // Characters appended.
+    UINT Capacity; // Characters the buffer can hold.
+} DNCP_BSTR_BUILDER;
+
+// Ensures the buffer can hold the given number of additional characters.
+HRESULT PAL_BstrBuilderReserve(DNCP_BSTR_BUILDER*, UINT);
+HRESULT PAL_BstrBuilderAppend(DNCP_BSTR_BUILDER*, LPCOLESTR, UINT);
+
+// Appends the given number of characters, to be written by the caller,
+// and returns where they start. Returns NULL if out of memory.
+LPOLESTR PAL_BstrBuilderAppendBuffer(DNCP_BSTR_BUILDER*, UINT);
+
+// Finishes the BSTR and hands it to the caller, leaving the builder empty.
+// Returns NULL if out of memory.
+BSTR PAL_BstrBuilderDetach(DNCP_BSTR_BUILDER*);
+
+// Releases the buffer, leaving the builder empty.
+void PAL_BstrBuilderFree(DNCP_BSTR_BUILDER*);
+
 //
 // GUIDs
 //
@@ -488,12 +719,30 @@ HRESULT PAL_IIDFromString(LPCOLESTR, IID*);
         #define V_BYREF(X)       V_UNION(X, byref)
 
         #define V_DECIMALREF(X)  V_UNION(X, pdecVal)
+    #else
+        // The COM interfaces in objidl.h are C++ only, but its memory
+        // contexts are needed by C callers of PAL_CoGetMalloc.
+        typedef enum tagMEMCTX
+        {
+            MEMCTX_TASK = 1,
+            MEMCTX_SHARED = 2,
+            MEMCTX_MACSYSTEM = 3,
+            MEMCTX_UNKNOWN = -1,
+            MEMCTX_SAME = -2
+        } MEMCTX;
     #endif // __cplusplus
 #endif // DNCP_INTERFACES
 
 #ifdef __cplusplus
+    #include <cstddef>
+    #include <cstdint>
+    #include <cstring>
+    #include <cwchar>
+    #include <functional>
     #include <memory>
+    #include <new>
     #include <type_traits>
+    #include <utility>
     namespace dncp
     {
         // Smart pointer for use with IUnknown based interfaces.
@@ -573,6 +822,610 @@ HRESULT PAL_IIDFromString(LPCOLESTR, IID*);
             void operator()(BSTR b) { PAL_SysFreeString(b); }
         };
         using bstr_ptr = std::unique_ptr<std::remove_pointer<BSTR>::type, bstr_deleter>;
+
+        // Builds a BSTR in place - see DNCP_BSTR_BUILDER.
+        class bstr_builder
+        {
+            DNCP_BSTR_BUILDER _builder;
+
+        public:
+            bstr_builder() noexcept : _builder{} {}
+
+            bstr_builder(bstr_builder const&) = delete;
+
+            bstr_builder(bstr_builder&& other) noexcept
+                : _builder(other._builder)
+            {
+                other._builder = DNCP_BSTR_BUILDER{};
+            }
+
+            ~bstr_builder() { PAL_BstrBuilderFree(&_builder); }
+
+            bstr_builder& operator=(bstr_builder const&) = delete;
+
+            bstr_builder& operator=(bstr_builder&& other) noexcept
+            {
+                PAL_BstrBuilderFree(&_builder);
+                _builder = other._builder;
+                other._builder = DNCP_BSTR_BUILDER{};
+                return (*this);
+            }
+
+            LPOLESTR data() noexcept { return _builder.Buffer; }
+            UINT length() const noexcept { return _builder.Length; }
+            UINT capacity() const noexcept { return _builder.Capacity; }
+
+            HRESULT reserve(UINT additional) noexcept
+            {
+                return PAL_BstrBuilderReserve(&_builder, additional);
+            }
+
+            HRESULT append(LPCOLESTR str, UINT len) noexcept
+            {
+                // Copy directly when the buffer has room.
+                if (_builder.Buffer != nullptr && len <= _builder.Capacity - _builder.Length)
+                {
+                    std::memcpy(_builder.Buffer + _builder.Length, str, len * sizeof(OLECHAR));
+                    _builder.Length += len;
+                    return S_OK;
+                }
+
+                return PAL_BstrBuilderAppend(&_builder, str, len);
+            }
+
+            HRESULT append(LPCOLESTR str) noexcept
+            {
+                return append(str, (UINT)PAL_wcslen(str));
+            }
+
+            HRESULT append(OLECHAR c) noexcept
+            {
+                return append(&c, 1);
+            }
+
+            LPOLESTR append_buffer(UINT len) noexcept
+            {
+                return PAL_BstrBuilderAppendBuffer(&_builder, len);
+            }
+
+            // Returns null if out of memory.
+            bstr_ptr finish() noexcept
+            {
+                return bstr_ptr{ PAL_BstrBuilderDetach(&_builder) };
+            }
+        };
+
+        namespace details
+        {
+            template<std::size_t... I>
+            struct index_list {};
+
+            template<typename A, typename B>
+            struct index_concat;
+
+            template<std::size_t... I, std::size_t... J>
+            struct index_concat<index_list<I...>, index_list<J...>>
+            {
+                using type = index_list<I..., (sizeof...(I) + J)...>;
+            };
+
+            // Halving keeps the instantiation depth logarithmic in N.
+            template<std::size_t N>
+            struct make_index_list
+                : index_concat<typename make_index_list<N / 2>::type, typename make_index_list<N - N / 2>::type>
+            {};
+
+            template<>
+            struct make_index_list<0> { using type = index_list<>; };
+
+            template<>
+            struct make_index_list<1> { using type = index_list<0>; };
+
+            // Image of a BSTR block. The spare bytes in front of the length
+            // prefix carry a tag that PAL_SysFreeString recognizes on 64-bit.
+            template<std::size_t N>
+            struct alignas(8) bstr_image
+            {
+                UINT tag;
+                UINT byte_length;
+                OLECHAR chars[N];
+            };
+            static_assert(offsetof(bstr_image<1>, chars) == 2 * sizeof(UINT), "Length prefix must precede the string");
+
+            constexpr UINT static_bstr_tag(UINT len)
+            {
+                return (UINT)0xB57 << 20 | (UINT)2 << 16 | (~len & 0xffffu);
+            }
+
+            template<std::size_t N, std::size_t... I>
+            constexpr bstr_image<N> make_bstr_image(OLECHAR const (&str)[N], index_list<I...>)
+            {
+                return bstr_image<N>{ static_bstr_tag(N - 1), (UINT)((N - 1) * sizeof(OLECHAR)), { str[I]... } };
+            }
+
+            template<std::size_t N>
+            constexpr bstr_image<N> make_bstr_image(OLECHAR const (&str)[N])
+            {
+                return make_bstr_image(str, typename make_index_list<N>::type{});
+            }
+        }
+
+        // A BSTR in read-only static storage - see DNCP_BSTR_LITERAL.
+        class bstr_literal
+        {
+            OLECHAR const* _str;
+            UINT _len;
+
+        public:
+            constexpr bstr_literal(OLECHAR const* str, UINT len) noexcept
+                : _str{ str }
+                , _len{ len }
+            { }
+
+            // The BSTR may be passed wherever one is borrowed, such as an
+            // [in] argument, but must not be modified or freed.
+            BSTR get() const noexcept { return const_cast<BSTR>(_str); }
+
+            UINT length() const noexcept { return _len; }
+        };
+
+        // Non-owning view of a BSTR. The length is read from the length
+        // prefix, so no scan for the terminator is needed. A null BSTR is
+        // viewed as empty. Strings are ordered as by VarBstrCmp() with a
+        // zero LCID: the bytes are compared and, if one string is a prefix
+        // of the other, the shorter string comes first.
+        class bstr_view
+        {
+            OLECHAR const* _str;
+            UINT _len;
+
+        public:
+            constexpr bstr_view() noexcept
+                : _str{}
+                , _len{}
+            { }
+
+            // The string must be a BSTR, since its length prefix is read.
+            explicit bstr_view(BSTR str) noexcept
+                : _str{ str }
+                , _len{ PAL_SysStringLen(str) }
+            { }
+
+            bstr_view(bstr_ptr const& str) noexcept
+                : bstr_view{ str.get() }
+            { }
+
+            bstr_view(bstr_literal str) noexcept
+                : _str{ str.get() }
+                , _len{ str.length() }
+            { }
+
+            constexpr bstr_view(OLECHAR const* str, UINT len) noexcept
+                : _str{ str }
+                , _len{ len }
+            { }
+
+            OLECHAR const* data() const noexcept { return _str; }
+            UINT length() const noexcept { return _len; }
+            bool empty() const noexcept { return _len == 0; }
+
+            OLECHAR const* begin() const noexcept { return _str; }
+            OLECHAR const* end() const noexcept { return _str + _len; }
+
+            OLECHAR operator[](UINT i) const noexcept { return _str[i]; }
+
+            // Returns a negative value, zero or a positive value if this
+            // string orders before, the same as or after the other.
+            int compare(bstr_view other) const noexcept
+            {
+                UINT len = _len < other._len ? _len : other._len;
+                int result = len == 0 ? 0 : std::memcmp(_str, other._str, len * sizeof(OLECHAR));
+                if (result != 0)
+                    return result;
+                return _len < other._len ? -1 : (_len > other._len ? 1 : 0);
+            }
+
+            bool equals(bstr_view other) const noexcept
+            {
+                return _len == other._len
+                    && (_len == 0 || 0 == std::memcmp(_str, other._str, _len * sizeof(OLECHAR)));
+            }
+
+            // 64-bit hash of the contents, mixing 4 characters at a time.
+            std::uint64_t hash() const noexcept
+            {
+                std::uint64_t const k = 0x9e3779b97f4a7c15u;
+                std::uint64_t h = k ^ _len;
+
+                UINT i = 0;
+                for (; i + 4 <= _len; i += 4)
+                {
+                    std::uint64_t v = (std::uint64_t)_str[i]
+                        | (std::uint64_t)_str[i + 1] << 16
+                        | (std::uint64_t)_str[i + 2] << 32
+                        | (std::uint64_t)_str[i + 3] << 48;
+                    h = (h ^ v) * k;
+                    h ^= h >> 29;
+                }
+
+                if (i < _len)
+                {
+                    std::uint64_t v = 0;
+                    for (UINT shift = 0; i < _len; ++i, shift += 16)
+                        v |= (std::uint64_t)_str[i] << shift;
+                    h = (h ^ v) * k;
+                }
+
+                // Final avalanche, from MurmurHash3.
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdu;
+                h ^= h >> 33;
+                h *= 0xc4ceb9fe1a85ec53u;
+                h ^= h >> 33;
+                return h;
+            }
+        };
+
+        inline bool operator==(bstr_view a, bstr_view b) noexcept { return a.equals(b); }
+        inline bool operator!=(bstr_view a, bstr_view b) noexcept { return !a.equals(b); }
+        inline bool operator<(bstr_view a, bstr_view b) noexcept { return a.compare(b) < 0; }
+        inline bool operator<=(bstr_view a, bstr_view b) noexcept { return a.compare(b) <= 0; }
+        inline bool operator>(bstr_view a, bstr_view b) noexcept { return a.compare(b) > 0; }
+        inline bool operator>=(bstr_view a, bstr_view b) noexcept { return a.compare(b) >= 0; }
+
+        // Allocator for use with standard containers, backed by CoTaskMem*.
+        template<typename T>
+        struct cotaskmem_allocator
+        {
+            static_assert(alignof(T) <= 8, "CoTaskMem blocks are only 8-byte aligned");
+
+            using value_type = T;
+
+            cotaskmem_allocator() noexcept = default;
+
+            template<typename U>
+            cotaskmem_allocator(cotaskmem_allocator<U> const&) noexcept {}
+
+            T* allocate(std::size_t n)
+            {
+                if (n > SIZE_MAX / sizeof(T))
+                    throw std::bad_alloc{};
+
+                void* p = PAL_CoTaskMemAlloc(n * sizeof(T));
+                if (p == nullptr)
+                    throw std::bad_alloc{};
+
+                return static_cast<T*>(p);
+            }
+
+            void deallocate(T* p, std::size_t) noexcept
+            {
+                PAL_CoTaskMemFree(p);
+            }
+        };
+
+        template<typename T, typename U>
+        bool operator==(cotaskmem_allocator<T> const&, cotaskmem_allocator<U> const&) noexcept
+        {
+            return true;
+        }
+
+        template<typename T, typename U>
+        bool operator!=(cotaskmem_allocator<T> const&, cotaskmem_allocator<U> const&) noexcept
+        {
+            return false;
+        }
+
+        // Vector whose elements are stored in a single CoTaskMem block.
+        // The block can be released to the caller of a COM method as an
+        // out-param, without copying it into a new block. Growth uses
+        // PAL_CoTaskMemRealloc, which extends the block in place when it can.
+        // Allocation failures throw std::bad_alloc.
+        template<typename T>
+        class cotaskmem_vector
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "Released elements are never destroyed");
+            static_assert(alignof(T) <= 8, "CoTaskMem blocks are only 8-byte aligned");
+
+            T* _data;
+            std::size_t _size;
+            std::size_t _capacity;
+
+            void grow(std::size_t min_capacity)
+            {
+                std::size_t capacity = _capacity * 2;
+                if (capacity < min_capacity)
+                    capacity = min_capacity;
+                if (capacity < 4)
+                    capacity = 4;
+
+                reserve(capacity);
+            }
+
+        public:
+            using value_type = T;
+            using size_type = std::size_t;
+            using iterator = T*;
+            using const_iterator = T const*;
+
+        public:
+            cotaskmem_vector() noexcept
+                : _data{}
+                , _size{}
+                , _capacity{}
+            { }
+
+            explicit cotaskmem_vector(std::size_t count)
+                : cotaskmem_vector{}
+            {
+                resize(count);
+            }
+
+            cotaskmem_vector(cotaskmem_vector const&) = delete;
+
+            cotaskmem_vector(cotaskmem_vector&& other) noexcept
+                : _data{ other._data }
+                , _size{ other._size }
+                , _capacity{ other._capacity }
+            {
+                other._data = nullptr;
+                other._size = 0;
+                other._capacity = 0;
+            }
+
+            ~cotaskmem_vector() { PAL_CoTaskMemFree(_data); }
+
+            cotaskmem_vector& operator=(cotaskmem_vector const&) = delete;
+
+            cotaskmem_vector& operator=(cotaskmem_vector&& other) noexcept
+            {
+                cotaskmem_vector tmp{ std::move(other) };
+                std::swap(_data, tmp._data);
+                std::swap(_size, tmp._size);
+                std::swap(_capacity, tmp._capacity);
+                return (*this);
+            }
+
+            T* data() noexcept { return _data; }
+            T const* data() const noexcept { return _data; }
+            std::size_t size() const noexcept { return _size; }
+            std::size_t capacity() const noexcept { return _capacity; }
+            bool empty() const noexcept { return _size == 0; }
+
+            T& operator[](std::size_t i) noexcept { return _data[i]; }
+            T const& operator[](std::size_t i) const noexcept { return _data[i]; }
+            T& back() noexcept { return _data[_size - 1]; }
+
+            iterator begin() noexcept { return _data; }
+            iterator end() noexcept { return _data + _size; }
+            const_iterator begin() const noexcept { return _data; }
+            const_iterator end() const noexcept { return _data + _size; }
+
+            void reserve(std::size_t capacity)
+            {
+                if (capacity <= _capacity)
+                    return;
+
+                if (capacity > SIZE_MAX / sizeof(T))
+                    throw std::bad_alloc{};
+
+                void* p = PAL_CoTaskMemRealloc(_data, capacity * sizeof(T));
+                if (p == nullptr)
+                    throw std::bad_alloc{};
+
+                _data = static_cast<T*>(p);
+                _capacity = capacity;
+            }
+
+            void resize(std::size_t count)
+            {
+                reserve(count);
+                for (std::size_t i = _size; i < count; ++i)
+                    ::new(static_cast<void*>(_data + i)) T();
+                _size = count;
+            }
+
+            void push_back(T const& value)
+            {
+                // The value may be an element of this vector.
+                T tmp = value;
+                if (_size == _capacity)
+                    grow(_size + 1);
+                _data[_size++] = tmp;
+            }
+
+            template<typename... Args>
+            T& emplace_back(Args&&... args)
+            {
+                T tmp(std::forward<Args>(args)...);
+                push_back(tmp);
+                return back();
+            }
+
+            void pop_back() noexcept { --_size; }
+
+            void clear() noexcept { _size = 0; }
+
+            // Release the elements to the caller, who frees them with
+            // PAL_CoTaskMemFree. Returns null if nothing was allocated.
+            //   *result = vec.release();
+            T* release() noexcept
+            {
+                T* tmp = _data;
+                _data = nullptr;
+                _size = 0;
+                _capacity = 0;
+                return tmp;
+            }
+        };
+
+        // Smart pointer for DNCP_MATCHER
+        struct matcher_deleter
+        {
+            void operator()(DNCP_MATCHER* m) { PAL_MatcherFree(m); }
+        };
+        using matcher_ptr = std::unique_ptr<DNCP_MATCHER, matcher_deleter>;
+
+        // Calls f(DNCP_MATCH const&) for every match until it returns false.
+        //   hr = dncp::matcher_search(m.get(), text, len, [&](DNCP_MATCH const& match) { ...; return true; });
+        template<typename F>
+        HRESULT matcher_search(DNCP_MATCHER const* matcher, WCHAR const* text, std::size_t len, F&& f)
+        {
+            using callable = typename std::remove_reference<F>::type;
+            return PAL_MatcherSearch(matcher, text, len,
+                [](void* context, DNCP_MATCH const* match) -> BOOL
+                {
+                    return (*static_cast<callable*>(context))(*match) ? TRUE : FALSE;
+                },
+                const_cast<void*>(static_cast<void const*>(std::addressof(f))));
+        }
+
+#ifndef DNCP_WINDOWS
+        static_assert(sizeof(wchar_t) == sizeof(UINT32), "wchar_t is UTF-32 outside Windows");
+
+        namespace details
+        {
+            // Block for the text of a string that doesn't fit inline.
+            template<typename T>
+            T* allocate_chars(std::size_t count)
+            {
+                if (count > SIZE_MAX / sizeof(T))
+                    throw std::bad_alloc{};
+
+                void* p = PAL_CoTaskMemAlloc(count * sizeof(T));
+                if (p == nullptr)
+                    throw std::bad_alloc{};
+
+                return static_cast<T*>(p);
+            }
+        }
+
+        // Null terminated wchar_t copy of a UTF-16 string, to pass to C
+        // library functions such as wcstod() or wcsftime(). A string shorter
+        // than N units is converted into an inline buffer, so a local copy
+        // makes no allocation. Allocation failures throw std::bad_alloc.
+        //   dncp::wchar_string<> str{ value };
+        //   double d = std::wcstod(str.c_str(), nullptr);
+        template<std::size_t N = 64>
+        class wchar_string
+        {
+            static_assert(N > 0, "The inline buffer must hold the terminator");
+
+            wchar_t* _data;
+            std::size_t _length;
+            wchar_t _buffer[N];
+
+        public:
+            explicit wchar_string(WCHAR const* str)
+                : wchar_string{ str, PAL_wcslen(str) }
+            { }
+
+            wchar_string(WCHAR const* str, std::size_t len)
+                : _data{ _buffer }
+                , _length{}
+            {
+                // No UTF-16 string has more UTF-32 units than UTF-16 units.
+                if (len >= N)
+                    _data = details::allocate_chars<wchar_t>(len + 1);
+
+                _length = PAL_Utf16ToUtf32(str, len, reinterpret_cast<UINT32*>(_data));
+                _data[_length] = L'\0';
+            }
+
+            wchar_string(wchar_string const&) = delete;
+
+            ~wchar_string()
+            {
+                if (_data != _buffer)
+                    PAL_CoTaskMemFree(_data);
+            }
+
+            wchar_string& operator=(wchar_string const&) = delete;
+
+            wchar_t const* c_str() const noexcept { return _data; }
+            std::size_t length() const noexcept { return _length; }
+        };
+
+        // Null terminated UTF-16 copy of a wchar_t string, such as one written
+        // by swprintf() or wcsftime(). A string of fewer than N units in
+        // UTF-16 is converted into an inline buffer.
+        //   dncp::utf16_string<> str{ buffer };
+        //   bstr_ptr b{ PAL_SysAllocStringLen(str.c_str(), (UINT)str.length()) };
+        template<std::size_t N = 64>
+        class utf16_string
+        {
+            static_assert(N > 0, "The inline buffer must hold the terminator");
+
+            WCHAR* _data;
+            std::size_t _length;
+            WCHAR _buffer[N];
+
+        public:
+            explicit utf16_string(wchar_t const* str)
+                : utf16_string{ str, std::wcslen(str) }
+            { }
+
+            utf16_string(wchar_t const* str, std::size_t len)
+                : _data{ _buffer }
+                , _length{}
+            {
+                UINT32 const* src = reinterpret_cast<UINT32 const*>(str);
+
+                // Each UTF-32 unit takes at most two UTF-16 units, so only
+                // longer strings need to be measured.
+                if (len > (N - 1) / 2)
+                {
+                    std::size_t units = PAL_Utf32ToUtf16(src, len, nullptr);
+                    if (units >= N)
+                        _data = details::allocate_chars<WCHAR>(units + 1);
+                }
+
+                _length = PAL_Utf32ToUtf16(src, len, _data);
+                _data[_length] = 0;
+            }
+
+            utf16_string(utf16_string const&) = delete;
+
+            ~utf16_string()
+            {
+                if (_data != _buffer)
+                    PAL_CoTaskMemFree(_data);
+            }
+
+            utf16_string& operator=(utf16_string const&) = delete;
+
+            WCHAR const* c_str() const noexcept { return _data; }
+            std::size_t length() const noexcept { return _length; }
+        };
+#endif // !DNCP_WINDOWS
+    }
+
+    // Allows dncp::bstr_view as a key of unordered containers.
+    namespace std
+    {
+        template<>
+        struct hash<::dncp::bstr_view>
+        {
+            size_t operator()(::dncp::bstr_view str) const noexcept
+            {
+                return (size_t)str.hash();
+            }
+        };
+    }
+
+    // Creates a dncp::bstr_literal from a string literal at compile time.
+    //   hr = obj->SetName(DNCP_BSTR_LITERAL(W("Name")).get());
+    #define DNCP_BSTR_LITERAL(str) \
+        ([]() noexcept -> ::dncp::bstr_literal \
+        { \
+            static constexpr auto image = ::dncp::details::make_bstr_image(str); \
+            return ::dncp::bstr_literal{ image.chars, (UINT)(sizeof(image.chars) / sizeof(OLECHAR) - 1) }; \
+        }())
+
+    // Allocates a copy of a literal, whose length is already known.
+    inline BSTR PAL_SysAllocString(::dncp::bstr_literal str)
+    {
+        return PAL_SysAllocStringLen(str.get(), str.length());
     }
 #endif // __cplusplus
 
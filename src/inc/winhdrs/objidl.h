@@ -22,6 +22,59 @@
 #include "rpc.h"
 #include "rpcndr.h"
 
+typedef enum tagMEMCTX
+{
+    MEMCTX_TASK = 1,
+    MEMCTX_SHARED = 2,
+    MEMCTX_MACSYSTEM = 3,
+    MEMCTX_UNKNOWN = -1,
+    MEMCTX_SAME = -2
+} MEMCTX;
+
+#ifndef __IMalloc_INTERFACE_DEFINED__
+#define __IMalloc_INTERFACE_DEFINED__
+
+/* interface IMalloc */
+/* [uuid][object][local] */ 
+
+typedef interface IMalloc IMalloc;
+typedef /* [unique] */ IMalloc *LPMALLOC;
+
+EXTERN_C const IID IID_IMalloc;
+
+    MIDL_INTERFACE("00000002-0000-0000-C000-000000000046")
+    IMalloc : public IUnknown
+    {
+    public:
+        virtual void *STDMETHODCALLTYPE Alloc( 
+            /* [annotation][in] */ 
+            _In_  SIZE_T cb) = 0;
+        
+        virtual void *STDMETHODCALLTYPE Realloc( 
+            /* [annotation][in] */ 
+            _In_opt_  void *pv,
+            /* [annotation][in] */ 
+            _In_  SIZE_T cb) = 0;
+        
+        virtual void STDMETHODCALLTYPE Free( 
+            /* [annotation][in] */ 
+            _In_opt_  void *pv) = 0;
+        
+        virtual SIZE_T STDMETHODCALLTYPE GetSize( 
+            /* [annotation][in] */ 
+            _In_opt_  void *pv) = 0;
+        
+        virtual int STDMETHODCALLTYPE DidAlloc( 
+            /* [annotation][in] */ 
+            _In_opt_  void *pv) = 0;
+        
+        virtual void STDMETHODCALLTYPE HeapMinimize( void) = 0;
+        
+    };
+
+#endif 	/* __IMalloc_INTERFACE_DEFINED__ */
+
+
 #ifndef __ISequentialStream_INTERFACE_DEFINED__
 #define __ISequentialStream_INTERFACE_DEFINED__
 
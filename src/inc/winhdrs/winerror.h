@@ -31,6 +31,13 @@
 #define SUCCEEDED(x) (x >= 0)
 #define FAILED(x) (x < 0)
 
+// Win32 error codes
+#define ERROR_SUCCESS                   0L
+#define ERROR_INVALID_PARAMETER         87L
+#define ERROR_INSUFFICIENT_BUFFER       122L
+#define ERROR_INVALID_FLAGS             1004L
+#define ERROR_NO_UNICODE_TRANSLATION    1113L
+
 // Win32 HRESULTs
 #define S_OK             ((HRESULT)0)
 #define S_FALSE          ((HRESULT)1)
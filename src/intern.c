@@ -0,0 +1,238 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <dncp.h>
+#include "bstr.h"
+
+//
+// Interned BSTRs.
+//
+// Equal strings share a single BSTR. The strings are kept in a hash
+// table, split into shards with their own lock to limit contention.
+// Each string's reference count lives in the payload of its tag, see
+// bstr.h, and is only changed with its shard locked. A count that
+// reaches the maximum is sticky and the string is never released.
+//
+// Releasing a string confirms it is in the table, so a foreign BSTR
+// whose spare bytes happen to look like a tag is freed as usual.
+//
+
+#ifdef BSTR_TAGS_SUPPORTED
+
+#define INTERN_SHARD_COUNT 64
+#define INTERN_MIN_BUCKETS 16
+#define INTERN_MAX_REFS 0xffffu
+
+struct intern_node
+{
+    struct intern_node* next;
+    uint64_t hash;
+    BSTR str;
+};
+
+struct intern_shard
+{
+    pthread_mutex_t lock;
+    struct intern_node** buckets;
+    size_t bucket_count;
+    size_t count;
+};
+
+static struct intern_shard shards[INTERN_SHARD_COUNT];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void InitShards(void)
+{
+    for (size_t i = 0; i < INTERN_SHARD_COUNT; ++i)
+        (void)pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static uint64_t HashString(LPCOLESTR str, UINT len)
+{
+    // FNV-1a over the code units.
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (UINT i = 0; i < len; ++i)
+    {
+        hash ^= str[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    return hash;
+}
+
+static struct intern_shard* GetShard(uint64_t hash)
+{
+    (void)pthread_once(&shards_once, InitShards);
+
+    // The low bits pick the bucket within the shard.
+    return &shards[(hash >> 58) % INTERN_SHARD_COUNT];
+}
+
+static struct intern_node** GetBucket(struct intern_shard* shard, uint64_t hash)
+{
+    return &shard->buckets[hash & (shard->bucket_count - 1)];
+}
+
+static void GrowShard(struct intern_shard* shard)
+{
+    size_t bucket_count = shard->bucket_count == 0 ? INTERN_MIN_BUCKETS : shard->bucket_count * 2;
+    struct intern_node** buckets = (struct intern_node**)calloc(bucket_count, sizeof(struct intern_node*));
+
+    // The table keeps working, with longer chains, if it can't grow.
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < shard->bucket_count; ++i)
+    {
+        struct intern_node* node = shard->buckets[i];
+        while (node != NULL)
+        {
+            struct intern_node* next = node->next;
+            struct intern_node** bucket = &buckets[node->hash & (bucket_count - 1)];
+            node->next = *bucket;
+            *bucket = node;
+            node = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
+}
+
+static BSTR AddRefOrInsert(struct intern_shard* shard, uint64_t hash, LPCOLESTR str, UINT len)
+{
+    if (shard->bucket_count != 0)
+    {
+        for (struct intern_node* node = *GetBucket(shard, hash); node != NULL; node = node->next)
+        {
+            if (node->hash != hash
+                || PAL_SysStringLen(node->str) != len
+                || 0 != memcmp(node->str, str, len * sizeof(OLECHAR)))
+            {
+                continue;
+            }
+
+            UINT refs = BSTR_TAG_PAYLOAD(bstr_tag_load(node->str));
+            if (refs < INTERN_MAX_REFS)
+                bstr_tag_store(node->str, BSTR_TAG(BSTR_KIND_INTERNED, refs + 1));
+
+            return node->str;
+        }
+    }
+
+    if (shard->count >= shard->bucket_count)
+        GrowShard(shard);
+    if (shard->bucket_count == 0)
+        return NULL;
+
+    struct intern_node* node = (struct intern_node*)malloc(sizeof(*node));
+    if (node == NULL)
+        return NULL;
+
+    node->str = PAL_SysAllocStringLen(str, len);
+    if (node->str == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+
+    bstr_tag_store(node->str, BSTR_TAG(BSTR_KIND_INTERNED, 1));
+    node->hash = hash;
+
+    struct intern_node** bucket = GetBucket(shard, hash);
+    node->next = *bucket;
+    *bucket = node;
+    shard->count++;
+    return node->str;
+}
+
+BSTR PAL_SysAllocStringInterned(LPCOLESTR str)
+{
+    if (str == NULL)
+        return NULL;
+
+    UINT len = (UINT)PAL_wcslen(str);
+    uint64_t hash = HashString(str, len);
+    struct intern_shard* shard = GetShard(hash);
+
+    (void)pthread_mutex_lock(&shard->lock);
+    BSTR bstr = AddRefOrInsert(shard, hash, str, len);
+    (void)pthread_mutex_unlock(&shard->lock);
+    return bstr;
+}
+
+bool intern_release(BSTR bstr)
+{
+    uint64_t hash = HashString(bstr, PAL_SysStringLen(bstr));
+    struct intern_shard* shard = GetShard(hash);
+
+    (void)pthread_mutex_lock(&shard->lock);
+    struct intern_node** link = shard->bucket_count != 0 ? GetBucket(shard, hash) : NULL;
+    while (link != NULL && *link != NULL && (*link)->str != bstr)
+        link = &(*link)->next;
+
+    if (link == NULL || *link == NULL)
+    {
+        (void)pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+
+    UINT refs = BSTR_TAG_PAYLOAD(bstr_tag_load(bstr));
+    if (refs == INTERN_MAX_REFS || refs > 1)
+    {
+        if (refs != INTERN_MAX_REFS)
+            bstr_tag_store(bstr, BSTR_TAG(BSTR_KIND_INTERNED, refs - 1));
+
+        (void)pthread_mutex_unlock(&shard->lock);
+        return true;
+    }
+
+    struct intern_node* node = *link;
+    *link = node->next;
+    shard->count--;
+    (void)pthread_mutex_unlock(&shard->lock);
+
+    // The string is ordinary again and freed as such.
+    free(node);
+    bstr_tag_store(bstr, 0);
+    PAL_SysFreeString(bstr);
+    return true;
+}
+
+#else
+
+BSTR PAL_SysAllocStringInterned(LPCOLESTR str)
+{
+    // There is no room for a tag, so every call returns a new string.
+    return PAL_SysAllocString(str);
+}
+
+bool intern_release(BSTR bstr)
+{
+    (void)bstr;
+    return false;
+}
+
+#endif // BSTR_TAGS_SUPPORTED
@@ -0,0 +1,422 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Required for mremap().
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "alloc.h"
+
+#if defined(__GLIBC__) && defined(__linux__)
+    #include <dlfcn.h>
+    #include <gnu/libc-version.h>
+#endif
+
+//
+// Large blocks are mapped directly from the OS and unmapped as soon
+// as they are freed, so they never fragment the heap or hold on to RSS.
+//
+// The block must still be releasable with free(). glibc's allocator
+// serves large requests the same way and identifies such a block by a
+// chunk header directly in front of the returned pointer:
+//
+//  | prev_size | size | IS_MMAPPED | user memory ...
+//  ^ chunk               ^ flag bit  ^ pointer returned
+//
+// where the mapping starts "prev_size" bytes before the chunk and is
+// "prev_size + size" bytes long. Writing the same header lets free(),
+// realloc() and malloc_usable_size() handle the block as their own.
+// Blocks mapped here also set the PREV_INUSE bit, which glibc never sets
+// for its own mapped chunks, so they can be told apart. A glibc realloc()
+// of the block rewrites the header, at which point glibc owns it.
+//
+// The header layout is specific to glibc, so the tier is only available
+// there, and only when free() is glibc's own rather than a replacement
+// such as jemalloc or a sanitizer's.
+//
+// The header is never used to recognize a large block, since reading it
+// would mean reading memory in front of blocks the library doesn't own.
+// Instead, every mapped block is recorded by address, with the length of
+// its mapping. A block released with free() stays recorded until its
+// address is seen again, so a recorded address is only trusted while its
+// header still describes that mapping with both IS_MMAPPED and PREV_INUSE
+// set. Unmapping uses the recorded length, never the header.
+//
+
+#if defined(__GLIBC__) && defined(__linux__)
+    #define LARGE_SUPPORTED
+#endif
+
+struct chunk_header
+{
+    size_t prev_size;
+    size_t size;
+};
+
+#define CHUNK_PREV_INUSE 0x1
+#define CHUNK_IS_MMAPPED 0x2
+#define CHUNK_FLAGS 0x7
+
+#define CHUNK_ALIGNMENT (_Alignof(max_align_t) > 2 * sizeof(size_t) ? _Alignof(max_align_t) : 2 * sizeof(size_t))
+
+// Offset of the user memory, and the chunk header, from the start of the mapping.
+#define MEM_OFFSET ((sizeof(struct chunk_header) + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1))
+#define CHUNK_OFFSET (MEM_OFFSET - sizeof(struct chunk_header))
+
+// Mappings at least this size are aligned and marked for transparent
+// huge pages to reduce TLB misses.
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+#ifdef LARGE_SUPPORTED
+
+static size_t page_size;
+
+//
+// Addresses of the mapped blocks, with the length of their mappings, in an
+// open addressing hash table.
+//
+
+struct registry_entry
+{
+    uintptr_t mem;
+    size_t total;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct registry_entry* registry;
+static size_t registry_capacity;
+static size_t registry_count;
+
+// Lets frees skip the lock while no block is mapped.
+static atomic_size_t registry_live;
+
+static size_t registry_slot(uintptr_t mem, size_t capacity)
+{
+    return (size_t)(((uint64_t)(mem / page_size) * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+static size_t registry_find(uintptr_t mem)
+{
+    size_t i = registry_slot(mem, registry_capacity);
+    while (registry[i].mem != 0 && registry[i].mem != mem)
+        i = (i + 1) & (registry_capacity - 1);
+    return i;
+}
+
+static bool registry_grow(void)
+{
+    size_t capacity = registry_capacity == 0 ? 64 : registry_capacity * 2;
+    struct registry_entry* table = (struct registry_entry*)calloc(capacity, sizeof(struct registry_entry));
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < registry_capacity; ++i)
+    {
+        if (registry[i].mem == 0)
+            continue;
+
+        size_t j = registry_slot(registry[i].mem, capacity);
+        while (table[j].mem != 0)
+            j = (j + 1) & (capacity - 1);
+        table[j] = registry[i];
+    }
+
+    free(registry);
+    registry = table;
+    registry_capacity = capacity;
+    return true;
+}
+
+// Records the block, or updates the length of its mapping.
+static void registry_set_locked(uintptr_t mem, size_t total)
+{
+    size_t i = registry_find(mem);
+    if (registry[i].mem == 0)
+    {
+        registry[i].mem = mem;
+        registry_count++;
+    }
+    registry[i].total = total;
+    atomic_store_explicit(&registry_live, registry_count, memory_order_relaxed);
+}
+
+static bool registry_add(void* mem, size_t total)
+{
+    bool added = true;
+    (void)pthread_mutex_lock(&registry_lock);
+    if ((registry_count + 1) * 2 > registry_capacity && !registry_grow())
+        added = false;
+    else
+        registry_set_locked((uintptr_t)mem, total);
+    (void)pthread_mutex_unlock(&registry_lock);
+    return added;
+}
+
+static void registry_remove_locked(uintptr_t mem)
+{
+    size_t i = registry_find(mem);
+    if (registry[i].mem == 0)
+        return;
+
+    // Shift back the entries that follow, so lookups need no tombstones.
+    size_t mask = registry_capacity - 1;
+    for (size_t j = (i + 1) & mask; registry[j].mem != 0; j = (j + 1) & mask)
+    {
+        size_t home = registry_slot(registry[j].mem, registry_capacity);
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            registry[i] = registry[j];
+            i = j;
+        }
+    }
+    registry[i].mem = 0;
+    registry_count--;
+    atomic_store_explicit(&registry_live, registry_count, memory_order_relaxed);
+}
+
+// Replacing an entry never needs the table to grow.
+static void registry_replace(void* old_mem, void* new_mem, size_t total)
+{
+    (void)pthread_mutex_lock(&registry_lock);
+    registry_remove_locked((uintptr_t)old_mem);
+    registry_set_locked((uintptr_t)new_mem, total);
+    (void)pthread_mutex_unlock(&registry_lock);
+}
+
+// Length of the block's mapping, which must be recorded.
+static size_t registry_total(void* mem)
+{
+    (void)pthread_mutex_lock(&registry_lock);
+    size_t total = registry[registry_find((uintptr_t)mem)].total;
+    (void)pthread_mutex_unlock(&registry_lock);
+    return total;
+}
+
+static void registry_remove(void* mem)
+{
+    (void)pthread_mutex_lock(&registry_lock);
+    registry_remove_locked((uintptr_t)mem);
+    (void)pthread_mutex_unlock(&registry_lock);
+}
+
+// The header is only written to blocks that free() can release.
+static bool is_glibc_free(void)
+{
+    Dl_info free_info;
+    Dl_info libc_info;
+    return 0 != dladdr((void*)free, &free_info)
+        && 0 != dladdr((void*)gnu_get_libc_version, &libc_info)
+        && free_info.dli_fbase == libc_info.dli_fbase;
+}
+
+bool large_init(void)
+{
+    long size = sysconf(_SC_PAGESIZE);
+    if (size <= 0 || !is_glibc_free())
+        return false;
+
+    page_size = (size_t)size;
+    return true;
+}
+
+static struct chunk_header* get_header(void* mem)
+{
+    return (struct chunk_header*)mem - 1;
+}
+
+static bool compute_mapping_size(size_t size, size_t* total)
+{
+    size_t with_header = size + MEM_OFFSET;
+    size_t rounded = (with_header + (page_size - 1)) & ~(page_size - 1);
+    if (with_header < size || rounded < with_header)
+        return false;
+
+    *total = rounded;
+    return true;
+}
+
+static void request_huge_pages(void* base, size_t total)
+{
+    // Best effort. The kernel may not support or allow it.
+    if (total >= HUGE_PAGE_SIZE)
+        (void)madvise(base, total, MADV_HUGEPAGE);
+}
+
+static void* map_region(size_t total)
+{
+    int const prot = PROT_READ | PROT_WRITE;
+    int const flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (total < HUGE_PAGE_SIZE)
+    {
+        void* base = mmap(NULL, total, prot, flags, -1, 0);
+        return base == MAP_FAILED ? NULL : base;
+    }
+
+    // Over-allocate so the start can be aligned on a huge page and
+    // trim the excess on either side.
+    size_t padded = total + HUGE_PAGE_SIZE - page_size;
+    if (padded < total)
+        return NULL;
+
+    char* raw = (char*)mmap(NULL, padded, prot, flags, -1, 0);
+    if (raw == (char*)MAP_FAILED)
+        return NULL;
+
+    char* base = (char*)(((uintptr_t)raw + (HUGE_PAGE_SIZE - 1)) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    size_t head = (size_t)(base - raw);
+    size_t tail = padded - head - total;
+    if (head != 0)
+        (void)munmap(raw, head);
+    if (tail != 0)
+        (void)munmap(base + total, tail);
+
+    request_huge_pages(base, total);
+    return base;
+}
+
+static void* init_block(char* base, size_t total)
+{
+    struct chunk_header* header = (struct chunk_header*)(base + CHUNK_OFFSET);
+    header->prev_size = CHUNK_OFFSET;
+    header->size = (total - CHUNK_OFFSET) | CHUNK_IS_MMAPPED | CHUNK_PREV_INUSE;
+    return header + 1;
+}
+
+void* large_alloc(size_t size)
+{
+    size_t total;
+    if (!compute_mapping_size(size, &total))
+        return NULL;
+
+    char* base = (char*)map_region(total);
+    if (base == NULL)
+        return NULL;
+
+    void* mem = init_block(base, total);
+    if (!registry_add(mem, total))
+    {
+        (void)munmap(base, total);
+        return NULL;
+    }
+
+    return mem;
+}
+
+bool large_is_block(void* mem)
+{
+    // Every block starts the same distance into a page.
+    if (((uintptr_t)mem & (page_size - 1)) != MEM_OFFSET
+        || atomic_load_explicit(&registry_live, memory_order_relaxed) == 0)
+    {
+        return false;
+    }
+
+    (void)pthread_mutex_lock(&registry_lock);
+    struct registry_entry const* entry = &registry[registry_find((uintptr_t)mem)];
+    bool found = entry->mem != 0;
+
+    // The block was released with free() if its header no longer describes
+    // the recorded mapping. glibc has since handed out the address, either
+    // for one of its own mapped chunks, which never set PREV_INUSE, or for
+    // an arena chunk, which is never IS_MMAPPED.
+    if (found)
+    {
+        struct chunk_header const* header = get_header(mem);
+        size_t const flags = CHUNK_IS_MMAPPED | CHUNK_PREV_INUSE;
+        if ((header->size & flags) != flags
+            || header->prev_size != CHUNK_OFFSET
+            || header->prev_size + (header->size & ~(size_t)CHUNK_FLAGS) != entry->total)
+        {
+            registry_remove_locked((uintptr_t)mem);
+            found = false;
+        }
+    }
+    (void)pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+void* large_realloc(void* mem, size_t size)
+{
+    char* base = (char*)mem - MEM_OFFSET;
+    size_t old_total = registry_total(mem);
+
+    size_t total;
+    if (!compute_mapping_size(size, &total))
+        return NULL;
+
+    if (total == old_total)
+        return mem;
+
+    // The kernel moves the pages instead of copying them.
+    char* new_base = (char*)mremap(base, old_total, total, MREMAP_MAYMOVE);
+    if (new_base == (char*)MAP_FAILED)
+        return NULL;
+
+    request_huge_pages(new_base, total);
+    void* new_mem = init_block(new_base, total);
+    registry_replace(mem, new_mem, total);
+    return new_mem;
+}
+
+void large_free(void* mem)
+{
+    size_t total = registry_total(mem);
+    registry_remove(mem);
+    (void)munmap((char*)mem - MEM_OFFSET, total);
+}
+
+#else
+
+bool large_init(void)
+{
+    return false;
+}
+
+void* large_alloc(size_t size)
+{
+    (void)size;
+    return NULL;
+}
+
+bool large_is_block(void* mem)
+{
+    (void)mem;
+    return false;
+}
+
+void* large_realloc(void* mem, size_t size)
+{
+    (void)mem;
+    (void)size;
+    return NULL;
+}
+
+void large_free(void* mem)
+{
+    (void)mem;
+}
+
+#endif // LARGE_SUPPORTED
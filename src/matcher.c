@@ -0,0 +1,638 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+    #define NOMINMAX
+    #define WIN32_LEAN_AND_MEAN
+    #include <Windows.h>
+    #include <intrin.h>
+#endif
+
+#include <dncp.h>
+#include "casefold.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define MATCHER_X64
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define MATCHER_NEON
+#endif
+
+// Simple uppercase form of a unit, as strings.c folds it.
+static inline WCHAR FoldUnit(WCHAR c)
+{
+    return (WCHAR)(c + casefold_deltas[casefold_index[c >> CASEFOLD_BLOCK_BITS]][c & (CASEFOLD_BLOCK_SIZE - 1)]);
+}
+
+#if defined(MATCHER_X64)
+
+static inline size_t CountTrailingZeros(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return (size_t)__builtin_ctz(mask);
+#endif
+}
+
+#elif defined(MATCHER_NEON)
+
+static inline size_t CountTrailingZeros64(uint64_t mask)
+{
+    return (size_t)__builtin_ctzll(mask);
+}
+
+// Mask with 8 bits set for each WCHAR that compared equal.
+static inline uint64_t MaskNeon(uint16x8_t eq)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0);
+}
+
+#endif
+
+//
+// Multi-pattern search.
+//
+// The patterns are compiled into an Aho-Corasick automaton over classes
+// of units. Each unit that occurs in a pattern has a class of its own, and
+// all other units share one. With DNCP_MATCHER_IGNORE_CASE, units are
+// classed by their simple uppercase forms, so folding costs nothing while
+// searching. When the transitions for every state and class fit in
+// MATCHER_DFA_MAX_ENTRIES, the automaton is a DFA and each unit of text
+// takes one table lookup. Otherwise the search follows the trie edges and
+// failure links. In the start state, the text is skipped with vector
+// compares when at most MATCHER_START_SET units can start a match.
+//
+
+#define MATCHER_START_SET 4
+#define MATCHER_DFA_MAX_ENTRIES ((size_t)1 << 22)
+#define MATCHER_NO_STATE UINT32_MAX
+
+// Set in DFA transitions to states where a pattern ends.
+#define MATCHER_MATCH_FLAG ((uint32_t)1 << 31)
+
+struct DNCP_MATCHER
+{
+    UINT pattern_count;
+    UINT* pattern_lengths;
+
+    // Class of each unit, found by its high byte then its low byte.
+    uint32_t class_block[256];
+    uint16_t* classes;
+    uint32_t class_count;
+
+    uint32_t state_count;
+
+    // DFA transitions, indexed by state * class_count + class. Each entry
+    // is the next state times class_count, with MATCHER_MATCH_FLAG if a
+    // pattern ends there. Null when the table would be too large.
+    uint32_t* dfa;
+
+    // Trie edges of each state, sorted by class, and the start state's
+    // transitions for every class.
+    uint32_t* edge_start;
+    uint32_t* edge_class;
+    uint32_t* edge_target;
+    uint32_t* root_next;
+
+    uint32_t* fail;
+
+    // Patterns that end at each state, and the first state along the
+    // failure links, starting with the state itself, where any end.
+    uint32_t* output_start;
+    UINT* output_patterns;
+    uint32_t* first_output;
+
+    // Units that can start a match, if there are only a few.
+    size_t start_count;
+    WCHAR start_units[MATCHER_START_SET];
+};
+
+struct matcher_pattern
+{
+    WCHAR const* units;
+    UINT length;
+    UINT index;
+};
+
+static int ComparePatterns(void const* a, void const* b)
+{
+    struct matcher_pattern const* p = (struct matcher_pattern const*)a;
+    struct matcher_pattern const* q = (struct matcher_pattern const*)b;
+    UINT len = p->length < q->length ? p->length : q->length;
+    for (UINT i = 0; i < len; ++i)
+    {
+        if (p->units[i] != q->units[i])
+            return p->units[i] < q->units[i] ? -1 : 1;
+    }
+
+    if (p->length != q->length)
+        return p->length < q->length ? -1 : 1;
+    return p->index < q->index ? -1 : (p->index > q->index);
+}
+
+static inline uint32_t UnitClass(struct DNCP_MATCHER const* m, WCHAR c)
+{
+    return m->classes[m->class_block[c >> 8] + (c & 0xff)];
+}
+
+static uint32_t FindEdge(struct DNCP_MATCHER const* m, uint32_t state, uint32_t cls)
+{
+    uint32_t lo = m->edge_start[state];
+    uint32_t hi = m->edge_start[state + 1];
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (m->edge_class[mid] < cls)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < m->edge_start[state + 1] && m->edge_class[lo] == cls ? m->edge_target[lo] : MATCHER_NO_STATE;
+}
+
+static uint32_t NextState(struct DNCP_MATCHER const* m, uint32_t state, uint32_t cls)
+{
+    for (;;)
+    {
+        if (state == 0)
+            return m->root_next[cls];
+
+        uint32_t next = FindEdge(m, state, cls);
+        if (next != MATCHER_NO_STATE)
+            return next;
+
+        state = m->fail[state];
+    }
+}
+
+void PAL_MatcherFree(DNCP_MATCHER* matcher)
+{
+    if (matcher == NULL)
+        return;
+
+    free(matcher->pattern_lengths);
+    free(matcher->classes);
+    free(matcher->dfa);
+    free(matcher->edge_start);
+    free(matcher->edge_class);
+    free(matcher->edge_target);
+    free(matcher->root_next);
+    free(matcher->fail);
+    free(matcher->output_start);
+    free(matcher->output_patterns);
+    free(matcher->first_output);
+    free(matcher);
+}
+
+// Assigns a class to every unit and builds the lookup blocks. Returns the
+// class of each folded pattern unit through unit_class.
+static bool BuildClasses(struct DNCP_MATCHER* m, WCHAR const* units, size_t total, bool ignore_case, uint32_t* unit_class)
+{
+    // Number the units that occur in the patterns in ascending order, so
+    // that trie edges created in pattern order are sorted by class.
+    for (size_t c = 0; c < 0x10000; ++c)
+        unit_class[c] = MATCHER_NO_STATE;
+    for (size_t i = 0; i < total; ++i)
+        unit_class[units[i]] = 0;
+
+    uint32_t used = 0;
+    for (size_t c = 0; c < 0x10000; ++c)
+    {
+        if (unit_class[c] == 0)
+            unit_class[c] = used++;
+    }
+
+    // Any other unit, if there is one.
+    uint32_t other = used < 0x10000 ? used : 0;
+    m->class_count = used < 0x10000 ? used + 1 : used;
+
+    size_t blocks = 1;
+    for (size_t high = 0; high < 256; ++high)
+    {
+        m->class_block[high] = 0;
+        for (size_t low = 0; low < 256; ++low)
+        {
+            WCHAR c = (WCHAR)(high << 8 | low);
+            WCHAR key = ignore_case ? FoldUnit(c) : c;
+            if (unit_class[key] != MATCHER_NO_STATE)
+            {
+                m->class_block[high] = (uint32_t)(blocks++ * 256);
+                break;
+            }
+        }
+    }
+
+    // Block zero holds only the class of other units.
+    m->classes = (uint16_t*)malloc(blocks * 256 * sizeof(uint16_t));
+    if (m->classes == NULL)
+        return false;
+
+    for (size_t i = 0; i < 256; ++i)
+        m->classes[i] = (uint16_t)other;
+
+    for (size_t high = 0; high < 256; ++high)
+    {
+        if (m->class_block[high] == 0)
+            continue;
+
+        uint16_t* block = m->classes + m->class_block[high];
+        for (size_t low = 0; low < 256; ++low)
+        {
+            WCHAR c = (WCHAR)(high << 8 | low);
+            WCHAR key = ignore_case ? FoldUnit(c) : c;
+            block[low] = (uint16_t)(unit_class[key] != MATCHER_NO_STATE ? unit_class[key] : other);
+        }
+    }
+
+    return true;
+}
+
+// Builds the trie from the sorted patterns, then the failure links and
+// outputs in breadth-first order.
+static bool BuildAutomaton(struct DNCP_MATCHER* m, struct matcher_pattern const* sorted, size_t total, UINT max_len, uint32_t const* unit_class)
+{
+    bool success = false;
+    uint32_t* parent = (uint32_t*)malloc((total + 1) * sizeof(uint32_t));
+    uint32_t* parent_class = (uint32_t*)malloc((total + 1) * sizeof(uint32_t));
+    uint32_t* end_state = (uint32_t*)malloc(m->pattern_count * sizeof(uint32_t));
+    uint32_t* path = (uint32_t*)malloc(((size_t)max_len + 1) * sizeof(uint32_t));
+    uint32_t* queue = (uint32_t*)malloc((total + 1) * sizeof(uint32_t));
+    if (parent == NULL || parent_class == NULL || end_state == NULL || path == NULL || queue == NULL)
+        goto cleanup;
+
+    // Sorted patterns share their common prefix with the previous one.
+    uint32_t states = 1;
+    path[0] = 0;
+    for (UINT k = 0; k < m->pattern_count; ++k)
+    {
+        UINT shared = 0;
+        if (k > 0)
+        {
+            struct matcher_pattern const* prev = &sorted[k - 1];
+            while (shared < prev->length && shared < sorted[k].length && prev->units[shared] == sorted[k].units[shared])
+                shared++;
+        }
+
+        for (UINT i = shared; i < sorted[k].length; ++i)
+        {
+            parent[states] = path[i];
+            parent_class[states] = unit_class[sorted[k].units[i]];
+            path[i + 1] = states++;
+        }
+        end_state[k] = path[sorted[k].length];
+    }
+    m->state_count = states;
+
+    m->edge_start = (uint32_t*)calloc((size_t)states + 1, sizeof(uint32_t));
+    m->edge_class = (uint32_t*)malloc(states * sizeof(uint32_t));
+    m->edge_target = (uint32_t*)malloc(states * sizeof(uint32_t));
+    m->root_next = (uint32_t*)calloc(m->class_count, sizeof(uint32_t));
+    m->fail = (uint32_t*)calloc(states, sizeof(uint32_t));
+    m->output_start = (uint32_t*)calloc((size_t)states + 1, sizeof(uint32_t));
+    m->output_patterns = (UINT*)malloc(m->pattern_count * sizeof(UINT));
+    m->first_output = (uint32_t*)malloc(states * sizeof(uint32_t));
+    if (m->edge_start == NULL || m->edge_class == NULL || m->edge_target == NULL || m->root_next == NULL
+        || m->fail == NULL || m->output_start == NULL || m->output_patterns == NULL || m->first_output == NULL)
+    {
+        goto cleanup;
+    }
+
+    // Children are created in class order, so each state's edges are
+    // sorted once grouped by parent.
+    for (uint32_t s = 1; s < states; ++s)
+        m->edge_start[parent[s] + 1]++;
+    for (uint32_t s = 0; s < states; ++s)
+        m->edge_start[s + 1] += m->edge_start[s];
+    for (uint32_t s = 1; s < states; ++s)
+    {
+        uint32_t e = m->edge_start[parent[s]]++;
+        m->edge_class[e] = parent_class[s];
+        m->edge_target[e] = s;
+    }
+    for (uint32_t s = states; s > 0; --s)
+        m->edge_start[s] = m->edge_start[s - 1];
+    m->edge_start[0] = 0;
+
+    for (UINT k = 0; k < m->pattern_count; ++k)
+        m->output_start[end_state[k] + 1]++;
+    for (uint32_t s = 0; s < states; ++s)
+        m->output_start[s + 1] += m->output_start[s];
+    for (UINT k = 0; k < m->pattern_count; ++k)
+        m->output_patterns[m->output_start[end_state[k]]++] = sorted[k].index;
+    for (uint32_t s = states; s > 0; --s)
+        m->output_start[s] = m->output_start[s - 1];
+    m->output_start[0] = 0;
+
+    for (uint32_t e = m->edge_start[0]; e < m->edge_start[1]; ++e)
+        m->root_next[m->edge_class[e]] = m->edge_target[e];
+
+    // A state's failure link is shallower, so it is complete by the time
+    // the state is reached.
+    size_t head = 0;
+    size_t tail = 0;
+    queue[tail++] = 0;
+    m->first_output[0] = MATCHER_NO_STATE;
+    while (head < tail)
+    {
+        uint32_t s = queue[head++];
+        for (uint32_t e = m->edge_start[s]; e < m->edge_start[s + 1]; ++e)
+        {
+            uint32_t t = m->edge_target[e];
+            m->fail[t] = s == 0 ? 0 : NextState(m, m->fail[s], m->edge_class[e]);
+            m->first_output[t] = m->output_start[t] != m->output_start[t + 1] ? t : m->first_output[m->fail[t]];
+            queue[tail++] = t;
+        }
+    }
+
+    if ((uint64_t)states * m->class_count <= MATCHER_DFA_MAX_ENTRIES)
+    {
+        size_t const width = m->class_count;
+        m->dfa = (uint32_t*)malloc(states * width * sizeof(uint32_t));
+        if (m->dfa == NULL)
+            goto cleanup;
+
+        // Each row is the row of the failure link with the state's own
+        // edges replaced, first with states and then converted to entries.
+        memcpy(m->dfa, m->root_next, width * sizeof(uint32_t));
+        for (size_t q = 1; q < states; ++q)
+        {
+            uint32_t s = queue[q];
+            uint32_t* row = m->dfa + s * width;
+            memcpy(row, m->dfa + m->fail[s] * width, width * sizeof(uint32_t));
+            for (uint32_t e = m->edge_start[s]; e < m->edge_start[s + 1]; ++e)
+                row[m->edge_class[e]] = m->edge_target[e];
+        }
+
+        for (size_t i = 0; i < states * width; ++i)
+        {
+            uint32_t t = m->dfa[i];
+            m->dfa[i] = (uint32_t)(t * width) | (m->first_output[t] != MATCHER_NO_STATE ? MATCHER_MATCH_FLAG : 0);
+        }
+    }
+
+    success = true;
+
+cleanup:
+    free(parent);
+    free(parent_class);
+    free(end_state);
+    free(path);
+    free(queue);
+    return success;
+}
+
+static void FindStartUnits(struct DNCP_MATCHER* m)
+{
+    m->start_count = 0;
+    for (size_t c = 0; c < 0x10000; ++c)
+    {
+        if (m->root_next[UnitClass(m, (WCHAR)c)] == 0)
+            continue;
+
+        if (m->start_count == MATCHER_START_SET)
+        {
+            m->start_count = 0;
+            return;
+        }
+        m->start_units[m->start_count++] = (WCHAR)c;
+    }
+}
+
+HRESULT PAL_MatcherCreate(LPCOLESTR const* patterns, UINT const* lengths, UINT count, DWORD flags, DNCP_MATCHER** matcher)
+{
+    if (matcher == NULL)
+        return E_POINTER;
+
+    *matcher = NULL;
+    if (patterns == NULL)
+        return E_POINTER;
+
+    if (count == 0 || (flags & ~(DWORD)DNCP_MATCHER_IGNORE_CASE) != 0)
+        return E_INVALIDARG;
+
+    bool const ignore_case = (flags & DNCP_MATCHER_IGNORE_CASE) != 0;
+    HRESULT hr = E_OUTOFMEMORY;
+    WCHAR* folded = NULL;
+    struct matcher_pattern* sorted = NULL;
+    uint32_t* unit_class = NULL;
+
+    struct DNCP_MATCHER* m = (struct DNCP_MATCHER*)calloc(1, sizeof(*m));
+    if (m == NULL)
+        return E_OUTOFMEMORY;
+
+    m->pattern_count = count;
+    m->pattern_lengths = (UINT*)malloc(count * sizeof(UINT));
+    sorted = (struct matcher_pattern*)malloc(count * sizeof(*sorted));
+    if (m->pattern_lengths == NULL || sorted == NULL)
+        goto cleanup;
+
+    // Every pattern unit makes at most one state, and state numbers times
+    // the class count must leave MATCHER_MATCH_FLAG clear.
+    size_t total = 0;
+    UINT max_len = 0;
+    for (UINT i = 0; i < count; ++i)
+    {
+        if (patterns[i] == NULL)
+        {
+            hr = E_INVALIDARG;
+            goto cleanup;
+        }
+
+        size_t len = lengths != NULL ? lengths[i] : PAL_wcslen(patterns[i]);
+        if (len == 0 || len > UINT_MAX || len > (MATCHER_MATCH_FLAG - 1) - total)
+        {
+            hr = E_INVALIDARG;
+            goto cleanup;
+        }
+
+        m->pattern_lengths[i] = (UINT)len;
+        max_len = (UINT)len > max_len ? (UINT)len : max_len;
+        total += len;
+    }
+
+    folded = (WCHAR*)malloc(total * sizeof(WCHAR));
+    unit_class = (uint32_t*)malloc(0x10000 * sizeof(uint32_t));
+    if (folded == NULL || unit_class == NULL)
+        goto cleanup;
+
+    WCHAR* next = folded;
+    for (UINT i = 0; i < count; ++i)
+    {
+        sorted[i].units = next;
+        sorted[i].length = m->pattern_lengths[i];
+        sorted[i].index = i;
+        for (UINT j = 0; j < sorted[i].length; ++j)
+            next[j] = ignore_case ? FoldUnit(patterns[i][j]) : patterns[i][j];
+        next += sorted[i].length;
+    }
+    qsort(sorted, count, sizeof(*sorted), ComparePatterns);
+
+    if (!BuildClasses(m, folded, total, ignore_case, unit_class)
+        || !BuildAutomaton(m, sorted, total, max_len, unit_class))
+    {
+        goto cleanup;
+    }
+
+    FindStartUnits(m);
+    *matcher = m;
+    m = NULL;
+    hr = S_OK;
+
+cleanup:
+    PAL_MatcherFree(m);
+    free(folded);
+    free(sorted);
+    free(unit_class);
+    return hr;
+}
+
+// Index of the first unit from start that can begin a match, or len.
+static size_t FindStart(struct DNCP_MATCHER const* m, WCHAR const* text, size_t start, size_t len)
+{
+    size_t i = start;
+#if defined(MATCHER_X64)
+    __m128i targets[MATCHER_START_SET];
+    for (size_t k = 0; k < m->start_count; ++k)
+        targets[k] = _mm_set1_epi16((short)m->start_units[k]);
+
+    for (; i + 8 <= len; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const*)(text + i));
+        __m128i eq = _mm_cmpeq_epi16(v, targets[0]);
+        for (size_t k = 1; k < m->start_count; ++k)
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi16(v, targets[k]));
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+        if (mask != 0)
+            return i + CountTrailingZeros(mask) / sizeof(WCHAR);
+    }
+#elif defined(MATCHER_NEON)
+    uint16x8_t targets[MATCHER_START_SET];
+    for (size_t k = 0; k < m->start_count; ++k)
+        targets[k] = vdupq_n_u16(m->start_units[k]);
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint16x8_t v = vld1q_u16((uint16_t const*)(text + i));
+        uint16x8_t eq = vceqq_u16(v, targets[0]);
+        for (size_t k = 1; k < m->start_count; ++k)
+            eq = vorrq_u16(eq, vceqq_u16(v, targets[k]));
+
+        uint64_t mask = MaskNeon(eq);
+        if (mask != 0)
+            return i + CountTrailingZeros64(mask) / 8;
+    }
+#endif
+    for (; i < len; ++i)
+    {
+        for (size_t k = 0; k < m->start_count; ++k)
+        {
+            if (text[i] == m->start_units[k])
+                return i;
+        }
+    }
+
+    return len;
+}
+
+// Reports the patterns that end at the state, longest first.
+static bool ReportMatches(struct DNCP_MATCHER const* m, uint32_t state, size_t end, DNCP_MATCH_CALLBACK callback, void* context)
+{
+    for (uint32_t s = m->first_output[state]; s != MATCHER_NO_STATE; s = m->first_output[m->fail[s]])
+    {
+        for (uint32_t k = m->output_start[s]; k < m->output_start[s + 1]; ++k)
+        {
+            DNCP_MATCH match;
+            match.Pattern = m->output_patterns[k];
+            match.Length = m->pattern_lengths[match.Pattern];
+            match.Offset = end - match.Length;
+            if (!callback(context, &match))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+HRESULT PAL_MatcherSearch(DNCP_MATCHER const* matcher, WCHAR const* text, SIZE_T len, DNCP_MATCH_CALLBACK callback, void* context)
+{
+    if (matcher == NULL || callback == NULL || (text == NULL && len != 0))
+        return E_POINTER;
+
+    struct DNCP_MATCHER const* m = matcher;
+    bool const skip = m->start_count != 0;
+    bool found = false;
+    if (m->dfa != NULL)
+    {
+        uint32_t const* dfa = m->dfa;
+        uint32_t entry = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (entry == 0 && skip)
+            {
+                i = FindStart(m, text, i, len);
+                if (i == len)
+                    break;
+            }
+
+            entry = dfa[entry + UnitClass(m, text[i])];
+            if ((entry & MATCHER_MATCH_FLAG) != 0)
+            {
+                entry &= ~MATCHER_MATCH_FLAG;
+                found = true;
+                if (!ReportMatches(m, entry / m->class_count, i + 1, callback, context))
+                    break;
+            }
+        }
+    }
+    else
+    {
+        uint32_t state = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (state == 0 && skip)
+            {
+                i = FindStart(m, text, i, len);
+                if (i == len)
+                    break;
+            }
+
+            state = NextState(m, state, UnitClass(m, text[i]));
+            if (m->first_output[state] != MATCHER_NO_STATE)
+            {
+                found = true;
+                if (!ReportMatches(m, state, i + 1, callback, context))
+                    break;
+            }
+        }
+    }
+
+    return found ? S_OK : S_FALSE;
+}
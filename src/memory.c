@@ -19,26 +19,352 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef __APPLE__
+    #include <malloc/malloc.h>
+#else
+    #include <malloc.h>
+#endif
 #include <dncp.h>
+#include "alloc.h"
 
 // CoTaskMemAlloc always aligns on an 8-byte boundary.
 #define ALIGN 8
 
-LPVOID PAL_CoTaskMemAlloc(SIZE_T cb)
+// CoTaskMemRealloc relies on realloc() maintaining the alignment.
+_Static_assert(_Alignof(max_align_t) >= ALIGN, "malloc() alignment is insufficient");
+
+// Blocks at least this size are trimmed by CoTaskMemRealloc when
+// shrunk to half their usable size or less.
+#define SHRINK_MIN_SIZE 4096
+
+static struct alloc_config config;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static atomic_bool config_ready;
+
+// Backend passed to PAL_SetAllocator(), picked up when the configuration is read.
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct alloc_backend requested_backend;
+static _Atomic(struct alloc_backend const*) pending_backend;
+
+static void init_config(void)
+{
+    struct alloc_backend const* backend = atomic_load_explicit(&pending_backend, memory_order_acquire);
+    if (backend != NULL)
+    {
+        config.backend_enabled = true;
+        config.backend = *backend;
+    }
+
+    // The cache and the large block tier are built on the system allocator.
+    config.cache_enabled = !config.backend_enabled
+        && alloc_read_env_bool("DNCP_COTASKMEM_CACHE", false)
+        && tcache_init();
+
+    config.large_threshold = config.backend_enabled ? 0 : alloc_read_env_size("DNCP_COTASKMEM_LARGE_THRESHOLD", 0);
+    if (config.large_threshold != 0 && !large_init())
+        config.large_threshold = 0;
+
+    bool dump_stats = alloc_read_env_bool("DNCP_ALLOC_STATS_DUMP", false);
+    config.stats_enabled = (dump_stats || alloc_read_env_bool("DNCP_ALLOC_STATS", false))
+        && stats_init(dump_stats);
+
+    config.sample_interval = alloc_read_env_size("DNCP_ALLOC_PROFILE_INTERVAL", 0);
+    if (config.sample_interval != 0 && !profile_init(config.sample_interval))
+        config.sample_interval = 0;
+
+    config.bstr_cache_enabled = alloc_read_env_bool("DNCP_BSTR_CACHE", true)
+        && !alloc_read_env_bool("OANOCACHE", false)
+        && bstr_cache_init();
+
+    atomic_store_explicit(&config_ready, true, memory_order_release);
+}
+
+struct alloc_config const* alloc_get_config(void)
+{
+    // Avoid the call into pthread_once() on every allocation.
+    if (!atomic_load_explicit(&config_ready, memory_order_acquire))
+        (void)pthread_once(&config_once, init_config);
+
+    return &config;
+}
+
+HRESULT PAL_SetAllocator(DNCP_ALLOCATOR const* allocator)
+{
+    if (allocator == NULL)
+        return E_POINTER;
+
+    if (allocator->Alloc == NULL
+        || allocator->Realloc == NULL
+        || allocator->Free == NULL
+        || allocator->GetSize == NULL)
+    {
+        return E_INVALIDARG;
+    }
+
+    (void)pthread_mutex_lock(&backend_lock);
+
+    // Blocks may already have been handed out by the current allocator.
+    HRESULT hr = E_NOT_VALID_STATE;
+    if (!atomic_load_explicit(&config_ready, memory_order_acquire)
+        && atomic_load_explicit(&pending_backend, memory_order_relaxed) == NULL)
+    {
+        requested_backend.alloc = allocator->Alloc;
+        requested_backend.realloc = allocator->Realloc;
+        requested_backend.free = allocator->Free;
+        requested_backend.usable_size = allocator->GetSize;
+        atomic_store_explicit(&pending_backend, &requested_backend, memory_order_release);
+
+        // Lock in the configuration. If an allocation on another thread
+        // read it first, the backend was not installed.
+        hr = alloc_get_config()->backend_enabled ? S_OK : E_NOT_VALID_STATE;
+    }
+
+    (void)pthread_mutex_unlock(&backend_lock);
+    return hr;
+}
+
+bool alloc_read_env_bool(char const* name, bool default_value)
+{
+    char const* value = getenv(name);
+    if (value == NULL || value[0] == '\0')
+        return default_value;
+
+    return strtoul(value, NULL, 0) != 0;
+}
+
+size_t alloc_read_env_size(char const* name, size_t default_value)
+{
+    char const* value = getenv(name);
+    if (value == NULL || value[0] == '\0')
+        return default_value;
+
+    char* end;
+    unsigned long long size = strtoull(value, &end, 0);
+    if (*end != '\0' || size > SIZE_MAX)
+        return default_value;
+
+    return (size_t)size;
+}
+
+size_t alloc_usable_size(void* block)
+{
+#ifdef __APPLE__
+    return malloc_size(block);
+#else
+    return malloc_usable_size(block);
+#endif
+}
+
+size_t alloc_block_size(void* block)
+{
+    struct alloc_config const* cfg = alloc_get_config();
+    if (cfg->backend_enabled)
+        return cfg->backend.usable_size(block);
+
+    return alloc_usable_size(block);
+}
+
+static bool ComputeAlignedSize(SIZE_T cb, SIZE_T* cb_safe)
 {
     // Ensure malloc always allocates.
     if (cb == 0)
         cb = ALIGN;
 
     // Align the allocation size.
-    SIZE_T cb_safe = (cb + (ALIGN - 1)) & ~(ALIGN - 1);
-    if (cb_safe < cb) // Overflow
-        return NULL;
+    SIZE_T cb_aligned = (cb + (ALIGN - 1)) & ~(ALIGN - 1);
+    if (cb_aligned < cb) // Overflow
+        return false;
+
+    *cb_safe = cb_aligned;
+    return true;
+}
+
+static void* AllocBlock(struct alloc_config const* cfg, SIZE_T cb_safe)
+{
+    if (cfg->backend_enabled)
+        return cfg->backend.alloc(cb_safe);
+
+    if (cfg->large_threshold != 0 && cb_safe >= cfg->large_threshold)
+        return large_alloc(cb_safe);
+
+    if (cfg->cache_enabled)
+    {
+        void* block = tcache_alloc(cb_safe);
+        if (block != NULL)
+            return block;
+    }
 
     return aligned_alloc(ALIGN, cb_safe);
 }
 
+static void FreeBlock(struct alloc_config const* cfg, void* block)
+{
+    if (cfg->backend_enabled)
+    {
+        if (cfg->sample_interval != 0)
+            profile_record_free(block);
+
+        cfg->backend.free(block);
+        return;
+    }
+
+    if (cfg->large_threshold != 0 && large_is_block(block))
+    {
+        if (cfg->sample_interval != 0)
+            profile_record_free(block);
+
+        large_free(block);
+        return;
+    }
+
+    // Sampled blocks are too large to be cached.
+    if (cfg->cache_enabled && tcache_free(block))
+        return;
+
+    if (cfg->sample_interval != 0)
+        profile_record_free(block);
+
+    free(block);
+}
+
+static void* ReallocBlock(struct alloc_config const* cfg, void* block, SIZE_T usable, SIZE_T cb_safe)
+{
+    if (cfg->backend_enabled)
+        return cfg->backend.realloc(block, cb_safe);
+
+    if (cfg->large_threshold != 0)
+    {
+        bool is_large = large_is_block(block);
+        bool want_large = cb_safe >= cfg->large_threshold;
+        if (is_large && want_large)
+            return large_realloc(block, cb_safe);
+
+        // Move the block into, or out of, the large block tier.
+        if (is_large || want_large)
+        {
+            void* new_block = AllocBlock(cfg, cb_safe);
+            if (new_block == NULL)
+                return NULL;
+
+            memcpy(new_block, block, usable < cb_safe ? usable : cb_safe);
+            FreeBlock(cfg, block);
+            return new_block;
+        }
+    }
+
+    // The allocator extends the block in place when the adjacent memory
+    // is free and resizes memory mapped blocks with mremap(), so large
+    // blocks are not copied. On failure the original block is untouched.
+    return realloc(block, cb_safe);
+}
+
+void* alloc_sampled_block(size_t size)
+{
+    SIZE_T cb_safe;
+    if (!ComputeAlignedSize(size, &cb_safe))
+        return NULL;
+
+    if (cb_safe < PROFILE_SAMPLED_MIN_SIZE)
+        cb_safe = PROFILE_SAMPLED_MIN_SIZE;
+
+    struct alloc_config const* cfg = alloc_get_config();
+    void* block = AllocBlock(cfg, cb_safe);
+    if (block == NULL)
+        return NULL;
+
+    if (cfg->stats_enabled)
+        stats_record_alloc(ALLOC_KIND_COTASKMEM, size, alloc_block_size(block));
+
+    profile_record_sample(block, size);
+    return block;
+}
+
+LPVOID PAL_CoTaskMemAlloc(SIZE_T cb)
+{
+    struct alloc_config const* cfg = alloc_get_config();
+    if (cfg->sample_interval != 0 && profile_sample_due(cb))
+        return alloc_sampled_block(cb);
+
+    SIZE_T cb_safe;
+    if (!ComputeAlignedSize(cb, &cb_safe))
+        return NULL;
+
+    void* block = AllocBlock(cfg, cb_safe);
+    if (block == NULL)
+        return NULL;
+
+    if (cfg->stats_enabled)
+        stats_record_alloc(ALLOC_KIND_COTASKMEM, cb, alloc_block_size(block));
+
+    return block;
+}
+
 void PAL_CoTaskMemFree(LPVOID pv)
 {
-    free(pv);
+    if (pv == NULL)
+        return;
+
+    struct alloc_config const* cfg = alloc_get_config();
+    if (cfg->stats_enabled)
+        stats_record_free(ALLOC_KIND_COTASKMEM, alloc_block_size(pv));
+
+    FreeBlock(cfg, pv);
+}
+
+LPVOID PAL_CoTaskMemRealloc(LPVOID pv, SIZE_T cb)
+{
+    if (pv == NULL)
+        return PAL_CoTaskMemAlloc(cb);
+
+    if (cb == 0)
+    {
+        PAL_CoTaskMemFree(pv);
+        return NULL;
+    }
+
+    SIZE_T cb_safe;
+    if (!ComputeAlignedSize(cb, &cb_safe))
+        return NULL;
+
+    // The underlying block is often larger than what was requested.
+    // Use the slack before asking the allocator for anything.
+    SIZE_T usable = alloc_block_size(pv);
+    if (cb_safe <= usable)
+    {
+        if (usable < SHRINK_MIN_SIZE || cb_safe > usable / 2)
+            return pv;
+    }
+
+    struct alloc_config const* cfg = alloc_get_config();
+
+    // The old address may be reused as soon as the allocator releases it,
+    // so any sample of the block is dropped up front. If the reallocation
+    // fails the block is simply no longer sampled.
+    bool sampled = false;
+    if (cfg->sample_interval != 0)
+    {
+        profile_record_free(pv);
+
+        sampled = profile_sample_due(cb);
+        if (sampled && cb_safe < PROFILE_SAMPLED_MIN_SIZE)
+            cb_safe = PROFILE_SAMPLED_MIN_SIZE;
+    }
+
+    void* block = ReallocBlock(cfg, pv, usable, cb_safe);
+    if (block == NULL)
+        return NULL;
+
+    if (cfg->stats_enabled)
+    {
+        stats_record_free(ALLOC_KIND_COTASKMEM, usable);
+        stats_record_alloc(ALLOC_KIND_COTASKMEM, cb, alloc_block_size(block));
+    }
+    if (sampled)
+        profile_record_sample(block, cb);
+
+    return block;
 }
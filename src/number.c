@@ -0,0 +1,775 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Required for newlocale() and uselocale().
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <locale.h>
+#include <pthread.h>
+#include <dncp.h>
+#include "pow5.h"
+#include "util.h"
+
+//
+// Number parsing and formatting, with the results of the Windows CRT in
+// the C locale.
+//
+// Decimal digits are found and converted four at a time. Four UTF-16
+// units are loaded into a 64-bit integer, tested together, and combined
+// pairwise with two multiplies instead of waiting on a multiply per digit.
+// Formatting writes two digits at a time from a table of digit pairs.
+//
+// Decimal floating point values are converted with the Eisel-Lemire
+// algorithm, which is correctly rounded for significands of up to 19
+// digits. Longer significands are truncated to 19 digits. If rounding the
+// truncated value and the one after it gives different results, as do
+// hexadecimal values, the conversion falls back to strtod().
+//
+
+static bool IsSpace(WCHAR c)
+{
+    return c == W(' ') || (c >= W('\t') && c <= W('\r'));
+}
+
+static bool IsDigit(WCHAR c)
+{
+    return (unsigned)(c - W('0')) < 10;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+// High bit of each of the four units in v that isn't a decimal digit.
+static uint64_t NonDigitMask(uint64_t v)
+{
+    uint64_t const high = 0x8000800080008000;
+    uint64_t low = v & ~high;
+    uint64_t at_least_0 = (low | high) - 0x0030003000300030;
+    uint64_t at_most_9 = (0x0039003900390039 | high) - low;
+    return ~(at_least_0 & at_most_9 & ~v) & high;
+}
+
+NO_SANITIZE_ADDRESS
+static uint64_t LoadBlock(char const* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Scans aligned blocks of four units, which never cross a page boundary.
+static size_t CountDigits(WCHAR const* str)
+{
+    size_t offset = (uintptr_t)str & 7;
+    char const* block = (char const*)str - offset;
+    uint64_t mask = NonDigitMask(LoadBlock(block)) >> (offset * 8);
+    if (mask != 0)
+        return (size_t)__builtin_ctzll(mask) / 16;
+
+    size_t count = (8 - offset) / sizeof(WCHAR);
+    while ((mask = NonDigitMask(LoadBlock(block += 8))) == 0)
+        count += 4;
+    return count + (size_t)__builtin_ctzll(mask) / 16;
+}
+
+#else
+
+static size_t CountDigits(WCHAR const* str)
+{
+    size_t count = 0;
+    while (IsDigit(str[count]))
+        count++;
+    return count;
+}
+
+#endif
+
+// Value of the four decimal digits at p.
+static uint32_t Digits4(WCHAR const* p)
+{
+    uint64_t v = (uint64_t)p[0]
+        | ((uint64_t)p[1] << 16)
+        | ((uint64_t)p[2] << 32)
+        | ((uint64_t)p[3] << 48);
+    v -= 0x0030003000300030;
+
+    // 10 * d0 + d1 in bits 0-15 and 10 * d2 + d3 in bits 32-47.
+    v = (v * 10 + (v >> 16)) & 0x000000ff000000ff;
+    return (uint32_t)((v * 100 + (v >> 32)) & 0xffff);
+}
+
+// Value of a run of decimal digits, which must fit in 64 bits.
+static uint64_t ParseDigits(WCHAR const* p, size_t count)
+{
+    uint64_t value = 0;
+    for (; count >= 8; p += 8, count -= 8)
+        value = value * 100000000 + (uint64_t)Digits4(p) * 10000 + Digits4(p + 4);
+
+    if (count >= 4)
+    {
+        value = value * 10000 + Digits4(p);
+        p += 4;
+        count -= 4;
+    }
+
+    for (; count > 0; ++p, --count)
+        value = value * 10 + (uint64_t)(*p - W('0'));
+    return value;
+}
+
+static int DigitValue(WCHAR c)
+{
+    if (IsDigit(c))
+        return c - W('0');
+    if (c >= W('a') && c <= W('z'))
+        return c - W('a') + 10;
+    if (c >= W('A') && c <= W('Z'))
+        return c - W('A') + 10;
+    return 36;
+}
+
+// Parses an integer as wcstoul() does, returning the end of the number or
+// str if there isn't one. The magnitude saturates at UINT64_MAX.
+static WCHAR const* ParseInteger(WCHAR const* str, int base, bool* negative, uint64_t* value, bool* overflow)
+{
+    WCHAR const* p = str;
+    while (IsSpace(*p))
+        p++;
+
+    *negative = false;
+    if (*p == W('-') || *p == W('+'))
+        *negative = *p++ == W('-');
+
+    // A prefix without a digit after it leaves just the zero.
+    if ((base == 0 || base == 16)
+        && p[0] == W('0') && (p[1] | 0x20) == W('x') && DigitValue(p[2]) < 16)
+    {
+        p += 2;
+        base = 16;
+    }
+    else if (base == 0)
+    {
+        base = p[0] == W('0') ? 8 : 10;
+    }
+
+    *value = 0;
+    *overflow = false;
+    if (base == 10)
+    {
+        size_t count = CountDigits(p);
+        if (count == 0)
+            return str;
+
+        WCHAR const* end = p + count;
+        while (count > 1 && *p == W('0'))
+        {
+            p++;
+            count--;
+        }
+
+        // Any 19 digits fit in 64 bits.
+        if (count <= 19)
+        {
+            *value = ParseDigits(p, count);
+        }
+        else
+        {
+            uint64_t high = ParseDigits(p, 19);
+            uint64_t last = (uint64_t)(p[19] - W('0'));
+            *overflow = count > 20 || high > (UINT64_MAX - last) / 10;
+            *value = *overflow ? UINT64_MAX : high * 10 + last;
+        }
+        return end;
+    }
+
+    WCHAR const* digits = p;
+    uint64_t v = 0;
+    for (int d; (d = DigitValue(*p)) < base; ++p)
+    {
+        if (v > (UINT64_MAX - (uint64_t)d) / (uint64_t)base)
+            *overflow = true;
+        else
+            v = v * (uint64_t)base + (uint64_t)d;
+    }
+
+    if (p == digits)
+        return str;
+
+    *value = *overflow ? UINT64_MAX : v;
+    return p;
+}
+
+static bool IsValidBase(int base)
+{
+    return base == 0 || (base >= 2 && base <= 36);
+}
+
+LONG PAL_wcstol(WCHAR const* str, WCHAR** end, int base)
+{
+    if (end != NULL)
+        *end = (WCHAR*)str;
+
+    if (str == NULL || !IsValidBase(base))
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    bool negative;
+    bool overflow;
+    uint64_t value;
+    WCHAR const* last = ParseInteger(str, base, &negative, &value, &overflow);
+    if (end != NULL)
+        *end = (WCHAR*)last;
+
+    uint64_t limit = negative ? (uint64_t)INT32_MAX + 1 : (uint64_t)INT32_MAX;
+    if (overflow || value > limit)
+    {
+        errno = ERANGE;
+        return negative ? INT32_MIN : INT32_MAX;
+    }
+
+    return negative ? (LONG)-(int64_t)value : (LONG)value;
+}
+
+ULONG PAL_wcstoul(WCHAR const* str, WCHAR** end, int base)
+{
+    if (end != NULL)
+        *end = (WCHAR*)str;
+
+    if (str == NULL || !IsValidBase(base))
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    bool negative;
+    bool overflow;
+    uint64_t value;
+    WCHAR const* last = ParseInteger(str, base, &negative, &value, &overflow);
+    if (end != NULL)
+        *end = (WCHAR*)last;
+
+    if (overflow || value > UINT32_MAX)
+    {
+        errno = ERANGE;
+        return UINT32_MAX;
+    }
+
+    // As in C, a negative value is negated in the unsigned type.
+    return negative ? (ULONG)(0 - (uint32_t)value) : (ULONG)value;
+}
+
+int PAL__wtoi(WCHAR const* str)
+{
+    return (int)PAL_wcstol(str, NULL, 10);
+}
+
+//
+// Floating point parsing.
+//
+
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_INFINITE_POWER 0x7ff
+#define DOUBLE_INFINITY_BITS ((uint64_t)DOUBLE_INFINITE_POWER << DOUBLE_MANTISSA_BITS)
+
+static uint64_t const powers_of_ten[20] =
+{
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+    UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+    UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+    UINT64_C(1000000000000000), UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000), UINT64_C(10000000000000000000),
+};
+
+static void Multiply128(uint64_t a, uint64_t b, uint64_t* high, uint64_t* low)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *high = (uint64_t)(product >> 64);
+    *low = (uint64_t)product;
+#else
+    uint64_t a_lo = (uint32_t)a;
+    uint64_t a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b;
+    uint64_t b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    *high = a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+    *low = (cross << 32) | (uint32_t)lo_lo;
+#endif
+}
+
+// The bits of the double nearest to w * 10^q, where w is not zero.
+static uint64_t EiselLemire(uint64_t w, int64_t q)
+{
+    if (q < POW5_SMALLEST_POWER)
+        return 0;
+    if (q > POW5_LARGEST_POWER)
+        return DOUBLE_INFINITY_BITS;
+
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+
+    // The top 55 bits of the product decide the result. The low half of
+    // the power only matters when the bits below those are all ones.
+    uint64_t const* pow5 = pow5_128[q - POW5_SMALLEST_POWER];
+    uint64_t high;
+    uint64_t low;
+    Multiply128(w, pow5[0], &high, &low);
+    uint64_t const precision_mask = UINT64_MAX >> (DOUBLE_MANTISSA_BITS + 3);
+    if ((high & precision_mask) == precision_mask)
+    {
+        uint64_t high2;
+        uint64_t low2;
+        Multiply128(w, pow5[1], &high2, &low2);
+        low += high2;
+        if (high2 > low)
+            high++;
+    }
+
+    int upper = (int)(high >> 63);
+    int shift = upper + 64 - DOUBLE_MANTISSA_BITS - 3;
+    uint64_t mantissa = high >> shift;
+
+    // floor(log2(10^q)) is ((217706 * q) >> 16) over the range of the table.
+    int64_t power2 = ((217706 * q) >> 16) + 63 + upper - lz + 1023;
+    if (power2 <= 0)
+    {
+        // Subnormal, or zero.
+        if (-power2 + 1 >= 64)
+            return 0;
+
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+
+        // Rounding up may make it the smallest normal value.
+        power2 = mantissa < ((uint64_t)1 << DOUBLE_MANTISSA_BITS) ? 0 : 1;
+        return mantissa | ((uint64_t)power2 << DOUBLE_MANTISSA_BITS);
+    }
+
+    // An exact halfway value rounds to even. It can only be exact for
+    // small powers of ten.
+    if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1
+        && (mantissa << shift) == high)
+    {
+        mantissa &= ~(uint64_t)1;
+    }
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= ((uint64_t)2 << DOUBLE_MANTISSA_BITS))
+    {
+        mantissa = (uint64_t)1 << DOUBLE_MANTISSA_BITS;
+        power2++;
+    }
+    mantissa &= ~((uint64_t)1 << DOUBLE_MANTISSA_BITS);
+
+    if (power2 >= DOUBLE_INFINITE_POWER)
+        return DOUBLE_INFINITY_BITS;
+
+    return mantissa | ((uint64_t)power2 << DOUBLE_MANTISSA_BITS);
+}
+
+static double FromBits(uint64_t bits)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void InitCLocale(void)
+{
+    c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+// Parses the ASCII units at str with strtod() in the C locale. Returns
+// the number of units parsed.
+static size_t ParseWithLibrary(WCHAR const* str, size_t count, double* value)
+{
+    *value = 0;
+
+    char stack[128];
+    char* buffer = count < sizeof(stack) ? stack : (char*)malloc(count + 1);
+    if (buffer == NULL)
+        return 0;
+
+    for (size_t i = 0; i < count; ++i)
+        buffer[i] = (char)str[i];
+    buffer[count] = '\0';
+
+    (void)pthread_once(&c_locale_once, InitCLocale);
+    locale_t previous = c_locale != (locale_t)0 ? uselocale(c_locale) : (locale_t)0;
+
+    char* end;
+    *value = strtod(buffer, &end);
+
+    if (previous != (locale_t)0)
+        (void)uselocale(previous);
+
+    size_t parsed = (size_t)(end - buffer);
+    if (buffer != stack)
+        free(buffer);
+    return parsed;
+}
+
+// Parses the decimal number at str, which starts with a digit or with a
+// point and a digit. Returns the end of the number.
+static WCHAR const* ParseDecimal(WCHAR const* str, double* value)
+{
+    WCHAR const* int_digits = str;
+    size_t int_count = CountDigits(str);
+    WCHAR const* p = str + int_count;
+
+    WCHAR const* frac_digits = p;
+    size_t frac_count = 0;
+    if (*p == W('.'))
+    {
+        frac_digits = ++p;
+        frac_count = CountDigits(p);
+        p += frac_count;
+    }
+
+    // An exponent without digits isn't part of the number. Exponents too
+    // large for any double saturate.
+    int64_t exponent = 0;
+    if ((*p | 0x20) == W('e'))
+    {
+        WCHAR const* e = p + 1;
+        bool negative = false;
+        if (*e == W('-') || *e == W('+'))
+            negative = *e++ == W('-');
+
+        if (IsDigit(*e))
+        {
+            for (; IsDigit(*e); ++e)
+            {
+                if (exponent < 0x10000)
+                    exponent = exponent * 10 + (*e - W('0'));
+            }
+            exponent = negative ? -exponent : exponent;
+            p = e;
+        }
+    }
+
+    WCHAR const* end = p;
+
+    // Leading zeros don't count towards the 19 significant digits.
+    while (int_count > 0 && *int_digits == W('0'))
+    {
+        int_digits++;
+        int_count--;
+    }
+    if (int_count == 0)
+    {
+        while (frac_count > 0 && *frac_digits == W('0'))
+        {
+            frac_digits++;
+            frac_count--;
+            exponent--;
+        }
+    }
+
+    uint64_t w;
+    int64_t q;
+    bool truncated = int_count + frac_count > 19;
+    if (!truncated)
+    {
+        w = ParseDigits(int_digits, int_count);
+        w = w * powers_of_ten[frac_count] + ParseDigits(frac_digits, frac_count);
+        q = exponent - (int64_t)frac_count;
+    }
+    else if (int_count >= 19)
+    {
+        w = ParseDigits(int_digits, 19);
+        q = exponent + (int64_t)(int_count - 19);
+    }
+    else
+    {
+        size_t taken = 19 - int_count;
+        w = ParseDigits(int_digits, int_count);
+        w = w * powers_of_ten[taken] + ParseDigits(frac_digits, taken);
+        q = exponent - (int64_t)taken;
+    }
+
+    if (w == 0)
+    {
+        *value = 0;
+        return end;
+    }
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    // Both w and 10^q are exact doubles, so a single operation rounds correctly.
+    if (!truncated && w <= ((uint64_t)1 << 53) && q >= -22 && q <= 22)
+    {
+        static double const exact_powers[23] =
+        {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        *value = q < 0 ? (double)w / exact_powers[-q] : (double)w * exact_powers[q];
+        return end;
+    }
+#endif
+
+    uint64_t bits = EiselLemire(w, q);
+    if (truncated && bits != EiselLemire(w + 1, q))
+    {
+        (void)ParseWithLibrary(str, (size_t)(end - str), value);
+        return end;
+    }
+
+    // Like strtod, report underflow for subnormal results as well as zero.
+    if ((bits >> 52) == 0 || bits == DOUBLE_INFINITY_BITS)
+        errno = ERANGE;
+
+    *value = FromBits(bits);
+    return end;
+}
+
+// Matches an ASCII word, ignoring case.
+static bool MatchWord(WCHAR const* str, char const* word)
+{
+    for (; *word != '\0'; ++str, ++word)
+    {
+        if ((*str | 0x20) != (WCHAR)*word)
+            return false;
+    }
+    return true;
+}
+
+static WCHAR const* ParseSpecial(WCHAR const* str, double* value)
+{
+    if (MatchWord(str, "inf"))
+    {
+        *value = HUGE_VAL;
+        return str + (MatchWord(str + 3, "inity") ? 8 : 3);
+    }
+
+    if (MatchWord(str, "nan"))
+    {
+        *value = NAN;
+
+        // An optional sequence of letters, digits and underscores in parentheses.
+        WCHAR const* p = str + 3;
+        if (*p == W('('))
+        {
+            for (++p; *p == W('_') || DigitValue(*p) < 36; ++p)
+                ;
+            if (*p == W(')'))
+                return p + 1;
+        }
+        return str + 3;
+    }
+
+    return NULL;
+}
+
+static bool IsHexFloatUnit(WCHAR c)
+{
+    return DigitValue(c) < 16 || (c | 0x20) == W('x') || (c | 0x20) == W('p')
+        || c == W('.') || c == W('+') || c == W('-');
+}
+
+double PAL_wcstod(WCHAR const* str, WCHAR** end)
+{
+    if (end != NULL)
+        *end = (WCHAR*)str;
+
+    if (str == NULL)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    WCHAR const* p = str;
+    while (IsSpace(*p))
+        p++;
+
+    bool negative = false;
+    if (*p == W('-') || *p == W('+'))
+        negative = *p++ == W('-');
+
+    double value = 0;
+    WCHAR const* last;
+    if (p[0] == W('0') && (p[1] | 0x20) == W('x'))
+    {
+        size_t count = 2;
+        while (IsHexFloatUnit(p[count]))
+            count++;
+        last = p + ParseWithLibrary(p, count, &value);
+    }
+    else if (IsDigit(p[0]) || (p[0] == W('.') && IsDigit(p[1])))
+    {
+        last = ParseDecimal(p, &value);
+    }
+    else
+    {
+        last = ParseSpecial(p, &value);
+    }
+
+    if (last == NULL || last == p)
+        return 0;
+
+    if (end != NULL)
+        *end = (WCHAR*)last;
+    return negative ? -value : value;
+}
+
+//
+// Integer formatting.
+//
+
+static WCHAR const digit_pairs[] =
+    W("00010203040506070809") W("10111213141516171819") W("20212223242526272829")
+    W("30313233343536373839") W("40414243444546474849") W("50515253545556575859")
+    W("60616263646566676869") W("70717273747576777879") W("80818283848586878889")
+    W("90919293949596979899");
+
+static WCHAR const digit_chars[] = W("0123456789abcdefghijklmnopqrstuvwxyz");
+
+static size_t DecimalLength(uint64_t value)
+{
+    // 1233 / 4096 is just over log10(2), so the guess is the length or
+    // one less. Setting the low bit never crosses a power of ten.
+    value |= 1;
+    size_t bits = 64 - (size_t)__builtin_clzll(value);
+    size_t guess = (bits * 1233) >> 12;
+    return guess + (value >= powers_of_ten[guess]);
+}
+
+static void WritePair(WCHAR* dest, uint32_t pair)
+{
+    memcpy(dest, &digit_pairs[pair * 2], 2 * sizeof(WCHAR));
+}
+
+// Writes the decimal digits of value so they end just before end.
+static void WriteDecimal(uint64_t value, WCHAR* end)
+{
+    // Split off eight digits at a time so the rest uses 32-bit division.
+    while (value > UINT32_MAX)
+    {
+        uint64_t q = value / 100000000;
+        uint32_t r = (uint32_t)(value - q * 100000000);
+        value = q;
+
+        uint32_t high = r / 10000;
+        uint32_t low = r - high * 10000;
+        end -= 8;
+        WritePair(end, high / 100);
+        WritePair(end + 2, high % 100);
+        WritePair(end + 4, low / 100);
+        WritePair(end + 6, low % 100);
+    }
+
+    uint32_t v = (uint32_t)value;
+    while (v >= 100)
+    {
+        uint32_t q = v / 100;
+        end -= 2;
+        WritePair(end, v - q * 100);
+        v = q;
+    }
+
+    if (v >= 10)
+        WritePair(end - 2, v);
+    else
+        end[-1] = (WCHAR)(W('0') + v);
+}
+
+static int FormatInteger(uint64_t value, bool negative, WCHAR* buffer, size_t size, int radix)
+{
+    if (buffer == NULL || size == 0)
+        return EINVAL;
+
+    buffer[0] = W('\0');
+    if (size <= (negative ? 2u : 1u))
+        return ERANGE;
+
+    if (radix < 2 || radix > 36)
+        return EINVAL;
+
+    if (radix == 10)
+    {
+        size_t length = DecimalLength(value) + negative;
+        if (length >= size)
+            return ERANGE;
+
+        WriteDecimal(value, buffer + length);
+        if (negative)
+            buffer[0] = W('-');
+        buffer[length] = W('\0');
+        return 0;
+    }
+
+    WCHAR digits[64];
+    WCHAR* end = digits + ARRAY_SIZE(digits);
+    WCHAR* start = end;
+    if ((radix & (radix - 1)) == 0)
+    {
+        unsigned bits = (unsigned)__builtin_ctz((unsigned)radix);
+        do
+        {
+            *--start = digit_chars[value & (uint64_t)(radix - 1)];
+            value >>= bits;
+        } while (value != 0);
+    }
+    else
+    {
+        do
+        {
+            *--start = digit_chars[value % (uint64_t)radix];
+            value /= (uint64_t)radix;
+        } while (value != 0);
+    }
+
+    size_t length = (size_t)(end - start);
+    if (length >= size)
+        return ERANGE;
+
+    memcpy(buffer, start, length * sizeof(WCHAR));
+    buffer[length] = W('\0');
+    return 0;
+}
+
+int PAL__itow_s(int value, WCHAR* buffer, size_t size, int radix)
+{
+    // Only decimal values are signed. Other radixes format the bits as unsigned.
+    bool negative = radix == 10 && value < 0;
+    uint64_t magnitude = negative ? 0 - (uint64_t)(int64_t)value : (uint64_t)(uint32_t)value;
+    return FormatInteger(magnitude, negative, buffer, size, radix);
+}
+
+int PAL__ui64tow_s(UINT64 value, WCHAR* buffer, size_t size, int radix)
+{
+    return FormatInteger(value, false, buffer, size, radix);
+}
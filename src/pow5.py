@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Copyright 2022 Aaron R Robinson
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is furnished
+# to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+# INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+# PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+# HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+# OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#
+# Generates pow5.h, the powers of five used by the decimal to binary
+# conversion in number.c.
+#
+#   python3 pow5.py > pow5.h
+#
+# Each power 5^q is normalized so its most significant bit is bit 127 of
+# a 128-bit value. The values are those the Eisel-Lemire algorithm was
+# proven correct with: powers from 5^-27 to 5^-1 are rounded up and all
+# others are truncated.
+#
+
+import sys
+
+LICENSE = '''\
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+'''
+
+SMALLEST_POWER = -342
+LARGEST_POWER = 308
+
+
+def power_of_five(q):
+    if q >= 0:
+        p = 5 ** q
+        while p < (1 << 127):
+            p <<= 1
+        while p >= (1 << 128):
+            p >>= 1
+        return p
+
+    p = 5 ** -q
+    z = p.bit_length()
+    if q >= -27:
+        return (1 << (z + 127)) // p + 1
+
+    c = (1 << (2 * z + 128)) // p + 1
+    while c >= (1 << 128):
+        c >>= 1
+    return c
+
+
+def main():
+    out = sys.stdout
+    out.write(LICENSE)
+    out.write('\n// Generated by pow5.py. Do not edit.\n\n')
+    out.write('#ifndef _SRC_POW5_H_\n#define _SRC_POW5_H_\n\n')
+    out.write('#include <stdint.h>\n\n')
+    out.write('#define POW5_SMALLEST_POWER (%d)\n' % SMALLEST_POWER)
+    out.write('#define POW5_LARGEST_POWER %d\n\n' % LARGEST_POWER)
+    out.write('// The high and low 64 bits of 5^q, from POW5_SMALLEST_POWER.\n')
+    out.write('static uint64_t const pow5_128[%d][2] =\n{\n' % (LARGEST_POWER - SMALLEST_POWER + 1))
+    for q in range(SMALLEST_POWER, LARGEST_POWER + 1):
+        p = power_of_five(q)
+        assert (1 << 127) <= p < (1 << 128)
+        out.write('    { 0x%016x, 0x%016x },\n' % (p >> 64, p & ((1 << 64) - 1)))
+    out.write('};\n\n#endif // _SRC_POW5_H_\n')
+
+
+if __name__ == '__main__':
+    main()
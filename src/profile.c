@@ -0,0 +1,457 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Required for sigaction() and backtrace().
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dncp.h>
+#include "alloc.h"
+
+//
+// Sampling heap profiler.
+//
+// Rather than tracking every block, roughly one allocation per "interval"
+// bytes is sampled and the call stack that allocated it recorded. Each
+// thread counts down the bytes it allocates and only takes the slow path
+// when the count runs out, at which point the distance to the next sample
+// is drawn from an exponential distribution with the interval as its mean.
+// This gives every allocated byte the same chance of being sampled, so
+// large blocks are sampled more often than small ones, and the true live
+// heap can be estimated from the samples.
+//
+// Sampled blocks are kept in a hash table keyed by address. A count of
+// samples per bucket, small enough to stay in cache, lets most frees
+// skip the table altogether, and lookups that do reach it are lock-free
+// and touch a single cache line. The table is only locked to insert or
+// remove a sample, which is rare. The countdown and the bucket check are
+// inlined from alloc.h so the allocation paths pay no call for them.
+// Sampled blocks are made too large for the thread and BSTR caches, so
+// blocks released into a cache are never checked at all.
+//
+// The profile uses the legacy text format of gperftools' heap profiler,
+// which pprof reads and unsamples itself.
+//
+
+_Atomic(uint8_t) profile_bucket_samples[PROFILE_BUCKET_COUNT];
+_Thread_local int64_t profile_bytes_until_sample;
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+    #define PROFILE_SUPPORTED
+    #include <execinfo.h>
+#endif
+
+#ifdef PROFILE_SUPPORTED
+
+#define PROFILE_MAX_FRAMES 32
+
+// Each bucket holds the keys of up to 8 samples in a single cache line.
+// A sample that doesn't fit in its bucket is dropped.
+#define PROFILE_BUCKET_SLOTS 8
+#define PROFILE_SLOT_COUNT (PROFILE_BUCKET_COUNT * PROFILE_BUCKET_SLOTS)
+
+struct bucket
+{
+    _Alignas(64) _Atomic(uintptr_t) keys[PROFILE_BUCKET_SLOTS];
+};
+
+struct sample
+{
+    size_t size;
+    uint32_t slot;
+    int depth;
+    void* frames[PROFILE_MAX_FRAMES];
+};
+
+static size_t sample_interval;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bucket* buckets;
+static atomic_size_t dropped_samples;
+
+// The samples themselves are kept packed at the front of an array, so
+// only the pages holding live samples are ever touched. Each slot of the
+// table refers to its sample by index. Guarded by the profile lock.
+static struct sample* samples;
+static uint32_t* slot_samples;
+static uint32_t live_samples;
+
+// The thread's random state for picking sample intervals.
+static _Thread_local uint64_t t_rng;
+
+// Where signal triggered profiles are written.
+static char const* dump_path;
+static int dump_pipe[2];
+
+static uint64_t NextRandom(void)
+{
+    // xorshift64*
+    uint64_t x = t_rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t_rng = x;
+    return x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+// Approximates log2(x) for x > 0 from the floating point representation.
+// The error is about 0.005, which is plenty for picking sample intervals.
+static double FastLog2(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+
+    bits = (bits & ~(UINT64_C(0x7ff) << 52)) | (UINT64_C(1023) << 52);
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+
+    // Quadratic fit of log2(m) for m in [1, 2).
+    return exponent + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
+
+static int64_t NextInterval(void)
+{
+    // Uniform in (0, 1].
+    double u = (double)((NextRandom() >> 38) + 1) / (double)(UINT64_C(1) << 26);
+
+    // Exponentially distributed with the interval as the mean.
+    double interval = -FastLog2(u) * 0.6931471805599453 * (double)sample_interval;
+    if (interval > (double)(INT64_MAX / 2))
+        return INT64_MAX / 2;
+
+    return (int64_t)interval + 1;
+}
+
+void profile_record_sample(void* block, size_t size)
+{
+    // Capture the stack before taking the lock. The first frame is this
+    // function, so it is skipped.
+    void* frames[PROFILE_MAX_FRAMES + 1];
+    int depth = backtrace(frames, PROFILE_MAX_FRAMES + 1) - 1;
+    if (depth < 0)
+        depth = 0;
+
+    size_t index = profile_bucket_index(block);
+    struct bucket* bucket = &buckets[index];
+
+    (void)pthread_mutex_lock(&profile_lock);
+    size_t i = PROFILE_BUCKET_SLOTS;
+    bool stale = false;
+    for (size_t j = 0; j < PROFILE_BUCKET_SLOTS; ++j)
+    {
+        uintptr_t key = atomic_load_explicit(&bucket->keys[j], memory_order_relaxed);
+
+        // A sample at the same address is stale. Its block was released
+        // with free() directly, which isn't seen here.
+        if (key == (uintptr_t)block)
+        {
+            i = j;
+            stale = true;
+            break;
+        }
+
+        if (key == 0 && i == PROFILE_BUCKET_SLOTS)
+            i = j;
+    }
+
+    if (i == PROFILE_BUCKET_SLOTS)
+    {
+        atomic_fetch_add_explicit(&dropped_samples, 1, memory_order_relaxed);
+    }
+    else
+    {
+        size_t slot = index * PROFILE_BUCKET_SLOTS + i;
+        if (!stale)
+            slot_samples[slot] = live_samples++;
+
+        struct sample* s = &samples[slot_samples[slot]];
+        s->size = size;
+        s->slot = (uint32_t)slot;
+        s->depth = depth;
+        memcpy(s->frames, frames + 1, (size_t)depth * sizeof(void*));
+
+        if (!stale)
+        {
+            atomic_store_explicit(&bucket->keys[i], (uintptr_t)block, memory_order_release);
+            atomic_fetch_add_explicit(&profile_bucket_samples[index], 1, memory_order_relaxed);
+        }
+    }
+    (void)pthread_mutex_unlock(&profile_lock);
+}
+
+bool profile_next_sample(void)
+{
+    // A thread's first allocation only seeds its state.
+    bool seeded = t_rng != 0;
+    if (!seeded)
+        t_rng = ((uint64_t)(uintptr_t)&t_rng ^ (uint64_t)time(NULL)) | 1;
+
+    profile_bytes_until_sample = NextInterval();
+    return seeded;
+}
+
+
+void profile_forget_sample(void* block)
+{
+    size_t index = profile_bucket_index(block);
+    struct bucket* bucket = &buckets[index];
+    for (size_t i = 0; i < PROFILE_BUCKET_SLOTS; ++i)
+    {
+        if (atomic_load_explicit(&bucket->keys[i], memory_order_relaxed) != (uintptr_t)block)
+            continue;
+
+        // The block is being freed, so no other thread can remove it.
+        (void)pthread_mutex_lock(&profile_lock);
+        atomic_store_explicit(&bucket->keys[i], 0, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&profile_bucket_samples[index], 1, memory_order_relaxed);
+
+        // Move the last sample into the hole to keep them packed.
+        uint32_t hole = slot_samples[index * PROFILE_BUCKET_SLOTS + i];
+        struct sample const* last = &samples[--live_samples];
+        if (hole != live_samples)
+        {
+            samples[hole] = *last;
+            slot_samples[last->slot] = hole;
+        }
+        (void)pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+}
+
+static int CompareStacks(void const* a, void const* b)
+{
+    struct sample const* x = (struct sample const*)a;
+    struct sample const* y = (struct sample const*)b;
+    if (x->depth != y->depth)
+        return x->depth < y->depth ? -1 : 1;
+
+    return memcmp(x->frames, y->frames, (size_t)x->depth * sizeof(void*));
+}
+
+static void WriteMappedLibraries(FILE* file)
+{
+#ifdef __linux__
+    // pprof uses the mappings to symbolize the addresses.
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL)
+        return;
+
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), maps)) != 0)
+        (void)fwrite(buffer, 1, read, file);
+
+    fclose(maps);
+#else
+    (void)file;
+#endif
+}
+
+static bool WriteProfile(FILE* file)
+{
+    // Copy the samples out so the lock isn't held while writing.
+    struct sample* snapshot = (struct sample*)malloc(PROFILE_SLOT_COUNT * sizeof(struct sample));
+    if (snapshot == NULL)
+        return false;
+
+    (void)pthread_mutex_lock(&profile_lock);
+    size_t count = live_samples;
+    memcpy(snapshot, samples, count * sizeof(struct sample));
+    (void)pthread_mutex_unlock(&profile_lock);
+
+    // Merge the samples by call stack.
+    qsort(snapshot, count, sizeof(struct sample), CompareStacks);
+
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < count; ++i)
+        total_bytes += snapshot[i].size;
+
+    // Only live blocks are reported. Cumulative allocations, the bracketed
+    // values, aren't tracked.
+    fprintf(file, "heap profile: %6zu: %8zu [%6d: %8d] @ heap_v2/%zu\n", count, total_bytes, 0, 0, sample_interval);
+    for (size_t i = 0; i < count;)
+    {
+        size_t j = i;
+        size_t bytes = 0;
+        for (; j < count && CompareStacks(&snapshot[i], &snapshot[j]) == 0; ++j)
+            bytes += snapshot[j].size;
+
+        fprintf(file, "%6zu: %8zu [%6d: %8d] @", j - i, bytes, 0, 0);
+        for (int f = 0; f < snapshot[i].depth; ++f)
+            fprintf(file, " %p", snapshot[i].frames[f]);
+        fprintf(file, "\n");
+        i = j;
+    }
+
+    WriteMappedLibraries(file);
+    free(snapshot);
+    return !ferror(file);
+}
+
+static void* DumpThread(void* arg)
+{
+    (void)arg;
+    unsigned int sequence = 0;
+    for (;;)
+    {
+        char signaled;
+        ssize_t read_count = read(dump_pipe[0], &signaled, 1);
+        if (read_count < 0)
+            continue;
+        if (read_count == 0)
+            break;
+
+        if (dump_path == NULL)
+        {
+            (void)WriteProfile(stderr);
+            continue;
+        }
+
+        char path[4096];
+        (void)snprintf(path, sizeof(path), "%s.%d.%04u.heap", dump_path, (int)getpid(), sequence++);
+        (void)PAL_WriteAllocationProfile(path);
+    }
+
+    return NULL;
+}
+
+static void DumpSignalHandler(int sig)
+{
+    (void)sig;
+
+    // Only async-signal-safe calls are allowed here. The dump happens on
+    // a dedicated thread.
+    int saved = errno;
+    char signaled = 1;
+    (void)!write(dump_pipe[1], &signaled, 1);
+    errno = saved;
+}
+
+static bool InstallDumpSignal(int sig)
+{
+    if (0 != pipe(dump_pipe))
+        return false;
+
+    (void)fcntl(dump_pipe[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(dump_pipe[1], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(dump_pipe[1], F_SETFL, O_NONBLOCK);
+
+    pthread_t thread;
+    if (0 != pthread_create(&thread, NULL, DumpThread, NULL))
+        return false;
+    (void)pthread_detach(thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = DumpSignalHandler;
+    action.sa_flags = SA_RESTART;
+    (void)sigemptyset(&action.sa_mask);
+    return 0 == sigaction(sig, &action, NULL);
+}
+
+bool profile_init(size_t interval)
+{
+    buckets = (struct bucket*)calloc(PROFILE_BUCKET_COUNT, sizeof(struct bucket));
+    samples = (struct sample*)malloc(PROFILE_SLOT_COUNT * sizeof(struct sample));
+    slot_samples = (uint32_t*)malloc(PROFILE_SLOT_COUNT * sizeof(uint32_t));
+    if (buckets == NULL || samples == NULL || slot_samples == NULL)
+    {
+        free(buckets);
+        free(samples);
+        free(slot_samples);
+        return false;
+    }
+
+    sample_interval = interval;
+
+    // The first backtrace() may load the unwinder, which allocates.
+    // Get that out of the way now rather than on the first sample.
+    void* frame;
+    (void)backtrace(&frame, 1);
+
+    char const* path = getenv("DNCP_ALLOC_PROFILE_PATH");
+    if (path != NULL && path[0] != '\0')
+        dump_path = path;
+
+    int sig = (int)alloc_read_env_size("DNCP_ALLOC_PROFILE_SIGNAL", 0);
+    if (sig > 0 && sig < NSIG)
+        (void)InstallDumpSignal(sig);
+
+    return true;
+}
+
+HRESULT PAL_WriteAllocationProfile(char const* path)
+{
+    if (alloc_get_config()->sample_interval == 0)
+        return S_FALSE;
+
+    FILE* file = path != NULL ? fopen(path, "w") : stderr;
+    if (file == NULL)
+        return E_FAIL;
+
+    bool success = WriteProfile(file);
+    if (path != NULL)
+        success = (0 == fclose(file)) && success;
+
+    return success ? S_OK : E_FAIL;
+}
+
+#else
+
+bool profile_init(size_t interval)
+{
+    (void)interval;
+    return false;
+}
+
+bool profile_next_sample(void)
+{
+    return false;
+}
+
+void profile_record_sample(void* block, size_t size)
+{
+    (void)block;
+    (void)size;
+}
+
+void profile_forget_sample(void* block)
+{
+    (void)block;
+}
+
+HRESULT PAL_WriteAllocationProfile(char const* path)
+{
+    (void)path;
+    return S_FALSE;
+}
+
+#endif // PROFILE_SUPPORTED
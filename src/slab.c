@@ -0,0 +1,396 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dncp.h>
+#include "alloc.h"
+#include "bstr.h"
+
+//
+// BSTR slabs.
+//
+// PAL_SysAllocStringArray() lays out many BSTRs in one block, each with
+// its own spare bytes, length prefix and terminator:
+//
+//  | slab header | tag | len | chars ... \0 | tag | len | chars ... \0 | ...
+//
+// Each member's tag holds its distance from the slab header, in units of
+// 8 bytes. The header counts the members still live and the slab is freed
+// with the last of them, so members can be freed individually with
+// PAL_SysFreeString(). PAL_SysFreeStringArray() releases a run of members
+// of the same slab with a single update.
+//
+// A tag is only a hint, see bstr.h, so the slab a tag points at is only
+// trusted once it is found in a registry of the live slabs. Nothing in
+// front of a string is read until then.
+//
+// Only small strings are placed in a slab, so a long-lived string doesn't
+// pin much memory. On 32-bit there is no room for a tag and every string
+// is allocated separately.
+//
+
+#define SLAB_ALIGN 8
+#define SLAB_MAX_SIZE ((SIZE_T)256 * 1024)
+#define SLAB_MAX_ENTRY ((SIZE_T)4 * 1024)
+
+struct slab_header
+{
+    _Atomic uint32_t refs;
+    uint32_t size;
+};
+
+#ifdef BSTR_TAGS_SUPPORTED
+
+//
+// Addresses of the live slabs, in an open addressing hash set.
+//
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static uintptr_t* registry;
+static size_t registry_capacity;
+static size_t registry_count;
+
+static size_t registry_slot(uintptr_t slab, size_t capacity)
+{
+    return (size_t)(((uint64_t)(slab / SLAB_ALIGN) * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (capacity - 1);
+}
+
+static size_t registry_find(uintptr_t slab)
+{
+    size_t i = registry_slot(slab, registry_capacity);
+    while (registry[i] != 0 && registry[i] != slab)
+        i = (i + 1) & (registry_capacity - 1);
+    return i;
+}
+
+static bool registry_grow(void)
+{
+    size_t capacity = registry_capacity == 0 ? 64 : registry_capacity * 2;
+    uintptr_t* table = (uintptr_t*)calloc(capacity, sizeof(uintptr_t));
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < registry_capacity; ++i)
+    {
+        if (registry[i] == 0)
+            continue;
+
+        size_t j = registry_slot(registry[i], capacity);
+        while (table[j] != 0)
+            j = (j + 1) & (capacity - 1);
+        table[j] = registry[i];
+    }
+
+    free(registry);
+    registry = table;
+    registry_capacity = capacity;
+    return true;
+}
+
+static bool registry_add(struct slab_header* slab)
+{
+    bool added = true;
+    (void)pthread_mutex_lock(&registry_lock);
+    if ((registry_count + 1) * 2 > registry_capacity && !registry_grow())
+    {
+        added = false;
+    }
+    else
+    {
+        registry[registry_find((uintptr_t)slab)] = (uintptr_t)slab;
+        registry_count++;
+    }
+    (void)pthread_mutex_unlock(&registry_lock);
+    return added;
+}
+
+static bool registry_contains(struct slab_header* slab)
+{
+    (void)pthread_mutex_lock(&registry_lock);
+    bool found = registry_count != 0 && registry[registry_find((uintptr_t)slab)] != 0;
+    (void)pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+static void registry_remove(struct slab_header* slab)
+{
+    (void)pthread_mutex_lock(&registry_lock);
+    size_t i = registry_find((uintptr_t)slab);
+
+    // Shift back the entries that follow, so lookups need no tombstones.
+    size_t mask = registry_capacity - 1;
+    for (size_t j = (i + 1) & mask; registry[j] != 0; j = (j + 1) & mask)
+    {
+        size_t home = registry_slot(registry[j], registry_capacity);
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            registry[i] = registry[j];
+            i = j;
+        }
+    }
+    registry[i] = 0;
+    registry_count--;
+    (void)pthread_mutex_unlock(&registry_lock);
+}
+
+// Bytes taken by a member, including its tag and length prefix.
+static SIZE_T EntrySize(UINT len)
+{
+    SIZE_T size = 2 * sizeof(UINT) + ((SIZE_T)len + 1) * sizeof(OLECHAR);
+    return (size + (SLAB_ALIGN - 1)) & ~(SIZE_T)(SLAB_ALIGN - 1);
+}
+
+static struct slab_header* GetSlab(BSTR bstr)
+{
+    SIZE_T offset = (SIZE_T)BSTR_TAG_PAYLOAD(bstr_tag_load(bstr)) * SLAB_ALIGN;
+    if (offset < sizeof(struct slab_header) || offset >= SLAB_MAX_SIZE)
+        return NULL;
+
+    // A live slab spans the string, so its header can be read.
+    struct slab_header* slab = (struct slab_header*)((char*)bstr_tag(bstr) - offset);
+    return registry_contains(slab) ? slab : NULL;
+}
+
+static bool InSlab(struct slab_header* slab, BSTR bstr)
+{
+    return (char*)bstr > (char*)slab && (char*)bstr < (char*)slab + slab->size;
+}
+
+static void ReleaseSlab(struct slab_header* slab, uint32_t count)
+{
+    if (atomic_fetch_sub_explicit(&slab->refs, count, memory_order_acq_rel) != count)
+        return;
+
+    registry_remove(slab);
+    if (alloc_get_config()->stats_enabled)
+        stats_record_free(ALLOC_KIND_BSTR, alloc_block_size(slab));
+
+    PAL_CoTaskMemFree(slab);
+}
+
+bool slab_release(BSTR bstr)
+{
+    struct slab_header* slab = GetSlab(bstr);
+    if (slab == NULL)
+        return false;
+
+    ReleaseSlab(slab, 1);
+    return true;
+}
+
+// While the array is being filled, entries not yet allocated hold the
+// length of their string plus one, or zero for a null string.
+static BSTR EncodeLength(UINT len)
+{
+    return (BSTR)(uintptr_t)((uint64_t)len + 1);
+}
+
+static bool DecodeLength(BSTR encoded, UINT* len)
+{
+    if (encoded == NULL)
+        return false;
+
+    *len = (UINT)((uintptr_t)encoded - 1);
+    return true;
+}
+
+// Fill a slab with strings [first, end), which have already been measured.
+static bool FillSlab(LPCOLESTR const* strs, UINT first, UINT end, SIZE_T size, BSTR* result)
+{
+    struct slab_header* slab = (struct slab_header*)PAL_CoTaskMemAlloc(size);
+    if (slab == NULL)
+        return false;
+
+    if (!registry_add(slab))
+    {
+        PAL_CoTaskMemFree(slab);
+        return false;
+    }
+
+    if (alloc_get_config()->stats_enabled)
+        stats_record_alloc(ALLOC_KIND_BSTR, size, alloc_block_size(slab));
+
+    slab->size = (uint32_t)size;
+
+    uint32_t members = 0;
+    char* entry = (char*)(slab + 1);
+    for (UINT i = first; i < end; ++i)
+    {
+        UINT len;
+        if (!DecodeLength(result[i], &len))
+            continue;
+
+        UINT* prefix = (UINT*)entry;
+        prefix[0] = BSTR_TAG(BSTR_KIND_SLAB, (SIZE_T)(entry - (char*)slab) / SLAB_ALIGN);
+        prefix[1] = len * sizeof(OLECHAR);
+
+        BSTR bstr = (BSTR)(prefix + 2);
+        if (strs[i] != NULL)
+            memcpy(bstr, strs[i], len * sizeof(OLECHAR));
+        bstr[len] = W('\0');
+
+        result[i] = bstr;
+        entry += EntrySize(len);
+        members++;
+    }
+
+    atomic_init(&slab->refs, members);
+    return true;
+}
+
+HRESULT PAL_SysAllocStringArray(LPCOLESTR const* strs, UINT const* lens, UINT count, BSTR* result)
+{
+    if (result == NULL || (strs == NULL && count != 0))
+        return E_POINTER;
+
+    for (UINT i = 0; i < count; ++i)
+    {
+        if (lens != NULL)
+            result[i] = EncodeLength(lens[i]);
+        else if (strs[i] != NULL)
+            result[i] = EncodeLength((UINT)PAL_wcslen(strs[i]));
+        else
+            result[i] = NULL;
+    }
+
+    UINT i = 0;
+    while (i < count)
+    {
+        // Long strings are allocated on their own.
+        UINT len;
+        if (!DecodeLength(result[i], &len))
+        {
+            i++;
+            continue;
+        }
+
+        if (EntrySize(len) > SLAB_MAX_ENTRY)
+        {
+            result[i] = PAL_SysAllocStringLen(strs[i], len);
+            if (result[i] == NULL)
+                goto fail;
+
+            i++;
+            continue;
+        }
+
+        // Gather the following strings that fit in the same slab.
+        UINT end = i;
+        SIZE_T size = sizeof(struct slab_header);
+        for (; end < count; ++end)
+        {
+            if (!DecodeLength(result[end], &len))
+                continue;
+
+            if (EntrySize(len) > SLAB_MAX_ENTRY || size + EntrySize(len) > SLAB_MAX_SIZE)
+                break;
+
+            size += EntrySize(len);
+        }
+
+        if (!FillSlab(strs, i, end, size, result))
+            goto fail;
+
+        i = end;
+    }
+
+    return S_OK;
+
+fail:
+    PAL_SysFreeStringArray(result, i);
+    memset(result, 0, count * sizeof(result[0]));
+    return E_OUTOFMEMORY;
+}
+
+void PAL_SysFreeStringArray(BSTR* strs, UINT count)
+{
+    if (strs == NULL)
+        return;
+
+    UINT i = 0;
+    while (i < count)
+    {
+        BSTR bstr = strs[i++];
+        if (bstr == NULL)
+            continue;
+
+        struct slab_header* slab = bstr_is_kind(bstr, BSTR_KIND_SLAB) ? GetSlab(bstr) : NULL;
+        if (slab == NULL)
+        {
+            PAL_SysFreeString(bstr);
+            continue;
+        }
+
+        // Release the run of members of this slab at once.
+        uint32_t run = 1;
+        while (i < count && strs[i] != NULL && InSlab(slab, strs[i]))
+        {
+            run++;
+            i++;
+        }
+
+        ReleaseSlab(slab, run);
+    }
+}
+
+#else
+
+bool slab_release(BSTR bstr)
+{
+    (void)bstr;
+    return false;
+}
+
+HRESULT PAL_SysAllocStringArray(LPCOLESTR const* strs, UINT const* lens, UINT count, BSTR* result)
+{
+    if (result == NULL || (strs == NULL && count != 0))
+        return E_POINTER;
+
+    for (UINT i = 0; i < count; ++i)
+    {
+        result[i] = lens != NULL
+            ? PAL_SysAllocStringLen(strs[i], lens[i])
+            : PAL_SysAllocString(strs[i]);
+
+        if (result[i] == NULL && (lens != NULL || strs[i] != NULL))
+        {
+            PAL_SysFreeStringArray(result, i);
+            memset(result, 0, count * sizeof(result[0]));
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    return S_OK;
+}
+
+void PAL_SysFreeStringArray(BSTR* strs, UINT count)
+{
+    if (strs == NULL)
+        return;
+
+    for (UINT i = 0; i < count; ++i)
+        PAL_SysFreeString(strs[i]);
+}
+
+#endif // BSTR_TAGS_SUPPORTED
@@ -0,0 +1,271 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dncp.h>
+#include "alloc.h"
+
+//
+// Allocation statistics.
+//
+// Each thread counts into its own set of counters, which only that
+// thread writes, so recording an allocation needs no atomic read-modify-
+// write or shared cache line. The counters are merged when queried. A
+// thread's counters are folded into the retired totals when it exits.
+//
+
+struct counters
+{
+    _Atomic uint64_t alloc_count;
+    _Atomic uint64_t free_count;
+    _Atomic uint64_t bytes_allocated;
+    _Atomic uint64_t bytes_freed;
+    _Atomic uint64_t histogram[DNCP_ALLOC_HISTOGRAM_BUCKETS];
+};
+
+struct thread_stats
+{
+    struct thread_stats* next;
+    struct thread_stats* prev;
+    struct counters counters[ALLOC_KIND_COUNT];
+};
+
+// Marks a thread that has exited, whose records go to the retired totals.
+#define THREAD_STATS_DEAD ((struct thread_stats*)(uintptr_t)1)
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats* live_threads;
+static struct thread_stats retired;
+
+static pthread_key_t stats_key;
+static _Thread_local struct thread_stats* t_stats;
+
+static size_t HistogramBucket(size_t size)
+{
+    if (size <= 16)
+        return 0;
+
+    // Bucket i holds sizes in (8 << i, 16 << i].
+    size_t bits = sizeof(unsigned long long) * 8 - (size_t)__builtin_clzll((unsigned long long)(size - 1));
+    size_t bucket = bits - 4;
+    return bucket < DNCP_ALLOC_HISTOGRAM_BUCKETS ? bucket : DNCP_ALLOC_HISTOGRAM_BUCKETS - 1;
+}
+
+// Only the owning thread updates its counters, so a plain load and store is sufficient.
+static void Increment(_Atomic uint64_t* counter, uint64_t value)
+{
+    uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+static void Accumulate(struct counters* dest, struct counters* src)
+{
+#define ACCUMULATE(field) \
+    atomic_fetch_add_explicit(&dest->field, atomic_load_explicit(&src->field, memory_order_relaxed), memory_order_relaxed)
+
+    ACCUMULATE(alloc_count);
+    ACCUMULATE(free_count);
+    ACCUMULATE(bytes_allocated);
+    ACCUMULATE(bytes_freed);
+    for (size_t i = 0; i < DNCP_ALLOC_HISTOGRAM_BUCKETS; ++i)
+        ACCUMULATE(histogram[i]);
+
+#undef ACCUMULATE
+}
+
+static void stats_thread_exit(void* data)
+{
+    struct thread_stats* ts = (struct thread_stats*)data;
+
+    (void)pthread_mutex_lock(&stats_lock);
+    for (size_t i = 0; i < ALLOC_KIND_COUNT; ++i)
+        Accumulate(&retired.counters[i], &ts->counters[i]);
+
+    if (ts->prev != NULL)
+        ts->prev->next = ts->next;
+    else
+        live_threads = ts->next;
+    if (ts->next != NULL)
+        ts->next->prev = ts->prev;
+    (void)pthread_mutex_unlock(&stats_lock);
+
+    free(ts);
+    t_stats = THREAD_STATS_DEAD;
+}
+
+static struct counters* GetCounters(enum alloc_kind kind, bool* shared)
+{
+    *shared = false;
+    struct thread_stats* ts = t_stats;
+    if (ts == NULL)
+    {
+        ts = (struct thread_stats*)calloc(1, sizeof(*ts));
+        if (ts != NULL && 0 != pthread_setspecific(stats_key, ts))
+        {
+            free(ts);
+            ts = NULL;
+        }
+
+        if (ts != NULL)
+        {
+            (void)pthread_mutex_lock(&stats_lock);
+            ts->next = live_threads;
+            if (live_threads != NULL)
+                live_threads->prev = ts;
+            live_threads = ts;
+            (void)pthread_mutex_unlock(&stats_lock);
+            t_stats = ts;
+        }
+    }
+
+    if (ts == NULL || ts == THREAD_STATS_DEAD)
+    {
+        // Record directly into the retired totals.
+        *shared = true;
+        return &retired.counters[kind];
+    }
+
+    return &ts->counters[kind];
+}
+
+void stats_record_alloc(enum alloc_kind kind, size_t requested, size_t usable)
+{
+    bool shared;
+    struct counters* c = GetCounters(kind, &shared);
+    if (shared)
+    {
+        atomic_fetch_add_explicit(&c->alloc_count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->bytes_allocated, usable, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->histogram[HistogramBucket(requested)], 1, memory_order_relaxed);
+        return;
+    }
+
+    Increment(&c->alloc_count, 1);
+    Increment(&c->bytes_allocated, usable);
+    Increment(&c->histogram[HistogramBucket(requested)], 1);
+}
+
+void stats_record_free(enum alloc_kind kind, size_t usable)
+{
+    bool shared;
+    struct counters* c = GetCounters(kind, &shared);
+    if (shared)
+    {
+        atomic_fetch_add_explicit(&c->free_count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->bytes_freed, usable, memory_order_relaxed);
+        return;
+    }
+
+    Increment(&c->free_count, 1);
+    Increment(&c->bytes_freed, usable);
+}
+
+static void CopyOut(DNCP_ALLOC_COUNTERS* dest, struct counters* src)
+{
+    dest->AllocCount += atomic_load_explicit(&src->alloc_count, memory_order_relaxed);
+    dest->FreeCount += atomic_load_explicit(&src->free_count, memory_order_relaxed);
+    dest->BytesAllocated += atomic_load_explicit(&src->bytes_allocated, memory_order_relaxed);
+    dest->BytesFreed += atomic_load_explicit(&src->bytes_freed, memory_order_relaxed);
+    for (size_t i = 0; i < DNCP_ALLOC_HISTOGRAM_BUCKETS; ++i)
+        dest->SizeHistogram[i] += atomic_load_explicit(&src->histogram[i], memory_order_relaxed);
+
+    dest->LiveBytes = (LONGLONG)(dest->BytesAllocated - dest->BytesFreed);
+}
+
+HRESULT PAL_GetAllocationStats(DNCP_ALLOC_STATS* stats)
+{
+    if (stats == NULL)
+        return E_POINTER;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!alloc_get_config()->stats_enabled)
+        return S_FALSE;
+
+    DNCP_ALLOC_COUNTERS* dest[ALLOC_KIND_COUNT] = { &stats->CoTaskMem, &stats->Bstr };
+
+    (void)pthread_mutex_lock(&stats_lock);
+    for (size_t i = 0; i < ALLOC_KIND_COUNT; ++i)
+    {
+        CopyOut(dest[i], &retired.counters[i]);
+        for (struct thread_stats* ts = live_threads; ts != NULL; ts = ts->next)
+            CopyOut(dest[i], &ts->counters[i]);
+    }
+    (void)pthread_mutex_unlock(&stats_lock);
+
+    return S_OK;
+}
+
+static void DumpCounters(char const* name, DNCP_ALLOC_COUNTERS const* c)
+{
+    fprintf(stderr, "%-10s %14llu %14llu %18llu %18llu %18lld\n",
+        name,
+        (unsigned long long)c->AllocCount,
+        (unsigned long long)c->FreeCount,
+        (unsigned long long)c->BytesAllocated,
+        (unsigned long long)c->BytesFreed,
+        (long long)c->LiveBytes);
+}
+
+static void DumpStats(void)
+{
+    DNCP_ALLOC_STATS stats;
+    if (PAL_GetAllocationStats(&stats) != S_OK)
+        return;
+
+    fprintf(stderr, "DNCP allocation statistics\n");
+    fprintf(stderr, "%-10s %14s %14s %18s %18s %18s\n", "", "allocs", "frees", "bytes allocated", "bytes freed", "live bytes");
+    DumpCounters("CoTaskMem", &stats.CoTaskMem);
+    DumpCounters("BSTR", &stats.Bstr);
+
+    fprintf(stderr, "Requested size histogram\n");
+    fprintf(stderr, "%12s %14s %14s\n", "size <=", "CoTaskMem", "BSTR");
+    for (size_t i = 0; i < DNCP_ALLOC_HISTOGRAM_BUCKETS; ++i)
+    {
+        if (stats.CoTaskMem.SizeHistogram[i] == 0 && stats.Bstr.SizeHistogram[i] == 0)
+            continue;
+
+        char bound[32];
+        if (i == DNCP_ALLOC_HISTOGRAM_BUCKETS - 1)
+            (void)snprintf(bound, sizeof(bound), "larger");
+        else
+            (void)snprintf(bound, sizeof(bound), "%zu", (size_t)16 << i);
+
+        fprintf(stderr, "%12s %14llu %14llu\n",
+            bound,
+            (unsigned long long)stats.CoTaskMem.SizeHistogram[i],
+            (unsigned long long)stats.Bstr.SizeHistogram[i]);
+    }
+}
+
+bool stats_init(bool dump_on_exit)
+{
+    if (0 != pthread_key_create(&stats_key, stats_thread_exit))
+        return false;
+
+    if (dump_on_exit)
+        (void)atexit(DumpStats);
+
+    return true;
+}
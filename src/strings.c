@@ -18,65 +18,1358 @@
 // SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <dncp.h>
+#include "casefold.h"
+#include "util.h"
 
-size_t PAL_wcslen(WCHAR const* str)
-{
-    assert(str != NULL);
+#if defined(__x86_64__)
+    #include <immintrin.h>
+    #define STRINGS_X64
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define STRINGS_NEON
+#endif
+
+//
+// Vectorized string functions.
+//
+// The scalar loops are kept as the reference implementations. The vector
+// versions scan with aligned loads, which never cross a page boundary and
+// so can't fault even when they read past the end of the string. The best
+// version for the CPU is selected when the library is loaded.
+//
 
+static size_t WcslenScalar(WCHAR const* str)
+{
     size_t len = 0;
     while (*str++ != W('\0'))
         len++;
     return len;
 }
 
-int PAL_wcscmp(WCHAR const* str1, WCHAR const* str2)
+#if defined(STRINGS_X64)
+
+// Byte mask of the WCHARs in the aligned block at p that are NUL.
+#define NUL_MASK_SSE2(p) \
+    ((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((__m128i const*)(p)), _mm_setzero_si128())))
+
+NO_SANITIZE_ADDRESS
+static size_t WcslenSse2(WCHAR const* str)
 {
-    assert(str1 != NULL && str2 != NULL);
+    // A misaligned WCHAR would straddle the vector lanes.
+    if (((uintptr_t)str & 1) != 0)
+        return WcslenScalar(str);
 
-    int i = 0;
-    while (str1[i] == str2[i] && str1[i] != W('\0'))
-        ++i;
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    unsigned mask = NUL_MASK_SSE2(p) >> ((uintptr_t)str & 15);
+    if (mask != 0)
+        return (size_t)__builtin_ctz(mask) / sizeof(WCHAR);
 
-    int res = (int)str1[i] - str2[i];
-    return ((-res) < 0) - (res < 0);
+    for (;;)
+    {
+        p += 16;
+        mask = NUL_MASK_SSE2(p);
+        if (mask != 0)
+            return (size_t)(p + __builtin_ctz(mask) - (char const*)str) / sizeof(WCHAR);
+    }
 }
 
-WCHAR* PAL_wcsstr(WCHAR const* dest, WCHAR const* src)
+#define NUL_MASK_AVX2(p) \
+    ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_load_si256((__m256i const*)(p)), _mm256_setzero_si256())))
+
+NO_SANITIZE_ADDRESS __attribute__((target("avx2")))
+static size_t WcslenAvx2(WCHAR const* str)
 {
-    assert(dest != NULL && src != NULL);
+    if (((uintptr_t)str & 1) != 0)
+        return WcslenScalar(str);
 
-    if (src[0] == W('\0'))
-        return (WCHAR*)dest;
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)31);
+    unsigned mask = NUL_MASK_AVX2(p) >> ((uintptr_t)str & 31);
+    if (mask != 0)
+        return (size_t)__builtin_ctz(mask) / sizeof(WCHAR);
+
+    // Check two blocks per iteration for long strings.
+    for (p += 32; ((uintptr_t)p & 63) != 0; p += 32)
+    {
+        mask = NUL_MASK_AVX2(p);
+        if (mask != 0)
+            return (size_t)(p + __builtin_ctz(mask) - (char const*)str) / sizeof(WCHAR);
+    }
+
+    for (;; p += 64)
+    {
+        __m256i a = _mm256_load_si256((__m256i const*)p);
+        __m256i b = _mm256_load_si256((__m256i const*)(p + 32));
+        __m256i zero = _mm256_setzero_si256();
+        __m256i any = _mm256_min_epu16(a, b);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(any, zero)) == 0)
+            continue;
+
+        mask = NUL_MASK_AVX2(p);
+        if (mask != 0)
+            return (size_t)(p + __builtin_ctz(mask) - (char const*)str) / sizeof(WCHAR);
+
+        mask = NUL_MASK_AVX2(p + 32);
+        return (size_t)(p + 32 + __builtin_ctz(mask) - (char const*)str) / sizeof(WCHAR);
+    }
+}
+
+#elif defined(STRINGS_NEON)
+
+// Mask with 8 bits set for each WCHAR in the aligned block at p that is NUL.
+static inline uint64_t NulMaskNeon(char const* p)
+{
+    uint16x8_t eq = vceqzq_u16(vld1q_u16((uint16_t const*)p));
+    return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0);
+}
+
+NO_SANITIZE_ADDRESS
+static size_t WcslenNeon(WCHAR const* str)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcslenScalar(str);
+
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    uint64_t mask = NulMaskNeon(p) >> (((uintptr_t)str & 15) / sizeof(WCHAR) * 8);
+    if (mask != 0)
+        return (size_t)__builtin_ctzll(mask) / 8;
+
+    for (;;)
+    {
+        p += 16;
+        mask = NulMaskNeon(p);
+        if (mask != 0)
+            return (size_t)(p - (char const*)str) / sizeof(WCHAR) + (size_t)__builtin_ctzll(mask) / 8;
+    }
+}
+
+#endif
+
+//
+// Comparison.
+//
+// Two strings can't both be read with aligned loads, so unaligned loads
+// are used while neither crosses into the next page, and the scan steps
+// one unit at a time over page boundaries. 4 KB is the smallest page size
+// of any supported platform.
+//
+
+#define MIN_PAGE_SIZE 4096
+
+static int CompareUnits(WCHAR a, WCHAR b)
+{
+    return (a > b) - (a < b);
+}
+
+static int WcsncmpScalar(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (str1[i] != str2[i] || str1[i] == W('\0'))
+            return CompareUnits(str1[i], str2[i]);
+    }
+
+    return 0;
+}
+
+#if defined(STRINGS_X64) || defined(STRINGS_NEON)
+
+// Units that can be read from both strings, up to count, before either
+// reaches the end of its page.
+static inline size_t UnitsInPage(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    size_t room1 = (MIN_PAGE_SIZE - ((uintptr_t)str1 & (MIN_PAGE_SIZE - 1))) / sizeof(WCHAR);
+    size_t room2 = (MIN_PAGE_SIZE - ((uintptr_t)str2 & (MIN_PAGE_SIZE - 1))) / sizeof(WCHAR);
+    size_t room = room1 < room2 ? room1 : room2;
+    return room < count ? room : count;
+}
+
+#endif
+
+#if defined(STRINGS_X64)
+
+NO_SANITIZE_ADDRESS
+static int WcsncmpSse2(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t limit = i + UnitsInPage(str1 + i, str2 + i, count - i);
+        for (; i + 8 <= limit; i += 8)
+        {
+            __m128i a = _mm_loadu_si128((__m128i const*)(str1 + i));
+            __m128i b = _mm_loadu_si128((__m128i const*)(str2 + i));
+
+            // Units that differ or end the string.
+            __m128i same = _mm_andnot_si128(_mm_cmpeq_epi16(a, _mm_setzero_si128()), _mm_cmpeq_epi16(a, b));
+            unsigned stop = (unsigned)_mm_movemask_epi8(same) ^ 0xffffu;
+            if (stop != 0)
+            {
+                i += (size_t)__builtin_ctz(stop) / sizeof(WCHAR);
+                return CompareUnits(str1[i], str2[i]);
+            }
+        }
+
+        // Step over the page boundary, or to the count, one unit at a time.
+        for (; i < limit; ++i)
+        {
+            if (str1[i] != str2[i] || str1[i] == W('\0'))
+                return CompareUnits(str1[i], str2[i]);
+        }
+    }
+
+    return 0;
+}
+
+NO_SANITIZE_ADDRESS __attribute__((target("avx2")))
+static int WcsncmpAvx2(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t limit = i + UnitsInPage(str1 + i, str2 + i, count - i);
+        for (; i + 16 <= limit; i += 16)
+        {
+            __m256i a = _mm256_loadu_si256((__m256i const*)(str1 + i));
+            __m256i b = _mm256_loadu_si256((__m256i const*)(str2 + i));
+
+            __m256i same = _mm256_andnot_si256(_mm256_cmpeq_epi16(a, _mm256_setzero_si256()), _mm256_cmpeq_epi16(a, b));
+            unsigned stop = ~(unsigned)_mm256_movemask_epi8(same);
+            if (stop != 0)
+            {
+                i += (size_t)__builtin_ctz(stop) / sizeof(WCHAR);
+                return CompareUnits(str1[i], str2[i]);
+            }
+        }
+
+        // Step over the page boundary, or to the count, one unit at a time.
+        for (; i < limit; ++i)
+        {
+            if (str1[i] != str2[i] || str1[i] == W('\0'))
+                return CompareUnits(str1[i], str2[i]);
+        }
+    }
+
+    return 0;
+}
+
+#elif defined(STRINGS_NEON)
+
+NO_SANITIZE_ADDRESS
+static int WcsncmpNeon(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t limit = i + UnitsInPage(str1 + i, str2 + i, count - i);
+        for (; i + 8 <= limit; i += 8)
+        {
+            uint16x8_t a = vld1q_u16((uint16_t const*)(str1 + i));
+            uint16x8_t b = vld1q_u16((uint16_t const*)(str2 + i));
+
+            // 8 bits set for each unit that differs or ends the string.
+            uint16x8_t same = vbicq_u16(vceqq_u16(a, b), vceqzq_u16(a));
+            uint64_t stop = ~vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(same)), 0);
+            if (stop != 0)
+            {
+                i += (size_t)__builtin_ctzll(stop) / 8;
+                return CompareUnits(str1[i], str2[i]);
+            }
+        }
+
+        // Step over the page boundary, or to the count, one unit at a time.
+        for (; i < limit; ++i)
+        {
+            if (str1[i] != str2[i] || str1[i] == W('\0'))
+                return CompareUnits(str1[i], str2[i]);
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+//
+// Search.
+//
+// PAL_wcsstr() uses the Two-Way algorithm of Crochemore and Perrin, which
+// is linear in the worst case and needs constant space. With vectors, a
+// filter runs first. It compares the first and last units of the needle
+// against 8 haystack positions at once, and only candidates passing both
+// are compared in full. If the filter turns up too many false candidates,
+// the search continues with Two-Way from where the filter stopped, which
+// keeps the worst case linear.
+//
+// The haystack's length is only measured as far as the search needs.
+//
+
+static size_t Max(size_t a, size_t b)
+{
+    return a > b ? a : b;
+}
+
+static size_t WcsnlenScalar(WCHAR const* str, size_t max)
+{
+    size_t len = 0;
+    while (len < max && str[len] != W('\0'))
+        len++;
+    return len;
+}
+
+#if defined(STRINGS_X64)
+
+NO_SANITIZE_ADDRESS
+static size_t Wcsnlen(WCHAR const* str, size_t max)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcsnlenScalar(str, max);
+
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    size_t offset = (uintptr_t)str & 15;
+    unsigned mask = NUL_MASK_SSE2(p) >> offset;
+    size_t len = (16 - offset) / sizeof(WCHAR);
+    if (mask != 0)
+        len = (size_t)__builtin_ctz(mask) / sizeof(WCHAR);
+
+    while (mask == 0 && len < max)
+    {
+        p += 16;
+        mask = NUL_MASK_SSE2(p);
+        len += mask != 0 ? (size_t)__builtin_ctz(mask) / sizeof(WCHAR) : 8;
+    }
+
+    return len < max ? len : max;
+}
+
+static WCHAR* TwoWaySearch(WCHAR const* hay, WCHAR const* needle, size_t len);
+
+static WCHAR* FilteredSearch(WCHAR const* hay, WCHAR const* needle, size_t len)
+{
+    __m128i const first = _mm_set1_epi16((short)needle[0]);
+    __m128i const last = _mm_set1_epi16((short)needle[len - 1]);
+
+    size_t known = 0;
+    bool ended = false;
+    size_t work = 0;
+    size_t i = 0;
+    for (;;)
+    {
+        // Both loads must be within the measured part of the haystack.
+        size_t need = i + len - 1 + 8;
+        if (known < need && !ended)
+        {
+            size_t want = Max(need, Max(2 * known, 256));
+            known += Wcsnlen(hay + known, want - known);
+            ended = known < want;
+        }
+
+        if (known < need)
+            break;
+
+        __m128i a = _mm_loadu_si128((__m128i const*)(hay + i));
+        __m128i b = _mm_loadu_si128((__m128i const*)(hay + i + len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(a, first), _mm_cmpeq_epi16(b, last)));
+        while (mask != 0)
+        {
+            WCHAR const* candidate = hay + i + (size_t)__builtin_ctz(mask) / sizeof(WCHAR);
+            if (len <= 2 || 0 == memcmp(candidate + 1, needle + 1, (len - 2) * sizeof(WCHAR)))
+                return (WCHAR*)candidate;
+
+            work += len;
+            mask &= mask - 1;
+            mask &= mask - 1;
+        }
+
+        i += 8;
+        if (work > 4 * i + 1024)
+            break;
+    }
+
+    return TwoWaySearch(hay + i, needle, len);
+}
+
+#elif defined(STRINGS_NEON)
+
+NO_SANITIZE_ADDRESS
+static size_t Wcsnlen(WCHAR const* str, size_t max)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcsnlenScalar(str, max);
+
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    size_t offset = (uintptr_t)str & 15;
+    uint64_t mask = NulMaskNeon(p) >> (offset / sizeof(WCHAR) * 8);
+    size_t len = (16 - offset) / sizeof(WCHAR);
+    if (mask != 0)
+        len = (size_t)__builtin_ctzll(mask) / 8;
+
+    while (mask == 0 && len < max)
+    {
+        p += 16;
+        mask = NulMaskNeon(p);
+        len += mask != 0 ? (size_t)__builtin_ctzll(mask) / 8 : 8;
+    }
+
+    return len < max ? len : max;
+}
+
+static WCHAR* TwoWaySearch(WCHAR const* hay, WCHAR const* needle, size_t len);
+
+static WCHAR* FilteredSearch(WCHAR const* hay, WCHAR const* needle, size_t len)
+{
+    uint16x8_t const first = vdupq_n_u16(needle[0]);
+    uint16x8_t const last = vdupq_n_u16(needle[len - 1]);
+
+    size_t known = 0;
+    bool ended = false;
+    size_t work = 0;
+    size_t i = 0;
+    for (;;)
+    {
+        size_t need = i + len - 1 + 8;
+        if (known < need && !ended)
+        {
+            size_t want = Max(need, Max(2 * known, 256));
+            known += Wcsnlen(hay + known, want - known);
+            ended = known < want;
+        }
+
+        if (known < need)
+            break;
+
+        uint16x8_t a = vld1q_u16((uint16_t const*)(hay + i));
+        uint16x8_t b = vld1q_u16((uint16_t const*)(hay + i + len - 1));
+        uint16x8_t both = vandq_u16(vceqq_u16(a, first), vceqq_u16(b, last));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(both)), 0);
+        while (mask != 0)
+        {
+            unsigned bit = (unsigned)__builtin_ctzll(mask);
+            WCHAR const* candidate = hay + i + bit / 8;
+            if (len <= 2 || 0 == memcmp(candidate + 1, needle + 1, (len - 2) * sizeof(WCHAR)))
+                return (WCHAR*)candidate;
+
+            work += len;
+            mask &= ~((uint64_t)0xff << bit);
+        }
+
+        i += 8;
+        if (work > 4 * i + 1024)
+            break;
+    }
+
+    return TwoWaySearch(hay + i, needle, len);
+}
+
+#else
+
+#define Wcsnlen WcsnlenScalar
+
+#endif
+
+// Units are hashed on their low byte for the bad character shift. A
+// collision can only make the shift shorter, never skip a match.
+#define UNIT_BUCKET(c) ((size_t)((c) & 0xff))
+
+static WCHAR* TwoWaySearch(WCHAR const* hay, WCHAR const* needle, size_t len)
+{
+    uint64_t unitset[256 / 64] = { 0 };
+    size_t shift[256];
+    for (size_t i = 0; i < len; ++i)
+    {
+        unitset[UNIT_BUCKET(needle[i]) / 64] |= (uint64_t)1 << (UNIT_BUCKET(needle[i]) % 64);
+        shift[UNIT_BUCKET(needle[i])] = i + 1;
+    }
+
+    // Compute the critical factorization from the maximal suffixes for
+    // both orderings of the alphabet.
+    size_t ip = SIZE_MAX;
+    size_t jp = 0;
+    size_t k = 1;
+    size_t p = 1;
+    while (jp + k < len)
+    {
+        if (needle[ip + k] == needle[jp + k])
+        {
+            if (k == p)
+            {
+                jp += p;
+                k = 1;
+            }
+            else
+            {
+                k++;
+            }
+        }
+        else if (needle[ip + k] > needle[jp + k])
+        {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }
+        else
+        {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+    size_t ms = ip;
+    size_t p0 = p;
+
+    ip = SIZE_MAX;
+    jp = 0;
+    k = p = 1;
+    while (jp + k < len)
+    {
+        if (needle[ip + k] == needle[jp + k])
+        {
+            if (k == p)
+            {
+                jp += p;
+                k = 1;
+            }
+            else
+            {
+                k++;
+            }
+        }
+        else if (needle[ip + k] < needle[jp + k])
+        {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }
+        else
+        {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+
+    if (ip + 1 > ms + 1)
+        ms = ip;
+    else
+        p = p0;
+
+    // A periodic needle remembers how much of it already matched.
+    size_t mem0;
+    if (0 != memcmp(needle, needle + p, (ms + 1) * sizeof(WCHAR)))
+    {
+        mem0 = 0;
+        p = Max(ms, len - ms - 1) + 1;
+    }
+    else
+    {
+        mem0 = len - p;
+    }
+
+    size_t mem = 0;
+
+    // End of the part of the haystack known not to contain the terminator.
+    WCHAR const* end = hay;
+    for (;;)
+    {
+        if ((size_t)(end - hay) < len)
+        {
+            size_t grow = len | 63;
+            size_t found = Wcsnlen(end, grow);
+            end += found;
+            if (found < grow && (size_t)(end - hay) < len)
+                return NULL;
+        }
+
+        // Check the last unit first, and skip ahead on a mismatch.
+        WCHAR c = hay[len - 1];
+        if ((unitset[UNIT_BUCKET(c) / 64] >> (UNIT_BUCKET(c) % 64) & 1) != 0)
+        {
+            k = len - shift[UNIT_BUCKET(c)];
+            if (k != 0)
+            {
+                if (k < mem)
+                    k = mem;
+                hay += k;
+                mem = 0;
+                continue;
+            }
+        }
+        else
+        {
+            hay += len;
+            mem = 0;
+            continue;
+        }
+
+        // Compare the right half.
+        for (k = Max(ms + 1, mem); needle[k] != W('\0') && needle[k] == hay[k]; k++)
+            ;
+        if (needle[k] != W('\0'))
+        {
+            hay += k - ms;
+            mem = 0;
+            continue;
+        }
+
+        // Compare the left half.
+        for (k = ms + 1; k > mem && needle[k - 1] == hay[k - 1]; k--)
+            ;
+        if (k <= mem)
+            return (WCHAR*)hay;
+
+        hay += p;
+        mem = mem0;
+    }
+}
+
+//
+// Character scanning.
+//
+// PAL_wcschr(), PAL_wcsrchr() and PAL_wcsspn() scan with aligned loads,
+// like PAL_wcslen(), testing each block for the terminator and the
+// characters of interest at once. PAL_wcsspn() is only vectorized for
+// sets of up to SPAN_VECTOR_SET characters. Larger sets are looked up
+// through a bitmap on the low byte of each unit.
+//
+
+#define SPAN_VECTOR_SET 4
+
+static WCHAR* WcschrScalar(WCHAR const* str, WCHAR c)
+{
+    for (;; ++str)
+    {
+        if (*str == c)
+            return (WCHAR*)str;
+        if (*str == W('\0'))
+            return NULL;
+    }
+}
+
+static WCHAR* WcsrchrScalar(WCHAR const* str, WCHAR c)
+{
+    WCHAR const* last = NULL;
+    for (;; ++str)
+    {
+        if (*str == c)
+            last = str;
+        if (*str == W('\0'))
+            return (WCHAR*)last;
+    }
+}
+
+static size_t WcsspnScalar(WCHAR const* str, WCHAR const* set, size_t count)
+{
+    uint64_t buckets[256 / 64] = { 0 };
+    for (size_t i = 0; i < count; ++i)
+        buckets[UNIT_BUCKET(set[i]) / 64] |= (uint64_t)1 << (UNIT_BUCKET(set[i]) % 64);
+
+    size_t len = 0;
+    for (;; ++len)
+    {
+        WCHAR c = str[len];
+        if ((buckets[UNIT_BUCKET(c) / 64] >> (UNIT_BUCKET(c) % 64) & 1) == 0)
+            return len;
+
+        // The terminator is never in the set.
+        size_t i = 0;
+        while (i < count && set[i] != c)
+            i++;
+        if (i == count)
+            return len;
+    }
+}
+
+#if defined(STRINGS_X64)
+
+NO_SANITIZE_ADDRESS
+static WCHAR* Wcschr(WCHAR const* str, WCHAR c)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcschrScalar(str, c);
+
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const target = _mm_set1_epi16((short)c);
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    __m128i v = _mm_load_si128((__m128i const*)p);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, zero), _mm_cmpeq_epi16(v, target)));
+    mask = mask >> ((uintptr_t)str & 15) << ((uintptr_t)str & 15);
+    while (mask == 0)
+    {
+        p += 16;
+        v = _mm_load_si128((__m128i const*)p);
+        mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, zero), _mm_cmpeq_epi16(v, target)));
+    }
+
+    WCHAR const* found = (WCHAR const*)(p + __builtin_ctz(mask));
+    return *found == c ? (WCHAR*)found : NULL;
+}
+
+NO_SANITIZE_ADDRESS
+static WCHAR* Wcsrchr(WCHAR const* str, WCHAR c)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcsrchrScalar(str, c);
+
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const target = _mm_set1_epi16((short)c);
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    unsigned const first = 0xffffu << ((uintptr_t)str & 15);
 
-    int i;
-    WCHAR* res = NULL;
-    while (*dest != W('\0'))
+    // The last block with a match, and the matches in it.
+    char const* last = NULL;
+    unsigned last_mask = 0;
+
+    __m128i v = _mm_load_si128((__m128i const*)p);
+    unsigned nul = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) & first;
+    unsigned hit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, target)) & first;
+    while (nul == 0)
     {
-        for (i = 0; true; ++i)
+        if (hit != 0)
         {
-            if (src[i] == W('\0'))
+            last = p;
+            last_mask = hit;
+        }
+
+        p += 16;
+        v = _mm_load_si128((__m128i const*)p);
+        nul = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+        hit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, target));
+    }
+
+    // Keep the matches up to and including the terminator.
+    hit &= ((nul & (0u - nul)) << 2) - 1;
+    if (hit != 0)
+    {
+        last = p;
+        last_mask = hit;
+    }
+
+    if (last == NULL)
+        return NULL;
+
+    // The highest bit is the high byte of the last match.
+    return (WCHAR*)(last + (31 - __builtin_clz(last_mask)) - 1);
+}
+
+NO_SANITIZE_ADDRESS
+static size_t WcsspnVector(WCHAR const* str, WCHAR const* set, size_t count)
+{
+    __m128i targets[SPAN_VECTOR_SET];
+    for (size_t i = 0; i < count; ++i)
+        targets[i] = _mm_set1_epi16((short)set[i]);
+
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    unsigned mask;
+    for (;;)
+    {
+        __m128i v = _mm_load_si128((__m128i const*)p);
+        __m128i in = _mm_cmpeq_epi16(v, targets[0]);
+        for (size_t i = 1; i < count; ++i)
+            in = _mm_or_si128(in, _mm_cmpeq_epi16(v, targets[i]));
+
+        // Units outside the set, including the terminator.
+        mask = ~(unsigned)_mm_movemask_epi8(in) & 0xffff;
+        if (p < (char const*)str)
+            mask = mask >> ((uintptr_t)str & 15) << ((uintptr_t)str & 15);
+        if (mask != 0)
+            break;
+
+        p += 16;
+    }
+
+    return (size_t)(p + __builtin_ctz(mask) - (char const*)str) / sizeof(WCHAR);
+}
+
+#elif defined(STRINGS_NEON)
+
+// Mask with 8 bits set for each WCHAR that compared equal.
+static inline uint64_t MaskNeon(uint16x8_t eq)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0);
+}
+
+NO_SANITIZE_ADDRESS
+static WCHAR* Wcschr(WCHAR const* str, WCHAR c)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcschrScalar(str, c);
+
+    uint16x8_t const target = vdupq_n_u16(c);
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    unsigned const shift = (unsigned)((uintptr_t)str & 15) / sizeof(WCHAR) * 8;
+    uint16x8_t v = vld1q_u16((uint16_t const*)p);
+    uint64_t mask = MaskNeon(vorrq_u16(vceqzq_u16(v), vceqq_u16(v, target))) >> shift << shift;
+    while (mask == 0)
+    {
+        p += 16;
+        v = vld1q_u16((uint16_t const*)p);
+        mask = MaskNeon(vorrq_u16(vceqzq_u16(v), vceqq_u16(v, target)));
+    }
+
+    WCHAR const* found = (WCHAR const*)p + __builtin_ctzll(mask) / 8;
+    return *found == c ? (WCHAR*)found : NULL;
+}
+
+NO_SANITIZE_ADDRESS
+static WCHAR* Wcsrchr(WCHAR const* str, WCHAR c)
+{
+    if (((uintptr_t)str & 1) != 0)
+        return WcsrchrScalar(str, c);
+
+    uint16x8_t const target = vdupq_n_u16(c);
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    uint64_t const first = ~(uint64_t)0 << ((uintptr_t)str & 15) / sizeof(WCHAR) * 8;
+
+    char const* last = NULL;
+    uint64_t last_mask = 0;
+
+    uint16x8_t v = vld1q_u16((uint16_t const*)p);
+    uint64_t nul = MaskNeon(vceqzq_u16(v)) & first;
+    uint64_t hit = MaskNeon(vceqq_u16(v, target)) & first;
+    while (nul == 0)
+    {
+        if (hit != 0)
+        {
+            last = p;
+            last_mask = hit;
+        }
+
+        p += 16;
+        v = vld1q_u16((uint16_t const*)p);
+        nul = MaskNeon(vceqzq_u16(v));
+        hit = MaskNeon(vceqq_u16(v, target));
+    }
+
+    unsigned end = (unsigned)__builtin_ctzll(nul) + 8;
+    if (end < 64)
+        hit &= ((uint64_t)1 << end) - 1;
+    if (hit != 0)
+    {
+        last = p;
+        last_mask = hit;
+    }
+
+    if (last == NULL)
+        return NULL;
+
+    return (WCHAR*)last + (63 - __builtin_clzll(last_mask)) / 8;
+}
+
+NO_SANITIZE_ADDRESS
+static size_t WcsspnVector(WCHAR const* str, WCHAR const* set, size_t count)
+{
+    uint16x8_t targets[SPAN_VECTOR_SET];
+    for (size_t i = 0; i < count; ++i)
+        targets[i] = vdupq_n_u16(set[i]);
+
+    char const* p = (char const*)((uintptr_t)str & ~(uintptr_t)15);
+    uint64_t mask;
+    for (;;)
+    {
+        uint16x8_t v = vld1q_u16((uint16_t const*)p);
+        uint16x8_t in = vceqq_u16(v, targets[0]);
+        for (size_t i = 1; i < count; ++i)
+            in = vorrq_u16(in, vceqq_u16(v, targets[i]));
+
+        mask = ~MaskNeon(in);
+        if (p < (char const*)str)
+        {
+            unsigned shift = (unsigned)((uintptr_t)str & 15) / sizeof(WCHAR) * 8;
+            mask = mask >> shift << shift;
+        }
+        if (mask != 0)
+            break;
+
+        p += 16;
+    }
+
+    // The first block can start before the string, so the offset is
+    // taken from the end of the span.
+    return (size_t)(p + __builtin_ctzll(mask) / 8 * sizeof(WCHAR) - (char const*)str) / sizeof(WCHAR);
+}
+
+#else
+
+#define Wcschr WcschrScalar
+#define Wcsrchr WcsrchrScalar
+
+#endif
+
+//
+// Case-insensitive comparison.
+//
+// Units are compared by their simple uppercase forms from casefold.h,
+// as by CompareStringOrdinal(). _wcsicmp() then lowers ASCII letters,
+// which orders strings as the Windows CRT does for ASCII, e.g., '_'
+// before 'a'. Blocks of 8 units that are all ASCII are folded with
+// vector arithmetic, and any other block goes through the table.
+//
+
+static inline WCHAR FoldUnit(WCHAR c, bool lower)
+{
+    WCHAR u = (WCHAR)(c + casefold_deltas[casefold_index[c >> CASEFOLD_BLOCK_BITS]][c & (CASEFOLD_BLOCK_SIZE - 1)]);
+    if (lower && u >= W('A') && u <= W('Z'))
+        u = (WCHAR)(u + (W('a') - W('A')));
+    return u;
+}
+
+// Compares up to count units, and stops at a terminator if requested.
+static int CompareFoldedScalar(WCHAR const* str1, WCHAR const* str2, size_t count, bool lower, bool stop_at_nul)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        WCHAR a = FoldUnit(str1[i], lower);
+        WCHAR b = FoldUnit(str2[i], lower);
+        if (a != b || (stop_at_nul && a == W('\0')))
+            return CompareUnits(a, b);
+    }
+
+    return 0;
+}
+
+#if defined(STRINGS_X64)
+
+NO_SANITIZE_ADDRESS
+static int CompareFoldedSse2(WCHAR const* str1, WCHAR const* str2, size_t count, bool lower, bool stop_at_nul)
+{
+    // Letters to fold are in (first, last), and move by delta.
+    __m128i const first = _mm_set1_epi16(lower ? 'A' - 1 : 'a' - 1);
+    __m128i const last = _mm_set1_epi16(lower ? 'Z' + 1 : 'z' + 1);
+    __m128i const delta = _mm_set1_epi16(lower ? 'a' - 'A' : 'A' - 'a');
+    __m128i const non_ascii = _mm_set1_epi16((short)0xff80);
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const nul_check = stop_at_nul ? _mm_set1_epi16(-1) : zero;
+
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t limit = i + UnitsInPage(str1 + i, str2 + i, count - i);
+        for (; i + 8 <= limit; i += 8)
+        {
+            __m128i a = _mm_loadu_si128((__m128i const*)(str1 + i));
+            __m128i b = _mm_loadu_si128((__m128i const*)(str2 + i));
+            __m128i high = _mm_and_si128(_mm_or_si128(a, b), non_ascii);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xffff)
+            {
+                int result = CompareFoldedScalar(str1 + i, str2 + i, 8, lower, stop_at_nul);
+                if (result != 0)
+                    return result;
+
+                // A terminator in an equal block ends the comparison.
+                if (stop_at_nul && _mm_movemask_epi8(_mm_cmpeq_epi16(a, zero)) != 0)
+                    return 0;
+                continue;
+            }
+
+            __m128i in_a = _mm_and_si128(_mm_cmpgt_epi16(a, first), _mm_cmplt_epi16(a, last));
+            __m128i in_b = _mm_and_si128(_mm_cmpgt_epi16(b, first), _mm_cmplt_epi16(b, last));
+            a = _mm_add_epi16(a, _mm_and_si128(in_a, delta));
+            b = _mm_add_epi16(b, _mm_and_si128(in_b, delta));
+
+            // Units that differ or end the string.
+            unsigned equal = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(a, b));
+            unsigned nul = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(a, zero), nul_check));
+            unsigned stop = nul | (equal ^ 0xffffu);
+            if (stop != 0)
             {
-                res = (WCHAR*)dest;
-                goto exit;
+                // Equal units here are the terminators of both strings.
+                unsigned bit = (unsigned)__builtin_ctz(stop);
+                if ((equal >> bit & 1) != 0)
+                    return 0;
+
+                i += bit / sizeof(WCHAR);
+                return CompareUnits(FoldUnit(str1[i], lower), FoldUnit(str2[i], lower));
             }
-            else if (dest[i] == W('\0'))
+        }
+
+        // Step over the page boundary, or to the count, one unit at a time.
+        for (; i < limit; ++i)
+        {
+            WCHAR a = FoldUnit(str1[i], lower);
+            WCHAR b = FoldUnit(str2[i], lower);
+            if (a != b || (stop_at_nul && a == W('\0')))
+                return CompareUnits(a, b);
+        }
+    }
+
+    return 0;
+}
+
+NO_SANITIZE_ADDRESS __attribute__((target("avx2")))
+static int CompareFoldedAvx2(WCHAR const* str1, WCHAR const* str2, size_t count, bool lower, bool stop_at_nul)
+{
+    __m256i const first = _mm256_set1_epi16(lower ? 'A' - 1 : 'a' - 1);
+    __m256i const last = _mm256_set1_epi16(lower ? 'Z' + 1 : 'z' + 1);
+    __m256i const delta = _mm256_set1_epi16(lower ? 'a' - 'A' : 'A' - 'a');
+    __m256i const non_ascii = _mm256_set1_epi16((short)0xff80);
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const nul_check = stop_at_nul ? _mm256_set1_epi16(-1) : zero;
+
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t limit = i + UnitsInPage(str1 + i, str2 + i, count - i);
+        for (; i + 16 <= limit; i += 16)
+        {
+            __m256i a = _mm256_loadu_si256((__m256i const*)(str1 + i));
+            __m256i b = _mm256_loadu_si256((__m256i const*)(str2 + i));
+            __m256i high = _mm256_and_si256(_mm256_or_si256(a, b), non_ascii);
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(high, zero)) != -1)
             {
-                res = NULL;
-                goto exit;
+                int result = CompareFoldedScalar(str1 + i, str2 + i, 16, lower, stop_at_nul);
+                if (result != 0)
+                    return result;
+
+                // A terminator in an equal block ends the comparison.
+                if (stop_at_nul && _mm256_movemask_epi8(_mm256_cmpeq_epi16(a, zero)) != 0)
+                    return 0;
+                continue;
             }
-            else if (dest[i] != src[i])
+
+            __m256i in_a = _mm256_and_si256(_mm256_cmpgt_epi16(a, first), _mm256_cmpgt_epi16(last, a));
+            __m256i in_b = _mm256_and_si256(_mm256_cmpgt_epi16(b, first), _mm256_cmpgt_epi16(last, b));
+            a = _mm256_add_epi16(a, _mm256_and_si256(in_a, delta));
+            b = _mm256_add_epi16(b, _mm256_and_si256(in_b, delta));
+
+            unsigned equal = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(a, b));
+            unsigned nul = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi16(a, zero), nul_check));
+            unsigned stop = nul | ~equal;
+            if (stop != 0)
             {
-                break;
+                unsigned bit = (unsigned)__builtin_ctz(stop);
+                if ((equal >> bit & 1) != 0)
+                    return 0;
+
+                i += bit / sizeof(WCHAR);
+                return CompareUnits(FoldUnit(str1[i], lower), FoldUnit(str2[i], lower));
             }
         }
 
-        dest++;
+        // Step over the page boundary, or to the count, one unit at a time.
+        for (; i < limit; ++i)
+        {
+            WCHAR a = FoldUnit(str1[i], lower);
+            WCHAR b = FoldUnit(str2[i], lower);
+            if (a != b || (stop_at_nul && a == W('\0')))
+                return CompareUnits(a, b);
+        }
     }
 
-exit:
-    return res;
-}
\ No newline at end of file
+    return 0;
+}
+
+#elif defined(STRINGS_NEON)
+
+NO_SANITIZE_ADDRESS
+static int CompareFoldedNeon(WCHAR const* str1, WCHAR const* str2, size_t count, bool lower, bool stop_at_nul)
+{
+    // Letters to fold are those within first + [0, 26).
+    uint16x8_t const first = vdupq_n_u16(lower ? 'A' : 'a');
+    uint16x8_t const letters = vdupq_n_u16(26);
+    uint16x8_t const delta = vdupq_n_u16((uint16_t)(lower ? 'a' - 'A' : 'A' - 'a'));
+    uint16x8_t const non_ascii = vdupq_n_u16(0xff80);
+    uint16x8_t const nul_check = vdupq_n_u16(stop_at_nul ? 0xffff : 0);
+
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t limit = i + UnitsInPage(str1 + i, str2 + i, count - i);
+        for (; i + 8 <= limit; i += 8)
+        {
+            uint16x8_t a = vld1q_u16((uint16_t const*)(str1 + i));
+            uint16x8_t b = vld1q_u16((uint16_t const*)(str2 + i));
+            if (vmaxvq_u16(vandq_u16(vorrq_u16(a, b), non_ascii)) != 0)
+            {
+                int result = CompareFoldedScalar(str1 + i, str2 + i, 8, lower, stop_at_nul);
+                if (result != 0)
+                    return result;
+
+                if (stop_at_nul && vminvq_u16(a) == 0)
+                    return 0;
+                continue;
+            }
+
+            a = vaddq_u16(a, vandq_u16(vcltq_u16(vsubq_u16(a, first), letters), delta));
+            b = vaddq_u16(b, vandq_u16(vcltq_u16(vsubq_u16(b, first), letters), delta));
+
+            uint64_t equal = MaskNeon(vceqq_u16(a, b));
+            uint64_t nul = MaskNeon(vandq_u16(vceqzq_u16(a), nul_check));
+            uint64_t stop = nul | ~equal;
+            if (stop != 0)
+            {
+                unsigned bit = (unsigned)__builtin_ctzll(stop);
+                if ((equal >> bit & 1) != 0)
+                    return 0;
+
+                i += bit / 8;
+                return CompareUnits(FoldUnit(str1[i], lower), FoldUnit(str2[i], lower));
+            }
+        }
+
+        for (; i < limit; ++i)
+        {
+            WCHAR a = FoldUnit(str1[i], lower);
+            WCHAR b = FoldUnit(str2[i], lower);
+            if (a != b || (stop_at_nul && a == W('\0')))
+                return CompareUnits(a, b);
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+#if defined(STRINGS_X64)
+    #define WCSLEN_DEFAULT WcslenSse2
+    #define WCSNCMP_DEFAULT WcsncmpSse2
+    #define COMPARE_FOLDED_DEFAULT CompareFoldedSse2
+#elif defined(STRINGS_NEON)
+    #define WCSLEN_DEFAULT WcslenNeon
+    #define WCSNCMP_DEFAULT WcsncmpNeon
+    #define COMPARE_FOLDED_DEFAULT CompareFoldedNeon
+#else
+    #define WCSLEN_DEFAULT WcslenScalar
+    #define WCSNCMP_DEFAULT WcsncmpScalar
+    #define COMPARE_FOLDED_DEFAULT CompareFoldedScalar
+#endif
+
+static size_t (*wcslen_impl)(WCHAR const*) = WCSLEN_DEFAULT;
+static int (*wcsncmp_impl)(WCHAR const*, WCHAR const*, size_t) = WCSNCMP_DEFAULT;
+static int (*compare_folded_impl)(WCHAR const*, WCHAR const*, size_t, bool, bool) = COMPARE_FOLDED_DEFAULT;
+
+#if defined(STRINGS_X64)
+__attribute__((constructor))
+static void SelectStringFunctions(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        wcslen_impl = WcslenAvx2;
+        wcsncmp_impl = WcsncmpAvx2;
+        compare_folded_impl = CompareFoldedAvx2;
+    }
+}
+#endif
+
+size_t PAL_wcslen(WCHAR const* str)
+{
+    assert(str != NULL);
+    return wcslen_impl(str);
+}
+
+int PAL_wcscmp(WCHAR const* str1, WCHAR const* str2)
+{
+    assert(str1 != NULL && str2 != NULL);
+    return PAL_wcsncmp(str1, str2, SIZE_MAX);
+}
+
+int PAL_wcsncmp(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    assert(count == 0 || (str1 != NULL && str2 != NULL));
+
+    // Too short to fill a vector, or misaligned WCHARs, which can
+    // straddle a page boundary.
+    if (count < 8 || (((uintptr_t)str1 | (uintptr_t)str2) & 1) != 0)
+        return WcsncmpScalar(str1, str2, count);
+
+    return wcsncmp_impl(str1, str2, count);
+}
+
+WCHAR* PAL_wcsstr(WCHAR const* dest, WCHAR const* src)
+{
+    assert(dest != NULL && src != NULL);
+
+    if (src[0] == W('\0'))
+        return (WCHAR*)dest;
+
+    size_t len = PAL_wcslen(src);
+#if defined(STRINGS_X64) || defined(STRINGS_NEON)
+    return FilteredSearch(dest, src, len);
+#else
+    return TwoWaySearch(dest, src, len);
+#endif
+}
+
+WCHAR* PAL_wcschr(WCHAR const* str, WCHAR c)
+{
+    assert(str != NULL);
+    return Wcschr(str, c);
+}
+
+WCHAR* PAL_wcsrchr(WCHAR const* str, WCHAR c)
+{
+    assert(str != NULL);
+    return Wcsrchr(str, c);
+}
+
+size_t PAL_wcsspn(WCHAR const* str, WCHAR const* set)
+{
+    assert(str != NULL && set != NULL);
+
+    size_t count = PAL_wcslen(set);
+    if (count == 0)
+        return 0;
+
+#if defined(STRINGS_X64) || defined(STRINGS_NEON)
+    if (count <= SPAN_VECTOR_SET && ((uintptr_t)str & 1) == 0)
+        return WcsspnVector(str, set, count);
+#endif
+    return WcsspnScalar(str, set, count);
+}
+
+//
+// Secure copies, with the checks and results of the Windows CRT.
+//
+
+int PAL_wcscpy_s(WCHAR* dest, size_t dest_size, WCHAR const* src)
+{
+    if (dest == NULL || dest_size == 0)
+        return EINVAL;
+
+    if (src == NULL)
+    {
+        dest[0] = W('\0');
+        return EINVAL;
+    }
+
+    size_t len = Wcsnlen(src, dest_size);
+    if (len == dest_size)
+    {
+        dest[0] = W('\0');
+        return ERANGE;
+    }
+
+    memcpy(dest, src, (len + 1) * sizeof(WCHAR));
+    return 0;
+}
+
+int PAL_wcscat_s(WCHAR* dest, size_t dest_size, WCHAR const* src)
+{
+    if (dest == NULL || dest_size == 0)
+        return EINVAL;
+
+    if (src == NULL)
+    {
+        dest[0] = W('\0');
+        return EINVAL;
+    }
+
+    // The destination must already be terminated within its size.
+    size_t dest_len = Wcsnlen(dest, dest_size);
+    if (dest_len == dest_size)
+    {
+        dest[0] = W('\0');
+        return EINVAL;
+    }
+
+    size_t room = dest_size - dest_len;
+    size_t len = Wcsnlen(src, room);
+    if (len == room)
+    {
+        dest[0] = W('\0');
+        return ERANGE;
+    }
+
+    memcpy(dest + dest_len, src, (len + 1) * sizeof(WCHAR));
+    return 0;
+}
+
+int PAL_wcsncpy_s(WCHAR* dest, size_t dest_size, WCHAR const* src, size_t count)
+{
+    if (count == 0 && dest == NULL && dest_size == 0)
+        return 0;
+
+    if (dest == NULL || dest_size == 0)
+        return EINVAL;
+
+    if (count == 0)
+    {
+        dest[0] = W('\0');
+        return 0;
+    }
+
+    if (src == NULL)
+    {
+        dest[0] = W('\0');
+        return EINVAL;
+    }
+
+    if (count == _TRUNCATE)
+    {
+        size_t len = Wcsnlen(src, dest_size);
+        if (len == dest_size)
+        {
+            memcpy(dest, src, (dest_size - 1) * sizeof(WCHAR));
+            dest[dest_size - 1] = W('\0');
+            return STRUNCATE;
+        }
+
+        memcpy(dest, src, (len + 1) * sizeof(WCHAR));
+        return 0;
+    }
+
+    size_t len = Wcsnlen(src, count);
+    if (len >= dest_size)
+    {
+        dest[0] = W('\0');
+        return ERANGE;
+    }
+
+    memcpy(dest, src, len * sizeof(WCHAR));
+    dest[len] = W('\0');
+    return 0;
+}
+
+int PAL__wcsicmp(WCHAR const* str1, WCHAR const* str2)
+{
+    return PAL__wcsnicmp(str1, str2, SIZE_MAX);
+}
+
+int PAL__wcsnicmp(WCHAR const* str1, WCHAR const* str2, size_t count)
+{
+    assert(count == 0 || (str1 != NULL && str2 != NULL));
+
+    if (count < 8 || (((uintptr_t)str1 | (uintptr_t)str2) & 1) != 0)
+        return CompareFoldedScalar(str1, str2, count, true, true);
+
+    return compare_folded_impl(str1, str2, count, true, true);
+}
+
+int PAL_CompareStringOrdinal(WCHAR const* str1, int count1, WCHAR const* str2, int count2, BOOL ignore_case)
+{
+    if (str1 == NULL || str2 == NULL || count1 < -1 || count2 < -1)
+    {
+        PAL_SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    size_t len1 = count1 == -1 ? PAL_wcslen(str1) : (size_t)count1;
+    size_t len2 = count2 == -1 ? PAL_wcslen(str2) : (size_t)count2;
+    size_t len = len1 < len2 ? len1 : len2;
+
+    // Embedded terminators are compared like any other unit.
+    int result = 0;
+    if (ignore_case)
+    {
+        result = len < 8 || (((uintptr_t)str1 | (uintptr_t)str2) & 1) != 0
+            ? CompareFoldedScalar(str1, str2, len, false, false)
+            : compare_folded_impl(str1, str2, len, false, false);
+    }
+    else if (0 != memcmp(str1, str2, len * sizeof(WCHAR)))
+    {
+        size_t i = 0;
+        while (str1[i] == str2[i])
+            i++;
+        result = CompareUnits(str1[i], str2[i]);
+    }
+
+    if (result == 0)
+        result = (len1 > len2) - (len1 < len2);
+
+    return CSTR_EQUAL + result;
+}
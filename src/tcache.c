@@ -0,0 +1,300 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <assert.h>
+#include "alloc.h"
+#include "util.h"
+
+//
+// Per-thread cache of size-classed blocks.
+//
+// Every cached block is a plain malloc() block, so a block handed out
+// by the cache can always be released with free() - this is required
+// for interop with .NET's Marshal.FreeCoTaskMem. Blocks are binned by
+// the usable size reported by the underlying allocator and the classes
+// are probed from that allocator on initialization, so they mirror its
+// own bins and a block always returns to the class it was served from.
+//
+// Each thread owns a bin per class that is touched without any
+// synchronization. A free on a thread other than the allocating one
+// lands in the freeing thread's bin. When a bin fills up it is moved,
+// as a single batch, into a shared depot where any thread can pick it
+// up when its own bin for that class runs dry. Depot slots are only
+// ever swapped with a single atomic exchange or compare-exchange, so
+// remote frees never take a lock and are not subject to ABA.
+//
+
+#define TCACHE_MAX_SIZE 2048
+#define TCACHE_MAX_CLASSES 255
+#define TCACHE_NO_CLASS 0xff
+
+_Static_assert(TCACHE_MAX_SIZE < PROFILE_SAMPLED_MIN_SIZE, "Sampled blocks must not fit in the cache");
+
+// Bounds on the number of blocks held in a single bin.
+#define TCACHE_BIN_BYTES (32 * 1024)
+#define TCACHE_BIN_MIN_COUNT 8
+#define TCACHE_BIN_MAX_COUNT 128
+
+// Number of batches the depot holds per class.
+#define TCACHE_DEPOT_SLOTS 8
+
+// A cached block links to the next block through its first word. The
+// head of a batch in the depot also records the batch length in its
+// second word, which requires the smallest class to hold two pointers.
+struct free_block
+{
+    struct free_block* next;
+    size_t batch_count;
+};
+
+struct tcache_bin
+{
+    struct free_block* head;
+    uint32_t count;
+};
+
+enum tcache_state
+{
+    TCACHE_UNINITIALIZED = 0,
+    TCACHE_ACTIVE,
+    TCACHE_DEAD,
+};
+
+struct tcache
+{
+    enum tcache_state state;
+    struct tcache_bin bins[TCACHE_MAX_CLASSES];
+};
+
+static size_t class_count;
+static size_t class_size[TCACHE_MAX_CLASSES];
+static uint32_t class_limit[TCACHE_MAX_CLASSES];
+
+// Indexed by size / 8. The "ceil" table maps a requested size to the
+// smallest class able to hold it. The "floor" table maps a usable size
+// to the largest class it can satisfy.
+static uint8_t class_ceil[TCACHE_MAX_SIZE / 8 + 1];
+static uint8_t class_floor[TCACHE_MAX_SIZE / 8 + 1];
+
+static _Atomic(struct free_block*) depot[TCACHE_MAX_CLASSES][TCACHE_DEPOT_SLOTS];
+
+static pthread_key_t tcache_key;
+static _Thread_local struct tcache t_cache;
+
+static void release_list(struct free_block* block)
+{
+    while (block != NULL)
+    {
+        struct free_block* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+static bool depot_push(size_t cls, struct free_block* batch)
+{
+    for (size_t i = 0; i < TCACHE_DEPOT_SLOTS; ++i)
+    {
+        _Atomic(struct free_block*)* slot = &depot[cls][i];
+        if (atomic_load_explicit(slot, memory_order_relaxed) != NULL)
+            continue;
+
+        struct free_block* expected = NULL;
+        if (atomic_compare_exchange_strong_explicit(slot, &expected, batch, memory_order_release, memory_order_relaxed))
+            return true;
+    }
+
+    return false;
+}
+
+static struct free_block* depot_pop(size_t cls)
+{
+    for (size_t i = 0; i < TCACHE_DEPOT_SLOTS; ++i)
+    {
+        _Atomic(struct free_block*)* slot = &depot[cls][i];
+        if (atomic_load_explicit(slot, memory_order_relaxed) == NULL)
+            continue;
+
+        struct free_block* batch = atomic_exchange_explicit(slot, NULL, memory_order_acquire);
+        if (batch != NULL)
+            return batch;
+    }
+
+    return NULL;
+}
+
+// Move the contents of the bin into the depot, or back to the
+// underlying allocator if the depot is full.
+static void flush_bin(size_t cls, struct tcache_bin* bin)
+{
+    if (bin->head == NULL)
+        return;
+
+    bin->head->batch_count = bin->count;
+    if (!depot_push(cls, bin->head))
+        release_list(bin->head);
+
+    bin->head = NULL;
+    bin->count = 0;
+}
+
+static void tcache_thread_exit(void* data)
+{
+    struct tcache* tc = (struct tcache*)data;
+    for (size_t i = 0; i < class_count; ++i)
+        flush_bin(i, &tc->bins[i]);
+
+    // Allocations made by later thread-exit callbacks bypass the cache.
+    tc->state = TCACHE_DEAD;
+}
+
+static struct tcache* get_tcache(void)
+{
+    struct tcache* tc = &t_cache;
+    if (tc->state == TCACHE_ACTIVE)
+        return tc;
+
+    if (tc->state == TCACHE_DEAD)
+        return NULL;
+
+    // Register the thread so the cache is flushed on thread exit.
+    if (0 != pthread_setspecific(tcache_key, tc))
+        return NULL;
+
+    tc->state = TCACHE_ACTIVE;
+    return tc;
+}
+
+bool tcache_init(void)
+{
+    if (0 != pthread_key_create(&tcache_key, tcache_thread_exit))
+        return false;
+
+    // Probe the underlying allocator for its bins.
+    class_count = 0;
+    for (size_t size = 8; size <= TCACHE_MAX_SIZE && class_count < TCACHE_MAX_CLASSES; size += 8)
+    {
+        void* block = malloc(size);
+        if (block == NULL)
+            return false;
+
+        size_t usable = alloc_usable_size(block) & ~(size_t)7;
+        free(block);
+
+        if (usable < sizeof(struct free_block) || usable > TCACHE_MAX_SIZE)
+            continue;
+
+        if (class_count != 0 && usable <= class_size[class_count - 1])
+            continue;
+
+        size_t limit = TCACHE_BIN_BYTES / usable;
+        if (limit < TCACHE_BIN_MIN_COUNT)
+            limit = TCACHE_BIN_MIN_COUNT;
+        if (limit > TCACHE_BIN_MAX_COUNT)
+            limit = TCACHE_BIN_MAX_COUNT;
+
+        class_size[class_count] = usable;
+        class_limit[class_count] = (uint32_t)limit;
+        class_count++;
+    }
+
+    if (class_count == 0)
+        return false;
+
+    size_t cls = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(class_ceil); ++i)
+    {
+        size_t size = i * 8;
+        while (cls < class_count && class_size[cls] < size)
+            cls++;
+        class_ceil[i] = cls < class_count ? (uint8_t)cls : TCACHE_NO_CLASS;
+    }
+
+    cls = TCACHE_NO_CLASS;
+    for (size_t i = 0; i < ARRAY_SIZE(class_floor); ++i)
+    {
+        size_t size = i * 8;
+        size_t next = cls == TCACHE_NO_CLASS ? 0 : cls + 1;
+        if (next < class_count && class_size[next] <= size)
+            cls = next;
+        class_floor[i] = (uint8_t)cls;
+    }
+
+    return true;
+}
+
+void* tcache_alloc(size_t size)
+{
+    if (size > TCACHE_MAX_SIZE)
+        return NULL;
+
+    size_t cls = class_ceil[(size + 7) / 8];
+    if (cls == TCACHE_NO_CLASS)
+        return NULL;
+
+    struct tcache* tc = get_tcache();
+    if (tc == NULL)
+        return NULL;
+
+    struct tcache_bin* bin = &tc->bins[cls];
+    struct free_block* block = bin->head;
+    if (block == NULL)
+    {
+        block = depot_pop(cls);
+        if (block == NULL)
+            return malloc(class_size[cls]);
+
+        bin->count = (uint32_t)block->batch_count;
+    }
+
+    assert(bin->count > 0);
+    bin->head = block->next;
+    bin->count--;
+    return block;
+}
+
+bool tcache_free(void* block)
+{
+    size_t usable = alloc_usable_size(block);
+    if (usable > TCACHE_MAX_SIZE)
+        return false;
+
+    size_t cls = class_floor[usable / 8];
+    if (cls == TCACHE_NO_CLASS)
+        return false;
+
+    struct tcache* tc = get_tcache();
+    if (tc == NULL)
+        return false;
+
+    struct tcache_bin* bin = &tc->bins[cls];
+    if (bin->count == class_limit[cls])
+        flush_bin(cls, bin);
+
+    struct free_block* fb = (struct free_block*)block;
+    fb->next = bin->head;
+    bin->head = fb;
+    bin->count++;
+    return true;
+}
@@ -0,0 +1,1347 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dncp.h>
+#include "utf.h"
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+    #define UTF_SSE2
+    #define UTF_AVX2
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+    #define UTF_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define UTF_NEON
+#endif
+
+//
+// Text is mostly ASCII, so runs of ASCII are found and converted
+// 16 units at a time with SSE2 or NEON. Runs of two and three byte
+// characters have their own vector steps, below, and the rest goes
+// through scalar decoders.
+//
+
+#define REPLACEMENT_CHAR 0xfffdu
+
+// Number of ASCII bytes at the start of the string.
+static size_t AsciiPrefix8(uint8_t const* s, size_t len)
+{
+    size_t i = 0;
+#if defined(UTF_SSE2)
+    for (; i + 16 <= len; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i const*)(s + i)));
+        if (mask != 0)
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#elif defined(UTF_NEON)
+    for (; i + 16 <= len; i += 16)
+    {
+        if (vmaxvq_u8(vld1q_u8(s + i)) >= 0x80)
+            break;
+    }
+#endif
+    while (i < len && s[i] < 0x80)
+        i++;
+    return i;
+}
+
+// Number of ASCII units at the start of the string.
+static size_t AsciiPrefix16(uint16_t const* s, size_t len)
+{
+    size_t i = 0;
+#if defined(UTF_SSE2)
+    __m128i const high = _mm_set1_epi16((short)0xff80);
+    for (; i + 8 <= len; i += 8)
+    {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i const*)(s + i)), high);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128())) != 0xffff)
+            break;
+    }
+#elif defined(UTF_NEON)
+    for (; i + 8 <= len; i += 8)
+    {
+        if (vmaxvq_u16(vld1q_u16(s + i)) >= 0x80)
+            break;
+    }
+#endif
+    while (i < len && s[i] < 0x80)
+        i++;
+    return i;
+}
+
+static void WidenAscii(uint8_t const* s, size_t len, uint16_t* d)
+{
+    size_t i = 0;
+#if defined(UTF_SSE2)
+    __m128i const zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const*)(s + i));
+        _mm_storeu_si128((__m128i*)(d + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i*)(d + i + 8), _mm_unpackhi_epi8(v, zero));
+    }
+#elif defined(UTF_NEON)
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(s + i);
+        vst1q_u16(d + i, vmovl_u8(vget_low_u8(v)));
+        vst1q_u16(d + i + 8, vmovl_high_u8(v));
+    }
+#endif
+    for (; i < len; ++i)
+        d[i] = s[i];
+}
+
+static void NarrowAscii(uint16_t const* s, size_t len, uint8_t* d)
+{
+    size_t i = 0;
+#if defined(UTF_SSE2)
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i lo = _mm_loadu_si128((__m128i const*)(s + i));
+        __m128i hi = _mm_loadu_si128((__m128i const*)(s + i + 8));
+        _mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(UTF_NEON)
+    for (; i + 16 <= len; i += 16)
+        vst1q_u8(d + i, vcombine_u8(vmovn_u16(vld1q_u16(s + i)), vmovn_u16(vld1q_u16(s + i + 8))));
+#endif
+    for (; i < len; ++i)
+        d[i] = (uint8_t)s[i];
+}
+
+// Decode one non-ASCII sequence. Returns the number of bytes consumed.
+// An ill-formed sequence decodes to U+FFFD and consumes its maximal
+// subpart, which is at least one byte.
+static size_t DecodeUtf8(uint8_t const* s, size_t len, uint32_t* cp)
+{
+    uint8_t lead = s[0];
+    size_t count;
+    uint8_t lower = 0x80;
+    uint8_t upper = 0xbf;
+    uint32_t value;
+
+    if (lead >= 0xc2 && lead <= 0xdf)
+    {
+        count = 2;
+        value = lead & 0x1f;
+    }
+    else if (lead >= 0xe0 && lead <= 0xef)
+    {
+        count = 3;
+        value = lead & 0x0f;
+        if (lead == 0xe0)
+            lower = 0xa0; // Overlong
+        else if (lead == 0xed)
+            upper = 0x9f; // Surrogates
+    }
+    else if (lead >= 0xf0 && lead <= 0xf4)
+    {
+        count = 4;
+        value = lead & 0x07;
+        if (lead == 0xf0)
+            lower = 0x90; // Overlong
+        else if (lead == 0xf4)
+            upper = 0x8f; // Beyond U+10FFFF
+    }
+    else
+    {
+        *cp = REPLACEMENT_CHAR;
+        return 1;
+    }
+
+    for (size_t i = 1; i < count; ++i)
+    {
+        if (i >= len || s[i] < lower || s[i] > upper)
+        {
+            *cp = REPLACEMENT_CHAR;
+            return i;
+        }
+
+        value = (value << 6) | (s[i] & 0x3f);
+        lower = 0x80;
+        upper = 0xbf;
+    }
+
+    *cp = value;
+    return count;
+}
+
+// Decode one non-ASCII sequence, with the common well-formed two and
+// three byte sequences checked inline.
+static inline size_t DecodeUtf8Fast(uint8_t const* s, size_t len, uint32_t* cp)
+{
+    uint8_t lead = s[0];
+    if (lead >= 0xc2 && lead <= 0xdf && len > 1 && (s[1] & 0xc0) == 0x80)
+    {
+        *cp = ((uint32_t)(lead & 0x1f) << 6) | (s[1] & 0x3f);
+        return 2;
+    }
+
+    if ((lead & 0xf0) == 0xe0 && len > 2 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80)
+    {
+        uint32_t value = ((uint32_t)(lead & 0x0f) << 12) | ((uint32_t)(s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+        if (value >= 0x800 && (value < 0xd800 || value > 0xdfff))
+        {
+            *cp = value;
+            return 3;
+        }
+    }
+
+    return DecodeUtf8(s, len, cp);
+}
+
+static size_t Utf8ToUtf16LengthScalar(uint8_t const* s, size_t len, bool* invalid)
+{
+    size_t units = 0;
+    bool bad = false;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t ascii = AsciiPrefix8(s + i, len - i);
+        units += ascii;
+        i += ascii;
+
+        // Stay in the scalar decoder for runs of non-ASCII characters.
+        while (i < len && s[i] >= 0x80)
+        {
+            uint32_t cp;
+            size_t consumed = DecodeUtf8Fast(s + i, len - i, &cp);
+            bad |= cp == REPLACEMENT_CHAR && !(consumed == 3 && s[i] == 0xef);
+            units += cp >= 0x10000 ? 2 : 1;
+            i += consumed;
+        }
+    }
+
+    *invalid = bad;
+    return units;
+}
+
+//
+// Well-formed UTF-8 is measured with vectors. Each block is validated
+// with the lookup tables of Keiser and Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte", and every byte that isn't a continuation
+// byte makes one UTF-16 unit, and every four byte lead another. Ill-formed
+// input is measured again by the scalar decoder, which counts the
+// replacement characters.
+//
+
+#if defined(UTF_AVX2) || defined(UTF_NEON)
+
+// Errors flagged by the tables, for the pair of bytes (prev1, input).
+#define TOO_SHORT       (1 << 0)    // 11______ 0_______ or 11______ 11______
+#define TOO_LONG        (1 << 1)    // 0_______ 10______
+#define OVERLONG_3      (1 << 2)    // 11100000 100_____
+#define TOO_LARGE       (1 << 3)    // 11110100 1001____ or 11110100 101_____ or 11110101+ 10______
+#define SURROGATE       (1 << 4)    // 11101101 101_____
+#define OVERLONG_2      (1 << 5)    // 1100000_ 10______
+#define TOO_LARGE_1000  (1 << 6)    // 11110101+ 1000____
+#define OVERLONG_4      (1 << 6)    // 11110000 1000____
+#define TWO_CONTS       (1 << 7)    // 10______ 10______, unless a third or fourth byte
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// Indexed by the high nibble of the first byte.
+#define BYTE_1_HIGH_TABLE \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+// Indexed by the low nibble of the first byte.
+#define BYTE_1_LOW_TABLE \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000
+
+// Indexed by the high nibble of the second byte.
+#define BYTE_2_HIGH_TABLE \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+#endif
+
+#if defined(UTF_AVX2)
+
+#define DUP16(...) __VA_ARGS__, __VA_ARGS__
+
+// The input shifted by n bytes, with the end of the previous block
+// shifted in.
+#define PREV_AVX2(input, prev, n) \
+    _mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2,popcnt")))
+static __m256i CheckBlockAvx2(__m256i input, __m256i prev)
+{
+    __m256i const byte_1_high = _mm256_setr_epi8(DUP16(BYTE_1_HIGH_TABLE));
+    __m256i const byte_1_low = _mm256_setr_epi8(DUP16(BYTE_1_LOW_TABLE));
+    __m256i const byte_2_high = _mm256_setr_epi8(DUP16((char)BYTE_2_HIGH_TABLE));
+    __m256i const nibble = _mm256_set1_epi8(0x0f);
+
+    __m256i prev1 = PREV_AVX2(input, prev, 1);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    // Third and fourth bytes must be continuations, which are exactly the
+    // bytes flagged as TWO_CONTS.
+    __m256i third = _mm256_subs_epu8(PREV_AVX2(input, prev, 2), _mm256_set1_epi8((char)(0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(PREV_AVX2(input, prev, 3), _mm256_set1_epi8((char)(0xf0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t CountUnitsAvx2(__m256i input)
+{
+    unsigned lead = (unsigned)_mm256_movemask_epi8(input);
+    unsigned continuation = (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8((char)0xc0), input));
+    unsigned four = lead & (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(input, _mm256_set1_epi8((char)0xef)));
+    return 32 - (size_t)__builtin_popcount(continuation) + (size_t)__builtin_popcount(four);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t Utf8ToUtf16LengthAvx2(uint8_t const* s, size_t len, bool* invalid)
+{
+    // A block ending with a lead byte this large or larger is incomplete.
+    __m256i const incomplete_limit = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)0xef, (char)0xdf, (char)0xbf);
+
+    __m256i prev = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    size_t units = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i input = _mm256_loadu_si256((__m256i const*)(s + i));
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+            units += 32;
+        }
+        else
+        {
+            error = _mm256_or_si256(error, CheckBlockAvx2(input, prev));
+            incomplete = _mm256_subs_epu8(input, incomplete_limit);
+            units += CountUnitsAvx2(input);
+        }
+        prev = input;
+    }
+
+    // The rest is padded with NULs, which also ends any incomplete sequence.
+    uint8_t tail[32] = { 0 };
+    memcpy(tail, s + i, len - i);
+    __m256i input = _mm256_loadu_si256((__m256i const*)tail);
+    error = _mm256_or_si256(error, CheckBlockAvx2(input, prev));
+    units += CountUnitsAvx2(input) - (32 - (len - i));
+
+    if (!_mm256_testz_si256(error, error))
+        return Utf8ToUtf16LengthScalar(s, len, invalid);
+
+    *invalid = false;
+    return units;
+}
+
+#elif defined(UTF_NEON)
+
+#define PREV_NEON(input, prev, n) vextq_u8((prev), (input), 16 - (n))
+
+static uint8x16_t CheckBlockNeon(uint8x16_t input, uint8x16_t prev)
+{
+    static uint8_t const tables[3][16] = { { BYTE_1_HIGH_TABLE }, { BYTE_1_LOW_TABLE }, { BYTE_2_HIGH_TABLE } };
+    uint8x16_t const nibble = vdupq_n_u8(0x0f);
+
+    uint8x16_t prev1 = PREV_NEON(input, prev, 1);
+    uint8x16_t special = vandq_u8(
+        vandq_u8(
+            vqtbl1q_u8(vld1q_u8(tables[0]), vshrq_n_u8(prev1, 4)),
+            vqtbl1q_u8(vld1q_u8(tables[1]), vandq_u8(prev1, nibble))),
+        vqtbl1q_u8(vld1q_u8(tables[2]), vshrq_n_u8(input, 4)));
+
+    uint8x16_t third = vqsubq_u8(PREV_NEON(input, prev, 2), vdupq_n_u8(0xe0 - 0x80));
+    uint8x16_t fourth = vqsubq_u8(PREV_NEON(input, prev, 3), vdupq_n_u8(0xf0 - 0x80));
+    uint8x16_t must_continue = vandq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0x80));
+    return veorq_u8(must_continue, special);
+}
+
+static size_t CountUnitsNeon(uint8x16_t input)
+{
+    uint8x16_t continuation = vceqq_u8(vandq_u8(input, vdupq_n_u8(0xc0)), vdupq_n_u8(0x80));
+    uint8x16_t four = vcgeq_u8(input, vdupq_n_u8(0xf0));
+    return 16 - vaddvq_u8(vshrq_n_u8(continuation, 7)) + vaddvq_u8(vshrq_n_u8(four, 7));
+}
+
+static size_t Utf8ToUtf16LengthNeon(uint8_t const* s, size_t len, bool* invalid)
+{
+    static uint8_t const limits[16] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf };
+    uint8x16_t const incomplete_limit = vld1q_u8(limits);
+
+    uint8x16_t prev = vdupq_n_u8(0);
+    uint8x16_t error = vdupq_n_u8(0);
+    uint8x16_t incomplete = vdupq_n_u8(0);
+    size_t units = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t input = vld1q_u8(s + i);
+        if (vmaxvq_u8(input) < 0x80)
+        {
+            error = vorrq_u8(error, incomplete);
+            incomplete = vdupq_n_u8(0);
+            units += 16;
+        }
+        else
+        {
+            error = vorrq_u8(error, CheckBlockNeon(input, prev));
+            incomplete = vqsubq_u8(input, incomplete_limit);
+            units += CountUnitsNeon(input);
+        }
+        prev = input;
+    }
+
+    uint8_t tail[16] = { 0 };
+    memcpy(tail, s + i, len - i);
+    uint8x16_t input = vld1q_u8(tail);
+    error = vorrq_u8(error, CheckBlockNeon(input, prev));
+    units += CountUnitsNeon(input) - (16 - (len - i));
+
+    if (vmaxvq_u8(error) != 0)
+        return Utf8ToUtf16LengthScalar(s, len, invalid);
+
+    *invalid = false;
+    return units;
+}
+
+#endif
+
+//
+// Each vector step for runs of characters converts the well-formed
+// characters at the start of a block, and stops before the first one it
+// doesn't handle, which is left to the scalar decoders. The x86 steps
+// only need SSE4.1, but are selected with the AVX2 length function. The steps store whole vectors, so they only run while
+// the rest of the input is long enough for the rest of the output to
+// cover the stores: every three bytes of UTF-8 make at least one unit of
+// UTF-16, and every unit of UTF-16 at least one byte of UTF-8.
+//
+
+#define UTF8_RUN_MIN 48
+#define UTF16_RUN_MIN 32
+
+#if defined(UTF_AVX2) || defined(UTF_NEON)
+
+// The positions of the set bits of each byte, for compacting vectors.
+static uint8_t const compact_table[256][8] =
+{
+    { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, { 1, 0, 0, 0, 0, 0, 0, 0 }, { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 2, 0, 0, 0, 0, 0, 0, 0 }, { 0, 2, 0, 0, 0, 0, 0, 0 }, { 1, 2, 0, 0, 0, 0, 0, 0 }, { 0, 1, 2, 0, 0, 0, 0, 0 },
+    { 3, 0, 0, 0, 0, 0, 0, 0 }, { 0, 3, 0, 0, 0, 0, 0, 0 }, { 1, 3, 0, 0, 0, 0, 0, 0 }, { 0, 1, 3, 0, 0, 0, 0, 0 },
+    { 2, 3, 0, 0, 0, 0, 0, 0 }, { 0, 2, 3, 0, 0, 0, 0, 0 }, { 1, 2, 3, 0, 0, 0, 0, 0 }, { 0, 1, 2, 3, 0, 0, 0, 0 },
+    { 4, 0, 0, 0, 0, 0, 0, 0 }, { 0, 4, 0, 0, 0, 0, 0, 0 }, { 1, 4, 0, 0, 0, 0, 0, 0 }, { 0, 1, 4, 0, 0, 0, 0, 0 },
+    { 2, 4, 0, 0, 0, 0, 0, 0 }, { 0, 2, 4, 0, 0, 0, 0, 0 }, { 1, 2, 4, 0, 0, 0, 0, 0 }, { 0, 1, 2, 4, 0, 0, 0, 0 },
+    { 3, 4, 0, 0, 0, 0, 0, 0 }, { 0, 3, 4, 0, 0, 0, 0, 0 }, { 1, 3, 4, 0, 0, 0, 0, 0 }, { 0, 1, 3, 4, 0, 0, 0, 0 },
+    { 2, 3, 4, 0, 0, 0, 0, 0 }, { 0, 2, 3, 4, 0, 0, 0, 0 }, { 1, 2, 3, 4, 0, 0, 0, 0 }, { 0, 1, 2, 3, 4, 0, 0, 0 },
+    { 5, 0, 0, 0, 0, 0, 0, 0 }, { 0, 5, 0, 0, 0, 0, 0, 0 }, { 1, 5, 0, 0, 0, 0, 0, 0 }, { 0, 1, 5, 0, 0, 0, 0, 0 },
+    { 2, 5, 0, 0, 0, 0, 0, 0 }, { 0, 2, 5, 0, 0, 0, 0, 0 }, { 1, 2, 5, 0, 0, 0, 0, 0 }, { 0, 1, 2, 5, 0, 0, 0, 0 },
+    { 3, 5, 0, 0, 0, 0, 0, 0 }, { 0, 3, 5, 0, 0, 0, 0, 0 }, { 1, 3, 5, 0, 0, 0, 0, 0 }, { 0, 1, 3, 5, 0, 0, 0, 0 },
+    { 2, 3, 5, 0, 0, 0, 0, 0 }, { 0, 2, 3, 5, 0, 0, 0, 0 }, { 1, 2, 3, 5, 0, 0, 0, 0 }, { 0, 1, 2, 3, 5, 0, 0, 0 },
+    { 4, 5, 0, 0, 0, 0, 0, 0 }, { 0, 4, 5, 0, 0, 0, 0, 0 }, { 1, 4, 5, 0, 0, 0, 0, 0 }, { 0, 1, 4, 5, 0, 0, 0, 0 },
+    { 2, 4, 5, 0, 0, 0, 0, 0 }, { 0, 2, 4, 5, 0, 0, 0, 0 }, { 1, 2, 4, 5, 0, 0, 0, 0 }, { 0, 1, 2, 4, 5, 0, 0, 0 },
+    { 3, 4, 5, 0, 0, 0, 0, 0 }, { 0, 3, 4, 5, 0, 0, 0, 0 }, { 1, 3, 4, 5, 0, 0, 0, 0 }, { 0, 1, 3, 4, 5, 0, 0, 0 },
+    { 2, 3, 4, 5, 0, 0, 0, 0 }, { 0, 2, 3, 4, 5, 0, 0, 0 }, { 1, 2, 3, 4, 5, 0, 0, 0 }, { 0, 1, 2, 3, 4, 5, 0, 0 },
+    { 6, 0, 0, 0, 0, 0, 0, 0 }, { 0, 6, 0, 0, 0, 0, 0, 0 }, { 1, 6, 0, 0, 0, 0, 0, 0 }, { 0, 1, 6, 0, 0, 0, 0, 0 },
+    { 2, 6, 0, 0, 0, 0, 0, 0 }, { 0, 2, 6, 0, 0, 0, 0, 0 }, { 1, 2, 6, 0, 0, 0, 0, 0 }, { 0, 1, 2, 6, 0, 0, 0, 0 },
+    { 3, 6, 0, 0, 0, 0, 0, 0 }, { 0, 3, 6, 0, 0, 0, 0, 0 }, { 1, 3, 6, 0, 0, 0, 0, 0 }, { 0, 1, 3, 6, 0, 0, 0, 0 },
+    { 2, 3, 6, 0, 0, 0, 0, 0 }, { 0, 2, 3, 6, 0, 0, 0, 0 }, { 1, 2, 3, 6, 0, 0, 0, 0 }, { 0, 1, 2, 3, 6, 0, 0, 0 },
+    { 4, 6, 0, 0, 0, 0, 0, 0 }, { 0, 4, 6, 0, 0, 0, 0, 0 }, { 1, 4, 6, 0, 0, 0, 0, 0 }, { 0, 1, 4, 6, 0, 0, 0, 0 },
+    { 2, 4, 6, 0, 0, 0, 0, 0 }, { 0, 2, 4, 6, 0, 0, 0, 0 }, { 1, 2, 4, 6, 0, 0, 0, 0 }, { 0, 1, 2, 4, 6, 0, 0, 0 },
+    { 3, 4, 6, 0, 0, 0, 0, 0 }, { 0, 3, 4, 6, 0, 0, 0, 0 }, { 1, 3, 4, 6, 0, 0, 0, 0 }, { 0, 1, 3, 4, 6, 0, 0, 0 },
+    { 2, 3, 4, 6, 0, 0, 0, 0 }, { 0, 2, 3, 4, 6, 0, 0, 0 }, { 1, 2, 3, 4, 6, 0, 0, 0 }, { 0, 1, 2, 3, 4, 6, 0, 0 },
+    { 5, 6, 0, 0, 0, 0, 0, 0 }, { 0, 5, 6, 0, 0, 0, 0, 0 }, { 1, 5, 6, 0, 0, 0, 0, 0 }, { 0, 1, 5, 6, 0, 0, 0, 0 },
+    { 2, 5, 6, 0, 0, 0, 0, 0 }, { 0, 2, 5, 6, 0, 0, 0, 0 }, { 1, 2, 5, 6, 0, 0, 0, 0 }, { 0, 1, 2, 5, 6, 0, 0, 0 },
+    { 3, 5, 6, 0, 0, 0, 0, 0 }, { 0, 3, 5, 6, 0, 0, 0, 0 }, { 1, 3, 5, 6, 0, 0, 0, 0 }, { 0, 1, 3, 5, 6, 0, 0, 0 },
+    { 2, 3, 5, 6, 0, 0, 0, 0 }, { 0, 2, 3, 5, 6, 0, 0, 0 }, { 1, 2, 3, 5, 6, 0, 0, 0 }, { 0, 1, 2, 3, 5, 6, 0, 0 },
+    { 4, 5, 6, 0, 0, 0, 0, 0 }, { 0, 4, 5, 6, 0, 0, 0, 0 }, { 1, 4, 5, 6, 0, 0, 0, 0 }, { 0, 1, 4, 5, 6, 0, 0, 0 },
+    { 2, 4, 5, 6, 0, 0, 0, 0 }, { 0, 2, 4, 5, 6, 0, 0, 0 }, { 1, 2, 4, 5, 6, 0, 0, 0 }, { 0, 1, 2, 4, 5, 6, 0, 0 },
+    { 3, 4, 5, 6, 0, 0, 0, 0 }, { 0, 3, 4, 5, 6, 0, 0, 0 }, { 1, 3, 4, 5, 6, 0, 0, 0 }, { 0, 1, 3, 4, 5, 6, 0, 0 },
+    { 2, 3, 4, 5, 6, 0, 0, 0 }, { 0, 2, 3, 4, 5, 6, 0, 0 }, { 1, 2, 3, 4, 5, 6, 0, 0 }, { 0, 1, 2, 3, 4, 5, 6, 0 },
+    { 7, 0, 0, 0, 0, 0, 0, 0 }, { 0, 7, 0, 0, 0, 0, 0, 0 }, { 1, 7, 0, 0, 0, 0, 0, 0 }, { 0, 1, 7, 0, 0, 0, 0, 0 },
+    { 2, 7, 0, 0, 0, 0, 0, 0 }, { 0, 2, 7, 0, 0, 0, 0, 0 }, { 1, 2, 7, 0, 0, 0, 0, 0 }, { 0, 1, 2, 7, 0, 0, 0, 0 },
+    { 3, 7, 0, 0, 0, 0, 0, 0 }, { 0, 3, 7, 0, 0, 0, 0, 0 }, { 1, 3, 7, 0, 0, 0, 0, 0 }, { 0, 1, 3, 7, 0, 0, 0, 0 },
+    { 2, 3, 7, 0, 0, 0, 0, 0 }, { 0, 2, 3, 7, 0, 0, 0, 0 }, { 1, 2, 3, 7, 0, 0, 0, 0 }, { 0, 1, 2, 3, 7, 0, 0, 0 },
+    { 4, 7, 0, 0, 0, 0, 0, 0 }, { 0, 4, 7, 0, 0, 0, 0, 0 }, { 1, 4, 7, 0, 0, 0, 0, 0 }, { 0, 1, 4, 7, 0, 0, 0, 0 },
+    { 2, 4, 7, 0, 0, 0, 0, 0 }, { 0, 2, 4, 7, 0, 0, 0, 0 }, { 1, 2, 4, 7, 0, 0, 0, 0 }, { 0, 1, 2, 4, 7, 0, 0, 0 },
+    { 3, 4, 7, 0, 0, 0, 0, 0 }, { 0, 3, 4, 7, 0, 0, 0, 0 }, { 1, 3, 4, 7, 0, 0, 0, 0 }, { 0, 1, 3, 4, 7, 0, 0, 0 },
+    { 2, 3, 4, 7, 0, 0, 0, 0 }, { 0, 2, 3, 4, 7, 0, 0, 0 }, { 1, 2, 3, 4, 7, 0, 0, 0 }, { 0, 1, 2, 3, 4, 7, 0, 0 },
+    { 5, 7, 0, 0, 0, 0, 0, 0 }, { 0, 5, 7, 0, 0, 0, 0, 0 }, { 1, 5, 7, 0, 0, 0, 0, 0 }, { 0, 1, 5, 7, 0, 0, 0, 0 },
+    { 2, 5, 7, 0, 0, 0, 0, 0 }, { 0, 2, 5, 7, 0, 0, 0, 0 }, { 1, 2, 5, 7, 0, 0, 0, 0 }, { 0, 1, 2, 5, 7, 0, 0, 0 },
+    { 3, 5, 7, 0, 0, 0, 0, 0 }, { 0, 3, 5, 7, 0, 0, 0, 0 }, { 1, 3, 5, 7, 0, 0, 0, 0 }, { 0, 1, 3, 5, 7, 0, 0, 0 },
+    { 2, 3, 5, 7, 0, 0, 0, 0 }, { 0, 2, 3, 5, 7, 0, 0, 0 }, { 1, 2, 3, 5, 7, 0, 0, 0 }, { 0, 1, 2, 3, 5, 7, 0, 0 },
+    { 4, 5, 7, 0, 0, 0, 0, 0 }, { 0, 4, 5, 7, 0, 0, 0, 0 }, { 1, 4, 5, 7, 0, 0, 0, 0 }, { 0, 1, 4, 5, 7, 0, 0, 0 },
+    { 2, 4, 5, 7, 0, 0, 0, 0 }, { 0, 2, 4, 5, 7, 0, 0, 0 }, { 1, 2, 4, 5, 7, 0, 0, 0 }, { 0, 1, 2, 4, 5, 7, 0, 0 },
+    { 3, 4, 5, 7, 0, 0, 0, 0 }, { 0, 3, 4, 5, 7, 0, 0, 0 }, { 1, 3, 4, 5, 7, 0, 0, 0 }, { 0, 1, 3, 4, 5, 7, 0, 0 },
+    { 2, 3, 4, 5, 7, 0, 0, 0 }, { 0, 2, 3, 4, 5, 7, 0, 0 }, { 1, 2, 3, 4, 5, 7, 0, 0 }, { 0, 1, 2, 3, 4, 5, 7, 0 },
+    { 6, 7, 0, 0, 0, 0, 0, 0 }, { 0, 6, 7, 0, 0, 0, 0, 0 }, { 1, 6, 7, 0, 0, 0, 0, 0 }, { 0, 1, 6, 7, 0, 0, 0, 0 },
+    { 2, 6, 7, 0, 0, 0, 0, 0 }, { 0, 2, 6, 7, 0, 0, 0, 0 }, { 1, 2, 6, 7, 0, 0, 0, 0 }, { 0, 1, 2, 6, 7, 0, 0, 0 },
+    { 3, 6, 7, 0, 0, 0, 0, 0 }, { 0, 3, 6, 7, 0, 0, 0, 0 }, { 1, 3, 6, 7, 0, 0, 0, 0 }, { 0, 1, 3, 6, 7, 0, 0, 0 },
+    { 2, 3, 6, 7, 0, 0, 0, 0 }, { 0, 2, 3, 6, 7, 0, 0, 0 }, { 1, 2, 3, 6, 7, 0, 0, 0 }, { 0, 1, 2, 3, 6, 7, 0, 0 },
+    { 4, 6, 7, 0, 0, 0, 0, 0 }, { 0, 4, 6, 7, 0, 0, 0, 0 }, { 1, 4, 6, 7, 0, 0, 0, 0 }, { 0, 1, 4, 6, 7, 0, 0, 0 },
+    { 2, 4, 6, 7, 0, 0, 0, 0 }, { 0, 2, 4, 6, 7, 0, 0, 0 }, { 1, 2, 4, 6, 7, 0, 0, 0 }, { 0, 1, 2, 4, 6, 7, 0, 0 },
+    { 3, 4, 6, 7, 0, 0, 0, 0 }, { 0, 3, 4, 6, 7, 0, 0, 0 }, { 1, 3, 4, 6, 7, 0, 0, 0 }, { 0, 1, 3, 4, 6, 7, 0, 0 },
+    { 2, 3, 4, 6, 7, 0, 0, 0 }, { 0, 2, 3, 4, 6, 7, 0, 0 }, { 1, 2, 3, 4, 6, 7, 0, 0 }, { 0, 1, 2, 3, 4, 6, 7, 0 },
+    { 5, 6, 7, 0, 0, 0, 0, 0 }, { 0, 5, 6, 7, 0, 0, 0, 0 }, { 1, 5, 6, 7, 0, 0, 0, 0 }, { 0, 1, 5, 6, 7, 0, 0, 0 },
+    { 2, 5, 6, 7, 0, 0, 0, 0 }, { 0, 2, 5, 6, 7, 0, 0, 0 }, { 1, 2, 5, 6, 7, 0, 0, 0 }, { 0, 1, 2, 5, 6, 7, 0, 0 },
+    { 3, 5, 6, 7, 0, 0, 0, 0 }, { 0, 3, 5, 6, 7, 0, 0, 0 }, { 1, 3, 5, 6, 7, 0, 0, 0 }, { 0, 1, 3, 5, 6, 7, 0, 0 },
+    { 2, 3, 5, 6, 7, 0, 0, 0 }, { 0, 2, 3, 5, 6, 7, 0, 0 }, { 1, 2, 3, 5, 6, 7, 0, 0 }, { 0, 1, 2, 3, 5, 6, 7, 0 },
+    { 4, 5, 6, 7, 0, 0, 0, 0 }, { 0, 4, 5, 6, 7, 0, 0, 0 }, { 1, 4, 5, 6, 7, 0, 0, 0 }, { 0, 1, 4, 5, 6, 7, 0, 0 },
+    { 2, 4, 5, 6, 7, 0, 0, 0 }, { 0, 2, 4, 5, 6, 7, 0, 0 }, { 1, 2, 4, 5, 6, 7, 0, 0 }, { 0, 1, 2, 4, 5, 6, 7, 0 },
+    { 3, 4, 5, 6, 7, 0, 0, 0 }, { 0, 3, 4, 5, 6, 7, 0, 0 }, { 1, 3, 4, 5, 6, 7, 0, 0 }, { 0, 1, 3, 4, 5, 6, 7, 0 },
+    { 2, 3, 4, 5, 6, 7, 0, 0 }, { 0, 2, 3, 4, 5, 6, 7, 0 }, { 1, 2, 3, 4, 5, 6, 7, 0 }, { 0, 1, 2, 3, 4, 5, 6, 7 },
+};
+
+#endif
+
+#if defined(UTF_AVX2)
+
+// Store the 16-bit lanes selected by the mask contiguously.
+__attribute__((target("avx2,popcnt")))
+static inline uint16_t* Compact16Avx2(__m128i v, unsigned mask, uint16_t* d)
+{
+    __m128i index = _mm_loadl_epi64((__m128i const*)compact_table[mask]);
+    index = _mm_add_epi8(index, index);
+    __m128i shuffle = _mm_unpacklo_epi8(index, _mm_add_epi8(index, _mm_set1_epi8(1)));
+    _mm_storeu_si128((__m128i*)d, _mm_shuffle_epi8(v, shuffle));
+    return d + __builtin_popcount(mask);
+}
+
+// Store the bytes, of the eight starting at offset, selected by the mask
+// contiguously.
+__attribute__((target("avx2,popcnt")))
+static inline uint8_t* Compact8Avx2(__m128i v, unsigned mask, int offset, uint8_t* d)
+{
+    __m128i index = _mm_add_epi8(_mm_loadl_epi64((__m128i const*)compact_table[mask]), _mm_set1_epi8((char)offset));
+    _mm_storel_epi64((__m128i*)d, _mm_shuffle_epi8(v, index));
+    return d + __builtin_popcount(mask);
+}
+
+// Decode the widened bytes, each lead byte with the byte after it.
+__attribute__((target("avx2,popcnt")))
+static inline __m128i Decode2Avx2(__m128i bytes, __m128i next)
+{
+    __m128i two = _mm_or_si128(
+        _mm_slli_epi16(_mm_and_si128(bytes, _mm_set1_epi16(0x1f)), 6),
+        _mm_and_si128(next, _mm_set1_epi16(0x3f)));
+    return _mm_blendv_epi8(two, bytes, _mm_cmpgt_epi16(_mm_set1_epi16(0x80), bytes));
+}
+
+// Convert the one and two byte characters at the start of 17 bytes.
+// Returns the number of bytes consumed.
+__attribute__((target("avx2,popcnt")))
+static inline size_t Utf8Run2Avx2(uint8_t const* s, uint16_t** d)
+{
+    __m128i v = _mm_loadu_si128((__m128i const*)s);
+    unsigned non_ascii = (unsigned)_mm_movemask_epi8(v);
+    unsigned cont = (unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8((char)0xc0), v));
+    unsigned lead = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpgt_epi8(v, _mm_set1_epi8((char)0xc1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8((char)0xe0), v)));
+
+    // Stop at the first byte that isn't ASCII or a lead byte followed by
+    // a continuation byte, or a continuation byte following a lead byte.
+    unsigned bad = (non_ascii & ~cont & ~lead) | (cont & ~(lead << 1)) | (lead & ~(cont >> 1));
+    unsigned consumed = (unsigned)__builtin_ctz(bad | 0x10000);
+    if (consumed == 0)
+        return 0;
+
+    __m128i const zero = _mm_setzero_si128();
+    __m128i next = _mm_loadu_si128((__m128i const*)(s + 1));
+    unsigned keep = ~cont & ((1u << consumed) - 1);
+    uint16_t* out = *d;
+    out = Compact16Avx2(Decode2Avx2(_mm_unpacklo_epi8(v, zero), _mm_unpacklo_epi8(next, zero)), keep & 0xff, out);
+    out = Compact16Avx2(Decode2Avx2(_mm_unpackhi_epi8(v, zero), _mm_unpackhi_epi8(next, zero)), keep >> 8, out);
+    *d = out;
+    return consumed;
+}
+
+// Decode the characters moved into 32-bit lanes, lead byte highest.
+__attribute__((target("avx2,popcnt")))
+static inline __m128i Decode3Avx2(__m128i lanes)
+{
+    return _mm_or_si128(
+        _mm_or_si128(
+            _mm_and_si128(lanes, _mm_set1_epi32(0x3f)),
+            _mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xfc0))),
+        _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xf000)));
+}
+
+// Convert the three byte characters at the start of 28 bytes. Returns
+// the number of bytes consumed.
+__attribute__((target("avx2,popcnt")))
+static inline size_t Utf8Run3Avx2(uint8_t const* s, uint16_t** d)
+{
+    __m128i const shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    __m128i const shape_mask = _mm_set1_epi32(0x00f0c0c0);
+    __m128i const shape = _mm_set1_epi32(0x00e08080);
+    __m128i const zero = _mm_setzero_si128();
+
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)s), shuffle);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(s + 12)), shuffle);
+    __m128i shaped = _mm_packs_epi32(
+        _mm_cmpeq_epi32(_mm_and_si128(a, shape_mask), shape),
+        _mm_cmpeq_epi32(_mm_and_si128(b, shape_mask), shape));
+    __m128i units = _mm_packus_epi32(Decode3Avx2(a), Decode3Avx2(b));
+
+    // Overlong encodings and surrogates are left to the scalar decoder.
+    __m128i high = _mm_and_si128(units, _mm_set1_epi16((short)0xf800));
+    __m128i bad = _mm_or_si128(
+        _mm_cmpeq_epi16(high, zero),
+        _mm_cmpeq_epi16(high, _mm_set1_epi16((short)0xd800)));
+    unsigned valid = (unsigned)_mm_movemask_epi8(_mm_packs_epi16(_mm_andnot_si128(bad, shaped), zero));
+    unsigned count = (unsigned)__builtin_ctz(~valid);
+    if (count == 0)
+        return 0;
+
+    _mm_storeu_si128((__m128i*)*d, units);
+    *d += count;
+    return 3 * (size_t)count;
+}
+
+// Convert the runs of characters the vector steps handle. Returns the
+// number of bytes consumed, and advances the destination.
+__attribute__((target("avx2,popcnt")))
+static size_t Utf8ToUtf16RunAvx2(uint8_t const* s, size_t len, uint16_t** d)
+{
+    // The destination is kept in a local, so it can stay in a register.
+    uint16_t* out = *d;
+    size_t i = 0;
+    while (i + UTF8_RUN_MIN <= len)
+    {
+        size_t consumed = s[i] < 0xe0 ? Utf8Run2Avx2(s + i, &out) : Utf8Run3Avx2(s + i, &out);
+        if (consumed == 0)
+            break;
+        i += consumed;
+    }
+    *d = out;
+    return i;
+}
+
+// Convert the characters below U+0800 at the start of 8 units. Returns
+// the number of units consumed.
+__attribute__((target("avx2,popcnt")))
+static inline size_t Utf16Run2Avx2(uint16_t const* s, uint8_t** d)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((__m128i const*)s);
+    __m128i small = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xf800)), zero);
+    unsigned count = (unsigned)__builtin_ctz(~(unsigned)_mm_movemask_epi8(small)) / 2;
+    if (count == 0)
+        return 0;
+
+    // Each unit becomes its byte, or its lead byte and continuation byte,
+    // and only the units that aren't ASCII keep their second byte.
+    __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xff80)), zero);
+    __m128i two = _mm_or_si128(
+        _mm_or_si128(_mm_srli_epi16(v, 6), _mm_set1_epi16((short)0x80c0)),
+        _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x3f)), 8));
+    __m128i bytes = _mm_blendv_epi8(two, v, ascii);
+    unsigned keep = ~((unsigned)_mm_movemask_epi8(ascii) & 0xaaaa) & ((1u << (2 * count)) - 1);
+
+    uint8_t* out = *d;
+    out = Compact8Avx2(bytes, keep & 0xff, 0, out);
+    out = Compact8Avx2(bytes, keep >> 8, 8, out);
+    *d = out;
+    return count;
+}
+
+// Convert the characters from U+0800 at the start of 8 units, up to the
+// first surrogate. Returns the number of units consumed.
+__attribute__((target("avx2,popcnt")))
+static inline size_t Utf16Run3Avx2(uint16_t const* s, uint8_t** d)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((__m128i const*)s);
+    __m128i high = _mm_and_si128(v, _mm_set1_epi16((short)0xf800));
+    __m128i stop = _mm_or_si128(
+        _mm_cmpeq_epi16(high, zero),
+        _mm_cmpeq_epi16(high, _mm_set1_epi16((short)0xd800)));
+    unsigned count = (unsigned)__builtin_ctz((unsigned)_mm_movemask_epi8(stop) | 0x10000) / 2;
+    if (count == 0)
+        return 0;
+
+    // The lead byte and first continuation byte of each unit, then the
+    // second continuation byte, are interleaved into 32-bit lanes and
+    // packed.
+    __m128i const pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m128i first = _mm_or_si128(
+        _mm_or_si128(_mm_srli_epi16(v, 12), _mm_set1_epi16((short)0x80e0)),
+        _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(v, 6), _mm_set1_epi16(0x3f)), 8));
+    __m128i last = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi16(0x3f)), _mm_set1_epi16(0x80));
+    _mm_storeu_si128((__m128i*)*d, _mm_shuffle_epi8(_mm_unpacklo_epi16(first, last), pack));
+    _mm_storeu_si128((__m128i*)(*d + 12), _mm_shuffle_epi8(_mm_unpackhi_epi16(first, last), pack));
+    *d += 3 * count;
+    return count;
+}
+
+// Convert the runs of characters the vector steps handle. Returns the
+// number of units consumed, and advances the destination.
+__attribute__((target("avx2,popcnt")))
+static size_t Utf16ToUtf8RunAvx2(uint16_t const* s, size_t len, uint8_t** d)
+{
+    // The destination is kept in a local, so it can stay in a register.
+    uint8_t* out = *d;
+    size_t i = 0;
+    while (i + UTF16_RUN_MIN <= len)
+    {
+        size_t consumed = s[i] < 0x800 ? Utf16Run2Avx2(s + i, &out) : Utf16Run3Avx2(s + i, &out);
+        if (consumed == 0)
+            break;
+        i += consumed;
+    }
+    *d = out;
+    return i;
+}
+
+#elif defined(UTF_NEON)
+
+// The lanes of a comparison as a bit mask.
+static inline unsigned MoveMask8Neon(uint8x16_t m)
+{
+    static uint8_t const bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t selected = vandq_u8(m, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(selected)) | ((unsigned)vaddv_u8(vget_high_u8(selected)) << 8);
+}
+
+static inline unsigned MoveMask16Neon(uint16x8_t m)
+{
+    static uint16_t const bits[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    return vaddvq_u16(vandq_u16(m, vld1q_u16(bits)));
+}
+
+static inline uint16_t* Compact16Neon(uint16x8_t v, unsigned mask, uint16_t* d)
+{
+    uint8x8_t index = vld1_u8(compact_table[mask]);
+    index = vadd_u8(index, index);
+    uint8x8x2_t pairs = vzip_u8(index, vadd_u8(index, vdup_n_u8(1)));
+    uint8x16_t shuffle = vcombine_u8(pairs.val[0], pairs.val[1]);
+    vst1q_u16(d, vreinterpretq_u16_u8(vqtbl1q_u8(vreinterpretq_u8_u16(v), shuffle)));
+    return d + __builtin_popcount(mask);
+}
+
+static inline uint8_t* Compact8Neon(uint8x16_t v, unsigned mask, uint8_t offset, uint8_t* d)
+{
+    uint8x8_t index = vadd_u8(vld1_u8(compact_table[mask]), vdup_n_u8(offset));
+    vst1_u8(d, vqtbl1_u8(v, index));
+    return d + __builtin_popcount(mask);
+}
+
+static inline uint16x8_t Decode2Neon(uint16x8_t bytes, uint16x8_t next)
+{
+    uint16x8_t two = vorrq_u16(
+        vshlq_n_u16(vandq_u16(bytes, vdupq_n_u16(0x1f)), 6),
+        vandq_u16(next, vdupq_n_u16(0x3f)));
+    return vbslq_u16(vcltq_u16(bytes, vdupq_n_u16(0x80)), bytes, two);
+}
+
+static inline size_t Utf8Run2Neon(uint8_t const* s, uint16_t** d)
+{
+    uint8x16_t v = vld1q_u8(s);
+    unsigned non_ascii = MoveMask8Neon(vcgeq_u8(v, vdupq_n_u8(0x80)));
+    unsigned cont = MoveMask8Neon(vceqq_u8(vandq_u8(v, vdupq_n_u8(0xc0)), vdupq_n_u8(0x80)));
+    unsigned lead = MoveMask8Neon(vcltq_u8(vsubq_u8(v, vdupq_n_u8(0xc2)), vdupq_n_u8(0xe0 - 0xc2)));
+
+    unsigned bad = (non_ascii & ~cont & ~lead) | (cont & ~(lead << 1)) | (lead & ~(cont >> 1));
+    unsigned consumed = (unsigned)__builtin_ctz(bad | 0x10000);
+    if (consumed == 0)
+        return 0;
+
+    uint8x16_t next = vld1q_u8(s + 1);
+    unsigned keep = ~cont & ((1u << consumed) - 1);
+    uint16_t* out = *d;
+    out = Compact16Neon(Decode2Neon(vmovl_u8(vget_low_u8(v)), vmovl_u8(vget_low_u8(next))), keep & 0xff, out);
+    out = Compact16Neon(Decode2Neon(vmovl_high_u8(v), vmovl_high_u8(next)), keep >> 8, out);
+    *d = out;
+    return consumed;
+}
+
+static inline size_t Utf8Run3Neon(uint8_t const* s, uint16_t** d)
+{
+    // The lead bytes and the continuation bytes are deinterleaved.
+    uint8x8x3_t bytes = vld3_u8(s);
+    uint8x8_t shaped = vand_u8(
+        vceq_u8(vand_u8(bytes.val[0], vdup_n_u8(0xf0)), vdup_n_u8(0xe0)),
+        vand_u8(
+            vceq_u8(vand_u8(bytes.val[1], vdup_n_u8(0xc0)), vdup_n_u8(0x80)),
+            vceq_u8(vand_u8(bytes.val[2], vdup_n_u8(0xc0)), vdup_n_u8(0x80))));
+    uint16x8_t units = vorrq_u16(
+        vorrq_u16(
+            vshlq_n_u16(vmovl_u8(vand_u8(bytes.val[0], vdup_n_u8(0x0f))), 12),
+            vshlq_n_u16(vmovl_u8(vand_u8(bytes.val[1], vdup_n_u8(0x3f))), 6)),
+        vmovl_u8(vand_u8(bytes.val[2], vdup_n_u8(0x3f))));
+
+    uint16x8_t high = vandq_u16(units, vdupq_n_u16(0xf800));
+    uint16x8_t bad = vorrq_u16(vceqq_u16(high, vdupq_n_u16(0)), vceqq_u16(high, vdupq_n_u16(0xd800)));
+    uint16x8_t valid = vbicq_u16(vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(shaped))), bad);
+    unsigned count = (unsigned)__builtin_ctz(~MoveMask16Neon(valid));
+    if (count == 0)
+        return 0;
+
+    vst1q_u16(*d, units);
+    *d += count;
+    return 3 * (size_t)count;
+}
+
+static size_t Utf8ToUtf16RunNeon(uint8_t const* s, size_t len, uint16_t** d)
+{
+    // The destination is kept in a local, so it can stay in a register.
+    uint16_t* out = *d;
+    size_t i = 0;
+    while (i + UTF8_RUN_MIN <= len)
+    {
+        size_t consumed = s[i] < 0xe0 ? Utf8Run2Neon(s + i, &out) : Utf8Run3Neon(s + i, &out);
+        if (consumed == 0)
+            break;
+        i += consumed;
+    }
+    *d = out;
+    return i;
+}
+
+static inline size_t Utf16Run2Neon(uint16_t const* s, uint8_t** d)
+{
+    uint16x8_t v = vld1q_u16(s);
+    unsigned count = (unsigned)__builtin_ctz(~MoveMask16Neon(vcltq_u16(v, vdupq_n_u16(0x800))));
+    if (count == 0)
+        return 0;
+
+    uint16x8_t ascii = vcltq_u16(v, vdupq_n_u16(0x80));
+    uint16x8_t two = vorrq_u16(
+        vorrq_u16(vshrq_n_u16(v, 6), vdupq_n_u16(0x80c0)),
+        vshlq_n_u16(vandq_u16(v, vdupq_n_u16(0x3f)), 8));
+    uint8x16_t bytes = vreinterpretq_u8_u16(vbslq_u16(ascii, v, two));
+    unsigned keep = ~(MoveMask8Neon(vreinterpretq_u8_u16(ascii)) & 0xaaaa) & ((1u << (2 * count)) - 1);
+
+    uint8_t* out = *d;
+    out = Compact8Neon(bytes, keep & 0xff, 0, out);
+    out = Compact8Neon(bytes, keep >> 8, 8, out);
+    *d = out;
+    return count;
+}
+
+static inline size_t Utf16Run3Neon(uint16_t const* s, uint8_t** d)
+{
+    uint16x8_t v = vld1q_u16(s);
+    uint16x8_t high = vandq_u16(v, vdupq_n_u16(0xf800));
+    uint16x8_t stop = vorrq_u16(vceqq_u16(high, vdupq_n_u16(0)), vceqq_u16(high, vdupq_n_u16(0xd800)));
+    unsigned count = (unsigned)__builtin_ctz(MoveMask16Neon(stop) | 0x100);
+    if (count == 0)
+        return 0;
+
+    // The lead bytes and the continuation bytes are interleaved.
+    uint8x8x3_t bytes;
+    bytes.val[0] = vorr_u8(vmovn_u16(vshrq_n_u16(v, 12)), vdup_n_u8(0xe0));
+    bytes.val[1] = vorr_u8(vand_u8(vmovn_u16(vshrq_n_u16(v, 6)), vdup_n_u8(0x3f)), vdup_n_u8(0x80));
+    bytes.val[2] = vorr_u8(vand_u8(vmovn_u16(v), vdup_n_u8(0x3f)), vdup_n_u8(0x80));
+    vst3_u8(*d, bytes);
+    *d += 3 * count;
+    return count;
+}
+
+static size_t Utf16ToUtf8RunNeon(uint16_t const* s, size_t len, uint8_t** d)
+{
+    // The destination is kept in a local, so it can stay in a register.
+    uint8_t* out = *d;
+    size_t i = 0;
+    while (i + UTF16_RUN_MIN <= len)
+    {
+        size_t consumed = s[i] < 0x800 ? Utf16Run2Neon(s + i, &out) : Utf16Run3Neon(s + i, &out);
+        if (consumed == 0)
+            break;
+        i += consumed;
+    }
+    *d = out;
+    return i;
+}
+
+#endif
+
+#if defined(UTF_NEON)
+    #define UTF8_LENGTH_DEFAULT Utf8ToUtf16LengthNeon
+    #define UTF8_RUN_DEFAULT Utf8ToUtf16RunNeon
+    #define UTF16_RUN_DEFAULT Utf16ToUtf8RunNeon
+#else
+    #define UTF8_LENGTH_DEFAULT Utf8ToUtf16LengthScalar
+    #define UTF8_RUN_DEFAULT NULL
+    #define UTF16_RUN_DEFAULT NULL
+#endif
+
+static size_t (*utf8_length_impl)(uint8_t const*, size_t, bool*) = UTF8_LENGTH_DEFAULT;
+
+// Null when there are no vector steps for runs of characters.
+static size_t (*utf8_run_impl)(uint8_t const*, size_t, uint16_t**) = UTF8_RUN_DEFAULT;
+static size_t (*utf16_run_impl)(uint16_t const*, size_t, uint8_t**) = UTF16_RUN_DEFAULT;
+
+#if defined(UTF_AVX2)
+__attribute__((constructor))
+static void SelectUtfFunctions(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        utf8_length_impl = Utf8ToUtf16LengthAvx2;
+        utf8_run_impl = Utf8ToUtf16RunAvx2;
+        utf16_run_impl = Utf16ToUtf8RunAvx2;
+    }
+}
+#endif
+
+size_t utf8_to_utf16_length(char const* src, size_t len, bool* invalid)
+{
+    bool bad;
+    size_t units = utf8_length_impl((uint8_t const*)src, len, &bad);
+    if (invalid != NULL)
+        *invalid = bad;
+    return units;
+}
+
+size_t utf8_to_utf16(char const* src, size_t len, WCHAR* dst, bool* invalid)
+{
+    uint8_t const* s = (uint8_t const*)src;
+    uint16_t* d = (uint16_t*)dst;
+    bool bad = false;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t ascii = AsciiPrefix8(s + i, len - i);
+        WidenAscii(s + i, ascii, d);
+        d += ascii;
+        i += ascii;
+
+        while (i < len && s[i] >= 0x80)
+        {
+            if (utf8_run_impl != NULL && len - i >= UTF8_RUN_MIN)
+            {
+                size_t run = utf8_run_impl(s + i, len - i, &d);
+                if (run != 0)
+                {
+                    i += run;
+                    continue;
+                }
+            }
+
+            uint32_t cp;
+            size_t consumed = DecodeUtf8Fast(s + i, len - i, &cp);
+            bad |= cp == REPLACEMENT_CHAR && !(consumed == 3 && s[i] == 0xef);
+            i += consumed;
+            if (cp >= 0x10000)
+            {
+                cp -= 0x10000;
+                *d++ = (uint16_t)(0xd800 | (cp >> 10));
+                *d++ = (uint16_t)(0xdc00 | (cp & 0x3ff));
+            }
+            else
+            {
+                *d++ = (uint16_t)cp;
+            }
+        }
+    }
+
+    if (invalid != NULL)
+        *invalid = bad;
+    return (size_t)(d - (uint16_t*)dst);
+}
+
+// Decode one non-ASCII code point. Returns the number of units consumed.
+// An unpaired surrogate decodes to U+FFFD.
+static size_t DecodeUtf16(uint16_t const* s, size_t len, uint32_t* cp)
+{
+    uint16_t unit = s[0];
+    if (unit < 0xd800 || unit > 0xdfff)
+    {
+        *cp = unit;
+        return 1;
+    }
+
+    if (unit <= 0xdbff && len > 1 && s[1] >= 0xdc00 && s[1] <= 0xdfff)
+    {
+        *cp = 0x10000 + (((uint32_t)unit - 0xd800) << 10) + ((uint32_t)s[1] - 0xdc00);
+        return 2;
+    }
+
+    *cp = REPLACEMENT_CHAR;
+    return 1;
+}
+
+// Bytes needed for the well-formed characters at the start of the string,
+// up to the first surrogate. Returns the number of units measured.
+static size_t Utf8BytesNoSurrogates(uint16_t const* s, size_t len, size_t* bytes)
+{
+    size_t i = 0;
+    size_t total = 0;
+#if defined(UTF_SSE2)
+    // Each unit of at least 0x80 adds a byte, and each of at least 0x800
+    // another. The comparisons are made unsigned by flipping the top bit.
+    __m128i const bias = _mm_set1_epi16((short)0x8000);
+    __m128i const two = _mm_set1_epi16((short)(0x80 - 1 - 0x8000));
+    __m128i const three = _mm_set1_epi16((short)(0x800 - 1 - 0x8000));
+    __m128i const surrogate_mask = _mm_set1_epi16((short)0xf800);
+    __m128i const surrogate = _mm_set1_epi16((short)0xd800);
+    __m128i const zero = _mm_setzero_si128();
+    __m128i extra = zero;
+    for (; i + 8 <= len; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const*)(s + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate)) != 0)
+            break;
+
+        // The comparisons are -1 when true. The sums are made in two
+        // 64-bit lanes, so they can't overflow.
+        __m128i biased = _mm_xor_si128(v, bias);
+        __m128i more = _mm_add_epi16(_mm_cmpgt_epi16(biased, two), _mm_cmpgt_epi16(biased, three));
+        extra = _mm_add_epi64(extra, _mm_sad_epu8(_mm_sub_epi16(zero, more), zero));
+    }
+
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i*)sums, extra);
+    total = i + (size_t)(sums[0] + sums[1]);
+#elif defined(UTF_NEON)
+    uint16x8_t const surrogate_mask = vdupq_n_u16(0xf800);
+    uint16x8_t const surrogate = vdupq_n_u16(0xd800);
+    uint16x8_t const two = vdupq_n_u16(0x80);
+    uint16x8_t const three = vdupq_n_u16(0x800);
+    for (; i + 8 <= len; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(s + i);
+        if (vmaxvq_u16(vceqq_u16(vandq_u16(v, surrogate_mask), surrogate)) != 0)
+            break;
+
+        uint16x8_t extra = vaddq_u16(vshrq_n_u16(vcgeq_u16(v, two), 15), vshrq_n_u16(vcgeq_u16(v, three), 15));
+        total += 8 + vaddvq_u16(extra);
+    }
+#endif
+    for (; i < len; ++i)
+    {
+        uint16_t unit = s[i];
+        if (unit >= 0xd800 && unit <= 0xdfff)
+            break;
+        total += unit < 0x80 ? 1 : (unit < 0x800 ? 2 : 3);
+    }
+
+    *bytes = total;
+    return i;
+}
+
+size_t utf16_to_utf8_length(WCHAR const* src, size_t len, bool* invalid)
+{
+    uint16_t const* s = (uint16_t const*)src;
+    size_t bytes = 0;
+    bool bad = false;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t ascii = AsciiPrefix16(s + i, len - i);
+        bytes += ascii;
+        i += ascii;
+
+        size_t measured;
+        i += Utf8BytesNoSurrogates(s + i, len - i, &measured);
+        bytes += measured;
+        if (i == len)
+            break;
+
+        uint32_t cp;
+        size_t consumed = DecodeUtf16(s + i, len - i, &cp);
+        bad |= cp == REPLACEMENT_CHAR;
+        bytes += cp < 0x10000 ? 3 : 4;
+        i += consumed;
+    }
+
+    if (invalid != NULL)
+        *invalid = bad;
+    return bytes;
+}
+
+size_t utf16_to_utf8(WCHAR const* src, size_t len, char* dst, bool* invalid)
+{
+    uint16_t const* s = (uint16_t const*)src;
+    uint8_t* d = (uint8_t*)dst;
+    bool bad = false;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t ascii = AsciiPrefix16(s + i, len - i);
+        NarrowAscii(s + i, ascii, d);
+        d += ascii;
+        i += ascii;
+
+        while (i < len && s[i] >= 0x80)
+        {
+            if (utf16_run_impl != NULL && len - i >= UTF16_RUN_MIN)
+            {
+                size_t run = utf16_run_impl(s + i, len - i, &d);
+                if (run != 0)
+                {
+                    i += run;
+                    continue;
+                }
+            }
+
+            uint32_t cp = s[i];
+            if (cp < 0x800)
+            {
+                *d++ = (uint8_t)(0xc0 | (cp >> 6));
+                *d++ = (uint8_t)(0x80 | (cp & 0x3f));
+                i++;
+                continue;
+            }
+
+            if (cp < 0xd800 || cp > 0xdfff)
+            {
+                i++;
+            }
+            else
+            {
+                size_t consumed = DecodeUtf16(s + i, len - i, &cp);
+                bad |= cp == REPLACEMENT_CHAR;
+                i += consumed;
+            }
+
+            if (cp < 0x10000)
+            {
+                *d++ = (uint8_t)(0xe0 | (cp >> 12));
+            }
+            else
+            {
+                *d++ = (uint8_t)(0xf0 | (cp >> 18));
+                *d++ = (uint8_t)(0x80 | ((cp >> 12) & 0x3f));
+            }
+            *d++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+            *d++ = (uint8_t)(0x80 | (cp & 0x3f));
+        }
+    }
+
+    if (invalid != NULL)
+        *invalid = bad;
+    return (size_t)(d - (uint8_t*)dst);
+}
+
+//
+// UTF-16 and UTF-32 differ only in surrogate pairs and in code points
+// above the BMP, which are rare, so runs without them are widened or
+// narrowed 8 units at a time with SSE2 or NEON.
+//
+
+static bool IsSurrogate(uint32_t unit)
+{
+    return unit >= 0xd800 && unit <= 0xdfff;
+}
+
+// Widen the units before the first surrogate. Returns their number.
+static size_t WidenNoSurrogates(uint16_t const* s, size_t len, uint32_t* d)
+{
+    size_t i = 0;
+#if defined(UTF_SSE2)
+    __m128i const surrogate_mask = _mm_set1_epi16((short)0xf800);
+    __m128i const surrogate = _mm_set1_epi16((short)0xd800);
+    __m128i const zero = _mm_setzero_si128();
+    for (; i + 8 <= len; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const*)(s + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate)) != 0)
+            break;
+
+        _mm_storeu_si128((__m128i*)(d + i), _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128((__m128i*)(d + i + 4), _mm_unpackhi_epi16(v, zero));
+    }
+#elif defined(UTF_NEON)
+    uint16x8_t const surrogate_mask = vdupq_n_u16(0xf800);
+    uint16x8_t const surrogate = vdupq_n_u16(0xd800);
+    for (; i + 8 <= len; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(s + i);
+        if (vmaxvq_u16(vceqq_u16(vandq_u16(v, surrogate_mask), surrogate)) != 0)
+            break;
+
+        vst1q_u32(d + i, vmovl_u16(vget_low_u16(v)));
+        vst1q_u32(d + i + 4, vmovl_high_u16(v));
+    }
+#endif
+    for (; i < len && !IsSurrogate(s[i]); ++i)
+        d[i] = s[i];
+    return i;
+}
+
+// Narrow the values before the first one that isn't a scalar value in
+// the BMP. Returns their number.
+static size_t NarrowBmp(uint32_t const* s, size_t len, uint16_t* d)
+{
+    size_t i = 0;
+#if defined(UTF_SSE2)
+    __m128i const high = _mm_set1_epi32((int)0xffff0000);
+    __m128i const surrogate_mask = _mm_set1_epi32((int)0xfffff800);
+    __m128i const surrogate = _mm_set1_epi32(0xd800);
+    __m128i const bias32 = _mm_set1_epi32(0x8000);
+    __m128i const bias16 = _mm_set1_epi16((short)0x8000);
+    __m128i const zero = _mm_setzero_si128();
+    for (; i + 8 <= len; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((__m128i const*)(s + i));
+        __m128i b = _mm_loadu_si128((__m128i const*)(s + i + 4));
+        __m128i surrogates = _mm_or_si128(
+            _mm_cmpeq_epi32(_mm_and_si128(a, surrogate_mask), surrogate),
+            _mm_cmpeq_epi32(_mm_and_si128(b, surrogate_mask), surrogate));
+        __m128i bmp = _mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(a, b), high), zero);
+        if (_mm_movemask_epi8(surrogates) != 0 || _mm_movemask_epi8(bmp) != 0xffff)
+            break;
+
+        // SSE2 only packs with signed saturation, so the values are
+        // moved into the signed range and back.
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32));
+        _mm_storeu_si128((__m128i*)(d + i), _mm_xor_si128(packed, bias16));
+    }
+#elif defined(UTF_NEON)
+    uint32x4_t const surrogate_mask = vdupq_n_u32(0xfffff800);
+    uint32x4_t const surrogate = vdupq_n_u32(0xd800);
+    for (; i + 8 <= len; i += 8)
+    {
+        uint32x4_t a = vld1q_u32(s + i);
+        uint32x4_t b = vld1q_u32(s + i + 4);
+        uint32x4_t surrogates = vorrq_u32(
+            vceqq_u32(vandq_u32(a, surrogate_mask), surrogate),
+            vceqq_u32(vandq_u32(b, surrogate_mask), surrogate));
+        if (vmaxvq_u32(surrogates) != 0 || vmaxvq_u32(vorrq_u32(a, b)) > 0xffff)
+            break;
+
+        vst1q_u16(d + i, vcombine_u16(vmovn_u32(a), vmovn_u32(b)));
+    }
+#endif
+    for (; i < len && s[i] <= 0xffff && !IsSurrogate(s[i]); ++i)
+        d[i] = (uint16_t)s[i];
+    return i;
+}
+
+size_t utf16_to_utf32(WCHAR const* src, size_t len, UINT32* dst)
+{
+    uint16_t const* s = (uint16_t const*)src;
+    if (dst == NULL)
+    {
+        // Each surrogate pair makes one unit. The loop has no branches,
+        // so the compiler can vectorize it.
+        size_t pairs = 0;
+        for (size_t i = 0; i + 1 < len; ++i)
+            pairs += (s[i] & 0xfc00) == 0xd800 && (s[i + 1] & 0xfc00) == 0xdc00;
+        return len - pairs;
+    }
+
+    uint32_t* d = dst;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t plain = WidenNoSurrogates(s + i, len - i, d);
+        d += plain;
+        i += plain;
+
+        // Decode at least a block's worth, so text with many surrogate
+        // pairs doesn't go back to the vector loop for every pair.
+        size_t end = len - i > 8 ? i + 8 : len;
+        while (i < end)
+        {
+            uint32_t cp = s[i++];
+            if (IsSurrogate(cp))
+            {
+                if (cp <= 0xdbff && i < len && (s[i] & 0xfc00) == 0xdc00)
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + ((uint32_t)s[i++] - 0xdc00);
+                else
+                    cp = REPLACEMENT_CHAR;
+            }
+            *d++ = cp;
+        }
+    }
+
+    return (size_t)(d - dst);
+}
+
+size_t utf32_to_utf16(UINT32 const* src, size_t len, WCHAR* dst)
+{
+    uint32_t const* s = src;
+    if (dst == NULL)
+    {
+        // Each code point above the BMP takes a surrogate pair.
+        size_t pairs = 0;
+        for (size_t i = 0; i < len; ++i)
+            pairs += s[i] - 0x10000u < 0x100000u;
+        return len + pairs;
+    }
+
+    uint16_t* d = (uint16_t*)dst;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t bmp = NarrowBmp(s + i, len - i, d);
+        d += bmp;
+        i += bmp;
+
+        size_t end = len - i > 8 ? i + 8 : len;
+        while (i < end)
+        {
+            uint32_t cp = s[i++];
+            if (cp <= 0xffff && !IsSurrogate(cp))
+            {
+                *d++ = (uint16_t)cp;
+            }
+            else if (cp - 0x10000u < 0x100000u)
+            {
+                cp -= 0x10000;
+                *d++ = (uint16_t)(0xd800 | (cp >> 10));
+                *d++ = (uint16_t)(0xdc00 | (cp & 0x3ff));
+            }
+            else
+            {
+                *d++ = (uint16_t)REPLACEMENT_CHAR;
+            }
+        }
+    }
+
+    return (size_t)(d - (uint16_t*)dst);
+}
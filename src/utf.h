@@ -0,0 +1,49 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#ifndef _SRC_UTF_H_
+#define _SRC_UTF_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <dncp.h>
+
+// Transcoding between UTF-8 and UTF-16 - see utf.c.
+//
+// Ill-formed input is replaced with U+FFFD, one replacement per maximal
+// ill-formed subpart as recommended by the Unicode Standard, and flagged
+// through the optional "invalid" argument. The conversion functions write
+// exactly the number of units returned by the matching length function,
+// and return that number.
+
+size_t utf8_to_utf16_length(char const* src, size_t len, bool* invalid);
+size_t utf8_to_utf16(char const* src, size_t len, WCHAR* dst, bool* invalid);
+
+size_t utf16_to_utf8_length(WCHAR const* src, size_t len, bool* invalid);
+size_t utf16_to_utf8(WCHAR const* src, size_t len, char* dst, bool* invalid);
+
+// Transcoding between UTF-16 and UTF-32. Unpaired surrogates, and UTF-32
+// values that aren't Unicode scalar values, are replaced with U+FFFD. The
+// functions return the number of units written or, if the destination is
+// null, the number that would be.
+
+size_t utf16_to_utf32(WCHAR const* src, size_t len, UINT32* dst);
+size_t utf32_to_utf16(UINT32 const* src, size_t len, WCHAR* dst);
+
+#endif // _SRC_UTF_H_
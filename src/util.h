@@ -17,4 +17,22 @@
 // OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 // SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
\ No newline at end of file
+#ifndef _SRC_UTIL_H_
+#define _SRC_UTIL_H_
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+// Aligned loads read bytes outside a string, but within the same aligned
+// block, which can't fault but which address sanitizers would report.
+#if defined(__SANITIZE_ADDRESS__)
+    #define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer)
+        #define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+    #endif
+#endif
+#ifndef NO_SANITIZE_ADDRESS
+    #define NO_SANITIZE_ADDRESS
+#endif
+
+#endif // _SRC_UTIL_H_
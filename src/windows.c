@@ -25,6 +25,8 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 #include <dncp.h>
 
@@ -33,11 +35,67 @@ LPVOID PAL_CoTaskMemAlloc(SIZE_T a)
     return CoTaskMemAlloc(a);
 }
 
+LPVOID PAL_CoTaskMemRealloc(LPVOID a, SIZE_T b)
+{
+    return CoTaskMemRealloc(a, b);
+}
+
 void PAL_CoTaskMemFree(LPVOID a)
 {
     CoTaskMemFree(a);
 }
 
+HRESULT PAL_CoGetMalloc(DWORD a, struct IMalloc** b)
+{
+    return CoGetMalloc(a, b);
+}
+
+HRESULT PAL_SetAllocator(DNCP_ALLOCATOR const* a)
+{
+    if (a == NULL)
+        return E_POINTER;
+
+    // The COM task allocator can't be replaced.
+    return E_NOTIMPL;
+}
+
+HANDLE PAL_HeapCreate(DWORD a, SIZE_T b, SIZE_T c)
+{
+    return HeapCreate(a, b, c);
+}
+
+LPVOID PAL_HeapAlloc(HANDLE a, DWORD b, SIZE_T c)
+{
+    return HeapAlloc(a, b, c);
+}
+
+BOOL PAL_HeapFree(HANDLE a, DWORD b, LPVOID c)
+{
+    return HeapFree(a, b, c);
+}
+
+BOOL PAL_HeapDestroy(HANDLE a)
+{
+    return HeapDestroy(a);
+}
+
+HRESULT PAL_GetAllocationStats(DNCP_ALLOC_STATS* a)
+{
+    if (a == NULL)
+        return E_POINTER;
+
+    // Statistics aren't collected for the Windows allocators.
+    memset(a, 0, sizeof(*a));
+    return S_FALSE;
+}
+
+HRESULT PAL_WriteAllocationProfile(char const* a)
+{
+    // The Windows allocators aren't profiled.
+    (void)a;
+    return S_FALSE;
+}
+
 size_t PAL_wcslen(WCHAR const* a)
 {
     return wcslen(a);
@@ -48,11 +106,161 @@ int PAL_wcscmp(WCHAR const* a, WCHAR const* b)
     return wcscmp(a, b);
 }
 
+int PAL_wcsncmp(WCHAR const* a, WCHAR const* b, size_t c)
+{
+    return wcsncmp(a, b, c);
+}
+
 WCHAR* PAL_wcsstr(WCHAR const* a, WCHAR const* b)
 {
     return wcsstr(a, b);
 }
 
+WCHAR* PAL_wcschr(WCHAR const* a, WCHAR b)
+{
+    return wcschr(a, b);
+}
+
+WCHAR* PAL_wcsrchr(WCHAR const* a, WCHAR b)
+{
+    return wcsrchr(a, b);
+}
+
+size_t PAL_wcsspn(WCHAR const* a, WCHAR const* b)
+{
+    return wcsspn(a, b);
+}
+
+int PAL__wcsicmp(WCHAR const* a, WCHAR const* b)
+{
+    return _wcsicmp(a, b);
+}
+
+int PAL__wcsnicmp(WCHAR const* a, WCHAR const* b, size_t c)
+{
+    return _wcsnicmp(a, b, c);
+}
+
+int PAL_CompareStringOrdinal(WCHAR const* a, int b, WCHAR const* c, int d, BOOL e)
+{
+    return CompareStringOrdinal(a, b, c, d, e);
+}
+
+int PAL_wcscpy_s(WCHAR* a, size_t b, WCHAR const* c)
+{
+    return wcscpy_s(a, b, c);
+}
+
+int PAL_wcscat_s(WCHAR* a, size_t b, WCHAR const* c)
+{
+    return wcscat_s(a, b, c);
+}
+
+int PAL_wcsncpy_s(WCHAR* a, size_t b, WCHAR const* c, size_t d)
+{
+    return wcsncpy_s(a, b, c, d);
+}
+
+int PAL__wtoi(WCHAR const* a)
+{
+    return _wtoi(a);
+}
+
+LONG PAL_wcstol(WCHAR const* a, WCHAR** b, int c)
+{
+    return wcstol(a, b, c);
+}
+
+ULONG PAL_wcstoul(WCHAR const* a, WCHAR** b, int c)
+{
+    return wcstoul(a, b, c);
+}
+
+double PAL_wcstod(WCHAR const* a, WCHAR** b)
+{
+    return wcstod(a, b);
+}
+
+int PAL__itow_s(int a, WCHAR* b, size_t c, int d)
+{
+    return _itow_s(a, b, c, d);
+}
+
+int PAL__ui64tow_s(UINT64 a, WCHAR* b, size_t c, int d)
+{
+    return _ui64tow_s(a, b, c, d);
+}
+
+DWORD PAL_GetLastError(void)
+{
+    return GetLastError();
+}
+
+void PAL_SetLastError(DWORD a)
+{
+    SetLastError(a);
+}
+
+int PAL_MultiByteToWideChar(UINT a, DWORD b, char const* c, int d, WCHAR* e, int f)
+{
+    return MultiByteToWideChar(a, b, c, d, e, f);
+}
+
+int PAL_WideCharToMultiByte(UINT a, DWORD b, WCHAR const* c, int d, char* e, int f, char const* g, BOOL* h)
+{
+    return WideCharToMultiByte(a, b, c, d, e, f, g, h);
+}
+
+size_t PAL_Utf16ToUtf32(WCHAR const* src, size_t len, UINT32* dst)
+{
+    size_t units = 0;
+    for (size_t i = 0; i < len; ++units)
+    {
+        UINT32 cp = src[i++];
+        if (cp >= 0xd800 && cp <= 0xdfff)
+        {
+            if (cp <= 0xdbff && i < len && src[i] >= 0xdc00 && src[i] <= 0xdfff)
+                cp = 0x10000 + ((cp - 0xd800) << 10) + ((UINT32)src[i++] - 0xdc00);
+            else
+                cp = 0xfffd;
+        }
+
+        if (dst != NULL)
+            dst[units] = cp;
+    }
+
+    return units;
+}
+
+size_t PAL_Utf32ToUtf16(UINT32 const* src, size_t len, WCHAR* dst)
+{
+    size_t units = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        UINT32 cp = src[i];
+        if (cp - 0x10000u < 0x100000u)
+        {
+            cp -= 0x10000;
+            if (dst != NULL)
+            {
+                dst[units] = (WCHAR)(0xd800 | (cp >> 10));
+                dst[units + 1] = (WCHAR)(0xdc00 | (cp & 0x3ff));
+            }
+            units += 2;
+            continue;
+        }
+
+        if (cp > 0xffff || (cp >= 0xd800 && cp <= 0xdfff))
+            cp = 0xfffd;
+
+        if (dst != NULL)
+            dst[units] = (WCHAR)cp;
+        units++;
+    }
+
+    return units;
+}
+
 BSTR PAL_SysAllocString(LPCOLESTR a)
 {
     return SysAllocString(a);
@@ -73,6 +281,187 @@ void PAL_SysFreeString(BSTR a)
     SysFreeString(a);
 }
 
+BSTR PAL_SysAllocStringInterned(LPCOLESTR a)
+{
+    // OLEAUT32 doesn't intern strings.
+    return SysAllocString(a);
+}
+
+HRESULT PAL_SysAllocStringArray(LPCOLESTR const* strs, UINT const* lens, UINT count, BSTR* result)
+{
+    if (result == NULL || (strs == NULL && count != 0))
+        return E_POINTER;
+
+    // OLEAUT32 has no batch allocation.
+    for (UINT i = 0; i < count; ++i)
+    {
+        result[i] = lens != NULL
+            ? SysAllocStringLen(strs[i], lens[i])
+            : SysAllocString(strs[i]);
+
+        if (result[i] == NULL && (lens != NULL || strs[i] != NULL))
+        {
+            PAL_SysFreeStringArray(result, i);
+            memset(result, 0, count * sizeof(result[0]));
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    return S_OK;
+}
+
+void PAL_SysFreeStringArray(BSTR* strs, UINT count)
+{
+    if (strs == NULL)
+        return;
+
+    for (UINT i = 0; i < count; ++i)
+        SysFreeString(strs[i]);
+}
+
+BSTR PAL_SysAllocStringFromUTF8(char const* str, UINT len)
+{
+    if (str == NULL)
+        return NULL;
+
+    if (len == 0)
+        return SysAllocStringLen(NULL, 0);
+
+    if (len > INT_MAX)
+        return NULL;
+
+    int units = MultiByteToWideChar(CP_UTF8, 0, str, (int)len, NULL, 0);
+    if (units == 0)
+        return NULL;
+
+    BSTR bstr = SysAllocStringLen(NULL, (UINT)units);
+    if (bstr == NULL)
+        return NULL;
+
+    (void)MultiByteToWideChar(CP_UTF8, 0, str, (int)len, bstr, units);
+    return bstr;
+}
+
+HRESULT PAL_SysStringToUTF8(BSTR str, char** result, UINT* len)
+{
+    if (result == NULL)
+        return E_POINTER;
+
+    *result = NULL;
+    UINT units = SysStringLen(str);
+    if (units > INT_MAX)
+        return E_OUTOFMEMORY;
+
+    int bytes = units == 0
+        ? 0
+        : WideCharToMultiByte(CP_UTF8, 0, str, (int)units, NULL, 0, NULL, NULL);
+    if (units != 0 && bytes == 0)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    char* utf8 = (char*)CoTaskMemAlloc((SIZE_T)bytes + 1);
+    if (utf8 == NULL)
+        return E_OUTOFMEMORY;
+
+    if (bytes != 0)
+        (void)WideCharToMultiByte(CP_UTF8, 0, str, (int)units, utf8, bytes, NULL, NULL);
+    utf8[bytes] = '\0';
+
+    *result = utf8;
+    if (len != NULL)
+        *len = (UINT)bytes;
+    return S_OK;
+}
+
+INT PAL_SysReAllocString(BSTR* a, LPCOLESTR b)
+{
+    return SysReAllocString(a, b);
+}
+
+INT PAL_SysReAllocStringLen(BSTR* a, LPCOLESTR b, UINT c)
+{
+    return SysReAllocStringLen(a, b, c);
+}
+
+// The builder's buffer is kept as a valid BSTR of its full capacity.
+HRESULT PAL_BstrBuilderReserve(DNCP_BSTR_BUILDER* a, UINT b)
+{
+    if (a == NULL)
+        return E_POINTER;
+
+    UINT const max_len = UINT_MAX / sizeof(OLECHAR) - 1;
+    if (b > max_len - a->Length)
+        return E_OUTOFMEMORY;
+
+    UINT needed = a->Length + b;
+    if (needed <= a->Capacity)
+        return S_OK;
+
+    UINT capacity = a->Capacity < max_len / 2 ? a->Capacity * 2 : max_len;
+    if (capacity < needed)
+        capacity = needed;
+    if (capacity < 16)
+        capacity = 16;
+
+    if (!SysReAllocStringLen(&a->Buffer, NULL, capacity))
+        return E_OUTOFMEMORY;
+
+    a->Capacity = capacity;
+    return S_OK;
+}
+
+HRESULT PAL_BstrBuilderAppend(DNCP_BSTR_BUILDER* a, LPCOLESTR b, UINT c)
+{
+    if (b == NULL && c != 0)
+        return E_POINTER;
+
+    LPOLESTR dest = PAL_BstrBuilderAppendBuffer(a, c);
+    if (dest == NULL)
+        return a == NULL ? E_POINTER : E_OUTOFMEMORY;
+
+    memcpy(dest, b, c * sizeof(b[0]));
+    return S_OK;
+}
+
+LPOLESTR PAL_BstrBuilderAppendBuffer(DNCP_BSTR_BUILDER* a, UINT b)
+{
+    if (FAILED(PAL_BstrBuilderReserve(a, b)))
+        return NULL;
+
+    LPOLESTR dest = a->Buffer + a->Length;
+    a->Length += b;
+    return dest;
+}
+
+BSTR PAL_BstrBuilderDetach(DNCP_BSTR_BUILDER* a)
+{
+    if (a == NULL)
+        return NULL;
+
+    if (a->Buffer == NULL)
+        return SysAllocStringLen(NULL, 0);
+
+    // Sets the length and terminator. If the buffer can't be trimmed
+    // they are written directly.
+    BSTR bstr = a->Buffer;
+    if (!SysReAllocStringLen(&bstr, NULL, a->Length))
+    {
+        ((UINT*)bstr)[-1] = a->Length * sizeof(OLECHAR);
+        bstr[a->Length] = L'\0';
+    }
+
+    memset(a, 0, sizeof(*a));
+    return bstr;
+}
+
+void PAL_BstrBuilderFree(DNCP_BSTR_BUILDER* a)
+{
+    if (a == NULL)
+        return;
+
+    SysFreeString(a->Buffer);
+    memset(a, 0, sizeof(*a));
+}
+
 UINT PAL_SysStringLen(BSTR a)
 {
     return SysStringLen(a);
@@ -0,0 +1,1051 @@
+// Copyright 2022 Aaron R Robinson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is furnished
+// to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+    #include <Windows.h>
+    #include <wtypes.h>
+    #include <malloc.h>
+#endif
+
+#include <dncp.h>
+
+// Usage: dncp_perf [benchmark ...]
+//
+// Runs the named benchmarks, or all of them when none are given.
+
+using perf_clock = std::chrono::steady_clock;
+
+static double elapsed_ns(perf_clock::time_point start)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(perf_clock::now() - start).count();
+}
+
+// Small deterministic generator so every run uses the same inputs.
+struct lcg
+{
+    uint32_t state;
+
+    uint32_t next()
+    {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+};
+
+//
+// CoTaskMem allocator contention
+//
+
+// The allocation path PAL_CoTaskMemAlloc takes by default.
+struct system_allocator
+{
+    static void* alloc(size_t cb)
+    {
+        cb = (cb + 7) & ~(size_t)7;
+#ifdef _MSC_VER
+        return _aligned_malloc(cb, 8);
+#else
+        return aligned_alloc(8, cb);
+#endif
+    }
+
+    static void free(void* p)
+    {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+};
+
+struct dncp_allocator
+{
+    static void* alloc(size_t cb) { return PAL_CoTaskMemAlloc(cb); }
+    static void free(void* p) { PAL_CoTaskMemFree(p); }
+};
+
+static size_t const alloc_ops_per_thread = 200000;
+static size_t const alloc_max_size = 512;
+
+// Each thread keeps a window of live blocks and replaces one per operation.
+template<typename A>
+static void alloc_local_churn(uint32_t seed)
+{
+    void* live[64] = {};
+    lcg rng{ seed };
+    for (size_t i = 0; i < alloc_ops_per_thread; ++i)
+    {
+        size_t slot = i % 64;
+        A::free(live[slot]);
+        live[slot] = A::alloc(1 + rng.next() % alloc_max_size);
+    }
+
+    for (void* p : live)
+        A::free(p);
+}
+
+// Single-producer single-consumer queue used to hand blocks between threads.
+class block_queue
+{
+    static size_t const capacity = 1024;
+    void* _slots[capacity];
+    std::atomic<size_t> _head;
+    std::atomic<size_t> _tail;
+
+public:
+    block_queue() : _slots{}, _head{ 0 }, _tail{ 0 } {}
+
+    void push(void* p)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        while (tail - _head.load(std::memory_order_acquire) == capacity)
+            std::this_thread::yield();
+        _slots[tail % capacity] = p;
+        _tail.store(tail + 1, std::memory_order_release);
+    }
+
+    void* pop()
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        while (head == _tail.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        void* p = _slots[head % capacity];
+        _head.store(head + 1, std::memory_order_release);
+        return p;
+    }
+};
+
+// Blocks are allocated on one thread and released on another, which
+// is the pattern for out-params released by the managed caller.
+template<typename A>
+static void alloc_remote_free(uint32_t seed, block_queue& queue, bool producer)
+{
+    lcg rng{ seed };
+    for (size_t i = 0; i < alloc_ops_per_thread; ++i)
+    {
+        if (producer)
+            queue.push(A::alloc(1 + rng.next() % alloc_max_size));
+        else
+            A::free(queue.pop());
+    }
+}
+
+template<typename A>
+static double run_alloc_workload(size_t thread_count, bool remote)
+{
+    std::vector<block_queue> queues(thread_count / 2 + 1);
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+
+    perf_clock::time_point start = perf_clock::now();
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        uint32_t seed = (uint32_t)i + 1;
+        if (remote)
+        {
+            block_queue& queue = queues[i / 2];
+            bool producer = (i % 2) == 0;
+            threads.emplace_back([seed, &queue, producer]() { alloc_remote_free<A>(seed, queue, producer); });
+        }
+        else
+        {
+            threads.emplace_back([seed]() { alloc_local_churn<A>(seed); });
+        }
+    }
+
+    for (std::thread& t : threads)
+        t.join();
+
+    // Millions of operations per second across all threads.
+    double ns = elapsed_ns(start);
+    return (double)(thread_count * alloc_ops_per_thread) * 1000.0 / ns;
+}
+
+static void perf_cotaskmem()
+{
+    char const* mode = std::getenv("DNCP_COTASKMEM_CACHE");
+    std::printf("CoTaskMem contention (DNCP_COTASKMEM_CACHE=%s, %zu ops per thread)\n", mode != nullptr ? mode : "", alloc_ops_per_thread);
+    std::printf("%8s %-8s %14s %14s %8s\n", "threads", "pattern", "system Mop/s", "dncp Mop/s", "ratio");
+
+    size_t const thread_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    for (bool remote : { false, true })
+    {
+        for (size_t thread_count : thread_counts)
+        {
+            if (remote && thread_count < 2)
+                continue;
+
+            double system = run_alloc_workload<system_allocator>(thread_count, remote);
+            double dncp = run_alloc_workload<dncp_allocator>(thread_count, remote);
+            std::printf("%8zu %-8s %14.2f %14.2f %7.2fx\n",
+                thread_count,
+                remote ? "remote" : "local",
+                system,
+                dncp,
+                dncp / system);
+        }
+    }
+}
+
+//
+// BSTR allocation
+//
+
+static void perf_bstr()
+{
+    char const* nocache = std::getenv("OANOCACHE");
+    std::printf("BSTR alloc/free (OANOCACHE=%s)\n", nocache != nullptr ? nocache : "");
+    std::printf("%8s %12s\n", "length", "ns/op");
+
+    WCHAR text[512];
+    for (WCHAR& c : text)
+        c = W('x');
+
+    size_t const ops = 2000000;
+    for (UINT len : { 4u, 16u, 64u, 256u, 500u })
+    {
+        BSTR live[8] = {};
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+        {
+            size_t slot = i % 8;
+            PAL_SysFreeString(live[slot]);
+            live[slot] = PAL_SysAllocStringLen(text, len);
+        }
+
+        double ns = elapsed_ns(start);
+        for (BSTR b : live)
+            PAL_SysFreeString(b);
+
+        std::printf("%8u %12.2f\n", len, ns / (double)ops);
+    }
+}
+
+//
+// Allocation profiler overhead
+//
+
+// The interval the readme suggests leaving enabled in production.
+static char const profile_interval[] = "4194304";
+
+// Path of this executable, used to rerun it with another configuration.
+static char const* perf_self;
+
+// Processor time rather than wall time, since the difference being
+// measured is small next to the time lost to other processes.
+static double cpu_ns(std::clock_t start)
+{
+    return (double)(std::clock() - start) * 1e9 / (double)CLOCKS_PER_SEC;
+}
+
+// Best processor time in ns/op of a CoTaskMem and a BSTR churn in this process.
+static void profile_measure(double* cotaskmem, double* bstr)
+{
+    WCHAR text[256];
+    for (WCHAR& c : text)
+        c = W('x');
+
+    // Each round is long enough to take many samples, so the best round
+    // isn't simply the one that happened to take the fewest.
+    size_t const ops = 1000000;
+    *cotaskmem = 0;
+    *bstr = 0;
+    for (int round = 0; round < 3; ++round)
+    {
+        void* blocks[64] = {};
+        lcg rng{ 42 };
+        std::clock_t start = std::clock();
+        for (size_t i = 0; i < ops; ++i)
+        {
+            size_t slot = i % 64;
+            PAL_CoTaskMemFree(blocks[slot]);
+            blocks[slot] = PAL_CoTaskMemAlloc(1 + rng.next() % alloc_max_size);
+        }
+
+        double ns = cpu_ns(start) / (double)ops;
+        for (void* p : blocks)
+            PAL_CoTaskMemFree(p);
+
+        if (round == 0 || ns < *cotaskmem)
+            *cotaskmem = ns;
+
+        BSTR strings[8] = {};
+        start = std::clock();
+        for (size_t i = 0; i < ops; ++i)
+        {
+            size_t slot = i % 8;
+            PAL_SysFreeString(strings[slot]);
+            strings[slot] = PAL_SysAllocStringLen(text, 1 + rng.next() % 255);
+        }
+
+        ns = cpu_ns(start) / (double)ops;
+        for (BSTR b : strings)
+            PAL_SysFreeString(b);
+
+        if (round == 0 || ns < *bstr)
+            *bstr = ns;
+    }
+}
+
+#ifndef _MSC_VER
+// Starts the measurement in a new process, since the profiler settings
+// are read once on first use.
+static FILE* profile_start_child(char const* interval)
+{
+    std::string command = "DNCP_PERF_PROFILE_CHILD=1 DNCP_ALLOC_PROFILE_INTERVAL=";
+    command += interval;
+    command += " '";
+    command += perf_self;
+    command += "' profile";
+
+    return popen(command.c_str(), "r");
+}
+
+static bool profile_finish_child(FILE* child, double* cotaskmem, double* bstr)
+{
+    int read = std::fscanf(child, "%lf %lf", cotaskmem, bstr);
+    return 0 == pclose(child) && read == 2;
+}
+#endif
+
+static void perf_profile()
+{
+    double cotaskmem;
+    double bstr;
+    if (std::getenv("DNCP_PERF_PROFILE_CHILD") != nullptr)
+    {
+        profile_measure(&cotaskmem, &bstr);
+        std::printf("%f %f\n", cotaskmem, bstr);
+        return;
+    }
+
+    std::printf("Allocation profiler overhead (DNCP_ALLOC_PROFILE_INTERVAL=%s)\n", profile_interval);
+#ifdef _MSC_VER
+    std::printf("Not supported\n");
+#else
+    // Zero padded to the same length, so both children start with the
+    // same environment size and stack layout.
+    std::string const off(std::strlen(profile_interval), '0');
+
+    // The two configurations run side by side, so changes in the speed
+    // of the machine affect both alike. Each process has its own address
+    // space layout, which changes its speed too, hence the many rounds.
+    double best[2][2] = {};
+    for (int round = 0; round < 40; ++round)
+    {
+        // Whichever starts first has the processor to itself for a while,
+        // so they take turns.
+        FILE* children[2];
+        int first = round % 2;
+        children[first] = profile_start_child(first ? profile_interval : off.c_str());
+        children[1 - first] = profile_start_child(first ? off.c_str() : profile_interval);
+        for (int on = 0; on < 2; ++on)
+        {
+            if (children[on] == nullptr || !profile_finish_child(children[on], &cotaskmem, &bstr))
+            {
+                if (on == 0 && children[1] != nullptr)
+                    (void)pclose(children[1]);
+
+                std::printf("Failed to run %s\n", perf_self);
+                return;
+            }
+
+            if (round == 0 || cotaskmem < best[on][0])
+                best[on][0] = cotaskmem;
+            if (round == 0 || bstr < best[on][1])
+                best[on][1] = bstr;
+        }
+    }
+
+    std::printf("%-10s %12s %12s %9s\n", "workload", "off ns/op", "on ns/op", "overhead");
+    char const* names[] = { "cotaskmem", "bstr" };
+    for (int i = 0; i < 2; ++i)
+    {
+        std::printf("%-10s %12.2f %12.2f %8.2f%%\n",
+            names[i],
+            best[0][i],
+            best[1][i],
+            (best[1][i] / best[0][i] - 1.0) * 100.0);
+    }
+#endif
+}
+
+//
+// String functions
+//
+
+// Keeps the compiler from optimizing away a result.
+static void consume(size_t value)
+{
+    static std::atomic<size_t> sink;
+    sink.store(value, std::memory_order_relaxed);
+}
+
+static size_t reference_wcslen(WCHAR const* str)
+{
+    WCHAR const volatile* p = str;
+    size_t len = 0;
+    while (p[len] != W('\0'))
+        len++;
+    return len;
+}
+
+// Iterations for a string of the given length, so every length runs
+// for a similar time.
+static size_t string_ops(size_t len)
+{
+    size_t ops = ((size_t)64 << 20) / (len + 16);
+    return ops < 100 ? 100 : ops;
+}
+
+static void perf_wcslen()
+{
+    std::printf("wcslen\n");
+    std::printf("%10s %14s %14s %8s\n", "length", "scalar ns", "dncp ns", "ratio");
+
+    size_t const max_len = (size_t)1 << 20;
+    std::vector<WCHAR> text(max_len + 1, W('x'));
+    for (size_t len : { (size_t)0, (size_t)1, (size_t)7, (size_t)16, (size_t)64, (size_t)256, (size_t)1024, (size_t)16 * 1024, (size_t)256 * 1024, max_len })
+    {
+        // The string is at the end of the buffer.
+        WCHAR const* str = text.data() + max_len - len;
+        size_t ops = string_ops(len);
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume(reference_wcslen(str));
+        double scalar = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume(PAL_wcslen(str));
+        double dncp = elapsed_ns(start) / (double)ops;
+
+        std::printf("%10zu %14.2f %14.2f %7.2fx\n", len, scalar, dncp, scalar / dncp);
+    }
+}
+
+static int reference_wcscmp(WCHAR const* str1, WCHAR const* str2)
+{
+    WCHAR const volatile* a = str1;
+    WCHAR const volatile* b = str2;
+    size_t i = 0;
+    while (a[i] == b[i] && a[i] != W('\0'))
+        i++;
+    return (a[i] > b[i]) - (a[i] < b[i]);
+}
+
+static void perf_wcscmp()
+{
+    std::printf("wcscmp of equal strings\n");
+    std::printf("%10s %14s %14s %8s\n", "length", "scalar ns", "dncp ns", "ratio");
+
+    size_t const max_len = (size_t)64 * 1024;
+    std::vector<WCHAR> text1(max_len + 1, W('x'));
+    std::vector<WCHAR> text2(max_len + 2, W('x'));
+    for (size_t len : { (size_t)4, (size_t)16, (size_t)32, (size_t)64, (size_t)256, (size_t)4096, max_len })
+    {
+        // The second string is misaligned relative to the first.
+        WCHAR* str1 = text1.data();
+        WCHAR* str2 = text2.data() + 1;
+        str1[len] = W('\0');
+        str2[len] = W('\0');
+        size_t ops = string_ops(len);
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)reference_wcscmp(str1, str2));
+        double scalar = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)PAL_wcscmp(str1, str2));
+        double dncp = elapsed_ns(start) / (double)ops;
+
+        str1[len] = W('x');
+        str2[len] = W('x');
+
+        std::printf("%10zu %14.2f %14.2f %7.2fx\n", len, scalar, dncp, scalar / dncp);
+    }
+}
+
+static int reference_wcsicmp(WCHAR const* str1, WCHAR const* str2)
+{
+    WCHAR const volatile* a = str1;
+    WCHAR const volatile* b = str2;
+    for (size_t i = 0;; ++i)
+    {
+        WCHAR x = a[i];
+        WCHAR y = b[i];
+        x = (x >= W('A') && x <= W('Z')) ? (WCHAR)(x + 0x20) : x;
+        y = (y >= W('A') && y <= W('Z')) ? (WCHAR)(y + 0x20) : y;
+        if (x != y || x == W('\0'))
+            return (x > y) - (x < y);
+    }
+}
+
+static void perf_wcsicmp()
+{
+    std::printf("_wcsicmp of equal ASCII strings in different case\n");
+    std::printf("%10s %14s %14s %8s\n", "length", "scalar ns", "dncp ns", "ratio");
+
+    size_t const max_len = (size_t)64 * 1024;
+    std::vector<WCHAR> text1(max_len + 1);
+    std::vector<WCHAR> text2(max_len + 1);
+    for (size_t i = 0; i < max_len; ++i)
+    {
+        text1[i] = (WCHAR)(W('a') + i % 26);
+        text2[i] = (WCHAR)(W('A') + i % 26);
+    }
+    for (size_t len : { (size_t)4, (size_t)16, (size_t)32, (size_t)64, (size_t)256, (size_t)4096, max_len })
+    {
+        WCHAR* str1 = text1.data();
+        WCHAR* str2 = text2.data();
+        WCHAR saved1 = str1[len];
+        WCHAR saved2 = str2[len];
+        str1[len] = W('\0');
+        str2[len] = W('\0');
+        size_t ops = string_ops(len);
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)reference_wcsicmp(str1, str2));
+        double scalar = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)PAL__wcsicmp(str1, str2));
+        double dncp = elapsed_ns(start) / (double)ops;
+
+        str1[len] = saved1;
+        str2[len] = saved2;
+
+        std::printf("%10zu %14.2f %14.2f %7.2fx\n", len, scalar, dncp, scalar / dncp);
+    }
+}
+
+static WCHAR const* reference_wcschr(WCHAR const* str, WCHAR c)
+{
+    WCHAR const volatile* s = str;
+    for (; *s != c; ++s)
+    {
+        if (*s == W('\0'))
+            return NULL;
+    }
+    return (WCHAR const*)s;
+}
+
+static void perf_wcschr()
+{
+    std::printf("wcschr and wcsrchr of an absent character\n");
+    std::printf("%10s %14s %14s %8s %14s %8s\n", "length", "scalar ns", "wcschr ns", "ratio", "wcsrchr ns", "ratio");
+
+    size_t const max_len = (size_t)64 * 1024;
+    std::vector<WCHAR> text(max_len + 1, W('x'));
+    for (size_t len : { (size_t)4, (size_t)16, (size_t)64, (size_t)256, (size_t)4096, max_len })
+    {
+        WCHAR* str = text.data();
+        str[len] = W('\0');
+        size_t ops = string_ops(len);
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)reference_wcschr(str, W('y')));
+        double scalar = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)PAL_wcschr(str, W('y')));
+        double chr = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)PAL_wcsrchr(str, W('y')));
+        double rchr = elapsed_ns(start) / (double)ops;
+
+        str[len] = W('x');
+
+        std::printf("%10zu %14.2f %14.2f %7.2fx %14.2f %7.2fx\n", len, scalar, chr, scalar / chr, rchr, scalar / rchr);
+    }
+}
+
+static WCHAR const* reference_wcsstr(WCHAR const* str, WCHAR const* find)
+{
+    WCHAR const volatile* s = str;
+    for (; *s != W('\0'); ++s)
+    {
+        size_t i = 0;
+        while (find[i] != W('\0') && s[i] == find[i])
+            i++;
+        if (find[i] == W('\0'))
+            return (WCHAR const*)s;
+    }
+    return find[0] == W('\0') ? str : NULL;
+}
+
+static void perf_wcsstr()
+{
+    std::printf("wcsstr without a match in a 64K haystack\n");
+    std::printf("%-10s %8s %14s %14s %8s\n", "haystack", "needle", "naive ns", "dncp ns", "ratio");
+
+    size_t const hay_len = (size_t)64 * 1024;
+    std::vector<WCHAR> repeated(hay_len + 1, W('a'));
+    repeated[hay_len] = W('\0');
+    std::vector<WCHAR> text(hay_len + 1);
+    for (size_t i = 0; i < hay_len; ++i)
+        text[i] = (WCHAR)(W('a') + (i * 7 + i / 26) % 26);
+    text[hay_len] = W('\0');
+
+    for (size_t len : { (size_t)4, (size_t)16, (size_t)64, (size_t)1024 })
+    {
+        // "aa...ab" nearly matches at every position of "aaaa...".
+        std::vector<WCHAR> needle(len + 1, W('a'));
+        needle[len - 1] = W('b');
+        needle[len] = W('\0');
+
+        struct { char const* name; WCHAR const* hay; } const cases[] =
+        {
+            { "repeated", repeated.data() },
+            { "text", text.data() },
+        };
+        for (auto const& c : cases)
+        {
+            size_t ops = ((size_t)256 << 20) / (hay_len * len);
+            ops = ops < 4 ? 4 : ops;
+
+            perf_clock::time_point start = perf_clock::now();
+            for (size_t i = 0; i < ops; ++i)
+                consume((size_t)reference_wcsstr(c.hay, needle.data()));
+            double naive = elapsed_ns(start) / (double)ops;
+
+            start = perf_clock::now();
+            for (size_t i = 0; i < ops; ++i)
+                consume((size_t)PAL_wcsstr(c.hay, needle.data()));
+            double dncp = elapsed_ns(start) / (double)ops;
+
+            std::printf("%-10s %8zu %14.0f %14.0f %7.2fx\n", c.name, len, naive, dncp, naive / dncp);
+        }
+    }
+}
+
+static void perf_utf8()
+{
+    std::printf("UTF-8 conversion of 64K characters\n");
+    std::printf("%-10s %14s %14s\n", "text", "to UTF-16", "to UTF-8");
+
+    // Repeated samples of ASCII, Latin, Cyrillic and CJK text.
+    struct { char const* name; char const* sample; } const texts[] =
+    {
+        { "ascii", "The quick brown fox jumps over the lazy dog. " },
+        { "latin", "Les na\xc3\xaf" "ves \xc3\xa9l\xc3\xa8" "ves pr\xc3\xa9" "f\xc3\xa8rent le caf\xc3\xa9. " },
+        { "cyrillic", "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xd0\xbc\xd0\xb8\xd1\x80 " },
+        { "cjk", "\xe4\xbd\xa0\xe5\xa5\xbd\xe4\xb8\x96\xe7\x95\x8c\xe3\x80\x82" },
+    };
+
+    size_t const chars = (size_t)64 * 1024;
+    for (auto const& t : texts)
+    {
+        std::vector<char> utf8;
+        size_t const sample_len = std::strlen(t.sample);
+        while (utf8.size() < chars)
+            utf8.insert(utf8.end(), t.sample, t.sample + sample_len);
+
+        int utf8_len = (int)utf8.size();
+        int utf16_len = PAL_MultiByteToWideChar(CP_UTF8, 0, utf8.data(), utf8_len, nullptr, 0);
+        std::vector<WCHAR> utf16((size_t)utf16_len);
+        std::vector<char> back((size_t)utf8_len);
+        size_t ops = ((size_t)256 << 20) / (size_t)utf8_len;
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)PAL_MultiByteToWideChar(CP_UTF8, 0, utf8.data(), utf8_len, utf16.data(), utf16_len));
+        double widen = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume((size_t)PAL_WideCharToMultiByte(CP_UTF8, 0, utf16.data(), utf16_len, back.data(), utf8_len, nullptr, nullptr));
+        double narrow = elapsed_ns(start) / (double)ops;
+
+        // Bytes of UTF-8 per nanosecond.
+        std::printf("%-10s %9.2f GB/s %9.2f GB/s\n", t.name, utf8_len / widen, utf8_len / narrow);
+    }
+}
+
+// The widening loop callers write by hand.
+static size_t reference_utf16_to_utf32(WCHAR const* src, size_t len, UINT32* dst)
+{
+    size_t units = 0;
+    for (size_t i = 0; i < len; ++units)
+    {
+        UINT32 cp = src[i++];
+        if (cp >= 0xd800 && cp <= 0xdbff && i < len && src[i] >= 0xdc00 && src[i] <= 0xdfff)
+            cp = 0x10000 + ((cp - 0xd800) << 10) + ((UINT32)src[i++] - 0xdc00);
+        else if (cp >= 0xd800 && cp <= 0xdfff)
+            cp = 0xfffd;
+        dst[units] = cp;
+    }
+    return units;
+}
+
+static void perf_utf32()
+{
+    std::printf("UTF-16 to UTF-32 and back, 64K units\n");
+    std::printf("%-10s %14s %14s %14s\n", "text", "scalar", "to UTF-32", "to UTF-16");
+
+    struct { char const* name; WCHAR const* sample; } const texts[] =
+    {
+        { "ascii", W("The quick brown fox jumps over the lazy dog. ") },
+        { "cjk", W("\u4f60\u597d\u4e16\u754c\u3002") },
+        { "emoji", W("ok \U0001F600 \U0001F44D ") },
+    };
+
+    size_t const units = (size_t)64 * 1024;
+    for (auto const& t : texts)
+    {
+        std::vector<WCHAR> utf16;
+        size_t const sample_len = PAL_wcslen(t.sample);
+        while (utf16.size() < units)
+            utf16.insert(utf16.end(), t.sample, t.sample + sample_len);
+
+        std::vector<UINT32> utf32(utf16.size());
+        std::vector<WCHAR> back(utf16.size());
+        size_t const utf32_len = PAL_Utf16ToUtf32(utf16.data(), utf16.size(), nullptr);
+        size_t const bytes = utf16.size() * sizeof(WCHAR);
+        size_t ops = ((size_t)256 << 20) / bytes;
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume(reference_utf16_to_utf32(utf16.data(), utf16.size(), utf32.data()));
+        double scalar = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume(PAL_Utf16ToUtf32(utf16.data(), utf16.size(), utf32.data()));
+        double widen = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+            consume(PAL_Utf32ToUtf16(utf32.data(), utf32_len, back.data()));
+        double narrow = elapsed_ns(start) / (double)ops;
+
+        // Bytes of UTF-16 per nanosecond.
+        std::printf("%-10s %9.2f GB/s %9.2f GB/s %9.2f GB/s\n", t.name, bytes / scalar, bytes / widen, bytes / narrow);
+    }
+
+#ifndef _MSC_VER
+    // A short string passed to a C library function.
+    WCHAR const number[] = W("12345.678");
+    size_t ops = (size_t)1 << 22;
+
+    perf_clock::time_point start = perf_clock::now();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        std::vector<wchar_t> copy(PAL_wcslen(number) + 1);
+        (void)reference_utf16_to_utf32(number, copy.size() - 1, reinterpret_cast<UINT32*>(copy.data()));
+        consume((size_t)copy[0]);
+    }
+    double heap = elapsed_ns(start) / (double)ops;
+
+    start = perf_clock::now();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        dncp::wchar_string<> copy{ number };
+        consume((size_t)copy.c_str()[0]);
+    }
+    double stack = elapsed_ns(start) / (double)ops;
+
+    std::printf("short string copy: heap %.2f ns, wchar_string %.2f ns\n", heap, stack);
+#endif
+}
+
+static void perf_matcher()
+{
+    std::printf("Find every occurrence of a set of words in a 64K document\n");
+    std::printf("%-8s %14s %14s %8s %14s\n", "words", "wcsstr ns", "matcher ns", "ratio", "ignore case ns");
+
+    uint32_t seed = 7;
+    auto next = [&](uint32_t bound)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) % bound;
+    };
+
+    std::vector<std::vector<WCHAR>> vocabulary(4096);
+    for (auto& word : vocabulary)
+    {
+        word.resize(4 + next(8));
+        for (WCHAR& c : word)
+            c = (WCHAR)(W('a') + next(26));
+        word.push_back(W('\0'));
+    }
+
+    size_t const doc_len = (size_t)64 * 1024;
+    std::vector<WCHAR> doc;
+    while (doc.size() < doc_len)
+    {
+        auto const& word = vocabulary[next((uint32_t)vocabulary.size())];
+        doc.insert(doc.end(), word.begin(), word.end() - 1);
+        doc.push_back(W(' '));
+    }
+    doc.resize(doc_len);
+    doc.push_back(W('\0'));
+
+    for (size_t count : { (size_t)4, (size_t)32, (size_t)256 })
+    {
+        std::vector<LPCOLESTR> words;
+        for (size_t i = 0; i < count; ++i)
+            words.push_back(vocabulary[i * 13].data());
+
+        DNCP_MATCHER* exact;
+        DNCP_MATCHER* ignore_case;
+        if (S_OK != PAL_MatcherCreate(words.data(), nullptr, (UINT)count, 0, &exact)
+            || S_OK != PAL_MatcherCreate(words.data(), nullptr, (UINT)count, DNCP_MATCHER_IGNORE_CASE, &ignore_case))
+        {
+            std::printf("PAL_MatcherCreate failed\n");
+            return;
+        }
+
+        auto count_matches = [](void* context, DNCP_MATCH const*) -> BOOL
+        {
+            ++*(size_t*)context;
+            return TRUE;
+        };
+
+        size_t ops = ((size_t)64 << 20) / (doc_len * count);
+        ops = ops < 4 ? 4 : ops;
+
+        perf_clock::time_point start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+        {
+            size_t found = 0;
+            for (LPCOLESTR word : words)
+            {
+                for (WCHAR const* at = PAL_wcsstr(doc.data(), word); at != nullptr; at = PAL_wcsstr(at + 1, word))
+                    found++;
+            }
+            consume(found);
+        }
+        double loop = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+        {
+            size_t found = 0;
+            (void)PAL_MatcherSearch(exact, doc.data(), doc_len, count_matches, &found);
+            consume(found);
+        }
+        double matcher = elapsed_ns(start) / (double)ops;
+
+        start = perf_clock::now();
+        for (size_t i = 0; i < ops; ++i)
+        {
+            size_t found = 0;
+            (void)PAL_MatcherSearch(ignore_case, doc.data(), doc_len, count_matches, &found);
+            consume(found);
+        }
+        double folded = elapsed_ns(start) / (double)ops;
+
+        std::printf("%-8zu %14.0f %14.0f %7.2fx %14.0f\n", count, loop, matcher, loop / matcher, folded);
+
+        PAL_MatcherFree(exact);
+        PAL_MatcherFree(ignore_case);
+    }
+}
+
+// What callers did before: narrow the ASCII string and call the C library.
+static size_t reference_narrow(WCHAR const* str, char* buffer, size_t size)
+{
+    size_t i = 0;
+    for (; str[i] != W('\0') && i + 1 < size; ++i)
+        buffer[i] = (char)str[i];
+    buffer[i] = '\0';
+    return i;
+}
+
+static void perf_numbers()
+{
+    std::printf("Parse and format numbers, ns per number\n");
+    std::printf("%-22s %12s %12s %8s\n", "", "libc ns", "dncp ns", "ratio");
+
+    size_t const count = 4096;
+    uint64_t seed = 3;
+    auto next = [&]()
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return seed >> 11 ^ seed << 53;
+    };
+
+    std::vector<std::vector<WCHAR>> ints;
+    std::vector<std::vector<WCHAR>> doubles;
+    std::vector<uint64_t> values;
+    char str[64];
+    for (size_t i = 0; i < count; ++i)
+    {
+        (void)std::snprintf(str, sizeof(str), "%u", (unsigned)(next() >> 32));
+        ints.emplace_back(str, str + std::strlen(str) + 1);
+
+        double d = (double)(next() >> 11) / (double)(1ull << 53) * 1e6;
+        (void)std::snprintf(str, sizeof(str), next() % 2 ? "%.17g" : "%.6f", d);
+        doubles.emplace_back(str, str + std::strlen(str) + 1);
+
+        values.push_back(next() >> (next() % 64));
+    }
+
+    size_t const rounds = 200;
+    auto report = [](char const* name, double libc, double dncp)
+    {
+        std::printf("%-22s %12.1f %12.1f %7.2fx\n", name, libc, dncp, libc / dncp);
+    };
+
+    perf_clock::time_point start = perf_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (auto const& s : ints)
+        {
+            (void)reference_narrow(s.data(), str, sizeof(str));
+            consume((size_t)std::strtoul(str, nullptr, 10));
+        }
+    }
+    double libc = elapsed_ns(start) / (double)(rounds * count);
+
+    start = perf_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (auto const& s : ints)
+            consume((size_t)PAL_wcstoul(s.data(), nullptr, 10));
+    }
+    report("wcstoul", libc, elapsed_ns(start) / (double)(rounds * count));
+
+    start = perf_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (auto const& s : doubles)
+        {
+            (void)reference_narrow(s.data(), str, sizeof(str));
+            double d = std::strtod(str, nullptr);
+            consume((size_t)d);
+        }
+    }
+    libc = elapsed_ns(start) / (double)(rounds * count);
+
+    start = perf_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (auto const& s : doubles)
+        {
+            double d = PAL_wcstod(s.data(), nullptr);
+            consume((size_t)d);
+        }
+    }
+    report("wcstod", libc, elapsed_ns(start) / (double)(rounds * count));
+
+    WCHAR buffer[72];
+    start = perf_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (uint64_t v : values)
+        {
+            int len = std::snprintf(str, sizeof(str), "%llu", (unsigned long long)v);
+            for (int i = 0; i <= len; ++i)
+                buffer[i] = (WCHAR)str[i];
+            consume((size_t)buffer[0]);
+        }
+    }
+    libc = elapsed_ns(start) / (double)(rounds * count);
+
+    start = perf_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (uint64_t v : values)
+        {
+            (void)PAL__ui64tow_s(v, buffer, 72, 10);
+            consume((size_t)buffer[0]);
+        }
+    }
+    report("_ui64tow_s", libc, elapsed_ns(start) / (double)(rounds * count));
+}
+
+struct benchmark
+{
+    char const* name;
+    void (*run)();
+};
+
+static benchmark const benchmarks[] =
+{
+    { "cotaskmem", perf_cotaskmem },
+    { "bstr", perf_bstr },
+    { "profile", perf_profile },
+    { "wcslen", perf_wcslen },
+    { "wcscmp", perf_wcscmp },
+    { "wcsicmp", perf_wcsicmp },
+    { "wcschr", perf_wcschr },
+    { "wcsstr", perf_wcsstr },
+    { "utf8", perf_utf8 },
+    { "utf32", perf_utf32 },
+    { "matcher", perf_matcher },
+    { "numbers", perf_numbers },
+};
+
+int main(int argc, char** argv)
+{
+    perf_self = argv[0];
+
+#ifndef _MSC_VER
+    // Benchmark the thread-caching allocator unless told otherwise.
+    setenv("DNCP_COTASKMEM_CACHE", "1", 0);
+#endif
+
+    int ran = 0;
+    for (benchmark const& b : benchmarks)
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc && !selected; ++i)
+            selected = 0 == std::strcmp(argv[i], b.name);
+
+        if (!selected)
+            continue;
+
+        b.run();
+        std::printf("\n");
+        ran++;
+    }
+
+    if (ran == 0)
+    {
+        std::fprintf(stderr, "No benchmark matched. Available:\n");
+        for (benchmark const& b : benchmarks)
+            std::fprintf(stderr, "  %s\n", b.name);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -18,13 +18,31 @@
 // SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <cwchar>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #ifdef _MSC_VER
     #include <Windows.h>
     #include <wtypes.h>
+    #include <malloc.h>
+#elif defined(__APPLE__)
+    #include <malloc/malloc.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#else
+    #include <malloc.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
 #endif
 
 #include <dncp.h>
@@ -67,127 +85,2305 @@ constexpr size_t string_length(char const (&)[N])
     return N - 1; // -1 for null
 }
 
+// Reads a numeric setting the way the library does.
+static unsigned long long read_env_number(char const* name, unsigned long long default_value)
+{
+    char const* value = std::getenv(name);
+    if (value == nullptr || value[0] == '\0')
+        return default_value;
+
+    return std::strtoull(value, nullptr, 0);
+}
+
 void test_memory()
 {
-    LPVOID p;
+    LPVOID p;
+#ifdef __GLIBC__
+    if (read_env_number("DNCP_COTASKMEM_LARGE_THRESHOLD", 0) != 0)
+    {
+        // Large blocks released with free(), whose addresses glibc may then
+        // hand out for chunks of a new thread's arena. Those are not large
+        // blocks, so resizing one mustn't unmap any of the arena. This runs
+        // before any other thread exits, so the worker gets a new arena.
+        std::vector<uintptr_t> released;
+        for (int i = 0; i < 100; ++i)
+        {
+            p = PAL_CoTaskMemAlloc(1536 * 1024);
+            TEST_ASSERT(p != nullptr);
+            released.push_back((uintptr_t)p);
+        }
+        for (uintptr_t b : released)
+            std::free((void*)b);
+        std::sort(released.begin(), released.end());
+
+        std::thread worker{ [&]()
+            {
+                // Page sized chunks, placed like large blocks in their pages.
+                size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+                size_t const offset = (uintptr_t)released[0] & (page - 1);
+                std::vector<uint8_t*> chunks;
+                int reused = 0;
+                for (size_t i = 0; i < 16384 && reused < 8; ++i)
+                {
+                    uint8_t* b = (uint8_t*)std::malloc(page - sizeof(size_t));
+                    TEST_ASSERT(b != nullptr);
+                    // The end of the chunk doubles as the next chunk's prev_size.
+                    std::memset(b, 0, page - sizeof(size_t));
+                    b[0] = 0x5a;
+                    if (std::binary_search(released.begin(), released.end(), (uintptr_t)b))
+                    {
+                        reused++;
+                        b = (uint8_t*)PAL_CoTaskMemRealloc(b, 2 * page);
+                        TEST_ASSERT(b != nullptr && b[0] == 0x5a);
+                        PAL_CoTaskMemFree(b);
+                        continue;
+                    }
+                    chunks.push_back(b);
+
+                    // Pad so the next chunk starts at the same offset in its page.
+                    size_t misplaced = ((uintptr_t)b + page - offset) & (page - 1);
+                    if (misplaced != 0)
+                    {
+                        size_t pad = page - misplaced;
+                        chunks.push_back((uint8_t*)std::malloc(pad < 4 * sizeof(size_t) ? pad + page - sizeof(size_t) : pad - sizeof(size_t)));
+                    }
+                }
+
+                // glibc reads the neighbours of the chunks it frees.
+                for (uint8_t* b : chunks)
+                    std::free(b);
+            } };
+        worker.join();
+    }
+#endif
+    {
+        p = PAL_CoTaskMemAlloc(0);
+        TEST_ASSERT(p != nullptr);
+        PAL_CoTaskMemFree(p);
+    }
+    {
+        p = PAL_CoTaskMemAlloc(1);
+        TEST_ASSERT(p != nullptr);
+        PAL_CoTaskMemFree(p);
+    }
+    {
+        p = PAL_CoTaskMemAlloc(12);
+        TEST_ASSERT(p != nullptr);
+        PAL_CoTaskMemFree(p);
+    }
+    {
+        // Check overflow, let OS handle other out of memory values.
+        SIZE_T will_overflow = ~((SIZE_T)0) - 6;
+        p = PAL_CoTaskMemAlloc(will_overflow);
+        TEST_ASSERT(p == nullptr);
+    }
+    {
+        // Exercise a range of sizes across the size classes.
+        std::vector<LPVOID> blocks;
+        bool all_aligned = true;
+        for (SIZE_T cb = 0; cb <= 4096; cb += 7)
+        {
+            p = PAL_CoTaskMemAlloc(cb);
+            all_aligned &= p != nullptr && ((uintptr_t)p % 8) == 0;
+            if (p != nullptr)
+                std::memset(p, 0xcc, cb);
+            blocks.push_back(p);
+        }
+        TEST_ASSERT(all_aligned);
+
+        // Large blocks.
+        for (SIZE_T cb : { (SIZE_T)1024 * 1024, (SIZE_T)3 * 1024 * 1024 + 5 })
+        {
+            p = PAL_CoTaskMemAlloc(cb);
+            TEST_ASSERT(p != nullptr && ((uintptr_t)p % 8) == 0);
+            if (p != nullptr)
+                std::memset(p, 0xcc, cb);
+            blocks.push_back(p);
+        }
+
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+#ifndef _MSC_VER
+            // .NET's Marshal.FreeCoTaskMem calls free() directly on non-Windows.
+            if (i % 2 == 0)
+            {
+                std::free(blocks[i]);
+                continue;
+            }
+#endif
+            PAL_CoTaskMemFree(blocks[i]);
+        }
+    }
+    {
+        // Blocks allocated on one thread and released on another.
+        std::vector<LPVOID> blocks(1024);
+        std::thread producer{ [&]()
+            {
+                for (LPVOID& b : blocks)
+                    b = PAL_CoTaskMemAlloc(48);
+            } };
+        producer.join();
+
+        bool all_allocated = true;
+        for (LPVOID b : blocks)
+        {
+            all_allocated &= b != nullptr;
+            PAL_CoTaskMemFree(b);
+        }
+        TEST_ASSERT(all_allocated);
+
+        // Reuse the released blocks on a fresh thread.
+        std::thread consumer{ [&]()
+            {
+                for (LPVOID& b : blocks)
+                    b = PAL_CoTaskMemAlloc(40);
+                for (LPVOID b : blocks)
+                    PAL_CoTaskMemFree(b);
+            } };
+        consumer.join();
+    }
+    {
+        // PAL_CoTaskMemRealloc
+        p = PAL_CoTaskMemRealloc(nullptr, 16);
+        TEST_ASSERT(p != nullptr);
+
+        // Grow through a range of sizes and confirm the contents are kept.
+        SIZE_T const sizes[] = { 16, 17, 64, 4096, 100000, 8 * 1024 * 1024, 32 * 1024 * 1024 };
+        SIZE_T prev = 0;
+        bool all_valid = true;
+        for (SIZE_T cb : sizes)
+        {
+            LPVOID n = PAL_CoTaskMemRealloc(p, cb);
+            all_valid &= n != nullptr && ((uintptr_t)n % 8) == 0;
+            if (n == nullptr)
+                break;
+            p = n;
+
+            for (SIZE_T i = 0; i < prev; ++i)
+                all_valid &= ((uint8_t*)p)[i] == (uint8_t)i;
+            for (SIZE_T i = prev; i < cb; ++i)
+                ((uint8_t*)p)[i] = (uint8_t)i;
+            prev = cb;
+        }
+        TEST_ASSERT(all_valid);
+
+        // Shrink and confirm the prefix is kept.
+        p = PAL_CoTaskMemRealloc(p, 1000);
+        TEST_ASSERT(p != nullptr);
+        bool prefix_kept = true;
+        for (SIZE_T i = 0; i < 1000; ++i)
+            prefix_kept &= ((uint8_t*)p)[i] == (uint8_t)i;
+        TEST_ASSERT(prefix_kept);
+
+        // Overflow fails and leaves the block intact.
+        SIZE_T will_overflow = ~((SIZE_T)0) - 6;
+        TEST_ASSERT(PAL_CoTaskMemRealloc(p, will_overflow) == nullptr);
+        TEST_ASSERT(((uint8_t*)p)[999] == (uint8_t)999);
+
+        // A size of zero frees the block.
+        TEST_ASSERT(PAL_CoTaskMemRealloc(p, 0) == nullptr);
+    }
+    {
+        dncp::cotaskmem_ptr<void> smart_ptr1{ nullptr };
+        dncp::cotaskmem_ptr<int> smart_ptr2{ (int*)PAL_CoTaskMemAlloc(16) };
+    }
+}
+
+void test_heap()
+{
+    HANDLE heap;
+    LPVOID p;
+    {
+        heap = PAL_HeapCreate(0, 0, 0);
+        TEST_ASSERT(heap != nullptr);
+
+        // Allocate well past the initial chunk.
+        bool all_valid = true;
+        std::vector<uint8_t*> blocks;
+        for (SIZE_T i = 0; i < 10000; ++i)
+        {
+            SIZE_T cb = i % 300;
+            uint8_t* b = (uint8_t*)PAL_HeapAlloc(heap, 0, cb);
+            all_valid &= b != nullptr && ((uintptr_t)b % sizeof(void*)) == 0;
+            if (b == nullptr)
+                break;
+            std::memset(b, (int)(i & 0xff), cb);
+            blocks.push_back(b);
+        }
+        TEST_ASSERT(all_valid);
+
+        // Blocks don't overlap.
+        bool all_intact = true;
+        for (SIZE_T i = 0; i < blocks.size(); ++i)
+        {
+            SIZE_T cb = i % 300;
+            for (SIZE_T j = 0; j < cb; ++j)
+                all_intact &= blocks[i][j] == (uint8_t)(i & 0xff);
+        }
+        TEST_ASSERT(all_intact);
+
+        // Requests larger than a chunk.
+        p = PAL_HeapAlloc(heap, HEAP_ZERO_MEMORY, 1024 * 1024);
+        TEST_ASSERT(p != nullptr && ((uint8_t*)p)[1024 * 1024 - 1] == 0);
+        TEST_ASSERT(PAL_HeapFree(heap, 0, p));
+        TEST_ASSERT(PAL_HeapFree(heap, 0, nullptr));
+
+        TEST_ASSERT(PAL_HeapDestroy(heap));
+    }
+    {
+        heap = PAL_HeapCreate(HEAP_NO_SERIALIZE, 4096, 0);
+        TEST_ASSERT(heap != nullptr);
+
+        p = PAL_HeapAlloc(heap, HEAP_ZERO_MEMORY, 100);
+        TEST_ASSERT(p != nullptr && ((uint8_t*)p)[0] == 0 && ((uint8_t*)p)[99] == 0);
+        TEST_ASSERT(PAL_HeapAlloc(heap, 0, 0) != nullptr);
+
+        TEST_ASSERT(PAL_HeapDestroy(heap));
+    }
+#ifndef _MSC_VER
+    {
+        // There are no structured exceptions to generate.
+        TEST_ASSERT(PAL_HeapCreate(HEAP_GENERATE_EXCEPTIONS, 0, 0) == nullptr);
+
+        heap = PAL_HeapCreate(0, 0, 0);
+        TEST_ASSERT(heap != nullptr);
+        TEST_ASSERT(PAL_HeapAlloc(heap, HEAP_GENERATE_EXCEPTIONS, 16) == nullptr);
+        TEST_ASSERT(PAL_HeapDestroy(heap));
+    }
+#endif
+    {
+        // A heap with a maximum size doesn't grow.
+        heap = PAL_HeapCreate(0, 0, 64 * 1024);
+        TEST_ASSERT(heap != nullptr);
+
+        SIZE_T total = 0;
+        while (PAL_HeapAlloc(heap, 0, 1024) != nullptr && total <= 64 * 1024)
+            total += 1024;
+        TEST_ASSERT(total <= 64 * 1024);
+
+        TEST_ASSERT(PAL_HeapDestroy(heap));
+    }
+    {
+        // A serialized heap shared between threads.
+        heap = PAL_HeapCreate(0, 0, 0);
+        TEST_ASSERT(heap != nullptr);
+
+        std::vector<std::thread> threads;
+        std::vector<char> results(4);
+        for (size_t t = 0; t < results.size(); ++t)
+        {
+            threads.emplace_back([heap, t, &results]()
+                {
+                    bool valid = true;
+                    for (int i = 0; i < 10000; ++i)
+                    {
+                        uint8_t* b = (uint8_t*)PAL_HeapAlloc(heap, 0, 24);
+                        valid &= b != nullptr;
+                        if (b != nullptr)
+                            std::memset(b, (int)t, 24);
+                    }
+                    results[t] = valid ? 1 : 0;
+                });
+        }
+
+        bool all_valid = true;
+        for (size_t t = 0; t < threads.size(); ++t)
+        {
+            threads[t].join();
+            all_valid &= results[t] != 0;
+        }
+        TEST_ASSERT(all_valid);
+
+        TEST_ASSERT(PAL_HeapDestroy(heap));
+    }
+}
+
+void test_alloc_stats()
+{
+    DNCP_ALLOC_STATS before;
+    DNCP_ALLOC_STATS after;
+    TEST_ASSERT(PAL_GetAllocationStats(nullptr) == E_POINTER);
+
+    HRESULT hr = PAL_GetAllocationStats(&before);
+    TEST_ASSERT(hr == S_OK || hr == S_FALSE);
+#ifndef _WIN32
+    if (read_env_number("DNCP_ALLOC_STATS", 0) != 0)
+        TEST_ASSERT(hr == S_OK);
+#endif
+    if (hr == S_FALSE)
+    {
+        // Statistics aren't being collected, so everything is zeroed.
+        DNCP_ALLOC_STATS zero;
+        std::memset(&zero, 0, sizeof(zero));
+        TEST_ASSERT(std::memcmp(&before, &zero, sizeof(zero)) == 0);
+        return;
+    }
+
+    LPVOID blocks[10];
+    for (LPVOID& b : blocks)
+        b = PAL_CoTaskMemAlloc(100);
+    BSTR bstr = PAL_SysAllocString(W("statistics"));
+
+    TEST_ASSERT(PAL_GetAllocationStats(&after) == S_OK);
+    TEST_ASSERT(after.CoTaskMem.AllocCount - before.CoTaskMem.AllocCount == 11);
+    TEST_ASSERT(after.Bstr.AllocCount - before.Bstr.AllocCount == 1);
+    TEST_ASSERT(after.CoTaskMem.LiveBytes - before.CoTaskMem.LiveBytes >= 10 * 100);
+    TEST_ASSERT(after.CoTaskMem.SizeHistogram[3] - before.CoTaskMem.SizeHistogram[3] == 10);
+
+    for (LPVOID b : blocks)
+        PAL_CoTaskMemFree(b);
+    PAL_SysFreeString(bstr);
+
+    // Counters from an exited thread are kept.
+    std::thread worker{ []() { PAL_CoTaskMemFree(PAL_CoTaskMemAlloc(1)); } };
+    worker.join();
+
+    TEST_ASSERT(PAL_GetAllocationStats(&after) == S_OK);
+    TEST_ASSERT(after.CoTaskMem.FreeCount - before.CoTaskMem.FreeCount == 12);
+    TEST_ASSERT(after.Bstr.FreeCount - before.Bstr.FreeCount == 1);
+    TEST_ASSERT(after.CoTaskMem.LiveBytes == before.CoTaskMem.LiveBytes);
+    TEST_ASSERT(after.Bstr.LiveBytes == before.Bstr.LiveBytes);
+}
+
+// Returns the live bytes reported in the header of a heap profile.
+static long long read_profile_live_bytes(char const* path)
+{
+    FILE* file = std::fopen(path, "r");
+    if (file == nullptr)
+        return -1;
+
+    long long count;
+    long long bytes;
+    if (2 != std::fscanf(file, "heap profile: %lld: %lld", &count, &bytes))
+        bytes = -1;
+
+    std::fclose(file);
+    return bytes;
+}
+
+void test_alloc_profile()
+{
+    char const* path = "dncp_test_profile.heap";
+    HRESULT hr = PAL_WriteAllocationProfile(path);
+    if (hr != S_OK)
+    {
+        // The heap isn't being profiled.
+        TEST_ASSERT(hr == S_FALSE);
+        return;
+    }
+
+    long long before = read_profile_live_bytes(path);
+    TEST_ASSERT(before >= 0);
+
+    // Large blocks are all but certain to be sampled.
+    size_t const size = 1024 * 1024;
+    LPVOID blocks[4];
+    for (LPVOID& b : blocks)
+        b = PAL_CoTaskMemAlloc(size);
+
+    TEST_ASSERT(PAL_WriteAllocationProfile(path) == S_OK);
+    long long live = read_profile_live_bytes(path);
+    TEST_ASSERT(live - before >= (long long)(4 * size));
+
+    blocks[0] = PAL_CoTaskMemRealloc(blocks[0], 2 * size);
+    TEST_ASSERT(PAL_WriteAllocationProfile(path) == S_OK);
+    TEST_ASSERT(read_profile_live_bytes(path) - live >= (long long)size);
+
+    for (LPVOID b : blocks)
+        PAL_CoTaskMemFree(b);
+
+    TEST_ASSERT(PAL_WriteAllocationProfile(path) == S_OK);
+    TEST_ASSERT(read_profile_live_bytes(path) == before);
+
+    // Small blocks churned through the caches leave no samples behind.
+    // Blocks released with free() earlier leave stale samples, which are
+    // only dropped when their address is sampled again, so the live total
+    // can shrink but never grow.
+    for (int round = 0; round < 4; ++round)
+    {
+        LPVOID small[16];
+        BSTR strings[16];
+        for (size_t i = 0; i < 16; ++i)
+        {
+            small[i] = PAL_CoTaskMemAlloc(1 + i * 8);
+            strings[i] = PAL_SysAllocStringLen(nullptr, (UINT)(1 + i * 4));
+        }
+
+        for (size_t i = 0; i < 16; ++i)
+        {
+            PAL_CoTaskMemFree(small[i]);
+            PAL_SysFreeString(strings[i]);
+        }
+    }
+
+    TEST_ASSERT(PAL_WriteAllocationProfile(path) == S_OK);
+    TEST_ASSERT(read_profile_live_bytes(path) <= before);
+    std::remove(path);
+}
+
+// Backend installed when DNCP_TEST_ALLOCATOR is set.
+static std::atomic<size_t> test_backend_calls{ 0 };
+
+static LPVOID TestBackendAlloc(SIZE_T cb)
+{
+    test_backend_calls++;
+    return std::malloc(cb);
+}
+
+static LPVOID TestBackendRealloc(LPVOID pv, SIZE_T cb)
+{
+    test_backend_calls++;
+    return std::realloc(pv, cb);
+}
+
+static void TestBackendFree(LPVOID pv)
+{
+    test_backend_calls++;
+    std::free(pv);
+}
+
+static SIZE_T TestBackendGetSize(LPVOID pv)
+{
+#ifdef _MSC_VER
+    return _msize(pv);
+#elif defined(__APPLE__)
+    return malloc_size(pv);
+#else
+    return malloc_usable_size(pv);
+#endif
+}
+
+static DNCP_ALLOCATOR const test_backend =
+{
+    TestBackendAlloc,
+    TestBackendRealloc,
+    TestBackendFree,
+    TestBackendGetSize,
+};
+
+static bool install_test_backend()
+{
+    char const* value = std::getenv("DNCP_TEST_ALLOCATOR");
+    if (value == nullptr || value[0] == '\0')
+        return false;
+
+    return PAL_SetAllocator(&test_backend) == S_OK;
+}
+
+void test_imalloc(bool test_backend_installed)
+{
+    IMalloc* m;
+    {
+        TEST_ASSERT(PAL_CoGetMalloc(MEMCTX_SHARED, &m) == E_INVALIDARG);
+        TEST_ASSERT(PAL_CoGetMalloc(MEMCTX_TASK, &m) == S_OK && m != nullptr);
+    }
+    {
+        IMalloc* m2;
+        TEST_ASSERT(PAL_CoGetMalloc(MEMCTX_TASK, &m2) == S_OK && m == m2);
+        m2->Release();
+    }
+    {
+        void* p;
+        TEST_ASSERT(m->QueryInterface(__uuidof(IMalloc), &p) == S_OK && p == m);
+        m->Release();
+        TEST_ASSERT(m->QueryInterface(__uuidof(IUnknown), &p) == S_OK && p != nullptr);
+        ((IUnknown*)p)->Release();
+        TEST_ASSERT(m->QueryInterface(__uuidof(IClassFactory), &p) == E_NOINTERFACE && p == nullptr);
+    }
+    {
+        void* p = m->Alloc(10);
+        TEST_ASSERT(p != nullptr);
+        TEST_ASSERT(m->GetSize(p) >= 10);
+        std::memset(p, 0xcc, 10);
+
+        p = m->Realloc(p, 4000);
+        TEST_ASSERT(p != nullptr);
+        TEST_ASSERT(m->GetSize(p) >= 4000);
+        TEST_ASSERT(((uint8_t*)p)[9] == 0xcc);
+        m->Free(p);
+    }
+    {
+        // IMalloc and the CoTaskMem functions share blocks.
+        void* p = PAL_CoTaskMemAlloc(100);
+        TEST_ASSERT(m->GetSize(p) >= 100);
+        m->Free(p);
+
+        p = m->Alloc(100);
+        TEST_ASSERT(p != nullptr);
+        PAL_CoTaskMemFree(p);
+    }
+    {
+        TEST_ASSERT(m->GetSize(nullptr) == (SIZE_T)-1);
+        TEST_ASSERT(m->DidAlloc(nullptr) == -1);
+        m->Free(nullptr);
+        m->HeapMinimize();
+    }
+    m->Release();
+
+    {
+        TEST_ASSERT(PAL_SetAllocator(nullptr) == E_POINTER);
+
+        // Memory has already been allocated.
+        HRESULT hr = PAL_SetAllocator(&test_backend);
+#ifdef _MSC_VER
+        TEST_ASSERT(hr == E_NOTIMPL);
+#else
+        TEST_ASSERT(hr == E_NOT_VALID_STATE);
+#endif
+    }
+    if (test_backend_installed)
+    {
+        size_t calls = test_backend_calls;
+        // Large enough to bypass the BSTR cache.
+        BSTR str = PAL_SysAllocStringLen(nullptr, 4096);
+        TEST_ASSERT(str != nullptr);
+        PAL_SysFreeString(str);
+        TEST_ASSERT(test_backend_calls == calls + 2);
+    }
+}
+
+// A page of memory followed by an inaccessible one, so reading past
+// the end of a string placed at its tail faults.
+class guarded_page
+{
+    char* _base;
+    size_t _size;
+
+public:
+    guarded_page()
+    {
+#ifdef _MSC_VER
+        SYSTEM_INFO info;
+        ::GetSystemInfo(&info);
+        _size = info.dwPageSize;
+        _base = (char*)::VirtualAlloc(nullptr, 2 * _size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        DWORD old;
+        (void)::VirtualProtect(_base + _size, _size, PAGE_NOACCESS, &old);
+#else
+        _size = (size_t)::sysconf(_SC_PAGESIZE);
+        _base = (char*)::mmap(nullptr, 2 * _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        (void)::mprotect(_base + _size, _size, PROT_NONE);
+#endif
+    }
+
+    guarded_page(guarded_page const&) = delete;
+    guarded_page& operator=(guarded_page const&) = delete;
+
+    ~guarded_page()
+    {
+#ifdef _MSC_VER
+        (void)::VirtualFree(_base, 0, MEM_RELEASE);
+#else
+        (void)::munmap(_base, 2 * _size);
+#endif
+    }
+
+    // Space for count WCHARs ending at the inaccessible page.
+    WCHAR* tail(size_t count) { return (WCHAR*)(_base + _size) - count; }
+};
+
+// Fill a buffer with a non-repeating string and terminate it.
+static WCHAR* fill_string(WCHAR* str, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        str[i] = (WCHAR)(W('a') + i % 26);
+    str[len] = W('\0');
+    return str;
+}
+
+void test_strings()
+{
+    // PAL_wcslen
+    {
+        WCHAR const len_0[] = W("");
+        WCHAR const len_1[] = W("1");
+        WCHAR const len_2[] = W("12");
+        WCHAR const len_9[] = W("123456789");
+        WCHAR const embedded_null[] = { W('1'), W('2'), W('\0'), W('4'), W('\0') };
+
+        TEST_ASSERT(PAL_wcslen(len_0) == string_length(len_0));
+        TEST_ASSERT(PAL_wcslen(len_1) == string_length(len_1));
+        TEST_ASSERT(PAL_wcslen(len_2) == string_length(len_2));
+        TEST_ASSERT(PAL_wcslen(len_9) == string_length(len_9));
+        TEST_ASSERT(PAL_wcslen(embedded_null) == 2 && string_length(embedded_null) == 4);
+    }
+    {
+        // Every start alignment and length around the vector widths.
+        WCHAR buffer[160];
+        bool match = true;
+        for (size_t start = 0; start < 32; ++start)
+        {
+            for (size_t len = 0; len < 100; ++len)
+                match &= PAL_wcslen(fill_string(buffer + start, len)) == len;
+        }
+        TEST_ASSERT(match);
+
+        // Strings ending at a page boundary.
+        guarded_page page;
+        match = true;
+        for (size_t len = 0; len < 100; ++len)
+            match &= PAL_wcslen(fill_string(page.tail(len + 1), len)) == len;
+        TEST_ASSERT(match);
+    }
+
+    // PAL_wcscmp
+    {
+        TEST_ASSERT(PAL_wcscmp(W(""), W("")) == 0);
+
+        WCHAR const aStr1[] = W("a");
+        WCHAR const aStr2[] = W("a");
+        WCHAR const AStr[] = W("A");
+        WCHAR const ZStr[] = W("Z");
+        TEST_ASSERT(PAL_wcscmp(aStr1, aStr2) == 0);
+        TEST_ASSERT(PAL_wcscmp(W(""), aStr1) == -1);
+        TEST_ASSERT(PAL_wcscmp(aStr1, W("")) == 1);
+        TEST_ASSERT(PAL_wcscmp(AStr, aStr1) == -1);
+        TEST_ASSERT(PAL_wcscmp(aStr1, AStr) == 1);
+        TEST_ASSERT(PAL_wcscmp(AStr, ZStr) == -1);
+        TEST_ASSERT(PAL_wcscmp(ZStr, AStr) == 1);
+
+        WCHAR const mixedStr1[] = W("aMqU");
+        WCHAR const mixedStr2[] = W("aMqu");
+        WCHAR const mixedStr3[] = W("aMq");
+        TEST_ASSERT(PAL_wcscmp(mixedStr1, mixedStr2) == -1);
+        TEST_ASSERT(PAL_wcscmp(mixedStr2, mixedStr1) == 1);
+        TEST_ASSERT(PAL_wcscmp(mixedStr3, mixedStr1) == -1);
+        TEST_ASSERT(PAL_wcscmp(mixedStr1, mixedStr3) == 1);
+
+        // Code units compare as unsigned values.
+        WCHAR const high[] = { (WCHAR)0xffff, W('\0') };
+        TEST_ASSERT(PAL_wcscmp(high, W("a")) == 1);
+        TEST_ASSERT(PAL_wcscmp(W("a"), high) == -1);
+    }
+    {
+        // A difference or terminator at every position and alignment.
+        WCHAR buffer1[160];
+        WCHAR buffer2[160];
+        bool match = true;
+        for (size_t start = 0; start < 16; ++start)
+        {
+            for (size_t len = 0; len < 70; ++len)
+            {
+                WCHAR* str1 = fill_string(buffer1 + start, len);
+                WCHAR* str2 = fill_string(buffer2 + (start * 7) % 16, len);
+                match &= PAL_wcscmp(str1, str2) == 0;
+                if (len == 0)
+                    continue;
+
+                str2[len - 1] = W('~');
+                match &= PAL_wcscmp(str1, str2) == -1 && PAL_wcscmp(str2, str1) == 1;
+                str2[len - 1] = W('\0');
+                match &= PAL_wcscmp(str1, str2) == 1 && PAL_wcscmp(str2, str1) == -1;
+            }
+        }
+        TEST_ASSERT(match);
+
+        // Strings ending at a page boundary.
+        guarded_page page1;
+        guarded_page page2;
+        match = true;
+        for (size_t len = 0; len < 70; ++len)
+        {
+            WCHAR* str1 = fill_string(page1.tail(len + 1), len);
+            WCHAR* str2 = fill_string(page2.tail(len + 1), len);
+            match &= PAL_wcscmp(str1, str2) == 0;
+            if (len > 1)
+                match &= PAL_wcscmp(str1 + 1, str2) == 1 && PAL_wcscmp(str2, str1 + 1) == -1;
+        }
+        TEST_ASSERT(match);
+    }
+
+    // PAL_wcsncmp
+    {
+        TEST_ASSERT(PAL_wcsncmp(W("abc"), W("abd"), 0) == 0);
+        TEST_ASSERT(PAL_wcsncmp(W("abc"), W("abd"), 2) == 0);
+        TEST_ASSERT(PAL_wcsncmp(W("abc"), W("abd"), 3) == -1);
+        TEST_ASSERT(PAL_wcsncmp(W("abd"), W("abc"), 100) == 1);
+        TEST_ASSERT(PAL_wcsncmp(W("ab"), W("abc"), 3) == -1);
+        TEST_ASSERT(PAL_wcsncmp(W("abc"), W("abc"), 100) == 0);
+
+        // The comparison stops at the count, even within a vector.
+        WCHAR buffer1[64];
+        WCHAR buffer2[64];
+        bool match = true;
+        for (size_t count = 0; count < 40; ++count)
+        {
+            fill_string(buffer1, 40);
+            fill_string(buffer2, 40);
+            buffer2[count] = W('~');
+            match &= PAL_wcsncmp(buffer1, buffer2, count) == 0;
+            match &= PAL_wcsncmp(buffer1, buffer2, count + 1) == -1;
+        }
+        TEST_ASSERT(match);
+
+        // A prefix of a string at a page boundary.
+        guarded_page page;
+        WCHAR* tail = fill_string(page.tail(21), 20);
+        TEST_ASSERT(PAL_wcsncmp(tail, buffer1, 20) == 0);
+        TEST_ASSERT(PAL_wcsncmp(tail + 19, buffer1 + 19, 2) == -1);
+    }
+
+    // PAL_wcsstr
+    {
+        WCHAR const find1[] = W("");
+        WCHAR const find2[] = W("5");
+        WCHAR const find3[] = W("5a");
+        WCHAR const find4[] = W("67890");
+        WCHAR const find5[] = W("1234567890");
+        WCHAR const find6[] = W("12345678901234567890");
+        WCHAR const str1[] = W("");
+        WCHAR const str2[] = W("1234567890");
+        TEST_ASSERT(PAL_wcsstr(str1, find1) == str1);
+        TEST_ASSERT(PAL_wcsstr(str1, find2) == NULL);
+        TEST_ASSERT(PAL_wcsstr(str2, find1) == str2);
+        TEST_ASSERT(PAL_wcsstr(str2, find2) == (str2 + 4));
+        TEST_ASSERT(PAL_wcsstr(str2, find3) == NULL);
+        TEST_ASSERT(PAL_wcsstr(str2, find4) == (str2 + 5));
+        TEST_ASSERT(PAL_wcsstr(str2, find5) == str2);
+        TEST_ASSERT(PAL_wcsstr(str2, find6) == NULL);
+    }
+    {
+        // Random strings over a small alphabet, so partial matches are common.
+        WCHAR hay[300];
+        WCHAR needle[40];
+        uint32_t seed = 1;
+        auto next = [&]() { seed = seed * 1103515245 + 12345; return seed >> 16; };
+        bool match = true;
+        for (int iter = 0; iter < 20000; ++iter)
+        {
+            size_t hay_len = next() % 280;
+            size_t needle_len = 1 + next() % 30;
+            WCHAR alphabet = (WCHAR)(2 + next() % 3);
+            for (size_t i = 0; i < hay_len; ++i)
+                hay[i] = (WCHAR)(W('a') + next() % alphabet);
+            hay[hay_len] = W('\0');
+            for (size_t i = 0; i < needle_len; ++i)
+                needle[i] = (WCHAR)(W('a') + next() % alphabet);
+            needle[needle_len] = W('\0');
+
+            // Often take the needle from the haystack.
+            if (hay_len > needle_len && next() % 2 == 0)
+                memcpy(needle, hay + next() % (hay_len - needle_len), needle_len * sizeof(WCHAR));
+
+            WCHAR const* expected = NULL;
+            for (size_t i = 0; expected == NULL && i + needle_len <= hay_len; ++i)
+            {
+                if (0 == memcmp(hay + i, needle, needle_len * sizeof(WCHAR)))
+                    expected = hay + i;
+            }
+            match &= PAL_wcsstr(hay, needle) == expected;
+        }
+        TEST_ASSERT(match);
+    }
+    {
+        // Periodic needles that almost match everywhere.
+        WCHAR hay[5000];
+        WCHAR needle[1100];
+        for (size_t i = 0; i < 4999; ++i)
+            hay[i] = W('a');
+        hay[4999] = W('\0');
+
+        bool match = true;
+        size_t const lengths[] = { 2, 3, 8, 9, 16, 17, 64, 1024 };
+        for (size_t len : lengths)
+        {
+            for (size_t i = 0; i < len - 1; ++i)
+                needle[i] = W('a');
+            needle[len - 1] = W('b');
+            needle[len] = W('\0');
+            match &= PAL_wcsstr(hay, needle) == NULL;
+
+            hay[4000] = W('b');
+            match &= PAL_wcsstr(hay, needle) == hay + 4001 - len;
+            hay[4000] = W('a');
+
+            // The needle is longer than the rest of the haystack.
+            match &= PAL_wcsstr(hay + 4999 - len + 1, needle) == NULL;
+
+            // Both ends of the needle match everywhere.
+            if (len > 2)
+            {
+                needle[len - 2] = W('b');
+                needle[len - 1] = W('a');
+                match &= PAL_wcsstr(hay, needle) == NULL;
+
+                hay[4000] = W('b');
+                match &= PAL_wcsstr(hay, needle) == hay + 4002 - len;
+                hay[4000] = W('a');
+            }
+        }
+        TEST_ASSERT(match);
+
+        // A haystack ending at a page boundary, at every alignment.
+        guarded_page page;
+        WCHAR const find[] = W("xyz");
+        match = true;
+        for (size_t len = 0; len < 70; ++len)
+        {
+            WCHAR* str = fill_string(page.tail(len + 1), len);
+            match &= PAL_wcsstr(str, find) == (len >= 26 ? str + 23 : NULL);
+            match &= PAL_wcsstr(str, W("a")) == (len > 0 ? str : NULL);
+        }
+        TEST_ASSERT(match);
+    }
+
+    // PAL_wcschr and PAL_wcsrchr
+    {
+        WCHAR const str[] = W("abcabc");
+        TEST_ASSERT(PAL_wcschr(str, W('b')) == str + 1);
+        TEST_ASSERT(PAL_wcsrchr(str, W('b')) == str + 4);
+        TEST_ASSERT(PAL_wcschr(str, W('d')) == NULL);
+        TEST_ASSERT(PAL_wcsrchr(str, W('d')) == NULL);
+        TEST_ASSERT(PAL_wcschr(str, W('\0')) == str + 6);
+        TEST_ASSERT(PAL_wcsrchr(str, W('\0')) == str + 6);
+        TEST_ASSERT(PAL_wcschr(W(""), W('a')) == NULL);
+
+        // Matches before, at and after the terminator, at every alignment.
+        WCHAR buffer[160];
+        bool match = true;
+        for (size_t start = 0; start < 16; ++start)
+        {
+            for (size_t len = 0; len < 70; ++len)
+            {
+                WCHAR* s = fill_string(buffer + start, len);
+                s[len + 1] = W('~');
+                match &= PAL_wcschr(s, W('~')) == NULL && PAL_wcsrchr(s, W('~')) == NULL;
+                match &= PAL_wcschr(s, W('\0')) == s + len && PAL_wcsrchr(s, W('\0')) == s + len;
+                for (size_t i = 0; i < len; ++i)
+                {
+                    WCHAR c = s[i];
+                    s[i] = W('~');
+                    match &= PAL_wcschr(s, W('~')) == s + i && PAL_wcsrchr(s, W('~')) == s + i;
+                    s[i] = c;
+                }
+                if (len > 26)
+                    match &= PAL_wcschr(s, W('b')) == s + 1 && PAL_wcsrchr(s, W('b')) == s + (len - 2) / 26 * 26 + 1;
+            }
+        }
+        TEST_ASSERT(match);
+
+        guarded_page page;
+        match = true;
+        for (size_t len = 0; len < 70; ++len)
+        {
+            WCHAR* s = fill_string(page.tail(len + 1), len);
+            match &= PAL_wcschr(s, W('~')) == NULL && PAL_wcsrchr(s, W('~')) == NULL;
+            match &= PAL_wcsrchr(s, W('a')) == (len > 0 ? s + (len - 1) / 26 * 26 : NULL);
+        }
+        TEST_ASSERT(match);
+    }
+
+    // PAL_wcsspn
+    {
+        TEST_ASSERT(PAL_wcsspn(W("abcde"), W("")) == 0);
+        TEST_ASSERT(PAL_wcsspn(W(""), W("abc")) == 0);
+        TEST_ASSERT(PAL_wcsspn(W("abcde"), W("ba")) == 2);
+        TEST_ASSERT(PAL_wcsspn(W("abcde"), W("edcba")) == 5);
+        TEST_ASSERT(PAL_wcsspn(W("abcde"), W("x")) == 0);
+
+        // Sets of each size, spans ending at every position and alignment.
+        WCHAR const set[] = W(" \t\r\n,;");
+        WCHAR buffer[160];
+        bool match = true;
+        for (size_t count = 1; count <= 6; ++count)
+        {
+            WCHAR sub[8] = {};
+            memcpy(sub, set, count * sizeof(WCHAR));
+            for (size_t start = 0; start < 16; ++start)
+            {
+                for (size_t len = 0; len < 70; ++len)
+                {
+                    WCHAR* s = buffer + start;
+                    for (size_t i = 0; i < len; ++i)
+                        s[i] = sub[i % count];
+                    s[len] = W('\0');
+                    match &= PAL_wcsspn(s, sub) == len;
+
+                    // A unit that only shares its low byte with a set member.
+                    s[len] = (WCHAR)(sub[0] | 0x100);
+                    s[len + 1] = W('\0');
+                    match &= PAL_wcsspn(s, sub) == len;
+                }
+            }
+        }
+        TEST_ASSERT(match);
+
+        guarded_page page;
+        match = true;
+        for (size_t len = 0; len < 70; ++len)
+        {
+            WCHAR* s = page.tail(len + 1);
+            for (size_t i = 0; i < len; ++i)
+                s[i] = W(' ');
+            s[len] = W('\0');
+            match &= PAL_wcsspn(s, W(" ")) == len;
+        }
+        TEST_ASSERT(match);
+    }
+
+    // PAL__wcsicmp, PAL__wcsnicmp and PAL_CompareStringOrdinal
+    {
+        TEST_ASSERT(PAL__wcsicmp(W("Hello"), W("hELLO")) == 0);
+        TEST_ASSERT(PAL__wcsicmp(W("abc"), W("ABD")) == -1);
+        TEST_ASSERT(PAL__wcsicmp(W("abc"), W("AB")) == 1);
+        TEST_ASSERT(PAL__wcsicmp(W(""), W("")) == 0);
+
+        // ASCII letters are lowered, as by the CRT.
+        TEST_ASSERT(PAL__wcsicmp(W("_"), W("A")) == -1);
+        TEST_ASSERT(PAL_CompareStringOrdinal(W("_"), -1, W("a"), -1, TRUE) == CSTR_GREATER_THAN);
+
+        // Other characters fold by the table, except into ASCII.
+        TEST_ASSERT(PAL__wcsicmp(W("\u00e9t\u00e9"), W("\u00c9T\u00c9")) == 0);
+        TEST_ASSERT(PAL__wcsicmp(W("\u03c3\u03c2"), W("\u03a3\u03a3")) == 0);
+        TEST_ASSERT(PAL__wcsicmp(W("\u0430\u0431"), W("\u0410\u0411")) == 0);
+        TEST_ASSERT(PAL__wcsicmp(W("\u0131"), W("I")) != 0);
+        TEST_ASSERT(PAL__wcsicmp(W("\u017f"), W("s")) != 0);
+        TEST_ASSERT(PAL__wcsicmp(W("\u00df"), W("\u1e9e")) != 0);
+
+        TEST_ASSERT(PAL__wcsnicmp(W("abcX"), W("ABCy"), 3) == 0);
+        TEST_ASSERT(PAL__wcsnicmp(W("abcX"), W("ABCy"), 4) == -1);
+        TEST_ASSERT(PAL__wcsnicmp(W("abc"), W("xyz"), 0) == 0);
+
+        WCHAR const embedded[] = { W('a'), W('\0'), W('b') };
+        WCHAR const embedded_upper[] = { W('A'), W('\0'), W('B') };
+        TEST_ASSERT(PAL_CompareStringOrdinal(embedded, 3, embedded_upper, 3, TRUE) == CSTR_EQUAL);
+        TEST_ASSERT(PAL_CompareStringOrdinal(embedded, 3, embedded_upper, 3, FALSE) == CSTR_GREATER_THAN);
+        TEST_ASSERT(PAL_CompareStringOrdinal(W("abc"), 2, W("ab"), -1, FALSE) == CSTR_EQUAL);
+        TEST_ASSERT(PAL_CompareStringOrdinal(W("ab"), -1, W("abc"), -1, FALSE) == CSTR_LESS_THAN);
+        TEST_ASSERT(PAL_CompareStringOrdinal(W("ABC"), -1, W("ab"), -1, TRUE) == CSTR_GREATER_THAN);
+        TEST_ASSERT(PAL_CompareStringOrdinal(NULL, -1, W("ab"), -1, TRUE) == 0);
+
+        // Differences at every position and alignment, in ASCII and
+        // non-ASCII blocks.
+        WCHAR buffer1[160];
+        WCHAR buffer2[160];
+        bool match = true;
+        for (size_t start = 0; start < 16; ++start)
+        {
+            for (size_t len = 1; len < 70; ++len)
+            {
+                WCHAR* str1 = fill_string(buffer1 + start, len);
+                WCHAR* str2 = fill_string(buffer2 + (start * 7) % 16, len);
+                for (size_t i = 0; i < len; i += 2)
+                    str2[i] = (WCHAR)(str2[i] - W('a') + W('A'));
+                if (len > 20)
+                {
+                    str1[len / 2] = (WCHAR)0x00e0;
+                    str2[len / 2] = (WCHAR)0x00c0;
+                }
+                match &= PAL__wcsicmp(str1, str2) == 0;
+                match &= PAL_CompareStringOrdinal(str1, (int)len, str2, (int)len, TRUE) == CSTR_EQUAL;
+
+                WCHAR c = str2[len - 1];
+                str2[len - 1] = W('~');
+                match &= PAL__wcsicmp(str1, str2) == -1 && PAL__wcsicmp(str2, str1) == 1;
+                match &= PAL_CompareStringOrdinal(str1, -1, str2, -1, TRUE) == CSTR_LESS_THAN;
+                str2[len - 1] = W('\0');
+                match &= PAL__wcsicmp(str1, str2) == 1 && PAL__wcsicmp(str2, str1) == -1;
+                str2[len - 1] = c;
+            }
+        }
+        TEST_ASSERT(match);
+
+        guarded_page page1;
+        guarded_page page2;
+        match = true;
+        for (size_t len = 0; len < 70; ++len)
+        {
+            WCHAR* str1 = fill_string(page1.tail(len + 1), len);
+            WCHAR* str2 = fill_string(page2.tail(len + 1), len);
+            for (size_t i = 0; i < len; ++i)
+                str2[i] = (WCHAR)(str2[i] - W('a') + W('A'));
+            match &= PAL__wcsicmp(str1, str2) == 0;
+            match &= PAL_CompareStringOrdinal(str1, -1, str2, (int)len, TRUE) == CSTR_EQUAL;
+        }
+        TEST_ASSERT(match);
+    }
+
+    // PAL_wcscpy_s, PAL_wcscat_s and PAL_wcsncpy_s
+    {
+        WCHAR buffer[8];
+        TEST_ASSERT(PAL_wcscpy_s(NULL, 8, W("abc")) == EINVAL);
+        TEST_ASSERT(PAL_wcscpy_s(buffer, 0, W("abc")) == EINVAL);
+        buffer[0] = W('x');
+        TEST_ASSERT(PAL_wcscpy_s(buffer, 8, NULL) == EINVAL && buffer[0] == W('\0'));
+        TEST_ASSERT(PAL_wcscpy_s(buffer, 8, W("abcdefg")) == 0 && PAL_wcscmp(buffer, W("abcdefg")) == 0);
+        TEST_ASSERT(PAL_wcscpy_s(buffer, 8, W("abcdefgh")) == ERANGE && buffer[0] == W('\0'));
+
+        TEST_ASSERT(PAL_wcscpy_s(buffer, 8, W("abc")) == 0);
+        TEST_ASSERT(PAL_wcscat_s(buffer, 8, W("defg")) == 0 && PAL_wcscmp(buffer, W("abcdefg")) == 0);
+        TEST_ASSERT(PAL_wcscat_s(buffer, 8, W("")) == 0 && PAL_wcscmp(buffer, W("abcdefg")) == 0);
+        TEST_ASSERT(PAL_wcscat_s(buffer, 8, W("h")) == ERANGE && buffer[0] == W('\0'));
+        TEST_ASSERT(PAL_wcscat_s(buffer, 8, NULL) == EINVAL && buffer[0] == W('\0'));
+        for (WCHAR& c : buffer)
+            c = W('x');
+        TEST_ASSERT(PAL_wcscat_s(buffer, 8, W("a")) == EINVAL && buffer[0] == W('\0'));
+
+        TEST_ASSERT(PAL_wcsncpy_s(NULL, 0, NULL, 0) == 0);
+        TEST_ASSERT(PAL_wcsncpy_s(NULL, 0, W("abc"), 2) == EINVAL);
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, W("abc"), 0) == 0 && buffer[0] == W('\0'));
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, NULL, 2) == EINVAL);
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, W("abcdefghij"), 7) == 0 && PAL_wcscmp(buffer, W("abcdefg")) == 0);
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, W("abc"), 7) == 0 && PAL_wcscmp(buffer, W("abc")) == 0);
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, W("abcdefghij"), 8) == ERANGE && buffer[0] == W('\0'));
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, W("abcdefghij"), _TRUNCATE) == STRUNCATE && PAL_wcscmp(buffer, W("abcdefg")) == 0);
+        TEST_ASSERT(PAL_wcsncpy_s(buffer, 8, W("abcdefg"), _TRUNCATE) == 0 && PAL_wcscmp(buffer, W("abcdefg")) == 0);
+    }
+}
+
+static std::vector<DNCP_MATCH> matcher_find_all(DNCP_MATCHER const* matcher, WCHAR const* text, size_t len)
+{
+    std::vector<DNCP_MATCH> matches;
+    (void)dncp::matcher_search(matcher, text, len, [&](DNCP_MATCH const& match)
+        {
+            matches.push_back(match);
+            return true;
+        });
+    return matches;
+}
+
+// Every pattern at every position, in the order the matcher reports.
+static std::vector<DNCP_MATCH> matcher_find_all_naive(std::vector<std::vector<WCHAR>> const& patterns, WCHAR const* text, size_t len, bool ignore_case)
+{
+    std::vector<UINT> order;
+    for (UINT i = 0; i < (UINT)patterns.size(); ++i)
+        order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [&](UINT a, UINT b) { return patterns[a].size() > patterns[b].size(); });
+
+    std::vector<DNCP_MATCH> matches;
+    for (size_t end = 1; end <= len; ++end)
+    {
+        for (UINT i : order)
+        {
+            int n = (int)patterns[i].size();
+            if ((size_t)n > end)
+                continue;
+
+            if (CSTR_EQUAL == PAL_CompareStringOrdinal(text + end - n, n, patterns[i].data(), n, ignore_case ? TRUE : FALSE))
+                matches.push_back(DNCP_MATCH{ i, (UINT)n, end - n });
+        }
+    }
+    return matches;
+}
+
+static bool matches_equal(std::vector<DNCP_MATCH> const& a, std::vector<DNCP_MATCH> const& b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (a[i].Pattern != b[i].Pattern || a[i].Length != b[i].Length || a[i].Offset != b[i].Offset)
+            return false;
+    }
+    return true;
+}
+
+static bool matcher_agrees(std::vector<std::vector<WCHAR>> const& patterns, std::vector<WCHAR> const& text, DWORD flags)
+{
+    std::vector<LPCOLESTR> strs;
+    std::vector<UINT> lens;
+    for (auto const& p : patterns)
+    {
+        strs.push_back(p.data());
+        lens.push_back((UINT)p.size());
+    }
+
+    DNCP_MATCHER* raw;
+    if (S_OK != PAL_MatcherCreate(strs.data(), lens.data(), (UINT)strs.size(), flags, &raw))
+        return false;
+
+    dncp::matcher_ptr matcher{ raw };
+    bool ignore_case = (flags & DNCP_MATCHER_IGNORE_CASE) != 0;
+    return matches_equal(
+        matcher_find_all(matcher.get(), text.data(), text.size()),
+        matcher_find_all_naive(patterns, text.data(), text.size(), ignore_case));
+}
+
+void test_matcher()
+{
+    {
+        LPCOLESTR const patterns[] = { W("he"), W("she"), W("his"), W("hers") };
+        DNCP_MATCHER* raw;
+        TEST_ASSERT(S_OK == PAL_MatcherCreate(patterns, nullptr, 4, 0, &raw));
+        dncp::matcher_ptr matcher{ raw };
+
+        // Overlapping matches, by end and then longest first.
+        WCHAR const text[] = W("ushers");
+        std::vector<DNCP_MATCH> matches = matcher_find_all(matcher.get(), text, string_length(text));
+        TEST_ASSERT(matches.size() == 3);
+        TEST_ASSERT(matches[0].Pattern == 1 && matches[0].Offset == 1 && matches[0].Length == 3);
+        TEST_ASSERT(matches[1].Pattern == 0 && matches[1].Offset == 2 && matches[1].Length == 2);
+        TEST_ASSERT(matches[2].Pattern == 3 && matches[2].Offset == 2 && matches[2].Length == 4);
+
+        // Returning false ends the search.
+        size_t calls = 0;
+        TEST_ASSERT(S_OK == dncp::matcher_search(matcher.get(), text, string_length(text), [&](DNCP_MATCH const&) { calls++; return false; }));
+        TEST_ASSERT(calls == 1);
+
+        TEST_ASSERT(S_FALSE == dncp::matcher_search(matcher.get(), W("xyz"), 3, [](DNCP_MATCH const&) { return true; }));
+        TEST_ASSERT(S_FALSE == dncp::matcher_search(matcher.get(), nullptr, 0, [](DNCP_MATCH const&) { return true; }));
+    }
+    {
+        // Equal patterns are both reported, in index order.
+        LPCOLESTR const patterns[] = { W("\u041f\u0440\u0438\u0432\u0435\u0442"), W("\u043f\u0440\u0438\u0432\u0435\u0442"), W("WORLD") };
+        WCHAR const text[] = W("\u043f\u0440\u0438\u0432\u0435\u0442 World");
+
+        DNCP_MATCHER* raw;
+        TEST_ASSERT(S_OK == PAL_MatcherCreate(patterns, nullptr, 3, DNCP_MATCHER_IGNORE_CASE, &raw));
+        dncp::matcher_ptr ignore_case{ raw };
+        std::vector<DNCP_MATCH> matches = matcher_find_all(ignore_case.get(), text, string_length(text));
+        TEST_ASSERT(matches.size() == 3);
+        TEST_ASSERT(matches[0].Pattern == 0 && matches[1].Pattern == 1 && matches[0].Offset == 0);
+        TEST_ASSERT(matches[2].Pattern == 2 && matches[2].Offset == 7);
+
+        TEST_ASSERT(S_OK == PAL_MatcherCreate(patterns, nullptr, 3, 0, &raw));
+        dncp::matcher_ptr exact{ raw };
+        matches = matcher_find_all(exact.get(), text, string_length(text));
+        TEST_ASSERT(matches.size() == 1 && matches[0].Pattern == 1);
+    }
+    {
+        LPCOLESTR const patterns[] = { W("a"), W("") };
+        LPCOLESTR const null_pattern[] = { nullptr };
+        DNCP_MATCHER* raw = nullptr;
+        TEST_ASSERT(E_POINTER == PAL_MatcherCreate(patterns, nullptr, 1, 0, nullptr));
+        TEST_ASSERT(E_POINTER == PAL_MatcherCreate(nullptr, nullptr, 1, 0, &raw));
+        TEST_ASSERT(E_INVALIDARG == PAL_MatcherCreate(patterns, nullptr, 0, 0, &raw));
+        TEST_ASSERT(E_INVALIDARG == PAL_MatcherCreate(patterns, nullptr, 1, 0x2, &raw));
+        TEST_ASSERT(E_INVALIDARG == PAL_MatcherCreate(patterns, nullptr, 2, 0, &raw));
+        TEST_ASSERT(E_INVALIDARG == PAL_MatcherCreate(null_pattern, nullptr, 1, 0, &raw));
+        TEST_ASSERT(raw == nullptr);
+
+        TEST_ASSERT(S_OK == PAL_MatcherCreate(patterns, nullptr, 1, 0, &raw));
+        TEST_ASSERT(E_POINTER == PAL_MatcherSearch(raw, W("a"), 1, nullptr, nullptr));
+        TEST_ASSERT(E_POINTER == PAL_MatcherSearch(raw, nullptr, 1, [](void*, DNCP_MATCH const*) { return TRUE; }, nullptr));
+        PAL_MatcherFree(raw);
+        PAL_MatcherFree(nullptr);
+    }
+    {
+        // Random patterns over a small alphabet, with case variants.
+        WCHAR const alphabet[] = { W('a'), W('b'), W('A'), W('B'), (WCHAR)0xe9, (WCHAR)0xc9 };
+        uint32_t seed = 1;
+        auto next = [&](uint32_t bound)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            return (seed >> 8) % bound;
+        };
+
+        bool agree = true;
+        for (int iter = 0; iter < 400; ++iter)
+        {
+            std::vector<std::vector<WCHAR>> patterns(1 + next(20));
+            for (auto& p : patterns)
+            {
+                p.resize(1 + next(5));
+                for (WCHAR& c : p)
+                    c = alphabet[next(iter % 2 == 0 ? 2 : 6)];
+            }
+
+            std::vector<WCHAR> text(next(80));
+            for (WCHAR& c : text)
+                c = next(10) == 0 ? W('x') : alphabet[next(6)];
+
+            agree &= matcher_agrees(patterns, text, 0);
+            agree &= matcher_agrees(patterns, text, DNCP_MATCHER_IGNORE_CASE);
+        }
+        TEST_ASSERT(agree);
+
+        // Too many states and classes for a DFA.
+        std::vector<std::vector<WCHAR>> patterns(3000);
+        for (auto& p : patterns)
+        {
+            p.resize(4);
+            for (WCHAR& c : p)
+                c = (WCHAR)(0x4e00 + next(3000));
+        }
+
+        std::vector<WCHAR> text;
+        for (int i = 0; i < 400; ++i)
+        {
+            auto const& p = patterns[next(3000)];
+            text.insert(text.end(), p.begin(), p.end() - next(2));
+            text.push_back((WCHAR)(0x4e00 + next(3000)));
+        }
+        TEST_ASSERT(matcher_agrees(patterns, text, 0));
+    }
+}
+
+void test_bstr()
+{
+    BSTR bstr;
+    {
+        WCHAR const expected[] = W("STRING");
+        size_t expected_len = string_length(expected);
+        size_t expected_byte_len = expected_len * sizeof(OLECHAR);
+
+        bstr = PAL_SysAllocString(expected);
+        TEST_ASSERT(0 == std::memcmp(expected, bstr, array_size_bytes(expected)));
+        TEST_ASSERT((UINT)expected_len == PAL_SysStringLen(bstr));
+        TEST_ASSERT((UINT)expected_byte_len == PAL_SysStringByteLen(bstr));
+        PAL_SysFreeString(bstr);
+    }
+    {
+        char const expected[] = "string";
+        size_t expected_byte_len = string_length(expected);
+        size_t expected_len = expected_byte_len / sizeof(OLECHAR);
+
+        bstr = PAL_SysAllocStringByteLen(expected, (UINT)expected_byte_len);
+        TEST_ASSERT(0 == std::memcmp(expected, bstr, array_size_bytes(expected)));
+        TEST_ASSERT((UINT)expected_byte_len == PAL_SysStringByteLen(bstr));
+        TEST_ASSERT((UINT)expected_len == PAL_SysStringLen(bstr));
+        PAL_SysFreeString(bstr);
+    }
+    {
+        dncp::bstr_ptr smart_ptr1{ nullptr };
+        dncp::bstr_ptr smart_ptr2{ PAL_SysAllocString(W("abcdefghijklmnopqrstuvwxyz")) };
+    }
+    {
+        // Every length up to and past the largest cached size.
+        std::vector<BSTR> bstrs;
+        for (UINT len = 0; len < 1200; len += 7)
+        {
+            bstr = PAL_SysAllocStringLen(nullptr, len);
+            TEST_ASSERT(bstr != nullptr && PAL_SysStringLen(bstr) == len && bstr[len] == W('\0'));
+            std::memset(bstr, 0x41, len * sizeof(OLECHAR));
+            bstrs.push_back(bstr);
+        }
+        for (BSTR b : bstrs)
+            PAL_SysFreeString(b);
+
+        bool valid = true;
+        for (UINT len = 0; len < 1200; len += 7)
+        {
+            bstr = PAL_SysAllocStringLen(W("cached"), len < 6 ? len : 6);
+            valid &= bstr != nullptr && PAL_SysStringLen(bstr) == (len < 6 ? len : 6);
+            PAL_SysFreeString(bstr);
+        }
+        TEST_ASSERT(valid);
+    }
+    {
+        // BSTRs released on a thread other than the allocating one.
+        std::vector<BSTR> bstrs;
+        for (int i = 0; i < 64; ++i)
+            bstrs.push_back(PAL_SysAllocString(W("cross thread")));
+
+        std::thread worker{ [&bstrs]()
+        {
+            for (BSTR b : bstrs)
+                PAL_SysFreeString(b);
+
+            BSTR local = PAL_SysAllocString(W("reused"));
+            TEST_ASSERT(PAL_SysStringLen(local) == 6);
+            PAL_SysFreeString(local);
+        } };
+        worker.join();
+    }
+    {
+        TEST_ASSERT(FALSE == PAL_SysReAllocString(nullptr, W("abc")));
+        TEST_ASSERT(FALSE == PAL_SysReAllocStringLen(nullptr, W("abc"), 3));
+
+        bstr = nullptr;
+        TEST_ASSERT(TRUE == PAL_SysReAllocString(&bstr, W("abc")));
+        TEST_ASSERT(bstr != nullptr && PAL_SysStringLen(bstr) == 3);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("abc"), 4 * sizeof(OLECHAR)));
+
+        TEST_ASSERT(TRUE == PAL_SysReAllocString(&bstr, W("0123456789")));
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 10);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("0123456789"), 11 * sizeof(OLECHAR)));
+
+        // The source is part of the string.
+        TEST_ASSERT(TRUE == PAL_SysReAllocStringLen(&bstr, bstr + 4, 4));
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 4);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("4567"), 5 * sizeof(OLECHAR)));
+
+        TEST_ASSERT(TRUE == PAL_SysReAllocString(&bstr, bstr + 1));
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 3);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("567"), 4 * sizeof(OLECHAR)));
+
+        // Without a source the content is kept.
+        TEST_ASSERT(TRUE == PAL_SysReAllocStringLen(&bstr, nullptr, 2));
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 2);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("56"), 3 * sizeof(OLECHAR)));
+        PAL_SysFreeString(bstr);
+    }
+    {
+        // Appending in a loop.
+        WCHAR const chunk[] = W("0123456789abcdef");
+        UINT const chunk_len = (UINT)string_length(chunk);
+        bstr = PAL_SysAllocString(W(""));
+        for (UINT i = 0; i < 500; ++i)
+        {
+            UINT len = PAL_SysStringLen(bstr);
+            TEST_ASSERT(TRUE == PAL_SysReAllocStringLen(&bstr, nullptr, len + chunk_len));
+            std::memcpy(bstr + len, chunk, chunk_len * sizeof(OLECHAR));
+        }
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 500 * chunk_len);
+        TEST_ASSERT(0 == std::memcmp(bstr + 499 * chunk_len, chunk, array_size_bytes(chunk)));
+
+        // A self-referencing copy of most of the string.
+        TEST_ASSERT(TRUE == PAL_SysReAllocStringLen(&bstr, bstr + chunk_len, 499 * chunk_len));
+        TEST_ASSERT(0 == std::memcmp(bstr, chunk, chunk_len * sizeof(OLECHAR)));
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 499 * chunk_len);
+        PAL_SysFreeString(bstr);
+    }
+#ifndef _MSC_VER
+    {
+        // Blocks sampled by the profiler never come from the cache.
+        bool cached = read_env_number("DNCP_BSTR_CACHE", 1) != 0
+            && read_env_number("OANOCACHE", 0) == 0
+            && read_env_number("DNCP_ALLOC_PROFILE_INTERVAL", 0) == 0;
+        if (cached)
+        {
+            // A freed BSTR is reused by the next allocation of its size.
+            bstr = PAL_SysAllocString(W("first"));
+            BSTR first = bstr;
+            PAL_SysFreeString(bstr);
+            bstr = PAL_SysAllocString(W("second"));
+            TEST_ASSERT(bstr == first);
+            PAL_SysFreeString(bstr);
+        }
+    }
+#endif
+}
+
+void test_bstr_builder()
+{
+    {
+        DNCP_BSTR_BUILDER builder{};
+        BSTR bstr = PAL_BstrBuilderDetach(&builder);
+        TEST_ASSERT(bstr != nullptr && PAL_SysStringLen(bstr) == 0 && bstr[0] == W('\0'));
+        PAL_SysFreeString(bstr);
+
+        TEST_ASSERT(PAL_BstrBuilderAppend(nullptr, W("a"), 1) == E_POINTER);
+        TEST_ASSERT(PAL_BstrBuilderAppend(&builder, nullptr, 1) == E_POINTER);
+        TEST_ASSERT(PAL_BstrBuilderReserve(&builder, UINT_MAX) == E_OUTOFMEMORY);
+    }
+    {
+        DNCP_BSTR_BUILDER builder{};
+        TEST_ASSERT(PAL_BstrBuilderAppend(&builder, W("Hello"), 5) == S_OK);
+        TEST_ASSERT(PAL_BstrBuilderAppend(&builder, W(", "), 2) == S_OK);
+
+        LPOLESTR dest = PAL_BstrBuilderAppendBuffer(&builder, 5);
+        TEST_ASSERT(dest != nullptr);
+        std::memcpy(dest, W("World"), 5 * sizeof(OLECHAR));
+        TEST_ASSERT(builder.Length == 12 && builder.Capacity >= 12);
+
+        BSTR bstr = PAL_BstrBuilderDetach(&builder);
+        TEST_ASSERT(builder.Buffer == nullptr && builder.Length == 0);
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 12);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("Hello, World"), 13 * sizeof(OLECHAR)));
+        PAL_SysFreeString(bstr);
+
+        TEST_ASSERT(PAL_BstrBuilderAppend(&builder, W("discarded"), 9) == S_OK);
+        PAL_BstrBuilderFree(&builder);
+        TEST_ASSERT(builder.Buffer == nullptr && builder.Capacity == 0);
+    }
+    {
+        dncp::bstr_builder builder;
+        WCHAR const line[] = W("line of a report\n");
+        UINT const line_len = (UINT)string_length(line);
+        UINT const count = 10000;
+        for (UINT i = 0; i < count; ++i)
+            TEST_ASSERT(builder.append(line) == S_OK);
+        TEST_ASSERT(builder.append(W('!')) == S_OK);
+        TEST_ASSERT(builder.length() == count * line_len + 1);
+
+        // The buffer grows geometrically.
+        TEST_ASSERT(builder.capacity() < 2 * builder.length() + 16);
+
+        dncp::bstr_builder moved{ std::move(builder) };
+        TEST_ASSERT(builder.data() == nullptr);
+
+        dncp::bstr_ptr bstr = moved.finish();
+        TEST_ASSERT(bstr != nullptr && PAL_SysStringLen(bstr.get()) == count * line_len + 1);
+        TEST_ASSERT(0 == std::memcmp(bstr.get() + (count - 1) * line_len, line, line_len * sizeof(OLECHAR)));
+        TEST_ASSERT(bstr.get()[count * line_len] == W('!') && bstr.get()[count * line_len + 1] == W('\0'));
+        TEST_ASSERT(moved.length() == 0);
+    }
+}
+
+void test_bstr_interned()
+{
+    TEST_ASSERT(PAL_SysAllocStringInterned(nullptr) == nullptr);
+
+#if !defined(_MSC_VER) && UINTPTR_MAX > 0xFFFFFFFFu
+    bool const shared = true;
+#else
+    bool const shared = false;
+#endif
+
+    {
+        BSTR a = PAL_SysAllocStringInterned(W("Interned"));
+        BSTR b = PAL_SysAllocStringInterned(W("Interned"));
+        BSTR c = PAL_SysAllocStringInterned(W("Interned!"));
+        TEST_ASSERT(a != nullptr && b != nullptr && c != nullptr);
+        TEST_ASSERT((a == b) == shared);
+        TEST_ASSERT(a != c);
+        TEST_ASSERT(PAL_SysStringLen(a) == 8 && 0 == std::memcmp(a, W("Interned"), 9 * sizeof(OLECHAR)));
+
+        // Each reference is released separately.
+        PAL_SysFreeString(a);
+        TEST_ASSERT(0 == std::memcmp(b, W("Interned"), 9 * sizeof(OLECHAR)));
+
+        // Reallocating an interned string leaves the shared copy alone.
+        BSTR d = PAL_SysAllocStringInterned(W("Interned"));
+        BSTR e = d;
+        TEST_ASSERT(TRUE == PAL_SysReAllocStringLen(&e, nullptr, 4));
+        TEST_ASSERT(PAL_SysStringLen(e) == 4 && 0 == std::memcmp(e, W("Inte"), 5 * sizeof(OLECHAR)));
+        TEST_ASSERT(0 == std::memcmp(b, W("Interned"), 9 * sizeof(OLECHAR)));
+        PAL_SysFreeString(e);
+
+        PAL_SysFreeString(b);
+        PAL_SysFreeString(c);
+
+        // The empty string can be interned too.
+        BSTR empty = PAL_SysAllocStringInterned(W(""));
+        TEST_ASSERT(empty != nullptr && PAL_SysStringLen(empty) == 0);
+        PAL_SysFreeString(empty);
+    }
+    {
+        // Threads intern and release the same strings concurrently.
+        WCHAR const* const names[] = { W("Alpha"), W("Beta"), W("Gamma"), W("Delta") };
+        std::atomic<int> mismatches{ 0 };
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&names, &mismatches]()
+            {
+                for (int i = 0; i < 10000; ++i)
+                {
+                    WCHAR const* name = names[i % 4];
+                    BSTR bstr = PAL_SysAllocStringInterned(name);
+                    if (bstr == nullptr || 0 != std::memcmp(bstr, name, (PAL_wcslen(name) + 1) * sizeof(OLECHAR)))
+                        mismatches++;
+                    PAL_SysFreeString(bstr);
+                }
+            });
+        }
+
+        for (std::thread& t : threads)
+            t.join();
+        TEST_ASSERT(mismatches == 0);
+    }
+}
+
+void test_bstr_literal()
+{
     {
-        p = PAL_CoTaskMemAlloc(0);
-        TEST_ASSERT(p != nullptr);
-        PAL_CoTaskMemFree(p);
+        dncp::bstr_literal lit = DNCP_BSTR_LITERAL(W("Literal"));
+        BSTR bstr = lit.get();
+        TEST_ASSERT(lit.length() == 7);
+        TEST_ASSERT(PAL_SysStringLen(bstr) == 7 && PAL_SysStringByteLen(bstr) == 7 * sizeof(OLECHAR));
+        TEST_ASSERT(0 == std::memcmp(bstr, W("Literal"), 8 * sizeof(OLECHAR)));
+        TEST_ASSERT(((uintptr_t)bstr % 8) == 0);
+
+        // The same literal expression always yields the same image.
+        BSTR images[2];
+        for (BSTR& image : images)
+            image = DNCP_BSTR_LITERAL(W("Repeated")).get();
+        TEST_ASSERT(images[0] == images[1]);
+
+        BSTR copy = PAL_SysAllocString(lit);
+        TEST_ASSERT(copy != bstr && PAL_SysStringLen(copy) == 7);
+        TEST_ASSERT(0 == std::memcmp(copy, W("Literal"), 8 * sizeof(OLECHAR)));
+        PAL_SysFreeString(copy);
+
+        dncp::bstr_literal empty = DNCP_BSTR_LITERAL(W(""));
+        TEST_ASSERT(empty.length() == 0 && PAL_SysStringLen(empty.get()) == 0 && empty.get()[0] == W('\0'));
     }
+#if !defined(_MSC_VER) && UINTPTR_MAX > 0xFFFFFFFFu
     {
-        p = PAL_CoTaskMemAlloc(1);
-        TEST_ASSERT(p != nullptr);
-        PAL_CoTaskMemFree(p);
+        // A literal freed by mistake is left alone.
+        BSTR bstr = DNCP_BSTR_LITERAL(W("Literal")).get();
+        PAL_SysFreeString(bstr);
+        TEST_ASSERT(0 == std::memcmp(bstr, W("Literal"), 8 * sizeof(OLECHAR)));
+
+        // Reallocating a literal copies it.
+        BSTR realloc = bstr;
+        TEST_ASSERT(TRUE == PAL_SysReAllocString(&realloc, W("Changed")));
+        TEST_ASSERT(realloc != bstr && 0 == std::memcmp(bstr, W("Literal"), 8 * sizeof(OLECHAR)));
+        PAL_SysFreeString(realloc);
     }
+#endif
+}
+
+void test_bstr_array()
+{
     {
-        p = PAL_CoTaskMemAlloc(12);
-        TEST_ASSERT(p != nullptr);
-        PAL_CoTaskMemFree(p);
+        TEST_ASSERT(PAL_SysAllocStringArray(nullptr, nullptr, 1, nullptr) == E_POINTER);
+        TEST_ASSERT(PAL_SysAllocStringArray(nullptr, nullptr, 0, nullptr) == E_POINTER);
+        BSTR none[1];
+        TEST_ASSERT(PAL_SysAllocStringArray(nullptr, nullptr, 0, none) == S_OK);
+        PAL_SysFreeStringArray(nullptr, 1);
     }
     {
-        // Check overflow, let OS handle other out of memory values.
-        SIZE_T will_overflow = ~((SIZE_T)0) - 6;
-        p = PAL_CoTaskMemAlloc(will_overflow);
-        TEST_ASSERT(p == nullptr);
+        // Short strings, a null entry and a string too long for a slab.
+        std::vector<WCHAR> long_str(3000, W('L'));
+        long_str.push_back(W('\0'));
+
+        UINT const count = 2000;
+        std::vector<LPCOLESTR> strs(count);
+        for (UINT i = 0; i < count; ++i)
+            strs[i] = (i % 3 == 0) ? W("Column") : W("Name");
+        strs[10] = nullptr;
+        strs[20] = long_str.data();
+
+        std::vector<BSTR> bstrs(count);
+        TEST_ASSERT(PAL_SysAllocStringArray(strs.data(), nullptr, count, bstrs.data()) == S_OK);
+        TEST_ASSERT(bstrs[10] == nullptr);
+        TEST_ASSERT(PAL_SysStringLen(bstrs[20]) == 3000 && bstrs[20][3000] == W('\0'));
+
+        bool contents_match = true;
+        for (UINT i = 0; i < count; ++i)
+        {
+            if (i == 10 || i == 20)
+                continue;
+            UINT len = (UINT)PAL_wcslen(strs[i]);
+            contents_match &= PAL_SysStringLen(bstrs[i]) == len
+                && 0 == std::memcmp(bstrs[i], strs[i], (len + 1) * sizeof(OLECHAR))
+                && ((uintptr_t)bstrs[i] % 8) == 0;
+        }
+        TEST_ASSERT(contents_match);
+#if !defined(_MSC_VER) && UINTPTR_MAX > 0xFFFFFFFFu
+        // Neighbours share a block.
+        TEST_ASSERT(bstrs[1] - bstrs[0] < 16);
+#endif
+
+        // Members can be freed and reallocated individually.
+        PAL_SysFreeString(bstrs[0]);
+        bstrs[0] = nullptr;
+        TEST_ASSERT(TRUE == PAL_SysReAllocString(&bstrs[1], W("Renamed column")));
+        TEST_ASSERT(0 == std::memcmp(bstrs[1], W("Renamed column"), 15 * sizeof(OLECHAR)));
+        TEST_ASSERT(0 == std::memcmp(bstrs[2], W("Name"), 5 * sizeof(OLECHAR)));
+
+        PAL_SysFreeStringArray(bstrs.data(), count);
     }
     {
-        dncp::cotaskmem_ptr<void> smart_ptr1{ nullptr };
-        dncp::cotaskmem_ptr<int> smart_ptr2{ (int*)PAL_CoTaskMemAlloc(16) };
+        // Explicit lengths, including embedded nulls.
+        LPCOLESTR strs[] = { W("ab\0cd"), W("xyz") };
+        UINT lens[] = { 5, 2 };
+        BSTR bstrs[2];
+        TEST_ASSERT(PAL_SysAllocStringArray(strs, lens, 2, bstrs) == S_OK);
+        TEST_ASSERT(PAL_SysStringLen(bstrs[0]) == 5 && 0 == std::memcmp(bstrs[0], W("ab\0cd"), 6 * sizeof(OLECHAR)));
+        TEST_ASSERT(PAL_SysStringLen(bstrs[1]) == 2 && bstrs[1][2] == W('\0'));
+
+        // Members may be released across threads.
+        std::thread worker{ [&bstrs]() { PAL_SysFreeString(bstrs[0]); } };
+        worker.join();
+        PAL_SysFreeString(bstrs[1]);
+    }
+#if !defined(_MSC_VER) && UINTPTR_MAX > 0xFFFFFFFFu
+    {
+        // A string whose spare bytes merely look like a slab member's tag,
+        // pointing in front of its block, is freed as an ordinary BSTR.
+        BSTR bstrs[2] = { PAL_SysAllocString(W("Foreign")), PAL_SysAllocString(W("Foreign")) };
+        TEST_ASSERT(bstrs[0] != nullptr && bstrs[1] != nullptr);
+        for (BSTR bstr : bstrs)
+        {
+            UINT const tag = (0xB57u << 20) | (3u << 16) | 2u;
+            std::memcpy((char*)bstr - sizeof(UINT) - 4, &tag, sizeof(tag));
+        }
+
+        PAL_SysFreeString(bstrs[0]);
+        PAL_SysFreeStringArray(&bstrs[1], 1);
     }
+#endif
 }
 
-void test_strings()
+void test_bstr_view()
 {
-    // PAL_wcslen
     {
-        WCHAR const len_0[] = W("");
-        WCHAR const len_1[] = W("1");
-        WCHAR const len_2[] = W("12");
-        WCHAR const len_9[] = W("123456789");
-        WCHAR const embedded_null[] = { W('1'), W('2'), W('\0'), W('4'), W('\0') };
+        dncp::bstr_ptr a{ PAL_SysAllocString(W("key")) };
+        dncp::bstr_ptr b{ PAL_SysAllocString(W("key")) };
+        dncp::bstr_ptr c{ PAL_SysAllocString(W("keys")) };
+        dncp::bstr_ptr embedded{ PAL_SysAllocStringLen(W("key\0"), 4) };
 
-        TEST_ASSERT(PAL_wcslen(len_0) == string_length(len_0));
-        TEST_ASSERT(PAL_wcslen(len_1) == string_length(len_1));
-        TEST_ASSERT(PAL_wcslen(len_2) == string_length(len_2));
-        TEST_ASSERT(PAL_wcslen(len_9) == string_length(len_9));
-        TEST_ASSERT(PAL_wcslen(embedded_null) == 2 && string_length(embedded_null) == 4);
+        dncp::bstr_view view{ a };
+        TEST_ASSERT(view.length() == 3 && !view.empty() && view.data() == a.get());
+        TEST_ASSERT(view[1] == W('e') && view.end() - view.begin() == 3);
+
+        TEST_ASSERT(view == dncp::bstr_view{ b });
+        TEST_ASSERT(view.hash() == dncp::bstr_view{ b }.hash());
+        TEST_ASSERT(view != dncp::bstr_view{ c } && view < dncp::bstr_view{ c });
+        TEST_ASSERT(view != dncp::bstr_view{ embedded });
+        TEST_ASSERT(view.hash() != dncp::bstr_view{ c }.hash());
+        TEST_ASSERT(view == DNCP_BSTR_LITERAL(W("key")));
+    }
+    {
+        // Null and empty strings are equal and order first.
+        dncp::bstr_ptr empty{ PAL_SysAllocString(W("")) };
+        dncp::bstr_view null_view{ (BSTR)nullptr };
+        TEST_ASSERT(null_view.empty() && null_view == dncp::bstr_view{ empty });
+        TEST_ASSERT(null_view.hash() == dncp::bstr_view{ empty }.hash());
+        TEST_ASSERT(null_view < DNCP_BSTR_LITERAL(W("a")));
+        TEST_ASSERT(DNCP_BSTR_LITERAL(W("b")) > DNCP_BSTR_LITERAL(W("a")));
+        TEST_ASSERT(DNCP_BSTR_LITERAL(W("ab")) >= DNCP_BSTR_LITERAL(W("a")));
+        TEST_ASSERT(DNCP_BSTR_LITERAL(W("a")).get() != nullptr && dncp::bstr_view{}.compare(null_view) == 0);
     }
+    {
+        // Views are keys of unordered containers, without copies.
+        std::vector<dncp::bstr_ptr> names;
+        std::unordered_map<dncp::bstr_view, int> index;
+        for (int i = 0; i < 100; ++i)
+        {
+            WCHAR name[] = W("name_00");
+            name[5] = (WCHAR)(W('0') + i / 10);
+            name[6] = (WCHAR)(W('0') + i % 10);
+            names.emplace_back(PAL_SysAllocString(name));
+            index.emplace(dncp::bstr_view{ names.back() }, i);
+        }
+        TEST_ASSERT(index.size() == 100);
 
-    // PAL_wcscmp
+        dncp::bstr_ptr lookup{ PAL_SysAllocString(W("name_42")) };
+        auto found = index.find(dncp::bstr_view{ lookup });
+        TEST_ASSERT(found != index.end() && found->second == 42);
+        TEST_ASSERT(index.find(DNCP_BSTR_LITERAL(W("name_4"))) == index.end());
+    }
+}
+
+void test_bstr_utf8()
+{
     {
-        TEST_ASSERT(PAL_wcscmp(W(""), W("")) == 0);
+        TEST_ASSERT(PAL_SysAllocStringFromUTF8(nullptr, 0) == nullptr);
+        TEST_ASSERT(PAL_SysStringToUTF8(nullptr, nullptr, nullptr) == E_POINTER);
 
-        WCHAR const aStr1[] = W("a");
-        WCHAR const aStr2[] = W("a");
-        WCHAR const AStr[] = W("A");
-        WCHAR const ZStr[] = W("Z");
-        TEST_ASSERT(PAL_wcscmp(aStr1, aStr2) == 0);
-        TEST_ASSERT(PAL_wcscmp(W(""), aStr1) == -1);
-        TEST_ASSERT(PAL_wcscmp(aStr1, W("")) == 1);
-        TEST_ASSERT(PAL_wcscmp(AStr, aStr1) == -1);
-        TEST_ASSERT(PAL_wcscmp(aStr1, AStr) == 1);
-        TEST_ASSERT(PAL_wcscmp(AStr, ZStr) == -1);
-        TEST_ASSERT(PAL_wcscmp(ZStr, AStr) == 1);
+        BSTR empty = PAL_SysAllocStringFromUTF8("", 0);
+        TEST_ASSERT(empty != nullptr && PAL_SysStringLen(empty) == 0 && empty[0] == W('\0'));
+        PAL_SysFreeString(empty);
 
-        WCHAR const mixedStr1[] = W("aMqU");
-        WCHAR const mixedStr2[] = W("aMqu");
-        WCHAR const mixedStr3[] = W("aMq");
-        TEST_ASSERT(PAL_wcscmp(mixedStr1, mixedStr2) == -1);
-        TEST_ASSERT(PAL_wcscmp(mixedStr2, mixedStr1) == 1);
-        TEST_ASSERT(PAL_wcscmp(mixedStr3, mixedStr1) == -1);
-        TEST_ASSERT(PAL_wcscmp(mixedStr1, mixedStr3) == 1);
+        char* utf8;
+        UINT len = 1;
+        TEST_ASSERT(PAL_SysStringToUTF8(nullptr, &utf8, &len) == S_OK);
+        TEST_ASSERT(utf8 != nullptr && utf8[0] == '\0' && len == 0);
+        PAL_CoTaskMemFree(utf8);
     }
+    {
+        // Long enough to cover the vectorized ASCII path and its tail.
+        char const ascii[] = "The quick brown fox jumps over the lazy dog, 0123456789 times!";
+        UINT const ascii_len = (UINT)(sizeof(ascii) - 1);
+        BSTR bstr = PAL_SysAllocStringFromUTF8(ascii, ascii_len);
+        TEST_ASSERT(PAL_SysStringLen(bstr) == ascii_len);
+        bool match = true;
+        for (UINT i = 0; i <= ascii_len; ++i)
+            match &= bstr[i] == (WCHAR)ascii[i];
+        TEST_ASSERT(match);
 
-    // PAL_wcsstr
+        char* utf8;
+        UINT len;
+        TEST_ASSERT(PAL_SysStringToUTF8(bstr, &utf8, &len) == S_OK);
+        TEST_ASSERT(len == ascii_len && 0 == std::memcmp(utf8, ascii, ascii_len + 1));
+        PAL_CoTaskMemFree(utf8);
+        PAL_SysFreeString(bstr);
+    }
     {
-        WCHAR const find1[] = W("");
-        WCHAR const find2[] = W("5");
-        WCHAR const find3[] = W("5a");
-        WCHAR const find4[] = W("67890");
-        WCHAR const find5[] = W("1234567890");
-        WCHAR const find6[] = W("12345678901234567890");
-        WCHAR const str1[] = W("");
-        WCHAR const str2[] = W("1234567890");
-        TEST_ASSERT(PAL_wcsstr(str1, find1) == str1);
-        TEST_ASSERT(PAL_wcsstr(str1, find2) == NULL);
-        TEST_ASSERT(PAL_wcsstr(str2, find1) == str2);
-        TEST_ASSERT(PAL_wcsstr(str2, find2) == (str2 + 4));
-        TEST_ASSERT(PAL_wcsstr(str2, find3) == NULL);
-        TEST_ASSERT(PAL_wcsstr(str2, find4) == (str2 + 5));
-        TEST_ASSERT(PAL_wcsstr(str2, find5) == str2);
-        TEST_ASSERT(PAL_wcsstr(str2, find6) == NULL);
+        // Two, three and four byte sequences, between runs of ASCII.
+        char const mixed[] = "caf\xc3\xa9 costs \xe2\x82\xac" "5, clef \xf0\x9d\x84\x9e and a long ASCII run after it.";
+        WCHAR const expected[] = W("caf\u00e9 costs \u20ac") W("5, clef \U0001D11E and a long ASCII run after it.");
+        UINT const mixed_len = (UINT)(sizeof(mixed) - 1);
+        UINT const expected_len = (UINT)string_length(expected);
+
+        BSTR bstr = PAL_SysAllocStringFromUTF8(mixed, mixed_len);
+        TEST_ASSERT(PAL_SysStringLen(bstr) == expected_len);
+        TEST_ASSERT(0 == std::memcmp(bstr, expected, (expected_len + 1) * sizeof(WCHAR)));
+
+        char* utf8;
+        UINT len;
+        TEST_ASSERT(PAL_SysStringToUTF8(bstr, &utf8, &len) == S_OK);
+        TEST_ASSERT(len == mixed_len && 0 == std::memcmp(utf8, mixed, mixed_len + 1));
+        PAL_CoTaskMemFree(utf8);
+        PAL_SysFreeString(bstr);
+    }
+    {
+        // Each maximal ill-formed subpart becomes one U+FFFD.
+        char const invalid[] = "a\xc3" "b\xe0\x80\x80" "c\xed\xa0\x80" "d\xf0\x9d\x84" "e\xff";
+        WCHAR const expected[] = W("a\uFFFDb\uFFFD\uFFFD\uFFFDc\uFFFD\uFFFD\uFFFDd\uFFFDe\uFFFD");
+        BSTR bstr = PAL_SysAllocStringFromUTF8(invalid, (UINT)(sizeof(invalid) - 1));
+        TEST_ASSERT(PAL_SysStringLen(bstr) == string_length(expected));
+        TEST_ASSERT(0 == std::memcmp(bstr, expected, sizeof(expected)));
+        PAL_SysFreeString(bstr);
+
+        // Unpaired surrogates become U+FFFD.
+        WCHAR const lone[] = { W('x'), (WCHAR)0xd800, W('y'), (WCHAR)0xdc00, 0 };
+        bstr = PAL_SysAllocStringLen(lone, 4);
+        char* utf8;
+        UINT len;
+        TEST_ASSERT(PAL_SysStringToUTF8(bstr, &utf8, &len) == S_OK);
+        TEST_ASSERT(len == 8 && 0 == std::memcmp(utf8, "x\xef\xbf\xbdy\xef\xbf\xbd", 9));
+        PAL_CoTaskMemFree(utf8);
+        PAL_SysFreeString(bstr);
     }
 }
 
-void test_bstr()
+void test_codepage()
 {
-    BSTR bstr;
     {
-        WCHAR const expected[] = W("STRING");
-        size_t expected_len = string_length(expected);
-        size_t expected_byte_len = expected_len * sizeof(OLECHAR);
+        // Sizing calls, with and without the terminator.
+        char const mixed[] = "caf\xc3\xa9 \xf0\x9d\x84\x9e";
+        WCHAR const expected[] = W("caf\u00e9 \U0001D11E");
+        int const mixed_len = (int)(sizeof(mixed) - 1);
+        int const expected_len = (int)string_length(expected);
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, 0, mixed, mixed_len, nullptr, 0) == expected_len);
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, 0, mixed, -1, nullptr, 0) == expected_len + 1);
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, 0, expected, expected_len, nullptr, 0, nullptr, nullptr) == mixed_len);
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, 0, expected, -1, nullptr, 0, nullptr, nullptr) == mixed_len + 1);
 
-        bstr = PAL_SysAllocString(expected);
-        TEST_ASSERT(0 == std::memcmp(expected, bstr, array_size_bytes(expected)));
-        TEST_ASSERT((UINT)expected_len == PAL_SysStringLen(bstr));
-        TEST_ASSERT((UINT)expected_byte_len == PAL_SysStringByteLen(bstr));
-        PAL_SysFreeString(bstr);
+        // Destinations of the exact size take the measured path, and
+        // larger ones the single pass.
+        WCHAR wide[64];
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, 0, mixed, -1, wide, expected_len + 1) == expected_len + 1);
+        TEST_ASSERT(0 == std::memcmp(wide, expected, sizeof(expected)));
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_ACP, 0, mixed, -1, wide, 64) == expected_len + 1);
+        TEST_ASSERT(0 == std::memcmp(wide, expected, sizeof(expected)));
+
+        char narrow[64];
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, 0, expected, -1, narrow, mixed_len + 1, nullptr, nullptr) == mixed_len + 1);
+        TEST_ASSERT(0 == std::memcmp(narrow, mixed, sizeof(mixed)));
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_ACP, 0, expected, -1, narrow, 64, nullptr, nullptr) == mixed_len + 1);
+        TEST_ASSERT(0 == std::memcmp(narrow, mixed, sizeof(mixed)));
+
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, 0, mixed, -1, wide, expected_len) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_INSUFFICIENT_BUFFER);
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, 0, expected, -1, narrow, mixed_len, nullptr, nullptr) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_INSUFFICIENT_BUFFER);
     }
     {
-        char const expected[] = "string";
-        size_t expected_byte_len = string_length(expected);
-        size_t expected_len = expected_byte_len / sizeof(OLECHAR);
+        // Argument checks.
+        WCHAR wide[8];
+        char narrow[8];
+        BOOL used_default;
+        struct
+        {
+            int result;
+            DWORD error;
+        } const cases[] =
+        {
+            { PAL_MultiByteToWideChar(1252, 0, "a", 1, wide, 8), ERROR_INVALID_PARAMETER },
+            { PAL_MultiByteToWideChar(CP_UTF8, 0x1, "a", 1, wide, 8), ERROR_INVALID_FLAGS },
+            { PAL_MultiByteToWideChar(CP_UTF8, 0, nullptr, 1, wide, 8), ERROR_INVALID_PARAMETER },
+            { PAL_MultiByteToWideChar(CP_UTF8, 0, "a", 0, wide, 8), ERROR_INVALID_PARAMETER },
+            { PAL_MultiByteToWideChar(CP_UTF8, 0, "a", -2, wide, 8), ERROR_INVALID_PARAMETER },
+            { PAL_MultiByteToWideChar(CP_UTF8, 0, "a", 1, nullptr, 8), ERROR_INVALID_PARAMETER },
+            { PAL_MultiByteToWideChar(CP_UTF8, 0, "a", 1, wide, -1), ERROR_INVALID_PARAMETER },
+            { PAL_WideCharToMultiByte(1252, 0, W("a"), 1, narrow, 8, nullptr, nullptr), ERROR_INVALID_PARAMETER },
+            { PAL_WideCharToMultiByte(CP_UTF8, 0x400, W("a"), 1, narrow, 8, nullptr, nullptr), ERROR_INVALID_FLAGS },
+            { PAL_WideCharToMultiByte(CP_UTF8, 0, W("a"), 1, narrow, 8, "?", nullptr), ERROR_INVALID_PARAMETER },
+            { PAL_WideCharToMultiByte(CP_UTF8, 0, W("a"), 1, narrow, 8, nullptr, &used_default), ERROR_INVALID_PARAMETER },
+            { PAL_WideCharToMultiByte(CP_UTF8, 0, nullptr, 1, narrow, 8, nullptr, nullptr), ERROR_INVALID_PARAMETER },
+            { PAL_WideCharToMultiByte(CP_UTF8, 0, W("a"), 0, narrow, 8, nullptr, nullptr), ERROR_INVALID_PARAMETER },
+        };
+        bool match = true;
+        for (auto const& c : cases)
+            match &= c.result == 0 && c.error != ERROR_SUCCESS;
+        TEST_ASSERT(match);
 
-        bstr = PAL_SysAllocStringByteLen(expected, (UINT)expected_byte_len);
-        TEST_ASSERT(0 == std::memcmp(expected, bstr, array_size_bytes(expected)));
-        TEST_ASSERT((UINT)expected_byte_len == PAL_SysStringByteLen(bstr));
-        TEST_ASSERT((UINT)expected_len == PAL_SysStringLen(bstr));
-        PAL_SysFreeString(bstr);
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, 0x1, "a", 1, wide, 8) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_INVALID_FLAGS);
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, 0, W("a"), 1, narrow, 8, "?", nullptr) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_INVALID_PARAMETER);
     }
     {
-        dncp::bstr_ptr smart_ptr1{ nullptr };
-        dncp::bstr_ptr smart_ptr2{ PAL_SysAllocString(W("abcdefghijklmnopqrstuvwxyz")) };
+        // Ill-formed input is replaced, or fails when asked to.
+        char const invalid[] = "a\xc3" "b";
+        WCHAR wide[8];
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, 0, invalid, 3, wide, 8) == 3);
+        TEST_ASSERT(wide[0] == W('a') && wide[1] == (WCHAR)0xfffd && wide[2] == W('b'));
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, invalid, 3, wide, 8) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_NO_UNICODE_TRANSLATION);
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, invalid, 3, nullptr, 0) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_NO_UNICODE_TRANSLATION);
+
+        // An encoded U+FFFD is well-formed.
+        TEST_ASSERT(PAL_MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, "\xef\xbf\xbd", 3, wide, 8) == 1);
+
+        WCHAR const lone[] = { W('x'), (WCHAR)0xdc00, W('y') };
+        char narrow[16];
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, 0, lone, 3, narrow, 16, nullptr, nullptr) == 5);
+        TEST_ASSERT(0 == std::memcmp(narrow, "x\xef\xbf\xbdy", 5));
+        PAL_SetLastError(ERROR_SUCCESS);
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, lone, 3, narrow, 16, nullptr, nullptr) == 0);
+        TEST_ASSERT(PAL_GetLastError() == ERROR_NO_UNICODE_TRANSLATION);
+        TEST_ASSERT(PAL_WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, lone, 1, narrow, 16, nullptr, nullptr) == 1);
+    }
+    {
+        // Random runs of characters of each length and of ill-formed
+        // sequences, so the vector steps start and stop everywhere. The
+        // destinations are checked for writes past the converted text.
+        struct
+        {
+            char const* bytes;
+            WCHAR const* expected;
+        } const ill_formed_utf8[] =
+        {
+            { "\x80", W("\ufffd") },
+            { "\xc0\xaf", W("\ufffd\ufffd") },
+            { "\xe0\x80\x80", W("\ufffd\ufffd\ufffd") },
+            { "\xe4\xbd!", W("\ufffd!") },
+            { "\xed\xa0\x80", W("\ufffd\ufffd\ufffd") },
+            { "\xf4\x90\x80\x80", W("\ufffd\ufffd\ufffd\ufffd") },
+            { "\xff", W("\ufffd") },
+        };
+
+        auto append_utf8 = [](std::vector<char>& utf8, uint32_t cp)
+        {
+            if (cp < 0x80)
+            {
+                utf8.push_back((char)cp);
+            }
+            else if (cp < 0x800)
+            {
+                utf8.push_back((char)(0xc0 | (cp >> 6)));
+                utf8.push_back((char)(0x80 | (cp & 0x3f)));
+            }
+            else if (cp < 0x10000)
+            {
+                utf8.push_back((char)(0xe0 | (cp >> 12)));
+                utf8.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+                utf8.push_back((char)(0x80 | (cp & 0x3f)));
+            }
+            else
+            {
+                utf8.push_back((char)(0xf0 | (cp >> 18)));
+                utf8.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+                utf8.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+                utf8.push_back((char)(0x80 | (cp & 0x3f)));
+            }
+        };
+        auto append_utf16 = [](std::vector<WCHAR>& utf16, uint32_t cp)
+        {
+            if (cp < 0x10000)
+            {
+                utf16.push_back((WCHAR)cp);
+            }
+            else
+            {
+                utf16.push_back((WCHAR)(0xd800 | ((cp - 0x10000) >> 10)));
+                utf16.push_back((WCHAR)(0xdc00 | (cp & 0x3ff)));
+            }
+        };
+
+        uint32_t seed = 1;
+        auto next = [&]() { seed = seed * 1103515245 + 12345; return seed >> 16; };
+
+        bool match = true;
+        for (int iteration = 0; iteration < 2000; ++iteration)
+        {
+            std::vector<char> utf8;
+            std::vector<WCHAR> utf8_expected;
+            std::vector<WCHAR> utf16;
+            std::vector<char> utf16_expected;
+            bool utf8_invalid = false;
+            bool utf16_invalid = false;
+            size_t const target = next() % 400 + 1;
+            while (utf8.size() < target || utf16.empty())
+            {
+                unsigned kind = next() % 6;
+                for (unsigned run = next() % 24 + 1; run > 0; --run)
+                {
+                    uint32_t cp;
+                    if (kind == 0)
+                    {
+                        cp = 0x20 + next() % 0x5f;
+                    }
+                    else if (kind == 1)
+                    {
+                        cp = 0x80 + next() % 0x780;
+                    }
+                    else if (kind == 2)
+                    {
+                        cp = 0x800 + next() % 0xf800;
+                        if (cp >= 0xd800 && cp <= 0xdfff)
+                            cp += 0x800;
+                    }
+                    else if (kind == 3)
+                    {
+                        cp = 0x10000 + ((next() << 4) | (next() & 0xf)) % 0x100000;
+                    }
+                    else if (kind == 4)
+                    {
+                        auto const& ill = ill_formed_utf8[next() % (sizeof(ill_formed_utf8) / sizeof(ill_formed_utf8[0]))];
+                        utf8.insert(utf8.end(), ill.bytes, ill.bytes + std::strlen(ill.bytes));
+                        utf8_expected.insert(utf8_expected.end(), ill.expected, ill.expected + PAL_wcslen(ill.expected));
+                        utf8_invalid = true;
+                        continue;
+                    }
+                    else
+                    {
+                        // An unpaired low surrogate, or high surrogate
+                        // followed by ASCII.
+                        bool low = (next() & 1) != 0;
+                        utf16.push_back(low ? (WCHAR)0xdc00 : (WCHAR)0xd800);
+                        append_utf8(utf16_expected, 0xfffd);
+                        if (!low)
+                        {
+                            utf16.push_back(W('x'));
+                            utf16_expected.push_back('x');
+                        }
+                        utf16_invalid = true;
+                        continue;
+                    }
+
+                    append_utf8(utf8, cp);
+                    append_utf16(utf8_expected, cp);
+                    append_utf16(utf16, cp);
+                    append_utf8(utf16_expected, cp);
+                }
+            }
+
+            // Exactly sized destinations take the measured path, and
+            // larger ones the single pass.
+            int const n8 = (int)utf8.size();
+            int const n16 = (int)utf8_expected.size();
+            for (int wide_len : { n16, n8 + 16 })
+            {
+                std::vector<WCHAR> wide((size_t)wide_len + 16, (WCHAR)0x5a5a);
+                match &= PAL_MultiByteToWideChar(CP_UTF8, 0, utf8.data(), n8, wide.data(), wide_len) == n16
+                    && 0 == std::memcmp(wide.data(), utf8_expected.data(), (size_t)n16 * sizeof(WCHAR))
+                    && std::all_of(wide.begin() + n16, wide.end(), [](WCHAR c) { return c == (WCHAR)0x5a5a; });
+            }
+            match &= (PAL_MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, utf8.data(), n8, nullptr, 0) == 0) == utf8_invalid;
+
+            int const units = (int)utf16.size();
+            int const bytes = (int)utf16_expected.size();
+            for (int narrow_len : { bytes, 3 * units + 16 })
+            {
+                std::vector<char> narrow((size_t)narrow_len + 16, (char)0x5a);
+                match &= PAL_WideCharToMultiByte(CP_UTF8, 0, utf16.data(), units, narrow.data(), narrow_len, nullptr, nullptr) == bytes
+                    && 0 == std::memcmp(narrow.data(), utf16_expected.data(), (size_t)bytes)
+                    && std::all_of(narrow.begin() + bytes, narrow.end(), [](char c) { return c == (char)0x5a; });
+            }
+            match &= (PAL_WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, utf16.data(), units, nullptr, 0, nullptr, nullptr) == 0) == utf16_invalid;
+        }
+        TEST_ASSERT(match);
+    }
+}
+
+void test_utf32()
+{
+    {
+        WCHAR const utf16[] = W("a\u00e9\u4e16\U0001F600z");
+        UINT32 const utf32[] = { 'a', 0xe9, 0x4e16, 0x1f600, 'z' };
+        size_t const utf16_len = string_length(utf16);
+        size_t const utf32_len = sizeof(utf32) / sizeof(utf32[0]);
+
+        UINT32 wide[16];
+        TEST_ASSERT(PAL_Utf16ToUtf32(utf16, utf16_len, nullptr) == utf32_len);
+        TEST_ASSERT(PAL_Utf16ToUtf32(utf16, utf16_len, wide) == utf32_len);
+        TEST_ASSERT(0 == std::memcmp(wide, utf32, sizeof(utf32)));
+
+        WCHAR narrow[16];
+        TEST_ASSERT(PAL_Utf32ToUtf16(utf32, utf32_len, nullptr) == utf16_len);
+        TEST_ASSERT(PAL_Utf32ToUtf16(utf32, utf32_len, narrow) == utf16_len);
+        TEST_ASSERT(0 == std::memcmp(narrow, utf16, utf16_len * sizeof(WCHAR)));
+
+        TEST_ASSERT(PAL_Utf16ToUtf32(nullptr, 0, nullptr) == 0);
+        TEST_ASSERT(PAL_Utf32ToUtf16(nullptr, 0, nullptr) == 0);
+    }
+    {
+        // Ill-formed input is replaced.
+        WCHAR const lone[] = { (WCHAR)0xdc00, W('a'), (WCHAR)0xd800, (WCHAR)0xd800, (WCHAR)0xdc00, (WCHAR)0xd800 };
+        UINT32 const lone_expected[] = { 0xfffd, 'a', 0xfffd, 0x10000, 0xfffd };
+        UINT32 wide[8];
+        TEST_ASSERT(PAL_Utf16ToUtf32(lone, 6, nullptr) == 5);
+        TEST_ASSERT(PAL_Utf16ToUtf32(lone, 6, wide) == 5);
+        TEST_ASSERT(0 == std::memcmp(wide, lone_expected, sizeof(lone_expected)));
+
+        UINT32 const invalid[] = { 0xd800, 0x110000, 0xdfff, 0xffffffff, 0x10ffff };
+        WCHAR const invalid_expected[] = { (WCHAR)0xfffd, (WCHAR)0xfffd, (WCHAR)0xfffd, (WCHAR)0xfffd, (WCHAR)0xdbff, (WCHAR)0xdfff };
+        WCHAR narrow[8];
+        TEST_ASSERT(PAL_Utf32ToUtf16(invalid, 5, nullptr) == 6);
+        TEST_ASSERT(PAL_Utf32ToUtf16(invalid, 5, narrow) == 6);
+        TEST_ASSERT(0 == std::memcmp(narrow, invalid_expected, sizeof(invalid_expected)));
+    }
+    {
+        // A surrogate pair at every position of strings that span
+        // several vector blocks.
+        bool match = true;
+        for (size_t len = 2; len < 40; ++len)
+        {
+            for (size_t pos = 0; pos + 1 < len; ++pos)
+            {
+                WCHAR utf16[40];
+                UINT32 expected[40];
+                size_t expected_len = 0;
+                for (size_t i = 0; i < len; ++i)
+                {
+                    utf16[i] = (WCHAR)(0x3000 + i);
+                    if (i != pos + 1)
+                        expected[expected_len++] = (UINT32)(0x3000 + i);
+                }
+                utf16[pos] = (WCHAR)0xd83d;
+                utf16[pos + 1] = (WCHAR)0xde00;
+                expected[pos] = 0x1f600;
+
+                UINT32 wide[40];
+                WCHAR narrow[40];
+                match &= PAL_Utf16ToUtf32(utf16, len, wide) == expected_len
+                    && 0 == std::memcmp(wide, expected, expected_len * sizeof(UINT32))
+                    && PAL_Utf32ToUtf16(wide, expected_len, narrow) == len
+                    && 0 == std::memcmp(narrow, utf16, len * sizeof(WCHAR));
+            }
+        }
+        TEST_ASSERT(match);
+    }
+#ifndef _MSC_VER
+    {
+        dncp::wchar_string<> number{ W("2.5") };
+        TEST_ASSERT(number.length() == 3);
+        TEST_ASSERT(std::wcstod(number.c_str(), nullptr) == 2.5);
+
+        // Longer than the inline buffer.
+        std::vector<WCHAR> digits(100, W('7'));
+        digits.push_back(0);
+        dncp::wchar_string<16> longer{ digits.data() };
+        TEST_ASSERT(longer.length() == 100);
+        TEST_ASSERT(std::wcslen(longer.c_str()) == 100);
+
+        wchar_t buffer[32];
+        TEST_ASSERT(std::swprintf(buffer, 32, L"%d \U0001F600", 42) == 4);
+        dncp::utf16_string<> formatted{ buffer };
+        TEST_ASSERT(formatted.length() == 5);
+        TEST_ASSERT(0 == std::memcmp(formatted.c_str(), W("42 \U0001F600"), 6 * sizeof(WCHAR)));
+
+        // Measured, then converted inline or into a block.
+        dncp::utf16_string<4> fits{ L"\U0001F600a" };
+        TEST_ASSERT(fits.length() == 3);
+        dncp::utf16_string<4> allocated{ L"\U0001F600\U0001F600" };
+        TEST_ASSERT(allocated.length() == 4);
+        TEST_ASSERT(allocated.c_str()[2] == (WCHAR)0xd83d && allocated.c_str()[4] == 0);
+    }
+#endif
+}
+
+static std::vector<WCHAR> widen_ascii(char const* str)
+{
+    std::vector<WCHAR> wide;
+    for (; *str != '\0'; ++str)
+        wide.push_back((WCHAR)*str);
+    wide.push_back(W('\0'));
+    return wide;
+}
+
+static bool narrow_equals(WCHAR const* wide, char const* str)
+{
+    for (; *str != '\0'; ++str, ++wide)
+    {
+        if (*wide != (WCHAR)*str)
+            return false;
+    }
+    return *wide == W('\0');
+}
+
+// Compares PAL_wcstod() with strtod(), which is correctly rounded.
+static bool wcstod_agrees(char const* str)
+{
+    std::vector<WCHAR> wide = widen_ascii(str);
+
+    char* expected_end;
+    double expected = std::strtod(str, &expected_end);
+    WCHAR* end;
+    double actual = PAL_wcstod(wide.data(), &end);
+
+    if ((size_t)(end - wide.data()) != (size_t)(expected_end - str))
+        return false;
+
+    if (expected != expected)
+        return actual != actual;
+
+    return 0 == std::memcmp(&expected, &actual, sizeof(double));
+}
+
+// Compares PAL_wcstol() with strtoll(), clamped to 32 bits.
+static bool wcstol_agrees(char const* str, int base)
+{
+    std::vector<WCHAR> wide = widen_ascii(str);
+
+    char* expected_end;
+    errno = 0;
+    long long expected = std::strtoll(str, &expected_end, base);
+    bool expected_range = errno == ERANGE || expected > INT32_MAX || expected < INT32_MIN;
+    if (expected_range)
+        expected = expected < 0 ? INT32_MIN : INT32_MAX;
+
+    WCHAR* end;
+    errno = 0;
+    LONG actual = PAL_wcstol(wide.data(), &end, base);
+    return actual == expected
+        && (errno == ERANGE) == expected_range
+        && (size_t)(end - wide.data()) == (size_t)(expected_end - str);
+}
+
+void test_numbers()
+{
+    {
+        WCHAR const str[] = W("  -123abc");
+        WCHAR* end;
+        TEST_ASSERT(PAL_wcstol(str, &end, 10) == -123);
+        TEST_ASSERT(end == str + 6);
+        TEST_ASSERT(PAL__wtoi(W("\t+42 ")) == 42);
+        TEST_ASSERT(PAL__wtoi(W("000000000000000000000000000042")) == 42);
+        TEST_ASSERT(PAL_wcstol(W("0x1A"), nullptr, 16) == 26);
+        TEST_ASSERT(PAL_wcstol(W("0X1a"), nullptr, 0) == 26);
+        TEST_ASSERT(PAL_wcstol(W("012"), nullptr, 0) == 10);
+        TEST_ASSERT(PAL_wcstol(W("zZ"), nullptr, 36) == 1295);
+        TEST_ASSERT(PAL_wcstol(W("2147483647"), nullptr, 10) == INT32_MAX);
+        TEST_ASSERT(PAL_wcstol(W("-2147483648"), nullptr, 10) == INT32_MIN);
+
+        // A prefix without a digit after it leaves just the zero.
+        WCHAR const prefix[] = W("0xg");
+        TEST_ASSERT(PAL_wcstol(prefix, &end, 16) == 0);
+        TEST_ASSERT(end == prefix + 1);
+
+        WCHAR const none[] = W("  +x");
+        TEST_ASSERT(PAL_wcstol(none, &end, 10) == 0);
+        TEST_ASSERT(end == none);
+
+        errno = 0;
+        TEST_ASSERT(PAL_wcstol(W("2147483648"), nullptr, 10) == INT32_MAX);
+        TEST_ASSERT(errno == ERANGE);
+        errno = 0;
+        TEST_ASSERT(PAL_wcstol(W("-99999999999999999999999"), nullptr, 10) == INT32_MIN);
+        TEST_ASSERT(errno == ERANGE);
+        errno = 0;
+        TEST_ASSERT(PAL_wcstol(W("1"), nullptr, 1) == 0);
+        TEST_ASSERT(errno == EINVAL);
+
+        errno = 0;
+        TEST_ASSERT(PAL_wcstoul(W("4294967295"), nullptr, 10) == UINT32_MAX);
+        TEST_ASSERT(PAL_wcstoul(W("-1"), nullptr, 10) == UINT32_MAX);
+        TEST_ASSERT(PAL_wcstoul(W("ffffffff"), nullptr, 16) == UINT32_MAX);
+        TEST_ASSERT(errno == 0);
+        TEST_ASSERT(PAL_wcstoul(W("4294967296"), nullptr, 10) == UINT32_MAX);
+        TEST_ASSERT(errno == ERANGE);
+    }
+    {
+        WCHAR buffer[72];
+        TEST_ASSERT(0 == PAL__itow_s(-2147483647 - 1, buffer, 72, 10));
+        TEST_ASSERT(narrow_equals(buffer, "-2147483648"));
+        TEST_ASSERT(0 == PAL__itow_s(-1, buffer, 72, 16));
+        TEST_ASSERT(narrow_equals(buffer, "ffffffff"));
+        TEST_ASSERT(0 == PAL__itow_s(0, buffer, 72, 10));
+        TEST_ASSERT(narrow_equals(buffer, "0"));
+        TEST_ASSERT(0 == PAL__ui64tow_s(UINT64_MAX, buffer, 72, 10));
+        TEST_ASSERT(narrow_equals(buffer, "18446744073709551615"));
+        TEST_ASSERT(0 == PAL__ui64tow_s(UINT64_MAX, buffer, 72, 2));
+        TEST_ASSERT(PAL_wcslen(buffer) == 64);
+        TEST_ASSERT(0 == PAL__ui64tow_s(35, buffer, 72, 36));
+        TEST_ASSERT(narrow_equals(buffer, "z"));
+
+        // Failures leave an empty string when there is room for one.
+        TEST_ASSERT(EINVAL == PAL__itow_s(1, nullptr, 72, 10));
+        TEST_ASSERT(EINVAL == PAL__itow_s(1, buffer, 0, 10));
+        buffer[0] = W('x');
+        TEST_ASSERT(EINVAL == PAL__itow_s(1, buffer, 72, 37));
+        TEST_ASSERT(buffer[0] == W('\0'));
+        buffer[0] = W('x');
+        TEST_ASSERT(ERANGE == PAL__itow_s(-5, buffer, 2, 10));
+        TEST_ASSERT(buffer[0] == W('\0'));
+        TEST_ASSERT(ERANGE == PAL__itow_s(1000, buffer, 4, 10));
+        TEST_ASSERT(buffer[0] == W('\0'));
+        TEST_ASSERT(0 == PAL__itow_s(1000, buffer, 5, 10));
+        TEST_ASSERT(ERANGE == PAL__ui64tow_s(256, buffer, 9, 2));
+        TEST_ASSERT(0 == PAL__ui64tow_s(256, buffer, 10, 2));
+    }
+    {
+        char const* const cases[] =
+        {
+            "0", "-0", "1", "0.1", ".5", "5.", "1e23", "1e", "1e+", "  -12.5e2x", "00000.000001e6",
+            "2.2250738585072011e-308", "2.2250738585072014e-308", "4.9e-324",
+            "2.4703282292062327e-324", "2.4703282292062328e-324",
+            "1.7976931348623157e308", "1.7976931348623158e308", "1.7976931348623159e308",
+            "1e-400", "1e400", "0e999999999", "1e-99999999999", "9007199254740993",
+            "9007199254740993.0000000000000000001", "9007199254740992.9999999999999999999",
+            "0.1000000000000000055511151231257827021181583404541015625",
+            "123456789012345678901234567890e-10", "0.000000000000000000000000000000000001234567890123456789012",
+            "inf", "-Infinity", "infinit", "nan", "-NaN", "nan(123_abc)", "nan(", "0x1.8p3", "-0X1P-1074", "0x", "0xg",
+            "", "-", ".", "e5", "+.e1",
+        };
+
+        bool agree = true;
+        for (char const* str : cases)
+            agree &= wcstod_agrees(str);
+        TEST_ASSERT(agree);
+
+        errno = 0;
+        TEST_ASSERT(PAL_wcstod(W("1e400"), nullptr) == HUGE_VAL);
+        TEST_ASSERT(errno == ERANGE);
+        errno = 0;
+        TEST_ASSERT(PAL_wcstod(W("-1e-400"), nullptr) == 0);
+        TEST_ASSERT(errno == ERANGE);
+        errno = 0;
+        TEST_ASSERT(PAL_wcstod(W("4.9e-324"), nullptr) == 4.9e-324);
+        TEST_ASSERT(errno == ERANGE);
+        errno = 0;
+        TEST_ASSERT(PAL_wcstod(W("2.2250738585072014e-308"), nullptr) == 2.2250738585072014e-308);
+        TEST_ASSERT(errno == 0);
+    }
+    {
+        uint64_t seed = 1;
+        auto next = [&]()
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            return seed >> 11 ^ seed << 53;
+        };
+
+        bool agree = true;
+        char str[512];
+        for (int i = 0; i < 20000; ++i)
+        {
+            // Random bit patterns, printed at various precisions.
+            uint64_t bits = next();
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            if (value != value || value - value != 0)
+                continue;
+
+            (void)std::snprintf(str, sizeof(str), "%.17g", value);
+            agree &= wcstod_agrees(str);
+            (void)std::snprintf(str, sizeof(str), "%.*e", (int)(next() % 30), value);
+            agree &= wcstod_agrees(str);
+
+            // Random digits, with a point and an exponent.
+            size_t digits = 1 + next() % 40;
+            size_t point = next() % (digits + 1);
+            char* p = str;
+            for (size_t d = 0; d < digits; ++d)
+            {
+                if (d == point)
+                    *p++ = '.';
+                *p++ = (char)('0' + next() % 10);
+            }
+            (void)std::snprintf(p, 16, "e%d", (int)(next() % 700) - 350);
+            agree &= wcstod_agrees(str);
+
+            // Integers in various bases.
+            int base = (int)(next() % 4);
+            base = base == 0 ? 10 : base == 1 ? 16 : base == 2 ? 0 : 2 + (int)(next() % 35);
+            (void)std::snprintf(str, sizeof(str), next() % 2 ? "%lld" : " %llx", (long long)(next() >> (next() % 64)) * (next() % 2 ? 1 : -1));
+            agree &= wcstol_agrees(str, base);
+
+            uint64_t number = next() >> (next() % 64);
+            WCHAR formatted[72];
+            (void)std::snprintf(str, sizeof(str), "%llu", (unsigned long long)number);
+            agree &= 0 == PAL__ui64tow_s(number, formatted, 72, 10) && narrow_equals(formatted, str);
+            (void)std::snprintf(str, sizeof(str), "%llx", (unsigned long long)number);
+            agree &= 0 == PAL__ui64tow_s(number, formatted, 72, 16) && narrow_equals(formatted, str);
+            (void)std::snprintf(str, sizeof(str), "%d", (int)number);
+            agree &= 0 == PAL__itow_s((int)number, formatted, 72, 10) && narrow_equals(formatted, str);
+
+            int radix = 2 + (int)(next() % 35);
+            agree &= 0 == PAL__ui64tow_s(number, formatted, 72, radix);
+            size_t len = PAL_wcslen(formatted);
+            for (size_t c = 0; c <= len; ++c)
+                str[c] = (char)formatted[c];
+            agree &= std::strtoull(str, nullptr, radix) == number;
+        }
+        TEST_ASSERT(agree);
     }
 }
 
@@ -270,6 +2466,10 @@ void test_interfaces()
         REFIID iid = __uuidof(IClassFactory);
         TEST_ASSERT(PAL_IsEqualGUID(&iid, &IID_IClassFactory));
     }
+    {
+        REFIID iid = __uuidof(IMalloc);
+        TEST_ASSERT(PAL_IsEqualGUID(&iid, &IID_IMalloc));
+    }
 }
 
 using dncp::com_ptr;
@@ -329,14 +2529,118 @@ void test_com_ptr()
     }
 }
 
+using dncp::cotaskmem_allocator;
+using dncp::cotaskmem_vector;
+
+// Fills a result the way a COM method returning an array does.
+static HRESULT get_squares(int32_t count, int32_t** result)
+{
+    cotaskmem_vector<int32_t> squares;
+    for (int32_t i = 0; i < count; ++i)
+        squares.push_back(i * i);
+
+    *result = squares.release();
+    return S_OK;
+}
+
+void test_cotaskmem_vector()
+{
+    {
+        std::vector<int32_t, cotaskmem_allocator<int32_t>> v;
+        for (int32_t i = 0; i < 1000; ++i)
+            v.push_back(i);
+        TEST_ASSERT(v.size() == 1000 && v[999] == 999);
+
+        cotaskmem_allocator<int32_t> a;
+        cotaskmem_allocator<double> b{ a };
+        TEST_ASSERT(a == b);
+    }
+    {
+        cotaskmem_vector<int32_t> v;
+        TEST_ASSERT(v.empty() && v.data() == nullptr);
+        TEST_ASSERT(v.release() == nullptr);
+    }
+    {
+        int32_t* result = nullptr;
+        TEST_ASSERT(get_squares(100, &result) == S_OK);
+        TEST_ASSERT(result != nullptr && result[0] == 0 && result[99] == 99 * 99);
+        PAL_CoTaskMemFree(result);
+    }
+    {
+        cotaskmem_vector<GUID> v(3);
+        TEST_ASSERT(v.size() == 3 && v.capacity() >= 3);
+        TEST_ASSERT(v[2] == GUID_NULL);
+
+        GUID guid;
+        TEST_ASSERT(PAL_CoCreateGuid(&guid) == S_OK);
+        v.push_back(guid);
+        v.reserve(1000);
+        TEST_ASSERT(v.capacity() == 1000);
+        TEST_ASSERT(v.back() == guid);
+
+        // Pushing an element of the vector while it grows.
+        v.resize(4);
+        while (v.size() < 64)
+            v.push_back(v[3]);
+        TEST_ASSERT(v[63] == guid);
+
+        cotaskmem_vector<GUID> w{ std::move(v) };
+        TEST_ASSERT(v.data() == nullptr && w.size() == 64);
+        v = std::move(w);
+        TEST_ASSERT(v.size() == 64 && w.empty());
+
+        size_t count = 0;
+        for (GUID const& g : v)
+            count += g == guid ? 1 : 0;
+        TEST_ASSERT(count == 61);
+
+        v.pop_back();
+        TEST_ASSERT(v.size() == 63);
+        v.clear();
+        TEST_ASSERT(v.empty() && v.capacity() == 1000);
+    }
+    {
+        cotaskmem_vector<uint8_t> v;
+        TEST_ASSERT(v.emplace_back((uint8_t)7) == 7);
+        bool threw = false;
+        try
+        {
+            v.reserve(SIZE_MAX);
+        }
+        catch (std::bad_alloc const&)
+        {
+            threw = true;
+        }
+        TEST_ASSERT(threw && v.size() == 1 && v[0] == 7);
+    }
+}
+
 int main()
 {
+    // The backend has to be installed before anything is allocated.
+    bool test_backend_installed = install_test_backend();
+
     test_memory();
+    test_heap();
+    test_alloc_stats();
+    test_alloc_profile();
+    test_imalloc(test_backend_installed);
     test_strings();
+    test_matcher();
     test_bstr();
+    test_bstr_builder();
+    test_bstr_interned();
+    test_bstr_literal();
+    test_bstr_array();
+    test_bstr_view();
+    test_bstr_utf8();
+    test_codepage();
+    test_utf32();
+    test_numbers();
     test_guids();
     test_interfaces();
     test_com_ptr();
+    test_cotaskmem_vector();
 
     std::printf("Test pass: %zd / %zd\n", test_count - test_failure, test_count);
     return test_failure == 0